@@ -63,6 +63,23 @@ typedef struct {
   uint32_t         app_version;
   int              enable_debug_layers;
   uint32_t         gpu_id;
+  // number of frames CPU can record while GPU is still executing
+  // previous ones. Must be in range [2, 4]; 0 means 2.
+  uint32_t         frames_in_flight;
+  // put all buffers and textures into one global descriptor set, see
+  // 'gfx_get_bindless_descriptor_set()'. Requires
+  // VK_EXT_descriptor_indexing, it's silently disabled otherwise.
+  int              enable_bindless;
+  // don't enable surface and swapchain extensions, windows can't be
+  // created. Work is recorded with 'gfx_begin_compute()'. Always set
+  // when library is built with LIDA_GFX_HEADLESS.
+  int              headless;
+  // write GPU timestamps for zones, see 'gfx_gpu_zone_begin()'. It's
+  // silently disabled if graphics queue doesn't support timestamps.
+  int              enable_gpu_zones;
+  // don't use dedicated transfer queue, uploads and transfer command
+  // lists go to graphics queue. Mostly useful to compare throughput.
+  int              disable_transfer_queue;
 
   GFX_Log_Callback                log_fn;
   GFX_Load_Shader_Module_Callback load_shader_fn;
@@ -254,6 +271,29 @@ typedef enum {
     // GFX_MEMORY_PROPERTY_PROTECTED_BIT = 0x00000020,
 } GFX_Memory_Properties;
 
+// How memory will be accessed, memory type is picked accordingly and
+// next best type is used when preferred one is out of memory.
+typedef enum {
+  // only GPU accesses memory, fastest memory is used
+  GFX_MEMORY_USAGE_GPU_ONLY = 0,
+  // written by CPU often and read by GPU. Device local memory visible
+  // to host is used when it's available.
+  GFX_MEMORY_USAGE_CPU_TO_GPU = 1,
+  // staging memory written by CPU and copied from by GPU
+  GFX_MEMORY_USAGE_UPLOAD = 2,
+  // written by GPU and read by CPU, cached memory is preferred
+  GFX_MEMORY_USAGE_READBACK = 3,
+} GFX_Memory_Usage;
+
+// Device queue that command lists are submitted to. Compute and
+// transfer queues run alongside graphics work when device has
+// dedicated families for them, otherwise graphics queue is used.
+typedef enum {
+  GFX_QUEUE_GRAPHICS = 0,
+  GFX_QUEUE_COMPUTE = 1,
+  GFX_QUEUE_TRANSFER = 2,
+} GFX_Queue;
+
 typedef enum {
   GFX_SAMPLER_ADDRESS_MODE_REPEAT = 0,
   GFX_SAMPLER_ADDRESS_MODE_MIRRORED_REPEAT = 1,
@@ -309,11 +349,18 @@ typedef struct {
   // TODO: attachments
   GFX_Render_Pass* render_pass;
   // uint32_t subpass; // no support for subpasses yet
+  // if set to 1 then the last descriptor set of pipeline is written
+  // with 'gfx_push_descriptors()' instead of being bound.
+  int push_descriptors;
+  // bitmask of descriptor sets whose uniform and storage buffers are
+  // dynamic(GFX_TYPE_*_BUFFER_DYNAMIC). Shaders can't tell that, so
+  // it's up to user.
+  uint32_t dynamic_buffer_sets;
 
 } GFX_Pipeline_Desc;
 
 typedef struct {
-  char data[24];
+  char data[64];
 } GFX_Pipeline;
 
 typedef struct {
@@ -321,9 +368,25 @@ typedef struct {
 } GFX_Memory_Block;
 
 typedef struct {
-  char data[512];
+  char data[4096];
 } GFX_Window;
 
+typedef struct {
+  char data[5120];
+} GFX_Offscreen_Target;
+
+typedef struct {
+  char data[2048];
+} GFX_Command_List;
+
+typedef struct {
+  char data[512];
+} GFX_Draw_Queue;
+
+typedef struct {
+  char data[16];
+} GFX_Semaphore;
+
 typedef struct {
   char data[32];
 } GFX_Buffer;
@@ -333,7 +396,7 @@ typedef struct {
 } GFX_Image;
 
 typedef struct {
-  char data[32];
+  char data[48];
 } GFX_Texture;
 
 typedef enum {
@@ -343,6 +406,10 @@ typedef enum {
   GFX_TYPE_STORAGE_IMAGE = 3,
   GFX_TYPE_UNIFORM_BUFFER = 6,
   GFX_TYPE_STORAGE_BUFFER = 7,
+  // offset of these is given when set is bound, see
+  // 'gfx_bind_descriptor_sets_with_offsets()'
+  GFX_TYPE_UNIFORM_BUFFER_DYNAMIC = 8,
+  GFX_TYPE_STORAGE_BUFFER_DYNAMIC = 9,
 
 } GFX_Descriptor_Type;
 
@@ -354,8 +421,103 @@ typedef struct {
   GFX_Stage stages;
 } GFX_Descriptor_Set_Binding;
 
+// Resource for a binding of descriptor set written by
+// 'gfx_get_cached_descriptor_set()', 'gfx_update_descriptor_sets()' or
+// 'gfx_push_descriptors()'. 'buffer', 'offset'
+// and 'range' are used by buffer bindings. 'texture', 'layout',
+// 'is_linear_filter' and 'address_mode' are used by image bindings.
+typedef struct {
+  const GFX_Buffer* buffer;
+  uint32_t offset;
+  // if 0 then whole buffer is used. Dynamic buffers need an explicit
+  // range as offset given at bind time is added to 'offset'.
+  uint32_t range;
+  const GFX_Texture* texture;
+  GFX_Image_Layout layout;
+  int is_linear_filter;
+  GFX_Sampler_Address_Mode address_mode;
+} GFX_Descriptor_Resource;
+
 typedef float GFX_Clear_Color[4];
 
+// Statistics of GPU memory allocator, see 'gfx_get_memory_stats()'.
+typedef struct {
+  // device memory allocated from Vulkan
+  uint64_t allocated_bytes;
+  uint32_t num_pages;
+  // memory taken by memory blocks
+  uint64_t used_bytes;
+  uint32_t num_allocations;
+  uint32_t num_free_blocks;
+  uint64_t largest_free_block;
+  // 0 if all free memory is contiguous, close to 1 if it's scattered
+  // over many small blocks
+  float fragmentation;
+  // Usage and budget of each memory heap. They come from
+  // VK_EXT_memory_budget if it's supported, then usage includes
+  // memory allocated by other processes. Otherwise usage is memory
+  // allocated by us and budget is a fixed part of heap size.
+  uint32_t num_heaps;
+  struct {
+    uint64_t size;
+    uint64_t usage;
+    uint64_t budget;
+    int device_local;
+  } heaps[16];
+  // number of streamable blocks evicted so far
+  uint32_t num_evictions;
+} GFX_Memory_Stats;
+
+// Counters of one frame, see 'gfx_get_frame_stats()'.
+typedef struct {
+  // draw commands actually recorded, draws merged by draw queue count
+  // once
+  uint32_t num_draws;
+  uint32_t num_dispatches;
+  // vertex or index count / 3 times instance count, all draws are
+  // counted as triangle lists
+  uint64_t num_triangles;
+  uint32_t num_barriers;
+  // binds which were not dropped as redundant
+  uint32_t num_pipeline_binds;
+  uint32_t num_descriptor_set_binds;
+  uint32_t num_descriptor_writes;
+  // bytes written by 'gfx_upload_*()' and 'gfx_copy_to_buffer()'
+  uint64_t uploaded_bytes;
+  // bytes copied between buffers and images by GPU commands
+  uint64_t copied_bytes;
+  // cache lookups which created Vulkan objects: render passes,
+  // shader modules, layouts, framebuffers and cached
+  // descriptor sets
+  uint32_t num_cache_misses;
+  // nanoseconds CPU was blocked waiting for GPU
+  uint64_t wait_time;
+} GFX_Frame_Stats;
+
+/**
+   Called when memory block of streamable resource is evicted. It must
+   destroy resources bound to 'memory', the block is freed after that.
+   GPU is done with the resources at this point. Don't allocate GPU
+   memory from this function.
+ */
+typedef void (*GFX_Evict_Function)(GFX_Memory_Block* memory, void* udata);
+#define GFX_STREAMABLE_NONE UINT32_MAX
+
+// Resource that 'gfx_defragment_memory()' may move to another place
+// in memory. Exactly one of 'buffer' and 'image' is set; it must be
+// the only resource bound to 'memory' and created with both
+// TRANSFER_SRC and TRANSFER_DST usage.
+typedef struct {
+  GFX_Memory_Block* memory;
+  GFX_Buffer* buffer;
+  GFX_Image* image;
+  // views of 'image', they're recreated after move
+  GFX_Texture* textures;
+  uint32_t num_textures;
+  // layout 'image' is in, moved image is left in the same layout
+  GFX_Image_Layout layout;
+} GFX_Defrag_Resource;
+
 typedef struct {
   GFX_Image* image;
   GFX_Image_Layout new_layout;
@@ -375,7 +537,9 @@ int gfx_init(const GFX_Init_Info* info);
 /**
    Free the graphics library.
 
-   This destroys all Vulkan objects created by 'gfx_init()'.
+   This destroys all Vulkan objects created by 'gfx_init()'. After
+   that 'gfx_init()' may be called again, with different settings for
+   example.
  */
 void gfx_free();
 
@@ -386,10 +550,167 @@ int gfx_is_initialised();
 
 void gfx_wait_idle_gpu();
 
+/**
+   GPU progress. Every submission to a queue(window frames, uploads,
+   'gfx_submit_to_queue()') signals next value of queue's counter. A
+   value is complete when GPU is done with that submission and all
+   submissions before it. Queues without their own family share
+   counter of graphics queue.
+
+   Counters are backed by timeline semaphores, on devices without
+   VK_KHR_timeline_semaphore they're emulated with fences.
+ */
+uint64_t gfx_get_submitted_value(GFX_Queue queue);
+// This never blocks.
+uint64_t gfx_get_completed_value(GFX_Queue queue);
+/**
+   Wait till 'value' is complete or 'timeout' nanoseconds pass.
+   @return 0 on success, 1 on timeout.
+ */
+int gfx_wait_for_value(GFX_Queue queue, uint64_t value, uint64_t timeout);
+
+// Value of graphics queue counter, see 'gfx_get_completed_value()'.
+typedef uint64_t GFX_Fence;
+
+/**
+   Begin recording commands that are not tied to a window, like
+   compute jobs on a headless server. Return command list that is
+   also used by functions without 'cmd_' prefix, or NULL on failure.
+
+   Batches work like window frames: they're submitted to graphics
+   queue, cycle through 'frames_in_flight' command buffers and
+   'gfx_allocate_frame_data()' works inside them. Beginning a batch
+   waits for the batch submitted 'frames_in_flight' batches ago.
+   NOTE: must not be called between 'gfx_begin_commands()' and
+   'gfx_submit_and_present()'.
+ */
+GFX_Command_List* gfx_begin_compute();
+/**
+   Submit commands recorded since 'gfx_begin_compute()'.
+   @return fence that is complete when GPU is done with them, 0 on
+   failure.
+ */
+GFX_Fence gfx_submit();
+/**
+   Wait till 'fence' is complete or 'timeout' nanoseconds pass.
+   @return 0 on success, 1 on timeout.
+ */
+int gfx_wait(GFX_Fence fence, uint64_t timeout);
+
+// Image of offscreen frame copied to host memory.
+typedef struct {
+  const void* data;
+  uint32_t width;
+  uint32_t height;
+  // bytes between starts of rows
+  uint32_t row_pitch;
+  // number of frame counted from target creation
+  uint64_t frame;
+} GFX_Readback;
+
+/**
+   Create a target for rendering without window, e.g. thumbnails or
+   video frames on a server. It has one color image per frame in
+   flight, frames are cycled like window frames.
+   @param format - color format, only uncompressed formats up to 128
+   bits per texel are supported.
+   @return 0 on success.
+ */
+int gfx_create_offscreen_target(GFX_Offscreen_Target* target, uint32_t width, uint32_t height, GFX_Format format);
+/**
+   Destroy offscreen target. This waits till GPU is done with its
+   frames.
+ */
+void gfx_destroy_offscreen_target(GFX_Offscreen_Target* target);
+/**
+   Begin recording commands for next frame of target, works like
+   'gfx_begin_commands()'. Return command list that is also used by
+   functions without 'cmd_' prefix, or NULL on failure.
+ */
+GFX_Command_List* gfx_begin_offscreen_frame(GFX_Offscreen_Target* target);
+
+GFX_Render_Pass* gfx_get_offscreen_pass(GFX_Offscreen_Target* target);
+
+void gfx_begin_offscreen_pass(GFX_Offscreen_Target* target);
+/**
+   Submit commands of current frame of target.
+   @param readback - if not 0, copy image of frame to host memory,
+   result is taken with 'gfx_poll_readback()'. Render pass of target
+   must be recorded in this frame then. Previous readback of this
+   frame that wasn't taken is dropped.
+   @return fence that is complete when GPU is done with frame, 0 on
+   failure.
+ */
+GFX_Fence gfx_submit_offscreen_frame(GFX_Offscreen_Target* target, int readback);
+/**
+   Take the oldest readback of target. This doesn't block unless
+   'wait' is set, so rendering of next frames is not stalled.
+   'readback->data' stays valid till the frame is submitted again,
+   'frames_in_flight' frames later. Polling after
+   'gfx_begin_offscreen_frame()' never misses a readback, as the
+   frame rendered 'frames_in_flight' frames ago is complete then.
+   @return 1 if readback was written, 0 if it's not ready or there's
+   none.
+ */
+int gfx_poll_readback(GFX_Offscreen_Target* target, GFX_Readback* readback, int wait);
+
+// GPU time of a zone, see 'gfx_get_gpu_zones()'.
+typedef struct {
+  const char* name;
+  // index of enclosing zone, -1 for top level zones. Zones are sorted
+  // in order they were begun, so parents come before children.
+  int32_t parent;
+  uint32_t depth;
+  // nanoseconds since beginning of the first zone of frame
+  uint64_t begin;
+  uint64_t duration;
+} GFX_GPU_Zone;
+
+/**
+   Begin a named zone of GPU work in the current frame. Zones nest
+   and are written as timestamps in main command list of frame, zones
+   of other lists are ignored. Render passes and executed command
+   lists are zoned automatically. Does nothing unless
+   'GFX_Init_Info::enable_gpu_zones' is set.
+   @param name - must stay valid till results are read, string
+   literals work best
+   NOTE: must not be called inside render pass with secondary contents.
+ */
+void gfx_gpu_zone_begin(const char* name);
+
+void gfx_gpu_zone_end();
+/**
+   Get tree of GPU zones of the latest frame whose results are
+   available. Results are read without stalling when frame's
+   resources are reused, so they're 'frames_in_flight' frames old.
+   @param frame - number of frame zones were recorded in, may be NULL
+   @return number of zones.
+ */
+uint32_t gfx_get_gpu_zones(const GFX_GPU_Zone** zones, uint64_t* frame);
+
+#ifdef LIDA_GFX_TRACE
+typedef void (*GFX_Trace_Write_Callback)(const char* data, size_t size, void* udata);
+
+/**
+   Write events recorded since the last call as Chrome trace JSON,
+   which is opened by chrome://tracing and ui.perfetto.dev. The CPU
+   track has library hot paths: cache lookups, pipeline creation,
+   shader reflection, descriptor updates, submits and waits for GPU.
+   The GPU track has GPU zones, see 'gfx_gpu_zone_begin()'. Tracks are
+   aligned with VK_EXT_calibrated_timestamps when it's supported.
+   Only the last 8192 events are kept. Events are recorded without
+   locks, so functions which command list docs mark as single-threaded
+   must really be called from one thread when tracing.
+   NOTE: available only if library is built with LIDA_GFX_TRACE.
+ */
+void gfx_write_trace(GFX_Trace_Write_Callback write_fn, void* udata);
+#endif
+
 int gfx_create_graphics_pipelines(GFX_Pipeline* pipelines, uint32_t count, const GFX_Pipeline_Desc* descs);
 int gfx_create_compute_pipelines(GFX_Pipeline* pipelines, uint32_t count, const char** tags);
 void gfx_destroy_pipeline(GFX_Pipeline* pipeline);
 
+#ifndef LIDA_GFX_HEADLESS
 typedef struct SDL_Window SDL_Window;
 
 /**
@@ -398,6 +719,7 @@ typedef struct SDL_Window SDL_Window;
    @note the SDL_WINDOW_VULKAN flag must be passed to SDL_CreateWindow
  */
 int gfx_create_window_sdl(GFX_Window* window, SDL_Window* handle, int vsync);
+#endif
 
 /**
    Destroy a window.
@@ -408,7 +730,13 @@ int gfx_resize_window(GFX_Window* window, uint32_t* width, uint32_t* height);
 
 void gfx_get_window_size(const GFX_Window* window, uint32_t* width, uint32_t* height);
 
-void gfx_begin_commands(GFX_Window* window);
+/**
+   Begin recording commands for the next frame. This waits until GPU
+   finishes the frame that was submitted 'frames_in_flight' frames
+   ago, so CPU can record ahead while GPU is still busy. Return 0 on
+   success.
+ */
+int gfx_begin_commands(GFX_Window* window);
 /**
    Acquire next swapchain image. Return 0 on success, 1 if resized and other value on error.
  */
@@ -441,9 +769,40 @@ void gfx_bind_pipeline(GFX_Pipeline* pipeline);
  */
 void gfx_bind_descriptor_sets(const GFX_Descriptor_Set* descriptor_sets, uint32_t ds_count);
 /**
+   Bind descriptor sets with offsets for their dynamic buffers. There
+   must be one offset per dynamic binding in 'descriptor_sets', in
+   order of sets and then of bindings.
+   NOTE: this function must be called after gfx_bind_pipeline()!
+ */
+void gfx_bind_descriptor_sets_with_offsets(const GFX_Descriptor_Set* descriptor_sets, uint32_t ds_count,
+					   const uint32_t* offsets, uint32_t num_offsets);
+/**
+   Write descriptors of the last set of bound pipeline directly into
+   command buffer, no descriptor set is allocated. Pipeline must be
+   created with 'GFX_Pipeline_Desc::push_descriptors'.
+
+   Uses VK_KHR_push_descriptor. When it's not supported a transient
+   set of current frame is written and bound instead, so then this
+   must be called between 'gfx_begin_commands()' and
+   'gfx_submit_and_present()' and lists using it must not be reused
+   across frames.
+   NOTE: this function must be called after gfx_bind_pipeline()!
+ */
+void gfx_push_descriptors(const GFX_Descriptor_Set_Binding* bindings, uint32_t num_bindings,
+			  const GFX_Descriptor_Resource* resources);
+/**
+   Update push constants starting from offset 0. Each part of data is
+   sent to shader stages whose push constant blocks contain it, so
+   stages may use different parts of push constants, e.g. with
+   'layout(offset = 64)' in GLSL.
    NOTE: this function must be called after gfx_bind_pipeline()!
  */
 void gfx_push_constants(const void* push_constant, uint32_t push_constant_size);
+/**
+   Update 'size' bytes of push constants at 'offset'.
+   NOTE: this function must be called after gfx_bind_pipeline()!
+ */
+void gfx_push_constants_with_offset(const void* push_constant, uint32_t offset, uint32_t size);
 
 void gfx_draw(uint32_t vertex_count, uint32_t instance_count, uint32_t first_vertex, uint32_t first_instance);
 void gfx_draw_indexed(uint32_t index_count, uint32_t instance_count, uint32_t first_index, int32_t vertex_offset, uint32_t first_instance);
@@ -455,15 +814,105 @@ void gfx_barrier(GFX_Pipeline_Stage src_stage, GFX_Pipeline_Stage dst_stage, con
 
 void gfx_clear_attachment(const GFX_Clear_Color* clear_color, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
 
+/**
+   Allocate a memory block and bind resources to it. Blocks are
+   sub-allocated from big device memory pages, so allocating a block
+   per resource is cheap and doesn't hit Vulkan's limit on number of
+   allocations.
+ */
 int gfx_allocate_memory_for_buffers(GFX_Memory_Block* memory, GFX_Buffer* buffers, uint32_t count, GFX_Memory_Properties properties);
 int gfx_allocate_memory_for_images(GFX_Memory_Block* memory, GFX_Image* images, uint32_t count, GFX_Memory_Properties properties);
+/**
+   Same as above, but memory type is chosen by intended usage instead
+   of exact properties. When a single resource is given and driver
+   prefers it to have its own allocation(big render targets for
+   example), a dedicated allocation is made.
+ */
+int gfx_allocate_buffer_memory(GFX_Memory_Block* memory, GFX_Buffer* buffers, uint32_t count, GFX_Memory_Usage usage);
+int gfx_allocate_image_memory(GFX_Memory_Block* memory, GFX_Image* images, uint32_t count, GFX_Memory_Usage usage);
+/**
+   Return memory block to its page. Resources bound to it must be
+   destroyed and not used by GPU.
+ */
 void gfx_free_memory(GFX_Memory_Block* memory);
+void gfx_get_memory_stats(GFX_Memory_Stats* stats);
+/**
+   Register memory block whose resources can be recreated later, like
+   streamed textures. When allocation would go over heap budget or
+   Vulkan runs out of memory, registered blocks that weren't touched
+   for longest time are evicted. Blocks touched by frames in flight
+   are never evicted.
+   @return id of streamable or GFX_STREAMABLE_NONE. It becomes invalid
+   after eviction.
+ */
+uint32_t gfx_register_streamable(GFX_Memory_Block* memory, GFX_Evict_Function evict, void* udata);
+// Must be called before freeing block of registered streamable.
+void gfx_unregister_streamable(uint32_t id);
+// Mark streamable as used by current frame.
+void gfx_touch_streamable(uint32_t id);
+/**
+   Move resources out of sparsely used memory pages, so pages can be
+   given back to Vulkan. Copies of at most 'max_bytes' are recorded to
+   'list' outside of render pass, so calling this once per frame with
+   a small budget spreads the work over many frames. Old resources
+   are destroyed when GPU is done with frames that could use them,
+   their pages are freed once they're empty.
+
+   Moved resources get new Vulkan handles and bindless indices:
+   descriptor sets allocated with 'gfx_allocate_descriptor_sets()'
+   must be written again and indices must be taken again with
+   'gfx_get_*_index()'. Old indices keep pointing to old resources
+   until frames that could use them are done. Cached sets and
+   reusable command lists are handled automatically.
+   @return number of moved resources.
+ */
+uint32_t gfx_defragment_memory(GFX_Command_List* list, GFX_Defrag_Resource* resources, uint32_t count, uint64_t max_bytes);
 
 int gfx_create_buffer(GFX_Buffer* buffer, GFX_Buffer_Usage usage, uint32_t size);
 void gfx_destroy_buffer(GFX_Buffer* buffer);
 void* gfx_get_buffer_data(GFX_Buffer* buffer);
 int gfx_copy_to_buffer(GFX_Buffer* buffer, const void* src, uint32_t offset, uint32_t size);
 
+/**
+   Upload data to a buffer or image in device local memory. Data is
+   copied to a persistently mapped staging ring right away, copies are
+   batched and submitted with window frame('gfx_submit_and_present()')
+   or by 'gfx_flush_uploads()'. Commands submitted after that see the
+   uploaded data. Copies go through a transfer queue when device has
+   one, see 'GFX_Init_Info::disable_transfer_queue'.
+
+   Destination must be created with TRANSFER_DST usage. Image data is
+   tightly packed; image is transitioned from 'old_layout' to
+   'new_layout', GFX_IMAGE_LAYOUT_UNDEFINED discards its contents.
+ */
+int gfx_upload_buffer(GFX_Buffer* buffer, uint64_t offset, const void* data, uint64_t size);
+int gfx_upload_image(GFX_Image* image, const void* data, uint64_t size,
+		     uint32_t x, uint32_t y, uint32_t z,
+		     uint32_t width, uint32_t height, uint32_t depth,
+		     uint32_t mip, uint32_t layer,
+		     GFX_Image_Layout old_layout, GFX_Image_Layout new_layout);
+// Submit pending uploads. If 'wait' is not 0 then wait till GPU is done with them.
+int gfx_flush_uploads(int wait);
+
+/**
+   Allocate 'size' bytes of per-frame data from a persistently mapped
+   ring buffer, see 'gfx_get_frame_data_buffer()'. Memory is valid
+   until GPU is done with current frame, it's reused
+   'frames_in_flight' frames later. Return NULL when the frame is out
+   of space. 'offset' receives offset of allocation in the buffer, it
+   is aligned for use as a dynamic offset.
+   NOTE: must be called between 'gfx_begin_commands()' and
+   'gfx_submit_and_present()' and only from one thread.
+ */
+void* gfx_allocate_frame_data(uint32_t size, uint32_t* offset);
+/**
+   Return buffer from which 'gfx_allocate_frame_data()' allocates. Bind
+   it once to a GFX_TYPE_UNIFORM_BUFFER_DYNAMIC or
+   GFX_TYPE_STORAGE_BUFFER_DYNAMIC binding and pass offsets of
+   allocations to 'gfx_bind_descriptor_sets_with_offsets()'.
+ */
+const GFX_Buffer* gfx_get_frame_data_buffer();
+
 void gfx_bind_vertex_buffers(GFX_Buffer* buffers, uint32_t count, const uint64_t* offsets);
 void gfx_bind_index_buffer(GFX_Buffer* buffer, const uint64_t offset);
 
@@ -496,6 +945,71 @@ int gfx_allocate_descriptor_sets(GFX_Descriptor_Set* sets, uint32_t num_sets,
 				 const GFX_Descriptor_Set_Binding* bindings, uint32_t num_bindings,
 				 int resetable);
 int gfx_free_descriptor_sets(GFX_Descriptor_Set* sets, uint32_t num_sets);
+/**
+   Allocate descriptor sets that live until the current frame of
+   'window' is done on GPU. Call this between 'gfx_begin_commands()'
+   and 'gfx_submit_and_present()'. Sets are freed all at once when
+   the frame is reused, so they're cheap to allocate per draw. Don't
+   free them and don't use them in reusable command lists.
+ */
+int gfx_allocate_transient_descriptor_sets(GFX_Window* window, GFX_Descriptor_Set* sets, uint32_t num_sets,
+					   const GFX_Descriptor_Set_Binding* bindings, uint32_t num_bindings);
+/**
+   Get a descriptor set with layout 'bindings' pointing at
+   'resources', 'resources[i]' is bound to 'bindings[i]'. Sets are
+   cached by their layout and contents, so asking for the same
+   resources again returns the same set without allocating and
+   updating it. Least recently used sets are evicted from cache and
+   freed when frames that might use them are done on GPU. Sets
+   referencing destroyed buffers or textures are dropped from cache.
+
+   Returned set must not be updated or freed. It may be evicted by
+   later calls, so ask cache again each frame instead of keeping it;
+   evicted sets stay valid until frames using them are done on GPU.
+ */
+int gfx_get_cached_descriptor_set(GFX_Descriptor_Set* set,
+				  const GFX_Descriptor_Set_Binding* bindings, uint32_t num_bindings,
+				  const GFX_Descriptor_Resource* resources);
+/**
+   Get global descriptor set of bindless mode. Returns 0 if bindless
+   mode is disabled or not supported.
+
+   The set has three runtime arrays which shaders index with values
+   returned by 'gfx_get_*_index()':
+   - binding 0: sampled textures(sampler2D[]), sampled with linear
+     filtering and repeat address mode, must be in
+     GFX_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+   - binding 1: storage textures(image2D[]), must be in
+     GFX_IMAGE_LAYOUT_GENERAL;
+   - binding 2: storage buffers(buffer ... []).
+   Pipeline layouts use this set for any shader set that declares a
+   runtime array. Resources are added when they're created and removed
+   when destroyed, indices stay the same while resource is alive. Bind
+   the set once per command list, it never needs to be updated by user.
+ */
+GFX_Descriptor_Set gfx_get_bindless_descriptor_set();
+/**
+   Get index of buffer in bindless storage buffer array. Returns
+   UINT32_MAX if bindless mode is disabled or buffer wasn't created
+   with GFX_BUFFER_USAGE_STORAGE. Index is valid after buffer is bound
+   to memory.
+ */
+uint32_t gfx_get_buffer_index(const GFX_Buffer* buffer);
+/**
+   Get index of texture in bindless sampled texture array. Returns
+   UINT32_MAX if bindless mode is disabled or image wasn't created
+   with GFX_IMAGE_USAGE_SAMPLED.
+ */
+uint32_t gfx_get_texture_index(const GFX_Texture* texture);
+/**
+   Same as 'gfx_get_texture_index()' but for storage texture array and
+   GFX_IMAGE_USAGE_STORAGE.
+ */
+uint32_t gfx_get_storage_texture_index(const GFX_Texture* texture);
+/**
+   Get number of cache hits and misses of 'gfx_get_cached_descriptor_set()'.
+ */
+void gfx_get_descriptor_cache_stats(uint32_t* hits, uint32_t* misses);
 /**
    NOTE: passing 'range=0' means use whole buffer.
    */
@@ -504,9 +1018,259 @@ void gfx_descriptor_buffer(GFX_Descriptor_Set set, uint32_t binding, GFX_Descrip
 void gfx_descriptor_sampled_texture(GFX_Descriptor_Set set, uint32_t binding,
 				    const GFX_Texture* texture, GFX_Image_Layout layout, int is_linear_filter, GFX_Sampler_Address_Mode mode);
 void gfx_descriptor_storage_texture(GFX_Descriptor_Set set, uint32_t binding, const GFX_Texture* texture);
+/**
+   Send descriptor writes recorded by 'gfx_descriptor_*()' to
+   Vulkan. There's no limit on number of writes in a batch: when
+   internal buffer is full it is flushed automatically.
+ */
 void gfx_batch_update_descriptor_sets();
+/**
+   Write all bindings of 'num_sets' sets at once. 'resources' contains
+   'num_bindings' elements per set, set after set. Sets must be
+   allocated with the same bindings.
+
+   When VK_KHR_descriptor_update_template is available each set is
+   written by one template update of a layout, so this is faster than
+   recording writes one by one. Pending 'gfx_descriptor_*()' writes
+   are flushed first.
+ */
+int gfx_update_descriptor_sets(const GFX_Descriptor_Set* sets, uint32_t num_sets,
+			       const GFX_Descriptor_Set_Binding* bindings, uint32_t num_bindings,
+			       const GFX_Descriptor_Resource* resources);
 void gfx_clear_color_image(GFX_Image* image, GFX_Image_Layout layout);
 
+/**
+   Command lists.
+
+   Functions above record commands to the command list of current
+   window frame(see 'gfx_begin_commands()'). Command lists allow to
+   record commands from several threads at once: each 'gfx_cmd_*'
+   function takes the list it records to. Lists recorded on different
+   threads must be created with different 'thread_id's; a list must
+   only be recorded by the thread it was created for.
+
+   A list cycles through 'frames_in_flight' command buffers, so it
+   may be begun once per frame without waiting for GPU.
+
+   NOTE: 'gfx_cmd_begin_render_pass()' may create a framebuffer, which
+   touches a global cache; call it from one thread only. Same is true
+   for 'gfx_cmd_push_descriptors()' when VK_KHR_push_descriptor is not
+   supported: it allocates transient sets of current frame then.
+ */
+
+/**
+   Create command lists for thread 'thread_id'(less than 16).
+   @param secondary - if not 0 then lists are executed from other
+   lists with 'gfx_cmd_execute_command_lists()', otherwise they are
+   submitted with 'gfx_submit_command_lists()'.
+ */
+int gfx_create_command_lists(GFX_Command_List* lists, uint32_t count, uint32_t thread_id, int secondary);
+/**
+   Create primary command lists for thread 'thread_id' that are
+   submitted to 'queue' with 'gfx_submit_to_queue()'. Lists of compute
+   queue can record dispatches, barriers and copies; lists of transfer
+   queue only copies and barriers.
+ */
+int gfx_create_queue_command_lists(GFX_Command_List* lists, uint32_t count, uint32_t thread_id, GFX_Queue queue);
+void gfx_destroy_command_lists(GFX_Command_List* lists, uint32_t count);
+
+int gfx_begin_command_list(GFX_Command_List* list);
+/**
+   Begin a secondary list that continues render pass currently
+   recorded in 'parent'. 'parent' must have begun the pass with
+   'secondary_contents' set. Viewport and scissor are set to cover
+   the whole render area.
+
+   This function only reads 'parent', so several threads may begin
+   their lists from the same parent simultaneously.
+ */
+int gfx_begin_secondary_command_list(GFX_Command_List* list, const GFX_Command_List* parent);
+int gfx_end_command_list(GFX_Command_List* list);
+
+/**
+   Begin recording a list that is replayed many times(every frame for
+   example) instead of being recorded again. Secondary reusable lists
+   are executed with 'gfx_cmd_execute_command_lists()' and primary
+   ones are submitted with 'gfx_submit_command_lists()'.
+
+   A reusable list becomes invalid when buffers, images, textures,
+   pipelines or descriptor sets it references are destroyed, or when
+   its descriptor sets are updated(this happens on window resize for
+   example). Check it with 'gfx_is_command_list_valid()' and record it
+   again when needed. Invalid lists are skipped during execution.
+
+   Recording a list again waits until GPU is done with all submits
+   that used it. For lists used by window frames this waits for all
+   work submitted to graphics queue so far, so frames that use the
+   list must be submitted before it is recorded again.
+
+   NOTE: secondary reusable lists can't continue a render pass.
+   NOTE: reusable lists are registered globally and recording may wait
+   for GPU; call it from one thread only.
+ */
+int gfx_begin_reusable_command_list(GFX_Command_List* list);
+/**
+   Check whether a reusable list was recorded and not invalidated
+   since then.
+ */
+int gfx_is_command_list_valid(const GFX_Command_List* list);
+/**
+   Get number of state commands(pipeline, descriptor set, vertex and
+   index buffer binds, push constants, viewport and scissor) recorded
+   to list and number of those that were dropped because the same state
+   was already set. Counters are reset when list is begun. Any pointer
+   can be NULL.
+ */
+void gfx_get_command_list_stats(const GFX_Command_List* list, uint32_t* issued, uint32_t* elided);
+/**
+   Get counters of the last frame submitted with
+   'gfx_submit_and_present()', 'gfx_submit()' or
+   'gfx_submit_offscreen_frame()'. Commands are counted when their
+   list is submitted, so reusable lists count each time they're
+   submitted. Lists submitted with 'gfx_submit_command_lists()' or
+   'gfx_submit_to_queue()', uploads, descriptor writes and waits count
+   to the frame recorded at that moment.
+ */
+void gfx_get_frame_stats(GFX_Frame_Stats* stats);
+
+/**
+   Start capturing draws recorded to 'list' instead of recording them
+   in call order. State binds and draws are saved to 'memory' of size
+   'size' provided by user. Captured draws are sorted by layer,
+   pipeline, descriptor sets and depth, then recorded with minimal
+   number of state changes when render pass ends, when a barrier or
+   a clear is recorded and when the queue ends. Draws with equal state
+   and mesh whose instances are adjacent are merged into one instanced
+   draw. Sorting is stable, draws with equal keys keep their order.
+
+   Each draw takes 80 bytes of memory plus around 220 bytes each time
+   state changes. When memory is exhausted captured draws are flushed
+   early.
+
+   Queue must be used inside a render pass and must end before the
+   list is ended. When queue ends, state bound by user last is bound
+   again, so draws recorded after it don't need to rebind anything.
+ */
+int gfx_begin_draw_queue(GFX_Command_List* list, GFX_Draw_Queue* queue, void* memory, size_t size);
+void gfx_end_draw_queue(GFX_Command_List* list);
+/**
+   Set sort order for following draws captured by draw queue. Draws
+   with smaller 'layer'(0-255) go first. Within a layer draws are
+   grouped by state and then by 'depth'(0-1) in increasing order.
+ */
+void gfx_cmd_set_draw_order(GFX_Command_List* list, uint32_t layer, float depth);
+void gfx_set_draw_order(uint32_t layer, float depth);
+
+/**
+   Get command list of current window frame. It's valid between
+   'gfx_begin_commands()' and 'gfx_submit_and_present()'.
+ */
+GFX_Command_List* gfx_get_command_list(GFX_Window* window);
+
+/**
+   Execute secondary command lists from 'list'. Secondary lists must
+   be ended.
+ */
+void gfx_cmd_execute_command_lists(GFX_Command_List* list, const GFX_Command_List* secondaries, uint32_t count);
+
+/**
+   Submit primary command lists together with current frame of
+   window. They are executed before window's own command list. Lists
+   must be ended.
+ */
+int gfx_submit_command_lists(GFX_Window* window, const GFX_Command_List* lists, uint32_t count);
+
+/**
+   Semaphores order work submitted to different queues. Each signal
+   must be followed by exactly one wait.
+ */
+int gfx_create_semaphore(GFX_Semaphore* semaphore);
+void gfx_destroy_semaphore(GFX_Semaphore* semaphore);
+
+/**
+   Check whether 'queue' has its own queue family, i.e. work submitted
+   to it may overlap with graphics work.
+ */
+int gfx_is_queue_dedicated(GFX_Queue queue);
+
+typedef struct {
+  const GFX_Command_List* lists;
+  uint32_t num_lists;
+  // lists start executing 'wait_stages[i]' after 'wait_semaphores[i]'
+  // is signaled
+  const GFX_Semaphore* wait_semaphores;
+  const GFX_Pipeline_Stage* wait_stages;
+  uint32_t num_wait_semaphores;
+  const GFX_Semaphore* signal_semaphores;
+  uint32_t num_signal_semaphores;
+} GFX_Submit_Info;
+
+/**
+   Submit primary command lists created with
+   'gfx_create_queue_command_lists()' for 'queue'. Lists must be
+   ended.
+
+   NOTE: lists are cycled and reused in the same way as lists of
+   window frame. Work submitted here must be waited on by a window
+   frame(see 'gfx_wait_semaphore()'), or user must check its value
+   with 'gfx_get_completed_value()' before recording the lists again
+   'frames_in_flight' times.
+   Buffers and images with STORAGE usage are shared between graphics
+   and compute queues; other images must not be touched by compute
+   queue. Uploads are executed on graphics queue(see
+   'gfx_upload_buffer()'), other queues see them after waiting for a
+   semaphore signaled by a later window frame.
+ */
+int gfx_submit_to_queue(GFX_Queue queue, const GFX_Submit_Info* info);
+/**
+   Make current frame of window wait for 'semaphore' before
+   'stage'. Must be called between 'gfx_begin_commands()' and
+   'gfx_submit_and_present()'.
+ */
+int gfx_wait_semaphore(GFX_Window* window, const GFX_Semaphore* semaphore, GFX_Pipeline_Stage stage);
+/**
+   Signal 'semaphore' when commands of current frame of window are
+   complete. Must be called between 'gfx_begin_commands()' and
+   'gfx_submit_and_present()'.
+ */
+int gfx_signal_semaphore(GFX_Window* window, const GFX_Semaphore* semaphore);
+
+/**
+   Begin a render pass.
+   @param secondary_contents - if not 0 then draw commands come from
+   secondary lists(see 'gfx_begin_secondary_command_list()'); the only
+   command allowed in 'list' until the pass ends is
+   'gfx_cmd_execute_command_lists()'.
+ */
+void gfx_cmd_begin_render_pass(GFX_Command_List* list, GFX_Render_Pass* render_pass, const GFX_Texture* attachments, uint32_t num_attachments, const GFX_Clear_Color* clear_colors, int secondary_contents);
+void gfx_cmd_begin_main_pass(GFX_Command_List* list, GFX_Window* window, int secondary_contents);
+void gfx_cmd_begin_offscreen_pass(GFX_Command_List* list, GFX_Offscreen_Target* target, int secondary_contents);
+void gfx_cmd_gpu_zone_begin(GFX_Command_List* list, const char* name);
+void gfx_cmd_gpu_zone_end(GFX_Command_List* list);
+void gfx_cmd_end_render_pass(GFX_Command_List* list);
+void gfx_cmd_bind_pipeline(GFX_Command_List* list, GFX_Pipeline* pipeline);
+void gfx_cmd_bind_descriptor_sets(GFX_Command_List* list, const GFX_Descriptor_Set* descriptor_sets, uint32_t ds_count);
+void gfx_cmd_bind_descriptor_sets_with_offsets(GFX_Command_List* list, const GFX_Descriptor_Set* descriptor_sets, uint32_t ds_count,
+					       const uint32_t* offsets, uint32_t num_offsets);
+void gfx_cmd_push_descriptors(GFX_Command_List* list, const GFX_Descriptor_Set_Binding* bindings, uint32_t num_bindings,
+			      const GFX_Descriptor_Resource* resources);
+void gfx_cmd_push_constants(GFX_Command_List* list, const void* push_constant, uint32_t push_constant_size);
+void gfx_cmd_push_constants_with_offset(GFX_Command_List* list, const void* push_constant, uint32_t offset, uint32_t size);
+void gfx_cmd_draw(GFX_Command_List* list, uint32_t vertex_count, uint32_t instance_count, uint32_t first_vertex, uint32_t first_instance);
+void gfx_cmd_draw_indexed(GFX_Command_List* list, uint32_t index_count, uint32_t instance_count, uint32_t first_index, int32_t vertex_offset, uint32_t first_instance);
+void gfx_cmd_dispatch(GFX_Command_List* list, uint32_t x, uint32_t y, uint32_t z);
+void gfx_cmd_barrier(GFX_Command_List* list, GFX_Pipeline_Stage src_stage, GFX_Pipeline_Stage dst_stage, const GFX_Image_Barrier* barriers, uint32_t count);
+void gfx_cmd_clear_attachment(GFX_Command_List* list, const GFX_Clear_Color* clear_color, uint32_t x, uint32_t y, uint32_t w, uint32_t h);
+void gfx_cmd_bind_vertex_buffers(GFX_Command_List* list, GFX_Buffer* buffers, uint32_t count, const uint64_t* offsets);
+void gfx_cmd_bind_index_buffer(GFX_Command_List* list, GFX_Buffer* buffer, const uint64_t offset);
+void gfx_cmd_copy_buffer_to_image_with_offset(GFX_Command_List* list, GFX_Buffer* buffer, GFX_Image* image, uint64_t offset,
+					      uint32_t x, uint32_t y, uint32_t z,
+					      uint32_t w, uint32_t h, uint32_t d);
+void gfx_cmd_copy_image_to_buffer(GFX_Command_List* list, GFX_Image* image, GFX_Buffer* buffer,
+				  uint32_t x, uint32_t y, uint32_t z,
+				  uint32_t w, uint32_t h, uint32_t d);
+void gfx_cmd_clear_color_image(GFX_Command_List* list, GFX_Image* image, GFX_Image_Layout layout);
+
 #ifdef __cplusplus
 }
 #endif
@@ -8,21 +8,100 @@
 #define LIDA_GFX_VERSION 1
 #endif
 
-// NOTE: configure which window library you want to use
+// NOTE: configure which window library you want to use. Headless
+// builds(LIDA_GFX_HEADLESS) don't use any and can't create windows.
+#ifndef LIDA_GFX_HEADLESS
 #define LIDA_GFX_USE_SDL
+#endif
 // #define LIDA_USE_GLFW
 
 #define LIDA_GFX_RENDER_PASS_MAX_ATTACHMENTS 4
 #define LIDA_GFX_SHADER_MAX_SETS 4
 #define LIDA_GFX_SHADER_MAX_BINDINGS_PER_SET 8
-#define LIDA_GFX_SHADER_MAX_RANGES 1
+// NOTE: push constant ranges of a pipeline, one per shader stage is enough
+#define LIDA_GFX_SHADER_MAX_RANGES 2
+// NOTE: how many frames CPU may record ahead of GPU. Actual number is
+// chosen by user via 'GFX_Init_Info::frames_in_flight'.
+#define LIDA_GFX_MAX_FRAMES_IN_FLIGHT 4
+// NOTE: maximum number of threads that can record command lists simultaneously
+#define LIDA_GFX_MAX_THREADS 16
+// NOTE: maximum number of command lists that can be submitted with one window frame
+#define LIDA_GFX_MAX_FRAME_COMMAND_LISTS 8
+// NOTE: maximum number of semaphores a window frame can wait on and
+// signal, see 'gfx_wait_semaphore()'
+#define LIDA_GFX_MAX_FRAME_SEMAPHORES 4
+// NOTE: maximum number of reusable command lists alive at once
+#define LIDA_GFX_MAX_REUSABLE_LISTS 32
+// NOTE: how many Vulkan objects a reusable command list can track
+// precisely. Lists that reference more objects are invalidated when
+// any object is destroyed.
+#define LIDA_GFX_COMMAND_LIST_MAX_REFERENCES 48
+// NOTE: maximum number of vertex buffers bound at once
+#define LIDA_GFX_MAX_VERTEX_BUFFERS 8
+// NOTE: push constants up to this size are filtered for redundancy,
+// Vulkan guarantees at least 128 bytes
+#define LIDA_GFX_MAX_PUSH_CONSTANT_SIZE 128
+// NOTE: transient descriptor pools of a frame. Each next pool is twice
+// as big as previous one, the first one has
+// LIDA_GFX_TRANSIENT_DS_POOL_SIZE sets.
+#define LIDA_GFX_MAX_TRANSIENT_DS_POOLS 8
+#define LIDA_GFX_TRANSIENT_DS_POOL_SIZE 256
+// NOTE: bytes of static memory used by descriptor set cache, each
+// cached set takes around 240 bytes
+#define LIDA_GFX_DS_CACHE_SIZE 16384
+#define LIDA_GFX_DS_CACHE_POOL_SIZE 256
+// NOTE: size of each resource array of bindless descriptor set, must
+// be a multiple of 32
+#define LIDA_GFX_BINDLESS_MAX_RESOURCES 4096
+// NOTE: bytes of per-frame data that can be allocated with
+// 'gfx_allocate_frame_data()' in one frame
+#define LIDA_GFX_FRAME_DATA_SIZE 65536
+// NOTE: maximum number of GPU zones in one frame, see
+// 'gfx_gpu_zone_begin()'. Each zone takes two timestamp queries.
+#define LIDA_GFX_MAX_GPU_ZONES 64
+// NOTE: maximum number of dynamic offsets bound at once
+#define LIDA_GFX_MAX_DYNAMIC_OFFSETS 8
+// NOTE: GPU memory is allocated by pages of this size and memory
+// blocks are sub-allocated from them. Bigger blocks get their own
+// pages.
+#define LIDA_GFX_MEMORY_PAGE_SIZE (64 * 1024 * 1024)
+#define LIDA_GFX_MAX_MEMORY_PAGES 64
+// NOTE: maximum number of used and free regions in all pages
+#define LIDA_GFX_MAX_MEMORY_CHUNKS 4096
+// NOTE: part of memory heap we allow ourselves to use if
+// VK_EXT_memory_budget is not supported
+#define LIDA_GFX_MEMORY_BUDGET_PERCENT 80
+// NOTE: maximum number of memory blocks registered with
+// 'gfx_register_streamable()'
+#define LIDA_GFX_MAX_STREAMABLES 1024
+// NOTE: size of persistently mapped staging ring used by
+// 'gfx_upload_buffer()' and 'gfx_upload_image()'
+#define LIDA_GFX_STAGING_SIZE (16 * 1024 * 1024)
+// NOTE: copies recorded before uploads are flushed automatically
+#define LIDA_GFX_MAX_UPLOAD_REGIONS 256
+// NOTE: number of upload submissions GPU may execute at once
+#define LIDA_GFX_MAX_UPLOAD_BATCHES 4
+// NOTE: define LIDA_GFX_TRACE to record CPU and GPU events for
+// 'gfx_write_trace()'. This is the number of events kept, older ones
+// are overwritten.
+#define LIDA_GFX_TRACE_EVENTS 8192
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+// needed for clock_gettime()
+#define _POSIX_C_SOURCE 199309L
+#endif
 
 #include <assert.h>             // TODO: make assert macro customizable
 #include <alloca.h>
 #include <string.h>
+#include <time.h>
 
 #include "lida_gfx.h"
 
+#ifdef LIDA_GFX_TRACE
+#include <stdio.h>
+#endif
+
 #ifdef LIDA_GFX_USE_SDL
 #include <SDL_vulkan.h>
 #endif
@@ -40,6 +119,9 @@
 #define ATTRIBUTE_ALIGNED(a)
 #endif
 
+#define MAX(a, b) ((a)>(b)?(a):(b))
+#define MIN(a, b) ((a)<(b)?(a):(b))
+
 
 /* --Vulkan */
 
@@ -202,7 +284,19 @@ static PFN_vkEnumerateInstanceLayerProperties vkEnumerateInstanceLayerProperties
   X(vkCreateSwapchainKHR);                              \
   X(vkDestroySwapchainKHR);                             \
   X(vkGetSwapchainImagesKHR);                           \
-  X(vkQueuePresentKHR)
+  X(vkQueuePresentKHR);                                 \
+  X(vkCreateDescriptorUpdateTemplateKHR);               \
+  X(vkDestroyDescriptorUpdateTemplateKHR);              \
+  X(vkUpdateDescriptorSetWithTemplateKHR);              \
+  X(vkGetPhysicalDeviceFeatures2KHR);                   \
+  X(vkGetPhysicalDeviceMemoryProperties2KHR);           \
+  X(vkGetBufferMemoryRequirements2KHR);                 \
+  X(vkGetImageMemoryRequirements2KHR);                  \
+  X(vkGetSemaphoreCounterValueKHR);                     \
+  X(vkWaitSemaphoresKHR);                               \
+  X(vkGetPhysicalDeviceCalibrateableTimeDomainsEXT);    \
+  X(vkGetCalibratedTimestampsEXT);                      \
+  X(vkCmdPushDescriptorSetKHR)
 
 // define Vulkan API functions
 #define X(name) static PFN_##name name
@@ -228,6 +322,27 @@ typedef int (__stdcall* FARPROC)(void);
 #ifdef _WIN32
 __declspec(dllimport) HMODULE __stdcall LoadLibraryA(LPCSTR);
 __declspec(dllimport) FARPROC __stdcall GetProcAddress(HMODULE, LPCSTR);
+// LARGE_INTEGER is a union of 64 bit integer
+__declspec(dllimport) int __stdcall QueryPerformanceCounter(long long*);
+__declspec(dllimport) int __stdcall QueryPerformanceFrequency(long long*);
+#endif
+
+
+/* --Tracing */
+
+// CPU zones around hot paths of the library, see
+// 'gfx_write_trace()'. They compile to nothing unless LIDA_GFX_TRACE
+// is defined.
+#ifdef LIDA_GFX_TRACE
+static void trace_begin(const char* name);
+static void trace_end();
+#define TRACE_BEGIN(name) trace_begin(name)
+#define TRACE_END() trace_end()
+#define TRACE_ENABLED 1
+#else
+#define TRACE_BEGIN(name) ((void)0)
+#define TRACE_END() ((void)0)
+#define TRACE_ENABLED 0
 #endif
 
 
@@ -254,6 +369,8 @@ typedef struct {
   destructor_function_t des_fn;
   const char* typename;
   uint32_t sizeof_;
+  // lookups that created a new object, see 'count_cache_misses()'
+  uint32_t num_misses;
 
   int32_t* ht_data;
   uint32_t ht_mask;
@@ -361,6 +478,7 @@ lru_cache_search(LRU_Cache* lru, const void* obj)
 static void*
 lru_cache_get(LRU_Cache* lru, const void* obj, int* flag)
 {
+  TRACE_BEGIN(lru->typename);
   uint32_t hash = lru->hash_fn(obj);
   uint32_t id = hash & lru->ht_mask;
   Node_Header* node = NULL;
@@ -376,7 +494,7 @@ lru_cache_get(LRU_Cache* lru, const void* obj, int* flag)
 	  Node_Header* left = lru_cache_ith(lru, node->prev);
 	  left->next = node->next;
 	  if (*next == lru->last)
-	    lru->last = left->prev;
+	    lru->last = node->prev;
 	}
 	if (node->next != -1) {
 	  Node_Header* right = lru_cache_ith(lru, node->next);
@@ -389,36 +507,36 @@ lru_cache_get(LRU_Cache* lru, const void* obj, int* flag)
       }
 
       if (flag) *flag = 0;
+      TRACE_END();
       return node+1;
     }
     next = &node->list;
   }
   if (lru->free == -1) {
-    // delete recently used value
-    Node_Header* last = lru_cache_ith(lru, lru->last);
+    // delete least recently used value
+    int32_t victim = lru->last;
+    Node_Header* last = lru_cache_ith(lru, victim);
     lru->des_fn(last+1);
-    id = last->hash & lru->ht_mask;
     // remove from bucket( O(1) amortized )
-    node = lru_cache_ith(lru, lru->ht_data[id]);
-    Node_Header* prev = NULL;
-    while (node != last) {
-      prev = node;
-      node = lru_cache_ith(lru, node->list);
+    int32_t* it = &lru->ht_data[last->hash & lru->ht_mask];
+    while (*it != victim) {
+      it = &lru_cache_ith(lru, *it)->list;
     }
-    if (prev) {
-      prev->list = node->list;
-      next = &prev->list;
+    *it = last->list;
+    // remove from queue
+    lru->last = last->prev;
+    if (lru->last != -1) {
+      lru_cache_ith(lru, lru->last)->next = -1;
     } else {
-      lru->ht_data[id] = node->list;
-      while (node->list != -1) {
-	node = lru_cache_ith(lru, node->list);
-      }
-      next = &node->list;
+      lru->first = -1;
     }
     last->list = -1;
-    lru->free = lru->last;
-    lru->last = last->prev;
-    lru_cache_ith(lru, lru->last)->next = -1;
+    lru->free = victim;
+    // bucket of the new value might have changed, find its end again
+    next = &lru->ht_data[id];
+    while (*next != -1) {
+      next = &lru_cache_ith(lru, *next)->list;
+    }
   }
   // insert new element
   node = lru_cache_ith(lru, lru->free);
@@ -433,8 +551,10 @@ lru_cache_get(LRU_Cache* lru, const void* obj, int* flag)
   node->list = -1;
   node->prev = -1;              // debug
   memcpy(node+1, obj, lru->sizeof_);
+  lru->num_misses++;
 
   if (flag) *flag = 1;
+  TRACE_END();
   return node+1;
 }
 
@@ -539,21 +659,208 @@ hash_string(const char* str)
 
 /* --global */
 
+// GPU memory allocator. Device memory is allocated in pages, pages
+// are split into chunks which are managed with TLSF: free chunks are
+// kept in lists indexed by (first level, second level), where first
+// level is log2 of size and second level splits it into
+// 2^MEMORY_SL_BITS ranges.
+#define MEMORY_SL_BITS 4
+#define MEMORY_FL_COUNT 32
+// NOTE: offsets and sizes of chunks are multiple of this, so Vulkan's
+// nonCoherentAtomSize(256 at most) is respected
+#define MEMORY_MIN_CHUNK 256
+#define MEMORY_FL_SHIFT 8
+#define MEMORY_MAX_POOLS 16
+#define MEMORY_NONE UINT32_MAX
+
+typedef struct {
+  VkDeviceSize offset;
+  VkDeviceSize size;
+  uint32_t     page;
+  uint32_t     is_free;
+  // neighbour chunks in page ordered by address
+  uint32_t     prev_phys;
+  uint32_t     next_phys;
+  // links of free list; unused headers are linked with 'next_free' too
+  uint32_t     prev_free;
+  uint32_t     next_free;
+} Memory_Chunk;
+
+typedef struct {
+  VkDeviceMemory handle;
+  VkDeviceSize   size;
+  // NULL if memory is not host visible
+  void*          mapped;
+  uint32_t       pool;
+  uint32_t       first_chunk;
+  // bytes taken by allocated chunks
+  VkDeviceSize   used;
+  // page is owned by one resource, see 'allocate_dedicated_memory_block()'
+  uint32_t       dedicated;
+} Memory_Page;
+
+// Pages of one memory type. Optimal images are kept apart from
+// buffers, so bufferImageGranularity can't be violated.
+typedef struct {
+  uint32_t     type;
+  uint32_t     is_image;
+  uint32_t     fl_bitmap;
+  uint32_t     sl_bitmaps[MEMORY_FL_COUNT];
+  uint32_t     free_lists[MEMORY_FL_COUNT][1<<MEMORY_SL_BITS];
+  uint32_t     num_pages;
+  // one empty page is kept to not reallocate it over and over
+  uint32_t     empty_page;
+  VkDeviceSize used;
+  uint32_t     num_allocations;
+} Memory_Pool;
+
+typedef struct {
+  // memory of page block was allocated from
+  VkDeviceMemory handle;
+  // end of block in page
+  VkDeviceSize size;
+  // resources are placed at this offset, it grows with each one
+  VkDeviceSize offset;
+  // beginning of block in page
+  VkDeviceSize base;
+  // mapped memory of page, maybe NULL
+  void* mapped;
+  uint32_t type;
+  uint32_t chunk;
+} Memory_Block;
+_Static_assert(sizeof(Memory_Block) <= sizeof(GFX_Memory_Block), "internal error: need to adjust sizeof GFX_Memory_Block");
+
+typedef struct {
+  VkBuffer buffer;
+  VkBufferCopy region;
+} Buffer_Upload;
+
+typedef struct {
+  VkImage image;
+  VkBufferImageCopy region;
+  VkImageLayout old_layout;
+  VkImageLayout new_layout;
+  // image is shared with compute queue, it can't be owned by transfer
+  // queue
+  int shared;
+} Image_Upload;
+
+typedef struct {
+  VkCommandBuffer graphics_cmd;
+  // these are only used if device has a transfer queue
+  VkCommandBuffer transfer_cmd;
+  VkSemaphore semaphore;
+  // graphics timeline value signaled when batch is done
+  uint64_t value;
+  // staging memory up to this point is used by batch
+  uint64_t head;
+  int pending;
+} Upload_Batch;
+
+// Progress of GPU on a queue. Each submission signals next value of a
+// timeline semaphore. Devices without timeline semaphores emulate it
+// with a ring of fences, one per submission in flight.
+#define MAX_TIMELINE_FENCES 16
+#define NUM_QUEUES 3
+typedef struct {
+  VkQueue queue;
+  VkSemaphore semaphore;
+  VkFence fences[MAX_TIMELINE_FENCES];
+  uint64_t submitted;
+  uint64_t completed;
+} Timeline;
+
+// Timestamps of zones recorded in one frame data partition, see
+// 'gfx_gpu_zone_begin()'. Results are read when partition is reused.
+typedef struct {
+  VkQueryPool pool;
+  GFX_GPU_Zone zones[LIDA_GFX_MAX_GPU_ZONES];
+  uint32_t num_zones;
+  uint64_t frame;
+#ifdef LIDA_GFX_TRACE
+  // trace time when frame was submitted
+  uint64_t submit_time;
+#endif
+} GPU_Zone_Frame;
+
+#ifdef LIDA_GFX_TRACE
+enum {
+  TRACE_TRACK_CPU = 1,
+  TRACE_TRACK_GPU = 2,
+};
+
+typedef struct {
+  const char* name;
+  // nanoseconds of host clock, see 'get_host_time()'
+  uint64_t begin;
+  uint64_t duration;
+  uint32_t track;
+} Trace_Event;
+#endif
+
+// Memory block registered with 'gfx_register_streamable()'
+typedef struct {
+  GFX_Memory_Block* memory;
+  GFX_Evict_Function evict;
+  void* udata;
+  uint64_t last_used;
+} Streamable;
+
 static struct {
-  uint32_t membuf[4096];
+  uint32_t membuf[8192];
   uint32_t memptr;
   uint32_t memright;
   VkInstance instance;
   VkPhysicalDevice physical_device;
   VkDevice logical_device;
-  // @TODO: utilize more device queues
   uint32_t graphics_queue_family;
   VkQueue graphics_queue;
+  // family with compute but no graphics queues, UINT32_MAX if device
+  // doesn't have one
+  uint32_t compute_queue_family;
+  VkQueue compute_queue;
+  // family with transfer only queues, UINT32_MAX if device doesn't
+  // have one
+  uint32_t transfer_queue_family;
+  VkQueue transfer_queue;
   VkDebugReportCallbackEXT debug_report_callback;
   VkCommandPool command_pool;
+  // indexed by GFX_Queue and thread id, created lazily
+  VkCommandPool thread_command_pools[NUM_QUEUES][LIDA_GFX_MAX_THREADS];
   VkDescriptorPool static_ds_pool;
   VkDescriptorPool dynamic_ds_pool;
-
+  // sets from 'ds_cache' are allocated from this pool
+  VkDescriptorPool ds_cache_pool;
+  // cached sets evicted from cache, they're freed when GPU is done
+  // with frames that could use them
+#define MAX_RETIRED_SETS 128
+  struct {
+    VkDescriptorSet set;
+    uint64_t frame;
+  } retired_sets[MAX_RETIRED_SETS];
+  uint32_t num_retired_sets;
+  uint32_t ds_cache_hits;
+  uint32_t ds_cache_misses;
+  // counters of frame being recorded and of the last submitted frame,
+  // see 'gfx_get_frame_stats()'. Commands are counted per command
+  // list and added when list is submitted; uploads, descriptor writes
+  // and waits are counted here directly.
+  GFX_Frame_Stats frame_stats;
+  GFX_Frame_Stats last_frame_stats;
+  // 'count_cache_misses()' when frame was begun
+  uint32_t frame_cache_misses;
+  // incremented each time a window frame is submitted
+  uint64_t frame_counter;
+  // graphics timeline value of recently submitted frames, indexed by
+  // frame counter
+#define MAX_FRAME_VALUES 16
+  uint64_t frame_values[MAX_FRAME_VALUES];
+  // indexed by GFX_Queue, queues without own family use graphics
+  // timeline
+  Timeline timelines[NUM_QUEUES];
+
+  // writes are sent to Vulkan in chunks of this size, batch is
+  // flushed automatically when chunk is full
 #define MAX_DS_WRITES 64
   VkWriteDescriptorSet ds_writes[MAX_DS_WRITES];
   union {
@@ -561,9 +868,176 @@ static struct {
     VkDescriptorImageInfo image;
   } ds_objects[MAX_DS_WRITES];
   uint32_t ds_writes_offset;
+  // VK_KHR_descriptor_update_template is enabled
+  int has_update_templates;
+  // VK_KHR_push_descriptor is enabled
+  int has_push_descriptors;
+  // VK_EXT_memory_budget is enabled
+  int has_memory_budget;
+  // VK_KHR_dedicated_allocation is enabled
+  int has_dedicated_allocation;
+  // VK_KHR_timeline_semaphore is enabled
+  int has_timeline_semaphores;
+  // frame being recorded by 'gfx_begin_commands()', its transient
+  // pools are used when push descriptors are not supported
+  void* current_frame;
+
+  // global descriptor set with arrays of all resources, see
+  // 'GFX_Init_Info::enable_bindless'
+  struct {
+    int enabled;
+    VkDescriptorSetLayout layout;
+    VkDescriptorPool pool;
+    VkDescriptorSet set;
+    // sampler used by all sampled images
+    VkSampler sampler;
+    // bit is set if array element is in use, per binding
+    uint32_t used[3][LIDA_GFX_BINDLESS_MAX_RESOURCES/32];
+    // released elements, they're reused when frames that could
+    // access them are done on GPU
+#define MAX_RETIRED_INDICES 256
+    struct {
+      uint32_t binding;
+      uint32_t index;
+      uint64_t frame;
+    } retired[MAX_RETIRED_INDICES];
+    uint32_t num_retired;
+  } bindless;
+
+  // ring buffer of 'gfx_allocate_frame_data()', it's split into one
+  // partition per frame in flight
+  struct {
+    GFX_Buffer buffer;
+    GFX_Memory_Block memory;
+    char* mapped;
+    uint32_t alignment;
+    // partition of frame being recorded
+    uint32_t begin;
+    uint32_t offset;
+    // graphics timeline value of last submission that used partition,
+    // window frames and compute batches share partitions
+    uint32_t partition;
+    uint64_t values[LIDA_GFX_MAX_FRAMES_IN_FLIGHT];
+  } frame_data;
+  // no surface and swapchain extensions are enabled, see
+  // 'GFX_Init_Info::headless'
+  int headless;
+  // frames of commands recorded with 'gfx_begin_compute()'. It's a
+  // window without swapchain.
+  GFX_Window compute_window;
+  int has_compute_window;
+
+  // timestamps of GPU zones, see 'GFX_Init_Info::enable_gpu_zones'
+  struct {
+    int enabled;
+    // indexed by frame data partition
+    GPU_Zone_Frame frames[LIDA_GFX_MAX_FRAMES_IN_FLIGHT];
+    // frame being recorded and its main command list, zones of other
+    // lists are ignored
+    GPU_Zone_Frame* recording;
+    void* list;
+    // innermost open zone, -1 if none
+    int32_t current;
+    // zone opened by render pass, it's closed with the pass
+    int32_t pass_zone;
+    // zones begun when frame was full, they're ignored
+    uint32_t skipped;
+    uint64_t timestamp_mask;
+    // zones of the last frame with results read back
+    GFX_GPU_Zone resolved[LIDA_GFX_MAX_GPU_ZONES];
+    uint32_t num_resolved;
+    uint64_t resolved_frame;
+  } gpu_zones;
+  // VK_EXT_calibrated_timestamps is enabled and can sample device and
+  // host clocks together
+  int has_calibrated_timestamps;
+
+#ifdef LIDA_GFX_TRACE
+  // events for 'gfx_write_trace()'. Ring has one producer and needs
+  // no locks: instrumented paths are only reached from functions that
+  // must be called from one thread. Command lists recorded on other
+  // threads don't reach them, except 'gfx_cmd_begin_render_pass()',
+  // 'gfx_begin_reusable_command_list()' and 'gfx_cmd_push_descriptors()'
+  // without VK_KHR_push_descriptor, which are documented as
+  // single-threaded.
+  struct {
+    Trace_Event events[LIDA_GFX_TRACE_EVENTS];
+    // events ever recorded and events already written
+    uint64_t head;
+    uint64_t tail;
+    // open CPU zones, deeper ones are ignored
+#define MAX_TRACE_DEPTH 16
+    const char* names[MAX_TRACE_DEPTH];
+    uint64_t begin_times[MAX_TRACE_DEPTH];
+    uint32_t depth;
+  } trace;
+#endif
 
-  VkCommandBuffer current_cmd;
-  GFX_Pipeline* current_pipeline;
+  // staging ring and copies recorded by 'gfx_upload_*()', see
+  // 'flush_uploads()'
+  struct {
+    GFX_Buffer buffer;
+    GFX_Memory_Block memory;
+    char* mapped;
+    // bytes ever allocated from ring and bytes GPU is done with
+    uint64_t head;
+    uint64_t tail;
+    VkCommandPool graphics_pool;
+    VkCommandPool transfer_pool;
+    Upload_Batch batches[LIDA_GFX_MAX_UPLOAD_BATCHES];
+    uint32_t next_batch;
+    Buffer_Upload buffer_copies[LIDA_GFX_MAX_UPLOAD_REGIONS];
+    uint32_t num_buffer_copies;
+    Image_Upload image_copies[LIDA_GFX_MAX_UPLOAD_REGIONS];
+    uint32_t num_image_copies;
+    // transfer queue can copy to any region of image
+    int transfer_images;
+  } upload;
+
+  // see 'allocate_memory_block()'
+  struct {
+    Memory_Page pages[LIDA_GFX_MAX_MEMORY_PAGES];
+    Memory_Pool pools[MEMORY_MAX_POOLS];
+    uint32_t num_pools;
+    Memory_Chunk chunks[LIDA_GFX_MAX_MEMORY_CHUNKS];
+    // head of list of unused chunk headers
+    uint32_t unused_chunks;
+    // device memory used and how much we may use, per heap. They're
+    // queried from VK_EXT_memory_budget when it's supported, otherwise
+    // we count our own pages.
+    VkDeviceSize heap_usage[VK_MAX_MEMORY_HEAPS];
+    VkDeviceSize heap_budget[VK_MAX_MEMORY_HEAPS];
+    // set by defragmentation, streamables can't be evicted meanwhile
+    int locked;
+    // blocks that can be freed to stay within budget
+    Streamable streamables[LIDA_GFX_MAX_STREAMABLES];
+    uint32_t num_evictions;
+  } allocator;
+
+  // resources replaced by 'gfx_defragment_memory()', they're
+  // destroyed with their memory when GPU is done with frames that
+  // could use them
+#define MAX_RETIRED_RESOURCES 64
+  struct {
+    uint32_t type;
+    union {
+      GFX_Buffer buffer;
+      GFX_Image image;
+      GFX_Texture texture;
+    } object;
+    // MEMORY_NONE for textures
+    uint32_t chunk;
+    uint64_t frame;
+  } retired_resources[MAX_RETIRED_RESOURCES];
+  uint32_t num_retired_resources;
+
+  // command list of the window frame being recorded; it is used by
+  // recording functions that don't take a command list
+  GFX_Command_List* current_list;
+  // lists recorded with 'gfx_begin_reusable_command_list()'
+  void* reusable_lists[LIDA_GFX_MAX_REUSABLE_LISTS];
+  uint32_t num_reusable_lists;
+  uint32_t frames_in_flight;
 
   GFX_Log_Callback                log_fn;
   GFX_Load_Shader_Module_Callback load_shader_fn;
@@ -584,7 +1058,12 @@ static struct {
   LRU_Cache ds_layout_cache;
   LRU_Cache pipeline_layout_cache;
   LRU_Cache framebuffer_cache;
-  LRU_Cache sampler_cache;
+  LRU_Cache ds_cache;
+
+  // All samplers library can make, indexed by [is_linear][address_mode].
+  // They're created in 'gfx_init()' and stay immutable, so command lists
+  // recorded on other threads can read them.
+  VkSampler samplers[2][5];
 
   VkPhysicalDeviceProperties device_properties;
   VkPhysicalDeviceFeatures device_features;
@@ -633,6 +1112,145 @@ static uint32_t count_set_bits(uint32_t n)
   return count;
 }
 
+// Index of the lowest set bit, 'n' must not be 0.
+static uint32_t find_first_set(uint32_t n)
+{
+#ifdef __GNUC__
+  return __builtin_ctz(n);
+#else
+  uint32_t i = 0;
+  while ((n & 1) == 0) {
+    n >>= 1;
+    i++;
+  }
+  return i;
+#endif
+}
+
+// Index of the highest set bit, 'n' must not be 0.
+static uint32_t find_last_set(uint64_t n)
+{
+#ifdef __GNUC__
+  return 63 - __builtin_clzll(n);
+#else
+  uint32_t i = 0;
+  while (n >>= 1)
+    i++;
+  return i;
+#endif
+}
+
+#ifdef _WIN32
+#define HOST_TIME_DOMAIN VK_TIME_DOMAIN_QUERY_PERFORMANCE_COUNTER_EXT
+#else
+#define HOST_TIME_DOMAIN VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT
+#endif
+
+// Convert value of HOST_TIME_DOMAIN clock to nanoseconds.
+static uint64_t
+host_time_to_ns(uint64_t time)
+{
+#ifdef _WIN32
+  long long frequency;
+  QueryPerformanceFrequency(&frequency);
+  return (uint64_t)((double)time * 1e9 / (double)frequency);
+#else
+  return time;
+#endif
+}
+
+// Return nanoseconds of HOST_TIME_DOMAIN clock, so CPU and calibrated
+// GPU events are on one timeline.
+static uint64_t
+get_host_time()
+{
+#ifdef _WIN32
+  long long counter;
+  QueryPerformanceCounter(&counter);
+  return host_time_to_ns((uint64_t)counter);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#ifdef LIDA_GFX_TRACE
+
+static void
+push_trace_event(const char* name, uint64_t begin, uint64_t duration, uint32_t track)
+{
+  // oldest event is overwritten when ring is full
+  if (g.trace.head - g.trace.tail == LIDA_GFX_TRACE_EVENTS)
+    g.trace.tail++;
+  g.trace.events[g.trace.head % LIDA_GFX_TRACE_EVENTS] = (Trace_Event) {
+    .name = name,
+    .begin = begin,
+    .duration = duration,
+    .track = track,
+  };
+  g.trace.head++;
+}
+
+static void
+trace_begin(const char* name)
+{
+  if (g.trace.depth < MAX_TRACE_DEPTH) {
+    g.trace.names[g.trace.depth] = name;
+    g.trace.begin_times[g.trace.depth] = get_host_time();
+  }
+  g.trace.depth++;
+}
+
+static void
+trace_end()
+{
+  g.trace.depth--;
+  if (g.trace.depth < MAX_TRACE_DEPTH) {
+    uint64_t begin = g.trace.begin_times[g.trace.depth];
+    push_trace_event(g.trace.names[g.trace.depth], begin, get_host_time() - begin, TRACE_TRACK_CPU);
+  }
+}
+
+// Check that device can sample its clock together with HOST_TIME_DOMAIN.
+static int
+has_host_time_domain()
+{
+  uint32_t count = 0;
+  vkGetPhysicalDeviceCalibrateableTimeDomainsEXT(g.physical_device, &count, NULL);
+  VkTimeDomainEXT* domains = alloca(count * sizeof(VkTimeDomainEXT));
+  vkGetPhysicalDeviceCalibrateableTimeDomainsEXT(g.physical_device, &count, domains);
+  int device = 0, host = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    device |= (domains[i] == VK_TIME_DOMAIN_DEVICE_EXT);
+    host |= (domains[i] == HOST_TIME_DOMAIN);
+  }
+  return device && host;
+}
+
+// Get GPU timestamp and trace time of the same moment. Return 0 if
+// device can't do that.
+static int
+calibrate_timestamps(uint64_t* gpu_time, uint64_t* cpu_time)
+{
+  if (g.has_calibrated_timestamps == 0)
+    return 0;
+  VkCalibratedTimestampInfoEXT infos[2] = {
+    { .sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT, .timeDomain = VK_TIME_DOMAIN_DEVICE_EXT },
+    { .sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT, .timeDomain = HOST_TIME_DOMAIN },
+  };
+  uint64_t timestamps[2];
+  uint64_t max_deviation;
+  VkResult err = vkGetCalibratedTimestampsEXT(g.logical_device, 2, infos, timestamps, &max_deviation);
+  if (err != VK_SUCCESS)
+    return 0;
+  *gpu_time = timestamps[0];
+  *cpu_time = host_time_to_ns(timestamps[1]);
+  return 1;
+}
+
+#endif // LIDA_GFX_TRACE
+
 
 /* --SPIR-V */
 // https://github.com/KhronosGroup/SPIRV-Headers/blob/main/include/spirv/1.0/spirv.h
@@ -1625,6 +2243,12 @@ typedef struct {
       const uint32_t* memberTypes;
       uint32_t numMemberTypes;
       SpvDecoration structType;
+      // from 'Offset' member decorations: offset of the first member
+      // and offset of the last one
+      uint32_t hasOffsets;
+      uint32_t minOffset;
+      uint32_t maxOffset;
+      uint32_t maxOffsetMember;
     } val_struct;
     struct {
       uint32_t elementTypeId;
@@ -1766,6 +2390,21 @@ ReflectSPIRV(const uint32_t* code, uint32_t size, Shader_Reflect* shader)
 	break;
       }
       break;
+    case SpvOpMemberDecorate:
+      assert(word_count >= 4);
+      assert(ins[1] < id_bound);
+      if (ins[3] == SpvDecorationOffset) {
+	assert(word_count == 5);
+	SPIRV_ID* id = &ids[ins[1]];
+	if (!id->data.val_struct.hasOffsets || ins[4] < id->data.val_struct.minOffset)
+	  id->data.val_struct.minOffset = ins[4];
+	if (!id->data.val_struct.hasOffsets || ins[4] >= id->data.val_struct.maxOffset) {
+	  id->data.val_struct.maxOffset = ins[4];
+	  id->data.val_struct.maxOffsetMember = ins[2];
+	}
+	id->data.val_struct.hasOffsets = 1;
+      }
+      break;
     case SpvOpTypeStruct:
       ids[ins[1]].opcode = opcode;
       ids[ins[1]].data.val_struct.memberTypes = ins + 2;
@@ -1806,6 +2445,12 @@ ReflectSPIRV(const uint32_t* code, uint32_t size, Shader_Reflect* shader)
       ids[ins[1]].data.val_array.elementTypeId = ins[2];
       ids[ins[1]].data.val_array.sizeConstantId = ins[3];
       break;
+    case SpvOpTypeRuntimeArray:
+      assert(ids[ins[1]].opcode == 0);
+      ids[ins[1]].opcode = opcode;
+      ids[ins[1]].data.val_array.elementTypeId = ins[2];
+      ids[ins[1]].data.val_array.sizeConstantId = 0;
+      break;
     case SpvOpTypePointer:
       assert(word_count == 4);
       assert(ins[1] < id_bound);
@@ -1858,11 +2503,24 @@ ReflectSPIRV(const uint32_t* code, uint32_t size, Shader_Reflect* shader)
       assert(ids[id->data.binding.typeId].opcode == SpvOpTypePointer);
       Binding_Set_Desc* set = &shader->sets[id->data.binding.set];
       VkDescriptorType* ds_type = &set->bindings[set->binding_count].descriptorType;
-      switch (ids[ids[id->data.binding.typeId].data.binding.typeId].opcode) {
+      // arrays of resources; runtime arrays have zero descriptors,
+      // they're only used with bindless set
+      uint32_t type_id = ids[id->data.binding.typeId].data.binding.typeId;
+      uint32_t descriptor_count = 1;
+      if (ids[type_id].opcode == SpvOpTypeArray) {
+	descriptor_count = ids[ids[type_id].data.val_array.sizeConstantId].data.val_const.constantValue;
+	type_id = ids[type_id].data.val_array.elementTypeId;
+      } else if (ids[type_id].opcode == SpvOpTypeRuntimeArray) {
+	descriptor_count = 0;
+	type_id = ids[type_id].data.val_array.elementTypeId;
+      }
+      switch (ids[type_id].opcode) {
       case SpvOpTypeStruct:
-	switch (ids[ids[id->data.binding.typeId].data.binding.typeId].data.val_struct.structType) {
+	switch (ids[type_id].data.val_struct.structType) {
 	case SpvDecorationBlock:
-	  *ds_type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	  // since SPIR-V 1.3 storage buffers are Blocks in StorageBuffer storage class
+	  *ds_type = (id->data.binding.storageClass == SpvStorageClassStorageBuffer) ?
+	    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER : VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
 	  break;
 	case SpvDecorationBufferBlock:
 	  *ds_type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
@@ -1886,17 +2544,28 @@ ReflectSPIRV(const uint32_t* code, uint32_t size, Shader_Reflect* shader)
       }
 
       set->bindings[set->binding_count].binding = id->data.binding.binding;
-      set->bindings[set->binding_count].descriptorCount = 1;
+      set->bindings[set->binding_count].descriptorCount = descriptor_count;
       set->bindings[set->binding_count].stageFlags = shader->stages;
       set->binding_count++;
     } else if (id->opcode == SpvOpVariable &&
 	       id->data.binding.storageClass == SpvStorageClassPushConstant) {
-      // process push constant
+      // process push constant; block may start at non-zero offset when
+      // stages use different parts of push constants
       assert(ids[id->data.binding.typeId].data.binding.storageClass == SpvStorageClassPushConstant);
+      uint32_t type_id = ids[id->data.binding.typeId].data.binding.typeId;
+      const SPIRV_ID* block = &ids[type_id];
+      uint32_t offset = 0, size;
+      if (block->opcode == SpvOpTypeStruct && block->data.val_struct.hasOffsets) {
+	uint32_t last_type = block->data.val_struct.memberTypes[block->data.val_struct.maxOffsetMember];
+	offset = block->data.val_struct.minOffset;
+	size = block->data.val_struct.maxOffset + SPIRV_ComputeTypeSize(ids, last_type, 0) - offset;
+      } else {
+	size = SPIRV_ComputeTypeSize(ids, type_id, 0);
+      }
       shader->ranges[shader->range_count] = (VkPushConstantRange) {
 	.stageFlags = shader->stages,
-	.offset = 0,
-	.size = SPIRV_ComputeTypeSize(ids, ids[id->data.binding.typeId].data.binding.typeId, 0),
+	.offset = offset,
+	.size = size,
       };
       shader->range_count++;
     }
@@ -1952,12 +2621,14 @@ get_instance_extensions(const GFX_Init_Info* info)
   } required_extensions[] = {
     // NOTE: here we declare all instance extensions we use
     { VK_EXT_DEBUG_REPORT_EXTENSION_NAME, info->enable_debug_layers },
-    { VK_KHR_SURFACE_EXTENSION_NAME, 1 },
-    { "VK_KHR_win32_surface", 1 },
-    { "VK_KHR_android_surface", 1 },
-    { "VK_KHR_xlib_surface", 1 },
-    { "VK_KHR_xcb_surface", 1 },
-    { "VK_KHR_wayland_surface", 1 },
+    // needed by VK_KHR_push_descriptor and VK_EXT_descriptor_indexing
+    { VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME, 1 },
+    { VK_KHR_SURFACE_EXTENSION_NAME, !g.headless },
+    { "VK_KHR_win32_surface", !g.headless },
+    { "VK_KHR_android_surface", !g.headless },
+    { "VK_KHR_xlib_surface", !g.headless },
+    { "VK_KHR_xcb_surface", !g.headless },
+    { "VK_KHR_wayland_surface", !g.headless },
   };
 
   vkEnumerateInstanceExtensionProperties(NULL, &num_available_instance_extensions, NULL);
@@ -1979,9 +2650,20 @@ get_instance_extensions(const GFX_Init_Info* info)
   }
 }
 
+static int
+is_instance_extension_enabled(const char* name)
+{
+  for (uint32_t i = 0; i < g.num_enabled_instance_extensions; i++) {
+    if (strcmp(g.enabled_instance_extensions[i], name) == 0)
+      return 1;
+  }
+  return 0;
+}
+
 static void
 get_device_extensions(const GFX_Init_Info* info)
 {
+  int has_properties2 = is_instance_extension_enabled(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
   VkExtensionProperties* available_device_extensions;
   uint32_t num_available_device_extensions;
 
@@ -2003,9 +2685,19 @@ get_device_extensions(const GFX_Init_Info* info)
     const char* name; int enabled;
   } required_extensions[] = {
     // NOTE: here we declare all device extensions we use
-    { VK_KHR_SWAPCHAIN_EXTENSION_NAME, 1 },
+    { VK_KHR_SWAPCHAIN_EXTENSION_NAME, !g.headless },
     { VK_EXT_DEBUG_MARKER_EXTENSION_NAME, info->enable_debug_layers },
     { VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME, 0 },
+    { VK_KHR_DESCRIPTOR_UPDATE_TEMPLATE_EXTENSION_NAME, 1 },
+    { VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME, has_properties2 },
+    { VK_KHR_MAINTENANCE3_EXTENSION_NAME, info->enable_bindless },
+    { VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME, info->enable_bindless && has_properties2 },
+    { VK_EXT_MEMORY_BUDGET_EXTENSION_NAME, has_properties2 },
+    { VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME, 1 },
+    { VK_KHR_DEDICATED_ALLOCATION_EXTENSION_NAME, 1 },
+    { VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME, has_properties2 },
+    // only used to put GPU zones on trace timeline
+    { VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME, TRACE_ENABLED && info->enable_gpu_zones },
   };
   g.enabled_device_extensions = push_mem(0);
   g.num_enabled_device_extensions = 0;
@@ -2027,6 +2719,77 @@ get_device_extensions(const GFX_Init_Info* info)
   }
 }
 
+static int
+is_device_extension_enabled(const char* name)
+{
+  for (uint32_t i = 0; i < g.num_enabled_device_extensions; i++) {
+    if (strcmp(g.enabled_device_extensions[i], name) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+// Check that device supports everything needed by bindless mode and
+// fill features to enable.
+static int
+get_bindless_features(VkPhysicalDeviceDescriptorIndexingFeaturesEXT* enabled)
+{
+  if (is_device_extension_enabled(VK_KHR_MAINTENANCE3_EXTENSION_NAME) == 0 ||
+      is_device_extension_enabled(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME) == 0) {
+    LOG_WARN("descriptor indexing is not supported, bindless mode is disabled");
+    return 0;
+  }
+  VkPhysicalDeviceDescriptorIndexingFeaturesEXT supported = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT,
+  };
+  VkPhysicalDeviceFeatures2KHR features = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR,
+    .pNext = &supported,
+  };
+  vkGetPhysicalDeviceFeatures2KHR(g.physical_device, &features);
+  if (!supported.runtimeDescriptorArray ||
+      !supported.descriptorBindingPartiallyBound ||
+      !supported.descriptorBindingUpdateUnusedWhilePending ||
+      !supported.descriptorBindingSampledImageUpdateAfterBind ||
+      !supported.descriptorBindingStorageImageUpdateAfterBind ||
+      !supported.descriptorBindingStorageBufferUpdateAfterBind ||
+      !supported.shaderSampledImageArrayNonUniformIndexing) {
+    LOG_WARN("device lacks descriptor indexing features, bindless mode is disabled");
+    return 0;
+  }
+  enabled->runtimeDescriptorArray = VK_TRUE;
+  enabled->descriptorBindingPartiallyBound = VK_TRUE;
+  enabled->descriptorBindingUpdateUnusedWhilePending = VK_TRUE;
+  enabled->descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+  enabled->descriptorBindingStorageImageUpdateAfterBind = VK_TRUE;
+  enabled->descriptorBindingStorageBufferUpdateAfterBind = VK_TRUE;
+  enabled->shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+  return 1;
+}
+
+static int
+get_timeline_features(VkPhysicalDeviceTimelineSemaphoreFeaturesKHR* enabled)
+{
+  if (is_device_extension_enabled(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME) == 0) {
+    LOG_WARN("timeline semaphores are not supported, GPU progress is tracked with fences");
+    return 0;
+  }
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR supported = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR,
+  };
+  VkPhysicalDeviceFeatures2KHR features = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR,
+    .pNext = &supported,
+  };
+  vkGetPhysicalDeviceFeatures2KHR(g.physical_device, &features);
+  if (!supported.timelineSemaphore) {
+    LOG_WARN("device lacks timeline semaphore feature, GPU progress is tracked with fences");
+    return 0;
+  }
+  enabled->timelineSemaphore = VK_TRUE;
+  return 1;
+}
+
 static const char*
 to_string_VkResult(VkResult err)
 {
@@ -2066,11 +2829,11 @@ to_string_VkResult(VkResult err)
 }
 
 static VkResult
-allocate_command_buffers(VkCommandBuffer* cmds, uint32_t count, VkCommandBufferLevel level)
+allocate_command_buffers(VkCommandPool pool, VkCommandBuffer* cmds, uint32_t count, VkCommandBufferLevel level)
 {
   VkCommandBufferAllocateInfo alloc_info = {
     .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-    .commandPool        = g.command_pool,
+    .commandPool        = pool,
     .level              = level,
     .commandBufferCount = count,
   };
@@ -2277,7 +3040,9 @@ create_shader(const char* tag)
   if (err != VK_SUCCESS) {
     LOG_ERROR("failed to create shader module with error %s", to_string_VkResult(err));
   } else {
+    TRACE_BEGIN("ReflectSPIRV");
     ReflectSPIRV(buffer, buffer_size / sizeof(uint32_t), &ret->reflect);
+    TRACE_END();
   }
   g.free_shader_fn(buffer);
   return ret;
@@ -2296,8 +3061,8 @@ merge_shader_reflects(Shader_Reflect* dst, const Shader_Reflect** shaders, uint3
       uint32_t old_count = *pCount;
       for (uint32_t j = 0; j < set->binding_count; j++) {
 	int found = 0;
-	for (uint32_t k = 0; old_count; k++) {
-	  VkDescriptorSetLayoutBinding* binding = &dst->sets[j].bindings[k];
+	for (uint32_t k = 0; k < old_count; k++) {
+	  VkDescriptorSetLayoutBinding* binding = &dst->sets[i].bindings[k];
 	  if (binding->binding == set->bindings[j].binding) {
 	    if (binding->descriptorType != set->bindings[j].descriptorType ||
 		binding->descriptorCount != set->bindings[j].descriptorCount) {
@@ -2319,14 +3084,18 @@ merge_shader_reflects(Shader_Reflect* dst, const Shader_Reflect** shaders, uint3
 	}
       }
     }
+    // NOTE: Vulkan doesn't allow a stage to be in several ranges, so
+    // equal ranges are merged and others are kept separate
     for (uint32_t i = 0; i < src->range_count; i++) {
-      const VkPushConstantRange* lrange, *rrange;
+      VkPushConstantRange* lrange;
+      const VkPushConstantRange* rrange;
       int found = 0;
       rrange = &src->ranges[i];
       for (uint32_t j = 0; j < dst->range_count; j++) {
 	lrange = &dst->ranges[j];
 	if (lrange->offset == rrange->offset &&
 	    lrange->size == rrange->size) {
+	  lrange->stageFlags |= rrange->stageFlags;
 	  found = 1;
 	  break;
 	}
@@ -2345,36 +3114,53 @@ typedef struct {
 
   VkDescriptorSetLayoutBinding bindings[LIDA_GFX_SHADER_MAX_BINDINGS_PER_SET];
   uint32_t num_bindings;
+  VkDescriptorSetLayoutCreateFlags flags;
   VkDescriptorSetLayout layout;
+  // NULL if VK_KHR_descriptor_update_template is not supported
+  VkDescriptorUpdateTemplateKHR update_template;
 
 } DS_Layout;
 
+// Descriptor data of one binding. Update templates read an array of
+// these, one per binding of layout in the same order.
+typedef union {
+  VkDescriptorBufferInfo buffer;
+  VkDescriptorImageInfo image;
+} Descriptor_Info;
+
 static uint32_t
 hash_ds_layout(const void* obj)
 {
   const DS_Layout* l = obj;
-  return hash_memory(l->bindings, l->num_bindings * sizeof(VkDescriptorSetLayoutBinding));
+  return hash_memory(l->bindings, l->num_bindings * sizeof(VkDescriptorSetLayoutBinding)) ^ l->flags;
 }
 
 static int
 eq_ds_layout(const void* l, const void* r)
 {
   const DS_Layout* left = l, *right = r;
-  if (left->num_bindings != right->num_bindings)
+  if (left->num_bindings != right->num_bindings || left->flags != right->flags)
     return 0;
   return memcmp(left->bindings, right->bindings,
 		left->num_bindings * sizeof(VkDescriptorSetLayoutBinding)) == 0;
 }
 
+// defined after descriptor set cache
+static void forget_cached_descriptor_sets(uint64_t handle);
+
 static void
 destroy_ds_layout(void* obj)
 {
   DS_Layout* s = obj;
+  forget_cached_descriptor_sets((uint64_t)s->layout);
+  if (s->update_template)
+    vkDestroyDescriptorUpdateTemplateKHR(g.logical_device, s->update_template, NULL);
   vkDestroyDescriptorSetLayout(g.logical_device, s->layout, NULL);
 }
 
 static DS_Layout*
-create_ds_layout(const VkDescriptorSetLayoutBinding* bindings, uint32_t num_bindings)
+create_ds_layout(const VkDescriptorSetLayoutBinding* bindings, uint32_t num_bindings,
+		 VkDescriptorSetLayoutCreateFlags flags)
 {
   int flag;
   if (num_bindings > LIDA_GFX_SHADER_MAX_BINDINGS_PER_SET) {
@@ -2386,12 +3172,14 @@ create_ds_layout(const VkDescriptorSetLayoutBinding* bindings, uint32_t num_bind
   DS_Layout temp;
   memcpy(temp.bindings, bindings, num_bindings * sizeof(VkDescriptorSetLayoutBinding));
   temp.num_bindings = num_bindings;
+  temp.flags = flags;
   DS_Layout* ret = lru_cache_get(&g.ds_layout_cache, &temp, &flag);
 
   if (flag == 0)
     return ret;
   VkDescriptorSetLayoutCreateInfo layout_info = {
     .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+    .flags = flags,
     .bindingCount = num_bindings,
     .pBindings = bindings,
   };
@@ -2399,9 +3187,80 @@ create_ds_layout(const VkDescriptorSetLayoutBinding* bindings, uint32_t num_bind
   if (err != VK_SUCCESS) {
     LOG_ERROR("failed to create descriptor layout with error %s", to_string_VkResult(err));
   }
+  ret->update_template = VK_NULL_HANDLE;
+  // NOTE: push descriptor sets are never written with templates
+  if (g.has_update_templates && err == VK_SUCCESS &&
+      (flags & VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR) == 0) {
+    VkDescriptorUpdateTemplateEntryKHR entries[LIDA_GFX_SHADER_MAX_BINDINGS_PER_SET];
+    for (uint32_t i = 0; i < num_bindings; i++) {
+      entries[i] = (VkDescriptorUpdateTemplateEntryKHR) {
+	.dstBinding = bindings[i].binding,
+	.dstArrayElement = 0,
+	.descriptorCount = 1,
+	.descriptorType = bindings[i].descriptorType,
+	.offset = i * sizeof(Descriptor_Info),
+	.stride = sizeof(Descriptor_Info),
+      };
+    }
+    VkDescriptorUpdateTemplateCreateInfoKHR template_info = {
+      .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO_KHR,
+      .descriptorUpdateEntryCount = num_bindings,
+      .pDescriptorUpdateEntries = entries,
+      .templateType = VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET_KHR,
+      .descriptorSetLayout = ret->layout,
+    };
+    err = vkCreateDescriptorUpdateTemplateKHR(g.logical_device, &template_info, NULL, &ret->update_template);
+    if (err != VK_SUCCESS) {
+      LOG_WARN("failed to create descriptor update template with error %s", to_string_VkResult(err));
+      ret->update_template = VK_NULL_HANDLE;
+    }
+  }
   return ret;
 }
 
+static VkWriteDescriptorSet
+make_descriptor_write(VkDescriptorSet set, uint32_t binding, VkDescriptorType type, const Descriptor_Info* info)
+{
+  VkWriteDescriptorSet write = {
+    .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+    .dstSet = set,
+    .dstBinding = binding,
+    .descriptorCount = 1,
+    .descriptorType = type,
+  };
+  switch (type) {
+  case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
+  case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
+  case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC:
+  case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC:
+    write.pBufferInfo = &info->buffer;
+    break;
+  default:
+    write.pImageInfo = &info->image;
+  }
+  return write;
+}
+
+// Write all bindings of 'set'. 'infos' has one element per binding of
+// 'layout'.
+static void
+write_descriptor_set(const DS_Layout* layout, VkDescriptorSet set, const Descriptor_Info* infos)
+{
+  g.frame_stats.num_descriptor_writes += layout->num_bindings;
+  if (layout->update_template) {
+    vkUpdateDescriptorSetWithTemplateKHR(g.logical_device, set, layout->update_template, infos);
+    return;
+  }
+  VkWriteDescriptorSet writes[LIDA_GFX_SHADER_MAX_BINDINGS_PER_SET];
+  for (uint32_t i = 0; i < layout->num_bindings; i++) {
+    writes[i] = make_descriptor_write(set, layout->bindings[i].binding,
+				      layout->bindings[i].descriptorType, &infos[i]);
+  }
+  TRACE_BEGIN("vkUpdateDescriptorSets");
+  vkUpdateDescriptorSets(g.logical_device, layout->num_bindings, writes, 0, NULL);
+  TRACE_END();
+}
+
 typedef struct {
 
   // NOTE: I think using pointer here is a bit dangerous as some
@@ -2444,8 +3303,28 @@ destroy_pipeline_layout(void* obj)
   vkDestroyPipelineLayout(g.logical_device, s->handle, NULL);
 }
 
+// Sets with runtime arrays are bindless set. Other bindings in such
+// set must match layout of bindless set too.
+static int
+is_bindless_set(const Binding_Set_Desc* set)
+{
+  int bindless = 0;
+  for (uint32_t i = 0; i < set->binding_count; i++) {
+    if (set->bindings[i].descriptorCount == 0)
+      bindless = 1;
+  }
+  return bindless;
+}
+
+/**
+   Create pipeline layout for shaders. If 'push_descriptors' is set
+   then the last set is written with 'gfx_push_descriptors()'. Buffers
+   of sets in 'dynamic_buffer_sets' mask become dynamic. Returns NULL
+   if shaders need bindless set, but bindless mode is disabled.
+ */
 static Pipeline_Layout*
-create_pipeline_layout(const Shader_Reflect** shader_templates, uint32_t count)
+create_pipeline_layout(const Shader_Reflect** shader_templates, uint32_t count, int push_descriptors,
+		       uint32_t dynamic_buffer_sets)
 {
   Pipeline_Layout layout = { 0 };
   if (count > 0) {
@@ -2456,7 +3335,29 @@ create_pipeline_layout(const Shader_Reflect** shader_templates, uint32_t count)
     }
     layout.num_sets = shader.set_count;
     for (uint32_t i = 0; i < shader.set_count; i++) {
-      DS_Layout* ds_layout = create_ds_layout(shader.sets[i].bindings, shader.sets[i].binding_count);
+      if (is_bindless_set(&shader.sets[i])) {
+	if (g.bindless.enabled == 0) {
+	  LOG_ERROR("shader uses runtime descriptor arrays, but bindless mode is not enabled");
+	  return NULL;
+	}
+	layout.set_layouts[i] = g.bindless.layout;
+	continue;
+      }
+      int is_push_set = push_descriptors && i+1 == shader.set_count;
+      VkDescriptorSetLayoutCreateFlags flags = 0;
+      if (is_push_set && g.has_push_descriptors)
+	flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR;
+      // NOTE: push descriptor sets can't have dynamic buffers
+      if ((dynamic_buffer_sets & (1u << i)) && !is_push_set) {
+	for (uint32_t j = 0; j < shader.sets[i].binding_count; j++) {
+	  VkDescriptorSetLayoutBinding* binding = &shader.sets[i].bindings[j];
+	  if (binding->descriptorType == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER)
+	    binding->descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	  else if (binding->descriptorType == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER)
+	    binding->descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+	}
+      }
+      DS_Layout* ds_layout = create_ds_layout(shader.sets[i].bindings, shader.sets[i].binding_count, flags);
       layout.set_layouts[i] = ds_layout->layout;
     }
     layout.num_ranges = shader.range_count;
@@ -2486,269 +3387,1989 @@ create_pipeline_layout(const Shader_Reflect** shader_templates, uint32_t count)
 typedef struct {
   VkPipeline handle;
   VkPipelineLayout layout;
+  // layout of set written by 'gfx_push_descriptors()'
+  VkDescriptorSetLayout push_layout;
   VkPipelineBindPoint bind_point;
+  // index of push descriptor set, UINT32_MAX if pipeline has none
+  uint32_t push_set;
+  // push constant ranges of layout, they tell which stages receive
+  // each part of push constants
+  uint32_t num_push_ranges;
+  VkPushConstantRange push_ranges[LIDA_GFX_SHADER_MAX_RANGES];
 } Pipeline;
 _Static_assert(sizeof(Pipeline) <= sizeof(GFX_Pipeline), "internal error: need to adjust sizeof for GFX_Pipeline");
+
+static void
+init_push_set(Pipeline* pipeline, const Pipeline_Layout* layout, int push_descriptors)
+{
+  pipeline->num_push_ranges = layout->num_ranges;
+  memcpy(pipeline->push_ranges, layout->ranges, layout->num_ranges * sizeof(VkPushConstantRange));
+  pipeline->push_set = UINT32_MAX;
+  pipeline->push_layout = VK_NULL_HANDLE;
+  if (push_descriptors) {
+    if (layout->num_sets == 0) {
+      LOG_ERROR("pipeline with push descriptors has no descriptor sets");
+      return;
+    }
+    pipeline->push_set = layout->num_sets-1;
+    pipeline->push_layout = layout->set_layouts[pipeline->push_set];
+  }
+}
 // NOTE: we don't cache pipelines as it won't be so good
 
+// State bound to one pipeline bind point(graphics or compute).
 typedef struct {
-  VkImage       image;
-  VkImageView   image_view;
-  VkFramebuffer framebuffer;
-} Window_Image;
-
+  VkPipeline       pipeline;
+  VkPipelineLayout layout;
+  uint32_t         num_sets;
+  VkDescriptorSet  sets[LIDA_GFX_SHADER_MAX_SETS];
+  uint32_t         num_dynamic_offsets;
+  uint32_t         dynamic_offsets[LIDA_GFX_MAX_DYNAMIC_OFFSETS];
+} Bind_Point_State;
+
+// Shadow of command buffer state. Used to drop binds of state that is
+// already bound. It's reset when state becomes unknown: at the
+// beginning of recording and after 'vkCmdExecuteCommands'.
 typedef struct {
-  VkCommandBuffer cmd;
-  VkSemaphore     image_available;
-} Window_Frame;
+  Bind_Point_State bind_points[2];
+  uint32_t         num_vertex_buffers;
+  VkBuffer         vertex_buffers[LIDA_GFX_MAX_VERTEX_BUFFERS];
+  VkDeviceSize     vertex_offsets[LIDA_GFX_MAX_VERTEX_BUFFERS];
+  VkBuffer         index_buffer;
+  VkDeviceSize     index_offset;
+  VkPipelineLayout push_constant_layout;
+  uint32_t         push_constant_size;
+  char             push_constants[LIDA_GFX_MAX_PUSH_CONSTANT_SIZE];
+  uint32_t         has_viewport;
+  VkViewport       viewport;
+  VkRect2D         scissor;
+} Command_State;
+
+// State which draws captured by a draw queue are recorded with. It's
+// followed by 'push_constant_size' bytes of push constants which
+// start at 'push_constant_offset'.
+typedef struct {
+  Pipeline         pipeline;
+  uint32_t         num_sets;
+  uint32_t         num_vertex_buffers;
+  VkDescriptorSet  sets[LIDA_GFX_SHADER_MAX_SETS];
+  uint32_t         num_dynamic_offsets;
+  uint32_t         dynamic_offsets[LIDA_GFX_MAX_DYNAMIC_OFFSETS];
+  VkBuffer         vertex_buffers[LIDA_GFX_MAX_VERTEX_BUFFERS];
+  VkDeviceSize     vertex_offsets[LIDA_GFX_MAX_VERTEX_BUFFERS];
+  VkBuffer         index_buffer;
+  VkDeviceSize     index_offset;
+  uint32_t         push_constant_offset;
+  uint32_t         push_constant_size;
+} Draw_State;
 
 typedef struct {
+  // sort key: | layer: 8 | pipeline: 16 | descriptor sets: 16 | depth: 24 |
+  uint64_t key;
+  // offset of Draw_State in queue memory
+  uint32_t state;
+  uint32_t indexed;
+  uint32_t count;
+  uint32_t instance_count;
+  // first vertex or first index
+  uint32_t first;
+  int32_t  vertex_offset;
+  uint32_t first_instance;
+} Draw_Packet;
 
-  VkSurfaceKHR                surface;
-  VkSwapchainKHR              swapchain;
-  Render_Pass*                render_pass;
-  uint32_t                    num_images;
-  Window_Image                images[8]; // NOTE: we hope that no vulkan driver creates more than 8 images for a swapchain
-  Window_Frame                frames[2];
-  VkSemaphore                 render_finished_semaphore;
-  VkFence                     resources_available_fence;
-  uint64_t                    frame_counter;
-  uint32_t                    current_image;
-  VkExtent2D                  swapchain_extent;
-  VkSurfaceFormatKHR          format;
-  VkPresentModeKHR            present_mode;
-  VkCompositeAlphaFlagBitsKHR composite_alpha;
+#define DRAW_STATE_NONE UINT32_MAX
 
-} Window;
-_Static_assert(sizeof(Window) <= sizeof(GFX_Window), "Internal error: adjust sizeof for GFX_Window");
+typedef struct {
+  // Draw packets grow from the beginning of memory and states from
+  // the end. Space for a copy of packets is always kept free between
+  // them, it's used for sorting.
+  char*      memory;
+  uint32_t   size;
+  uint32_t   num_packets;
+  uint32_t   state_top;
+  // offset of state which matches 'pending', DRAW_STATE_NONE if
+  // state was changed since last draw
+  uint32_t   current_state;
+  uint64_t   state_key;
+  uint64_t   order_key;
+  // state set by user, it's saved to memory at next draw
+  Draw_State pending;
+  // indexed by push constant offset
+  char       pending_push_constants[LIDA_GFX_MAX_PUSH_CONSTANT_SIZE];
+} Draw_Queue;
+_Static_assert(sizeof(Draw_Queue) <= sizeof(GFX_Draw_Queue), "internal error: adjust sizeof for GFX_Draw_Queue");
+
+typedef struct {
+  // Command buffers are cycled each time the list is begun, so a list
+  // may be recorded while GPU still executes its previous contents.
+  VkCommandBuffer      cmds[LIDA_GFX_MAX_FRAMES_IN_FLIGHT];
+  // command buffer being recorded
+  VkCommandBuffer      cmd;
+  VkCommandPool        pool;
+  uint32_t             num_cmds;
+  uint32_t             counter;
+  VkCommandBufferLevel level;
+  // family of queue this list is submitted to
+  uint32_t             queue_family;
+  // currently bound pipeline
+  Pipeline             pipeline;
+  // render pass being recorded, secondary lists begun with
+  // 'gfx_begin_secondary_command_list()' inherit it
+  VkRenderPass         render_pass;
+  VkFramebuffer        framebuffer;
+  VkExtent2D           render_area;
+  // Reusable lists are recorded once and replayed many times. They
+  // remember Vulkan objects they reference, and become invalid when
+  // one of them is destroyed or updated.
+  uint32_t             reusable;
+  uint32_t             valid;
+  // timeline values of the last submits that used reusable list,
+  // indexed like 'g.timelines'. LIST_USED_BY_FRAME means it was used by a
+  // window frame, whose value is not known yet, see
+  // 'wait_reusable_command_list()'.
+  uint64_t             used_values[NUM_QUEUES];
+  uint32_t             num_refs;
+  uint64_t             refs[LIDA_GFX_COMMAND_LIST_MAX_REFERENCES];
+  Command_State        state;
+  // number of state commands recorded and dropped since list was begun
+  uint32_t             num_issued;
+  uint32_t             num_elided;
+  // commands recorded since list was begun, added to frame stats each
+  // time list is submitted
+  GFX_Frame_Stats      stats;
+  // if not NULL then draws are captured to queue instead of being recorded
+  Draw_Queue*          queue;
+} Command_List;
+_Static_assert(sizeof(Command_List) <= sizeof(GFX_Command_List), "internal error: adjust sizeof for GFX_Command_List");
 
 static VkResult
-create_swapchain(Window* window)
+allocate_command_list(Command_List* list, VkCommandPool pool, uint32_t num_cmds, VkCommandBufferLevel level,
+		      uint32_t queue_family)
 {
-  VkResult err;
+  VkResult err = allocate_command_buffers(pool, list->cmds, num_cmds, level);
+  if (err != VK_SUCCESS) {
+    LOG_ERROR("failed to allocate command buffers with error %s", to_string_VkResult(err));
+    return err;
+  }
+  list->cmd = VK_NULL_HANDLE;
+  list->pool = pool;
+  list->num_cmds = num_cmds;
+  list->counter = 0;
+  list->level = level;
+  list->queue_family = queue_family;
+  list->reusable = 0;
+  list->valid = 0;
+  list->num_refs = 0;
+  memset(list->used_values, 0, sizeof(list->used_values));
+  return err;
+}
 
-  // get device capabilities of surface
-  VkSurfaceCapabilitiesKHR capabilities;
-  vkGetPhysicalDeviceSurfaceCapabilitiesKHR(g.physical_device, window->surface, &capabilities);
+#define LIST_REFERENCES_OVERFLOW UINT32_MAX
+#define LIST_USED_BY_FRAME UINT64_MAX
 
-  // choose surface format
-  VkSurfaceFormatKHR old_format = window->format;
-  uint32_t count;
-  vkGetPhysicalDeviceSurfaceFormatsKHR(g.physical_device, window->surface, &count, NULL);
-  VkSurfaceFormatKHR* formats = push_mem(sizeof(VkSurfaceFormatKHR) * count);
-  vkGetPhysicalDeviceSurfaceFormatsKHR(g.physical_device, window->surface, &count, formats);
-  window->format = formats[0];
-  for (uint32_t i = 1; i < count; i++) {
-    // try to pick R8G8B8A8_SRGB with nonlinear color space because it looks good
-    // TODO: choose in more smart way
-    if (formats[i].format == VK_FORMAT_R8G8B8A8_SRGB &&
-	formats[i].colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
+static void
+add_list_reference(Command_List* list, uint64_t handle)
+{
+  if (list->reusable == 0 || list->num_refs == LIST_REFERENCES_OVERFLOW)
+    return;
+  for (uint32_t i = 0; i < list->num_refs; i++) {
+    if (list->refs[i] == handle)
+      return;
+  }
+  if (list->num_refs == LIDA_GFX_COMMAND_LIST_MAX_REFERENCES) {
+    // stop tracking; from now on any destroyed object invalidates this list
+    list->num_refs = LIST_REFERENCES_OVERFLOW;
+    return;
+  }
+  list->refs[list->num_refs++] = handle;
+}
+
+/**
+   Mark reusable lists that reference 'handle' as invalid. Call this
+   whenever a Vulkan object that can be referenced by a command buffer
+   gets destroyed or updated.
+ */
+static void
+invalidate_command_lists(uint64_t handle)
+{
+  for (uint32_t i = 0; i < g.num_reusable_lists; i++) {
+    Command_List* list = g.reusable_lists[i];
+    if (list->valid == 0)
+      continue;
+    if (list->num_refs == LIST_REFERENCES_OVERFLOW) {
+      list->valid = 0;
+      continue;
+    }
+    for (uint32_t j = 0; j < list->num_refs; j++) {
+      if (list->refs[j] == handle) {
+	list->valid = 0;
+	break;
+      }
+    }
+  }
+}
+
+static void
+free_command_list(Command_List* list)
+{
+  if (list->reusable) {
+    invalidate_command_lists((uint64_t)(uintptr_t)list->cmds[0]);
+    for (uint32_t i = 0; i < g.num_reusable_lists; i++) {
+      if (g.reusable_lists[i] == list) {
+	g.reusable_lists[i] = g.reusable_lists[--g.num_reusable_lists];
+	break;
+      }
+    }
+    list->reusable = 0;
+  }
+  if (list->num_cmds > 0)
+    vkFreeCommandBuffers(g.logical_device, list->pool, list->num_cmds, list->cmds);
+  list->num_cmds = 0;
+  list->cmd = VK_NULL_HANDLE;
+}
+
+static void
+reset_command_state(Command_List* list)
+{
+  memset(&list->state, 0, sizeof(Command_State));
+}
+
+// returns 1 if command is needed, 0 if it was dropped
+static int
+count_state_command(Command_List* list, int needed)
+{
+  if (needed) {
+    list->num_issued++;
+  } else {
+    list->num_elided++;
+  }
+  return needed;
+}
+
+static void
+add_frame_stats(GFX_Frame_Stats* dst, const GFX_Frame_Stats* src)
+{
+  dst->num_draws += src->num_draws;
+  dst->num_dispatches += src->num_dispatches;
+  dst->num_triangles += src->num_triangles;
+  dst->num_barriers += src->num_barriers;
+  dst->num_pipeline_binds += src->num_pipeline_binds;
+  dst->num_descriptor_set_binds += src->num_descriptor_set_binds;
+  dst->num_descriptor_writes += src->num_descriptor_writes;
+  dst->uploaded_bytes += src->uploaded_bytes;
+  dst->copied_bytes += src->copied_bytes;
+  dst->num_cache_misses += src->num_cache_misses;
+  dst->wait_time += src->wait_time;
+}
+
+static void
+count_draw(Command_List* list, uint32_t count, uint32_t instance_count)
+{
+  list->stats.num_draws++;
+  // NOTE: we don't know topology here, count as triangle list
+  list->stats.num_triangles += (uint64_t)(count / 3) * instance_count;
+}
+
+static VkResult
+begin_command_list(Command_List* list, uint32_t index, VkCommandBufferUsageFlags flags,
+		   const VkCommandBufferInheritanceInfo* inheritance)
+{
+  list->cmd = list->cmds[index];
+  list->pipeline.handle = VK_NULL_HANDLE;
+  list->render_pass = VK_NULL_HANDLE;
+  list->framebuffer = VK_NULL_HANDLE;
+  reset_command_state(list);
+  list->num_issued = 0;
+  list->num_elided = 0;
+  memset(&list->stats, 0, sizeof(GFX_Frame_Stats));
+  list->queue = NULL;
+  // Vulkan spec: if commandBuffer is a secondary command buffer,
+  // pInheritanceInfo must be a valid pointer
+  VkCommandBufferInheritanceInfo empty_inheritance = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+  };
+  if (inheritance == NULL && list->level == VK_COMMAND_BUFFER_LEVEL_SECONDARY)
+    inheritance = &empty_inheritance;
+  VkCommandBufferBeginInfo begin_info = {
+    .sType            = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags            = flags,
+    .pInheritanceInfo = inheritance,
+  };
+  VkResult err = vkBeginCommandBuffer(list->cmd, &begin_info);
+  if (err != VK_SUCCESS) {
+    LOG_ERROR("failed to begin command buffer with error %s", to_string_VkResult(err));
+  }
+  return err;
+}
+
+static void
+set_full_viewport(Command_List* list, VkExtent2D extent)
+{
+  // TODO: option to specify whether to dynamically set viewport/scissor
+  VkViewport viewport = {
+    .x        = 0.0f,
+    .y        = 0.0f,
+    .width    = (float)extent.width,
+    .height   = (float)extent.height,
+    .minDepth = 0.0f,
+    .maxDepth = 1.0f,
+  };
+  VkRect2D scissor = { .offset = {0, 0}, .extent = extent };
+  Command_State* state = &list->state;
+  int has_viewport = state->has_viewport;
+  if (count_state_command(list, has_viewport == 0 ||
+			  memcmp(&state->viewport, &viewport, sizeof(VkViewport)) != 0)) {
+    vkCmdSetViewport(list->cmd, 0, 1, &viewport);
+    state->viewport = viewport;
+  }
+  if (count_state_command(list, has_viewport == 0 ||
+			  memcmp(&state->scissor, &scissor, sizeof(VkRect2D)) != 0)) {
+    vkCmdSetScissor(list->cmd, 0, 1, &scissor);
+    state->scissor = scissor;
+  }
+  state->has_viewport = 1;
+}
+
+static void
+begin_render_pass(Command_List* list, VkRenderPass render_pass, VkFramebuffer framebuffer, VkExtent2D extent,
+		  const VkClearValue* clear_values, uint32_t num_clear_values, int secondary_contents)
+{
+  // TODO: option to specify render area
+  VkRect2D render_area = { .offset = {0, 0},
+			   .extent = extent };
+  VkRenderPassBeginInfo begin_info = {
+    .sType           = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+    .renderPass      = render_pass,
+    .framebuffer     = framebuffer,
+    .renderArea      = render_area,
+    .clearValueCount = num_clear_values,
+    .pClearValues    = clear_values,
+  };
+  list->render_pass = render_pass;
+  list->framebuffer = framebuffer;
+  list->render_area = extent;
+  add_list_reference(list, (uint64_t)framebuffer);
+  if (secondary_contents) {
+    // Vulkan spec: when contents is
+    // VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS the only valid
+    // command is vkCmdExecuteCommands, so viewport is set by
+    // secondary lists themselves
+    vkCmdBeginRenderPass(list->cmd, &begin_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+  } else {
+    vkCmdBeginRenderPass(list->cmd, &begin_info, VK_SUBPASS_CONTENTS_INLINE);
+    set_full_viewport(list, extent);
+  }
+}
+
+static void
+bind_pipeline(Command_List* list, const Pipeline* pipeline)
+{
+  list->pipeline = *pipeline;
+  Bind_Point_State* state = &list->state.bind_points[pipeline->bind_point];
+  if (!count_state_command(list, state->pipeline != pipeline->handle))
+    return;
+  vkCmdBindPipeline(list->cmd, pipeline->bind_point, pipeline->handle);
+  list->stats.num_pipeline_binds++;
+  add_list_reference(list, (uint64_t)pipeline->handle);
+  state->pipeline = pipeline->handle;
+  if (state->layout != pipeline->layout) {
+    // NOTE: sets bound with a different layout may be disturbed, so
+    // forget them
+    state->layout = pipeline->layout;
+    state->num_sets = 0;
+  }
+}
+
+// NOTE: we don't know which set each dynamic offset belongs to, so
+// when offsets are given sets are either skipped entirely or bound
+// all at once.
+#define DYNAMIC_OFFSETS_UNKNOWN UINT32_MAX
+
+static void
+bind_descriptor_sets(Command_List* list, const VkDescriptorSet* sets, uint32_t ds_count,
+		     const uint32_t* offsets, uint32_t num_offsets)
+{
+  Pipeline* pipeline = &list->pipeline;
+  Bind_Point_State* state = &list->state.bind_points[pipeline->bind_point];
+  // skip sets which are already bound, only the rest is bound
+  uint32_t first = 0;
+  if (state->layout == pipeline->layout) {
+    while (first < ds_count && first < state->num_sets && state->sets[first] == sets[first])
+      first++;
+  }
+  int same_offsets = 1;
+  if (num_offsets > 0) {
+    same_offsets = first == ds_count && state->num_dynamic_offsets == num_offsets &&
+      memcmp(state->dynamic_offsets, offsets, num_offsets * sizeof(uint32_t)) == 0;
+    if (!same_offsets)
+      first = 0;
+  }
+  if (!count_state_command(list, first < ds_count || !same_offsets))
+    return;
+  vkCmdBindDescriptorSets(list->cmd, pipeline->bind_point,
+			  pipeline->layout, first,
+			  ds_count - first, sets + first,
+			  num_offsets, offsets);
+  list->stats.num_descriptor_set_binds++;
+  for (uint32_t i = first; i < ds_count; i++) {
+    add_list_reference(list, (uint64_t)sets[i]);
+  }
+  if (num_offsets > 0 && num_offsets <= LIDA_GFX_MAX_DYNAMIC_OFFSETS) {
+    memcpy(state->dynamic_offsets, offsets, num_offsets * sizeof(uint32_t));
+    state->num_dynamic_offsets = num_offsets;
+  } else if (num_offsets > 0 || (first > 0 && state->num_dynamic_offsets != 0)) {
+    // offsets of sets we've just replaced are unknown
+    state->num_dynamic_offsets = DYNAMIC_OFFSETS_UNKNOWN;
+  } else {
+    state->num_dynamic_offsets = 0;
+  }
+  if (ds_count <= LIDA_GFX_SHADER_MAX_SETS) {
+    memcpy(state->sets, sets, ds_count * sizeof(VkDescriptorSet));
+    if (state->layout != pipeline->layout) {
+      state->layout = pipeline->layout;
+      state->num_sets = ds_count;
+    } else {
+      state->num_sets = MAX(state->num_sets, ds_count);
+    }
+  } else {
+    state->num_sets = 0;
+  }
+}
+
+static void
+push_constants(Command_List* list, const void* push_constant, uint32_t offset, uint32_t size)
+{
+  Pipeline* pipeline = &list->pipeline;
+  Command_State* state = &list->state;
+  if (!count_state_command(list, state->push_constant_layout != pipeline->layout ||
+			   offset + size > state->push_constant_size ||
+			   memcmp(state->push_constants + offset, push_constant, size) != 0))
+    return;
+  // Vulkan wants exactly the stages whose ranges contain updated
+  // bytes, so update is split at range boundaries
+  uint32_t begin = offset, end = offset + size;
+  while (begin < end) {
+    uint32_t next = end;
+    VkShaderStageFlags stages = 0;
+    for (uint32_t i = 0; i < pipeline->num_push_ranges; i++) {
+      const VkPushConstantRange* range = &pipeline->push_ranges[i];
+      if (range->offset <= begin && begin < range->offset + range->size) {
+	stages |= range->stageFlags;
+	next = MIN(next, range->offset + range->size);
+      } else if (range->offset > begin) {
+	next = MIN(next, range->offset);
+      }
+    }
+    if (stages) {
+      vkCmdPushConstants(list->cmd, pipeline->layout, stages,
+			 begin, next - begin, (const char*)push_constant + (begin - offset));
+    } else {
+      LOG_WARN("push constants [%u, %u) are not used by any stage of pipeline", begin, next);
+    }
+    begin = next;
+  }
+  if (offset + size <= LIDA_GFX_MAX_PUSH_CONSTANT_SIZE) {
+    if (state->push_constant_layout != pipeline->layout) {
+      state->push_constant_layout = pipeline->layout;
+      state->push_constant_size = 0;
+    }
+    memcpy(state->push_constants + offset, push_constant, size);
+    // we only track bytes known from the beginning
+    if (offset <= state->push_constant_size)
+      state->push_constant_size = MAX(state->push_constant_size, offset + size);
+  } else {
+    state->push_constant_layout = VK_NULL_HANDLE;
+  }
+}
+
+static void
+bind_vertex_buffers(Command_List* list, const VkBuffer* buffers, const VkDeviceSize* offsets, uint32_t count)
+{
+  Command_State* state = &list->state;
+  // bind only the range of buffers that differ from bound ones
+  uint32_t first = count, last = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    if (i < state->num_vertex_buffers &&
+	state->vertex_buffers[i] == buffers[i] && state->vertex_offsets[i] == offsets[i])
+      continue;
+    state->vertex_buffers[i] = buffers[i];
+    state->vertex_offsets[i] = offsets[i];
+    add_list_reference(list, (uint64_t)buffers[i]);
+    if (first == count)
+      first = i;
+    last = i;
+  }
+  state->num_vertex_buffers = MAX(state->num_vertex_buffers, count);
+  if (!count_state_command(list, first < count))
+    return;
+  vkCmdBindVertexBuffers(list->cmd, first, last - first + 1,
+			 &state->vertex_buffers[first], &state->vertex_offsets[first]);
+}
+
+static void
+bind_index_buffer(Command_List* list, VkBuffer buffer, VkDeviceSize offset)
+{
+  Command_State* state = &list->state;
+  if (!count_state_command(list, state->index_buffer != buffer || state->index_offset != offset))
+    return;
+  vkCmdBindIndexBuffer(list->cmd, buffer, offset, VK_INDEX_TYPE_UINT32);
+  add_list_reference(list, (uint64_t)buffer);
+  state->index_buffer = buffer;
+  state->index_offset = offset;
+}
+
+// 'push_data' points to push constants of state, its first byte is
+// at 'state->push_constant_offset'.
+static void
+apply_draw_state(Command_List* list, const Draw_State* state, const char* push_data)
+{
+  if (state->pipeline.handle)
+    bind_pipeline(list, &state->pipeline);
+  if (state->num_sets)
+    bind_descriptor_sets(list, state->sets, state->num_sets, state->dynamic_offsets, state->num_dynamic_offsets);
+  if (state->num_vertex_buffers)
+    bind_vertex_buffers(list, state->vertex_buffers, state->vertex_offsets, state->num_vertex_buffers);
+  if (state->index_buffer)
+    bind_index_buffer(list, state->index_buffer, state->index_offset);
+  // only bytes that were pushed and that pipeline uses are pushed
+  // again, others would be stale
+  uint32_t begin = state->push_constant_offset, end = begin + state->push_constant_size;
+  for (uint32_t i = 0; i < list->pipeline.num_push_ranges && begin < end; i++) {
+    const VkPushConstantRange* range = &list->pipeline.push_ranges[i];
+    uint32_t first = MAX(begin, range->offset), last = MIN(end, range->offset + range->size);
+    if (first < last)
+      push_constants(list, push_data + (first - begin), first, last - first);
+  }
+}
+
+static void
+record_draw(Command_List* list, const Draw_Packet* draw, uint32_t instance_count)
+{
+  if (draw->indexed) {
+    vkCmdDrawIndexed(list->cmd, draw->count, instance_count, draw->first, draw->vertex_offset, draw->first_instance);
+  } else {
+    vkCmdDraw(list->cmd, draw->count, instance_count, draw->first, draw->first_instance);
+  }
+  count_draw(list, draw->count, instance_count);
+}
+
+static int
+draw_states_equal(const Draw_State* l, const Draw_State* r)
+{
+  return l->pipeline.handle == r->pipeline.handle &&
+    l->pipeline.layout == r->pipeline.layout &&
+    l->num_sets == r->num_sets &&
+    l->num_dynamic_offsets == r->num_dynamic_offsets &&
+    l->num_vertex_buffers == r->num_vertex_buffers &&
+    l->index_buffer == r->index_buffer &&
+    l->index_offset == r->index_offset &&
+    l->push_constant_offset == r->push_constant_offset &&
+    l->push_constant_size == r->push_constant_size &&
+    memcmp(l->sets, r->sets, l->num_sets * sizeof(VkDescriptorSet)) == 0 &&
+    memcmp(l->dynamic_offsets, r->dynamic_offsets, l->num_dynamic_offsets * sizeof(uint32_t)) == 0 &&
+    memcmp(l->vertex_buffers, r->vertex_buffers, l->num_vertex_buffers * sizeof(VkBuffer)) == 0 &&
+    memcmp(l->vertex_offsets, r->vertex_offsets, l->num_vertex_buffers * sizeof(VkDeviceSize)) == 0 &&
+    memcmp(l+1, r+1, l->push_constant_size) == 0;
+}
+
+// Stable LSD radix sort, 8 bits per pass. Returns pointer to the
+// sorted array, which is either 'packets' or 'temp'.
+static Draw_Packet*
+sort_draw_packets(Draw_Packet* packets, Draw_Packet* temp, uint32_t count)
+{
+  for (uint32_t shift = 0; shift < 64; shift += 8) {
+    uint32_t offsets[256] = { 0 };
+    for (uint32_t i = 0; i < count; i++) {
+      offsets[(packets[i].key >> shift) & 0xFF]++;
+    }
+    // all keys have the same digit, nothing to do in this pass
+    if (offsets[(packets[0].key >> shift) & 0xFF] == count)
+      continue;
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = offsets[i];
+      offsets[i] = sum;
+      sum += c;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      temp[offsets[(packets[i].key >> shift) & 0xFF]++] = packets[i];
+    }
+    Draw_Packet* tmp = packets;
+    packets = temp;
+    temp = tmp;
+  }
+  return packets;
+}
+
+/**
+   Sort captured draws and record them to command buffer. Draws that
+   share state and mesh and have adjacent instances are merged into
+   one instanced draw.
+ */
+static void
+flush_draw_queue(Command_List* list)
+{
+  Draw_Queue* queue = list->queue;
+  if (queue == NULL || queue->num_packets == 0)
+    return;
+  uint32_t count = queue->num_packets;
+  Draw_Packet* packets = (Draw_Packet*)queue->memory;
+  packets = sort_draw_packets(packets, packets + count, count);
+  for (uint32_t i = 0; i < count; ) {
+    const Draw_Packet* draw = &packets[i];
+    const Draw_State* state = (const Draw_State*)(queue->memory + draw->state);
+    uint32_t instance_count = draw->instance_count;
+    uint32_t j = i+1;
+    for (; j < count; j++) {
+      const Draw_Packet* next = &packets[j];
+      if (next->indexed != draw->indexed ||
+	  next->count != draw->count ||
+	  next->first != draw->first ||
+	  next->vertex_offset != draw->vertex_offset ||
+	  next->first_instance != draw->first_instance + instance_count)
+	break;
+      if (next->state != draw->state &&
+	  !draw_states_equal(state, (const Draw_State*)(queue->memory + next->state)))
+	break;
+      instance_count += next->instance_count;
+    }
+    apply_draw_state(list, state, (const char*)(state+1));
+    record_draw(list, draw, instance_count);
+    i = j;
+  }
+  queue->num_packets = 0;
+  queue->state_top = queue->size;
+  queue->current_state = DRAW_STATE_NONE;
+  // binds made by user after this point are relative to pending state
+  list->pipeline = queue->pending.pipeline;
+}
+
+static int
+draw_queue_fits(const Draw_Queue* queue, uint32_t state_size)
+{
+  // reserve space for one more packet and its copy for sorting
+  uint64_t packets_size = (uint64_t)(queue->num_packets + 1) * 2 * sizeof(Draw_Packet);
+  return packets_size + state_size <= queue->state_top;
+}
+
+static void
+queue_draw(Command_List* list, const Draw_Packet* draw)
+{
+  Draw_Queue* queue = list->queue;
+  uint32_t state_size = sizeof(Draw_State) + queue->pending.push_constant_size;
+  state_size = (state_size + 7) & ~7;
+  if (!draw_queue_fits(queue, (queue->current_state == DRAW_STATE_NONE) ? state_size : 0)) {
+    flush_draw_queue(list);
+    if (!draw_queue_fits(queue, state_size)) {
+      LOG_ERROR("draw queue memory is too small, recording draw immediately");
+      apply_draw_state(list, &queue->pending, queue->pending_push_constants + queue->pending.push_constant_offset);
+      record_draw(list, draw, draw->instance_count);
+      return;
+    }
+  }
+  if (queue->current_state == DRAW_STATE_NONE) {
+    queue->state_top -= state_size;
+    char* dst = queue->memory + queue->state_top;
+    memcpy(dst, &queue->pending, sizeof(Draw_State));
+    memcpy(dst + sizeof(Draw_State), queue->pending_push_constants + queue->pending.push_constant_offset,
+	   queue->pending.push_constant_size);
+    queue->current_state = queue->state_top;
+    const Draw_State* pending = &queue->pending;
+    uint64_t pipeline_bits = hash_memory(&pending->pipeline.handle, sizeof(VkPipeline)) & 0xFFFF;
+    uint64_t sets_bits = (pending->num_sets > 0) ? hash_memory(pending->sets, pending->num_sets * sizeof(VkDescriptorSet)) & 0xFFFF : 0;
+    queue->state_key = (pipeline_bits << 40) | (sets_bits << 24);
+  }
+  Draw_Packet* packet = &((Draw_Packet*)queue->memory)[queue->num_packets++];
+  *packet = *draw;
+  packet->key = queue->order_key | queue->state_key;
+  packet->state = queue->current_state;
+}
+
+static void
+begin_draw_queue(Command_List* list, Draw_Queue* queue, void* memory, uint32_t size)
+{
+  memset(queue, 0, sizeof(Draw_Queue));
+  // align memory to 8 bytes
+  uintptr_t offset = (8 - ((uintptr_t)memory & 7)) & 7;
+  queue->memory = (char*)memory + offset;
+  queue->size = (size > offset) ? ((size - offset) & ~7) : 0;
+  queue->state_top = queue->size;
+  queue->current_state = DRAW_STATE_NONE;
+  // draws are recorded with state set before the queue was begun
+  Draw_State* pending = &queue->pending;
+  const Command_State* state = &list->state;
+  const Bind_Point_State* bind_point = &state->bind_points[list->pipeline.bind_point];
+  pending->pipeline = list->pipeline;
+  if (bind_point->layout == list->pipeline.layout &&
+      bind_point->num_dynamic_offsets != DYNAMIC_OFFSETS_UNKNOWN) {
+    pending->num_sets = bind_point->num_sets;
+    memcpy(pending->sets, bind_point->sets, bind_point->num_sets * sizeof(VkDescriptorSet));
+    pending->num_dynamic_offsets = bind_point->num_dynamic_offsets;
+    memcpy(pending->dynamic_offsets, bind_point->dynamic_offsets, bind_point->num_dynamic_offsets * sizeof(uint32_t));
+  }
+  pending->num_vertex_buffers = state->num_vertex_buffers;
+  memcpy(pending->vertex_buffers, state->vertex_buffers, sizeof(state->vertex_buffers));
+  memcpy(pending->vertex_offsets, state->vertex_offsets, sizeof(state->vertex_offsets));
+  pending->index_buffer = state->index_buffer;
+  pending->index_offset = state->index_offset;
+  if (state->push_constant_layout == list->pipeline.layout) {
+    pending->push_constant_size = state->push_constant_size;
+    memcpy(queue->pending_push_constants, state->push_constants, state->push_constant_size);
+  }
+  list->queue = queue;
+}
+
+typedef struct {
+  VkImage       image;
+  VkImageView   image_view;
+  VkFramebuffer framebuffer;
+} Window_Image;
+
+typedef struct {
+  VkSemaphore      image_available;
+  VkSemaphore      render_finished;
+  // graphics timeline value signaled when GPU finishes executing 'cmd'
+  uint64_t         value;
+  // pools for transient descriptor sets, they're reset when frame is
+  // begun. Pools are created lazily.
+  VkDescriptorPool ds_pools[LIDA_GFX_MAX_TRANSIENT_DS_POOLS];
+  uint32_t         num_ds_pools;
+  uint32_t         current_ds_pool;
+} Window_Frame;
+
+typedef struct {
+
+  VkSurfaceKHR                surface;
+  VkSwapchainKHR              swapchain;
+  Render_Pass*                render_pass;
+  uint32_t                    num_images;
+  Window_Image                images[8]; // NOTE: we hope that no vulkan driver creates more than 8 images for a swapchain
+  Window_Frame                frames[LIDA_GFX_MAX_FRAMES_IN_FLIGHT];
+  uint32_t                    num_frames;
+  uint64_t                    frame_counter;
+  // i-th command buffer of this list is used by i-th frame
+  Command_List                main_list;
+  // primary command lists submitted before main_list
+  VkCommandBuffer             frame_lists[LIDA_GFX_MAX_FRAME_COMMAND_LISTS+1];
+  uint32_t                    num_frame_lists;
+  // semaphores added with 'gfx_wait_semaphore()' and
+  // 'gfx_signal_semaphore()', first slots are taken by swapchain ones
+  VkSemaphore                 wait_semaphores[LIDA_GFX_MAX_FRAME_SEMAPHORES+1];
+  VkPipelineStageFlags        wait_stages[LIDA_GFX_MAX_FRAME_SEMAPHORES+1];
+  uint32_t                    num_wait_semaphores;
+  VkSemaphore                 signal_semaphores[LIDA_GFX_MAX_FRAME_SEMAPHORES+1];
+  uint32_t                    num_signal_semaphores;
+  uint32_t                    current_image;
+  VkExtent2D                  swapchain_extent;
+  VkSurfaceFormatKHR          format;
+  VkPresentModeKHR            present_mode;
+  VkCompositeAlphaFlagBitsKHR composite_alpha;
+
+} Window;
+_Static_assert(sizeof(Window) <= sizeof(GFX_Window), "Internal error: adjust sizeof for GFX_Window");
+
+// Create views and framebuffers for 'images' of window.
+static VkResult
+create_window_images(Window* window)
+{
+  VkResult err = VK_SUCCESS;
+  VkImageViewCreateInfo image_view_info = {
+    .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+    .viewType = VK_IMAGE_VIEW_TYPE_2D,
+    .format = window->format.format,
+    .components = { .r = VK_COMPONENT_SWIZZLE_R,
+		    .g = VK_COMPONENT_SWIZZLE_G,
+		    .b = VK_COMPONENT_SWIZZLE_B,
+		    .a = VK_COMPONENT_SWIZZLE_A,},
+    .subresourceRange = { .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+			  .baseMipLevel = 0,
+			  .levelCount = 1,
+			  .baseArrayLayer = 0,
+			  .layerCount = 1 },
+  };
+  VkFramebufferCreateInfo framebuffer_info = {
+    .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+    .renderPass = window->render_pass->render_pass,
+    .attachmentCount = 1,
+    .width = window->swapchain_extent.width,
+    .height = window->swapchain_extent.height,
+    .layers = 1,
+  };
+  for (uint32_t i = 0; i < window->num_images; i++) {
+    image_view_info.image = window->images[i].image;
+    err = vkCreateImageView(g.logical_device, &image_view_info, NULL, &window->images[i].image_view);
+    if (err != VK_SUCCESS) {
+      LOG_ERROR("failed to create image view no. %u with error %s", i, to_string_VkResult(err));
+    }
+    framebuffer_info.pAttachments = &window->images[i].image_view;
+    err = vkCreateFramebuffer(g.logical_device, &framebuffer_info, NULL, &window->images[i].framebuffer);
+    if (err != VK_SUCCESS) {
+      LOG_ERROR("failed to create framebuffer no. %u with error %s", i, to_string_VkResult(err));
+    }
+  }
+  return err;
+}
+
+static void
+destroy_window_images(Window* window)
+{
+  for (uint32_t i = 0; i < window->num_images; i++) {
+    invalidate_command_lists((uint64_t)window->images[i].framebuffer);
+    vkDestroyFramebuffer(g.logical_device, window->images[i].framebuffer, NULL);
+    vkDestroyImageView(g.logical_device, window->images[i].image_view, NULL);
+  }
+}
+
+static VkResult
+create_swapchain(Window* window)
+{
+  VkResult err;
+
+  // get device capabilities of surface
+  VkSurfaceCapabilitiesKHR capabilities;
+  vkGetPhysicalDeviceSurfaceCapabilitiesKHR(g.physical_device, window->surface, &capabilities);
+
+  // choose surface format
+  VkSurfaceFormatKHR old_format = window->format;
+  uint32_t count;
+  vkGetPhysicalDeviceSurfaceFormatsKHR(g.physical_device, window->surface, &count, NULL);
+  VkSurfaceFormatKHR* formats = push_mem(sizeof(VkSurfaceFormatKHR) * count);
+  vkGetPhysicalDeviceSurfaceFormatsKHR(g.physical_device, window->surface, &count, formats);
+  window->format = formats[0];
+  for (uint32_t i = 1; i < count; i++) {
+    // try to pick R8G8B8A8_SRGB with nonlinear color space because it looks good
+    // TODO: choose in more smart way
+    if (formats[i].format == VK_FORMAT_R8G8B8A8_SRGB &&
+	formats[i].colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
       window->format = formats[i];
       break;
     }
   }
-  pop_mem(formats);
+  pop_mem(formats);
+
+  // choose present mode
+  vkGetPhysicalDeviceSurfacePresentModesKHR(g.physical_device, window->surface, &count, NULL);
+  VkPresentModeKHR* present_modes = push_mem(sizeof(VkPresentModeKHR) * count);
+  vkGetPhysicalDeviceSurfacePresentModesKHR(g.physical_device, window->surface, &count, present_modes);
+  VkPresentModeKHR required_present_mode = window->present_mode;
+  window->present_mode = VK_PRESENT_MODE_FIFO_KHR;
+  for (uint32_t i = 1; i < count; i++) {
+    if (present_modes[i] == required_present_mode) {
+      window->present_mode = present_modes[i];
+      break;
+    }
+  }
+  pop_mem(present_modes);
+  if (required_present_mode != window->present_mode) {
+    LOG_WARN("Present mode '%d' isn't supported, '%d' was chosen instead",
+	     required_present_mode, window->present_mode);
+  }
+
+  // choose swapchain extent
+  if (capabilities.currentExtent.width == UINT32_MAX) {
+#define CLAMP(value, low, high) (((value)<(low))?(low):(((value)>(high))?(high):(value)))
+    window->swapchain_extent.width = CLAMP(window->swapchain_extent.width,
+					   capabilities.minImageExtent.width,
+					   capabilities.maxImageExtent.height);
+    window->swapchain_extent.height = CLAMP(window->swapchain_extent.height,
+					    capabilities.minImageExtent.height,
+					    capabilities.maxImageExtent.height);
+#undef CLAMP
+  } else {
+    window->swapchain_extent = capabilities.currentExtent;
+  }
+
+  // choose image count
+  uint32_t image_count = capabilities.minImageCount + 1;
+  if (capabilities.maxImageCount > 0 && image_count > capabilities.maxImageCount)
+    image_count = capabilities.maxImageCount;
+
+  // choose composite alpha flag
+  if (capabilities.supportedCompositeAlpha & VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR) {
+    window->composite_alpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+  } else {
+    uint32_t i = 0;
+    VkCompositeAlphaFlagsKHR flags = capabilities.supportedCompositeAlpha;
+    // composite_alpha always will be initialized as spec says:
+    // supportedCompositeAlpha is a bitmask of VkCompositeAlphaFlagBitsKHR, representing the alpha compositing modes supported by the presentation engine for the surface on the specified device, and at least one bit will be set
+    while (flags > 0) {
+      if (flags & 1) {
+	window->composite_alpha = 1 << i;
+	break;
+      }
+      flags >>= 1;
+      i++;
+    }
+  }
+
+  // TODO: present queue?
+  uint32_t queue_family_indices[] = { g.graphics_queue_family };
+
+  // create swapchain
+  VkSwapchainCreateInfoKHR swapchain_info = {
+    .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
+    .surface = window->surface,
+    .minImageCount = image_count,
+    .imageFormat = window->format.format,
+    .imageColorSpace = window->format.colorSpace,
+    .imageExtent = window->swapchain_extent,
+    .imageArrayLayers = 1,
+    .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
+    .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    .queueFamilyIndexCount = 1,
+    .pQueueFamilyIndices = queue_family_indices,
+    .preTransform = capabilities.currentTransform,
+    .compositeAlpha = window->composite_alpha,
+    .presentMode = window->present_mode,
+    .clipped = 1,
+    .oldSwapchain = window->swapchain,
+  };
+  // note: we specified swapchainInfo.oldSwapchain so
+  // we don't need to destroy oldSwapchain when resizing
+  // From vulkan spec:
+  // Upon calling vkCreateSwapchainKHR with an oldSwapchain that is not
+  // VK_NULL_HANDLE, oldSwapchain is retired — even if creation of the new
+  // swapchain fails. The new swapchain is created in the non-retired state
+  // whether or not oldSwapchain is VK_NULL_HANDLE.
+  err = vkCreateSwapchainKHR(g.logical_device, &swapchain_info, NULL, &window->swapchain);
+  if (err != VK_SUCCESS) {
+    LOG_ERROR("failed to create swapchain with error %s", to_string_VkResult(err));
+    return err;
+  }
+  if (swapchain_info.oldSwapchain) {
+    vkDestroySwapchainKHR(g.logical_device, swapchain_info.oldSwapchain, NULL);
+  }
+
+  // recreate render pass if needed
+  if (old_format.format != window->format.format) {
+    GFX_Attachment_Info attachment = {
+      .format = (GFX_Format)window->format.format,
+      .load_op = GFX_ATTACHMENT_OP_NONE,
+      .store_op = GFX_ATTACHMENT_OP_STORE,
+      .initial_layout = GFX_IMAGE_LAYOUT_UNDEFINED,
+      .final_layout = GFX_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+      .work_layout = GFX_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    };
+    window->render_pass = create_render_pass(&attachment, 1);
+  }
+
+  // get images of swapchain (Vulkan kindly manages their memory and lifetime for us)
+  vkGetSwapchainImagesKHR(g.logical_device, window->swapchain, &window->num_images, NULL);
+  // NOTE: we hope that no device creates more than 8 swapchain images
+  VkImage swapchain_images[8];
+  vkGetSwapchainImagesKHR(g.logical_device, window->swapchain, &window->num_images, swapchain_images);
+
+  for (uint32_t i = 0; i < window->num_images; i++) {
+    window->images[i].image = swapchain_images[i];
+  }
+  err = create_window_images(window);
+
+  // TODO: manage preTransform
+  // This is crucial for devices you can flip
+
+  return err;
+}
+
+static VkResult
+create_window_frames(Window* window)
+{
+  VkResult err;
+  window->num_frames = g.frames_in_flight;
+  err = allocate_command_list(&window->main_list, g.command_pool, window->num_frames, VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+			      g.graphics_queue_family);
+  if (err != VK_SUCCESS) {
+    return err;
+  }
+  VkSemaphoreCreateInfo semaphore_info = { .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+  for (uint32_t i = 0; i < window->num_frames; i++) {
+    Window_Frame* frame = &window->frames[i];
+    err = vkCreateSemaphore(g.logical_device, &semaphore_info, NULL, &frame->image_available);
+    if (err != VK_SUCCESS) {
+      LOG_ERROR("failed to create semaphore with error %s", to_string_VkResult(err));
+      return err;
+    }
+    err = vkCreateSemaphore(g.logical_device, &semaphore_info, NULL, &frame->render_finished);
+    if (err != VK_SUCCESS) {
+      LOG_ERROR("failed to create semaphore with error %s", to_string_VkResult(err));
+      return err;
+    }
+    // value 0 is complete, so first wait in 'gfx_begin_commands()' doesn't block
+    frame->value = 0;
+    frame->num_ds_pools = 0;
+    frame->current_ds_pool = 0;
+  }
+  window->frame_counter = 0;
+  window->current_image = UINT32_MAX;
+  window->num_frame_lists = 0;
+  return err;
+}
+
+static void
+destroy_window_frames(Window* window)
+{
+  for (uint32_t i = 0; i < window->num_frames; i++) {
+    vkDestroySemaphore(g.logical_device, window->frames[i].image_available, NULL);
+    vkDestroySemaphore(g.logical_device, window->frames[i].render_finished, NULL);
+    for (uint32_t j = 0; j < window->frames[i].num_ds_pools; j++) {
+      vkDestroyDescriptorPool(g.logical_device, window->frames[i].ds_pools[j], NULL);
+    }
+    window->frames[i].num_ds_pools = 0;
+  }
+  free_command_list(&window->main_list);
+}
+
+static Window_Frame*
+get_current_frame(Window* window)
+{
+  return &window->frames[window->frame_counter % window->num_frames];
+}
+
+static int
+create_gpu_zones()
+{
+  uint32_t valid_bits = g.queue_families[g.graphics_queue_family].timestampValidBits;
+  if (valid_bits == 0) {
+    LOG_WARN("graphics queue doesn't support timestamps, GPU zones are disabled");
+    return -1;
+  }
+  g.gpu_zones.timestamp_mask = (valid_bits >= 64) ? UINT64_MAX : ((1ull << valid_bits) - 1);
+  VkQueryPoolCreateInfo pool_info = {
+    .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+    .queryType = VK_QUERY_TYPE_TIMESTAMP,
+    .queryCount = 2 * LIDA_GFX_MAX_GPU_ZONES,
+  };
+  for (uint32_t i = 0; i < g.frames_in_flight; i++) {
+    VkResult err = vkCreateQueryPool(g.logical_device, &pool_info, NULL, &g.gpu_zones.frames[i].pool);
+    if (err != VK_SUCCESS) {
+      LOG_ERROR("failed to create query pool with error %s", to_string_VkResult(err));
+      return -1;
+    }
+    g.gpu_zones.frames[i].num_zones = 0;
+  }
+  g.gpu_zones.recording = NULL;
+  g.gpu_zones.list = NULL;
+  g.gpu_zones.num_resolved = 0;
+  g.gpu_zones.enabled = 1;
+  return 0;
+}
+
+static void
+destroy_gpu_zones()
+{
+  for (uint32_t i = 0; i < g.frames_in_flight; i++) {
+    if (g.gpu_zones.frames[i].pool)
+      vkDestroyQueryPool(g.logical_device, g.gpu_zones.frames[i].pool, NULL);
+    g.gpu_zones.frames[i].pool = VK_NULL_HANDLE;
+  }
+  g.gpu_zones.enabled = 0;
+}
+
+// Read timestamps of zone frame into 'g.gpu_zones.resolved'. GPU must
+// be done with frame, so this doesn't block.
+static void
+resolve_gpu_zones(GPU_Zone_Frame* frame)
+{
+  uint32_t count = frame->num_zones;
+  if (count == 0)
+    return;
+  uint64_t* timestamps = alloca(2 * count * sizeof(uint64_t));
+  VkResult err = vkGetQueryPoolResults(g.logical_device, frame->pool, 0, 2 * count,
+				       2 * count * sizeof(uint64_t), timestamps, sizeof(uint64_t),
+				       VK_QUERY_RESULT_64_BIT);
+  if (err != VK_SUCCESS) {
+    LOG_WARN("failed to get timestamps of frame %lu with error %s",
+	     (unsigned long)frame->frame, to_string_VkResult(err));
+    return;
+  }
+  // timestamps may wrap around, so only differences are used
+  uint64_t mask = g.gpu_zones.timestamp_mask;
+  double period = g.device_properties.limits.timestampPeriod;
+  for (uint32_t i = 0; i < count; i++) {
+    GFX_GPU_Zone* zone = &g.gpu_zones.resolved[i];
+    *zone = frame->zones[i];
+    zone->begin = (uint64_t)(((timestamps[2*i] - timestamps[0]) & mask) * period);
+    zone->duration = (uint64_t)(((timestamps[2*i+1] - timestamps[2*i]) & mask) * period);
+  }
+  g.gpu_zones.num_resolved = count;
+  g.gpu_zones.resolved_frame = frame->frame;
+#ifdef LIDA_GFX_TRACE
+  // put zones on GPU track of trace. Without calibration they're
+  // aligned with submission, GPU starts a bit later actually.
+  uint64_t gpu_time, cpu_time;
+  int calibrated = calibrate_timestamps(&gpu_time, &cpu_time);
+  for (uint32_t i = 0; i < count; i++) {
+    const GFX_GPU_Zone* zone = &g.gpu_zones.resolved[i];
+    uint64_t begin;
+    if (calibrated) {
+      // frame is complete, so its timestamps are in the past
+      begin = cpu_time - (uint64_t)(((gpu_time - timestamps[2*i]) & mask) * period);
+    } else {
+      begin = frame->submit_time + zone->begin;
+    }
+    push_trace_event(zone->name, begin, zone->duration, TRACE_TRACK_GPU);
+  }
+#endif
+}
 
-  // choose present mode
-  vkGetPhysicalDeviceSurfacePresentModesKHR(g.physical_device, window->surface, &count, NULL);
-  VkPresentModeKHR* present_modes = push_mem(sizeof(VkPresentModeKHR) * count);
-  vkGetPhysicalDeviceSurfacePresentModesKHR(g.physical_device, window->surface, &count, present_modes);
-  VkPresentModeKHR required_present_mode = window->present_mode;
-  window->present_mode = VK_PRESENT_MODE_FIFO_KHR;
-  for (uint32_t i = 1; i < count; i++) {
-    if (present_modes[i] == required_present_mode) {
-      window->present_mode = present_modes[i];
-      break;
+// Start writing zones of frame to 'list'. Called when frame is begun,
+// timestamps of previous frame in this partition are available then.
+static void
+begin_gpu_zone_frame(Command_List* list)
+{
+  if (g.gpu_zones.enabled == 0)
+    return;
+  GPU_Zone_Frame* frame = &g.gpu_zones.frames[g.frame_data.partition];
+  resolve_gpu_zones(frame);
+  vkCmdResetQueryPool(list->cmd, frame->pool, 0, 2 * LIDA_GFX_MAX_GPU_ZONES);
+  frame->num_zones = 0;
+  frame->frame = g.frame_counter;
+  g.gpu_zones.recording = frame;
+  g.gpu_zones.list = list;
+  g.gpu_zones.current = -1;
+  g.gpu_zones.pass_zone = -1;
+  g.gpu_zones.skipped = 0;
+}
+
+// Return index of the begun zone, -1 if it's ignored because list is
+// not main list of frame or frame is full.
+static int32_t
+begin_gpu_zone(Command_List* list, const char* name)
+{
+  if (g.gpu_zones.list == NULL || g.gpu_zones.list != list)
+    return -1;
+  GPU_Zone_Frame* frame = g.gpu_zones.recording;
+  if (frame->num_zones == LIDA_GFX_MAX_GPU_ZONES)
+    return -1;
+  // timestamp must come after draws that were queued before
+  flush_draw_queue(list);
+  int32_t index = frame->num_zones++;
+  int32_t parent = g.gpu_zones.current;
+  frame->zones[index] = (GFX_GPU_Zone) {
+    .name = name,
+    .parent = parent,
+    .depth = (parent >= 0) ? frame->zones[parent].depth + 1 : 0,
+  };
+  vkCmdWriteTimestamp(list->cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame->pool, 2 * index);
+  g.gpu_zones.current = index;
+  return index;
+}
+
+static void
+end_gpu_zone(Command_List* list)
+{
+  if (g.gpu_zones.list == NULL || g.gpu_zones.list != list)
+    return;
+  if (g.gpu_zones.skipped > 0) {
+    g.gpu_zones.skipped--;
+    return;
+  }
+  int32_t index = g.gpu_zones.current;
+  if (index < 0) {
+    LOG_WARN("GPU zone ended without being begun");
+    return;
+  }
+  GPU_Zone_Frame* frame = g.gpu_zones.recording;
+  flush_draw_queue(list);
+  vkCmdWriteTimestamp(list->cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame->pool, 2 * index + 1);
+  g.gpu_zones.current = frame->zones[index].parent;
+}
+
+// Close zones opened at or after 'first', so all queries of frame
+// are written.
+static void
+end_gpu_zones_from(Command_List* list, int32_t first)
+{
+  if (g.gpu_zones.list == NULL || g.gpu_zones.list != list)
+    return;
+  while (g.gpu_zones.skipped > 0 || (g.gpu_zones.current >= 0 && g.gpu_zones.current >= first))
+    end_gpu_zone(list);
+}
+
+static VkResult
+create_ds_pool(uint32_t max_sets, VkDescriptorPoolCreateFlags flags, VkDescriptorPool* pool)
+{
+  // transient and cached sets are usually small, so we allow every
+  // set to take one descriptor of each type
+  VkDescriptorPoolSize sizes[] = {
+    { VK_DESCRIPTOR_TYPE_SAMPLER, max_sets },
+    { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, max_sets },
+    { VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE, max_sets },
+    { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, max_sets },
+    { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, max_sets },
+    { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, max_sets },
+    { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, max_sets },
+    { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, max_sets },
+  };
+  VkDescriptorPoolCreateInfo pool_info = {
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+    .flags = flags,
+    .maxSets = max_sets,
+    .poolSizeCount = ARR_SIZE(sizes),
+    .pPoolSizes = sizes,
+  };
+  VkResult err = vkCreateDescriptorPool(g.logical_device, &pool_info, NULL, pool);
+  if (err != VK_SUCCESS) {
+    LOG_ERROR("failed to create descriptor pool with error %s", to_string_VkResult(err));
+  }
+  return err;
+}
+
+/**
+   Allocate descriptor sets from pools of window frame. If current
+   pool is exhausted next pool is used, pools are created on demand.
+ */
+static VkResult
+allocate_transient_descriptor_sets(Window_Frame* frame, VkDescriptorSet* sets, const VkDescriptorSetLayout* layouts, uint32_t num_sets)
+{
+  VkResult err;
+  while (1) {
+    if (frame->current_ds_pool == frame->num_ds_pools) {
+      if (frame->num_ds_pools == LIDA_GFX_MAX_TRANSIENT_DS_POOLS) {
+	LOG_ERROR("out of transient descriptor pools, maximum is %d", LIDA_GFX_MAX_TRANSIENT_DS_POOLS);
+	return VK_ERROR_OUT_OF_POOL_MEMORY;
+      }
+      uint32_t max_sets = LIDA_GFX_TRANSIENT_DS_POOL_SIZE << frame->num_ds_pools;
+      err = create_ds_pool(max_sets, 0, &frame->ds_pools[frame->num_ds_pools]);
+      if (err != VK_SUCCESS) {
+	return err;
+      }
+      LOG_DEBUG("created transient descriptor pool with %u sets", max_sets);
+      frame->num_ds_pools++;
+    }
+    VkDescriptorSetAllocateInfo allocate_info = {
+      .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+      .descriptorPool     = frame->ds_pools[frame->current_ds_pool],
+      .descriptorSetCount = num_sets,
+      .pSetLayouts        = layouts,
+    };
+    err = vkAllocateDescriptorSets(g.logical_device, &allocate_info, sets);
+    if (err == VK_SUCCESS) {
+      return err;
     }
+    // NOTE: Vulkan 1.0 doesn't specify which error is returned when
+    // pool is exhausted, so try next pool on any error
+    frame->current_ds_pool++;
   }
-  pop_mem(present_modes);
-  if (required_present_mode != window->present_mode) {
-    LOG_WARN("Present mode '%d' isn't supported, '%d' was chosen instead",
-	     required_present_mode, window->present_mode);
+}
+
+static void
+reset_transient_ds_pools(Window_Frame* frame)
+{
+  for (uint32_t i = 0; i <= frame->current_ds_pool && i < frame->num_ds_pools; i++) {
+    vkResetDescriptorPool(g.logical_device, frame->ds_pools[i], 0);
   }
+  frame->current_ds_pool = 0;
+}
 
-  // choose swapchain extent
-  if (capabilities.currentExtent.width == UINT32_MAX) {
-#define CLAMP(value, low, high) (((value)<(low))?(low):(((value)>(high))?(high):(value)))
-    window->swapchain_extent.width = CLAMP(window->swapchain_extent.width,
-					   capabilities.minImageExtent.width,
-					   capabilities.maxImageExtent.height);
-    window->swapchain_extent.height = CLAMP(window->swapchain_extent.height,
-					    capabilities.minImageExtent.height,
-					    capabilities.maxImageExtent.height);
-#undef CLAMP
+// Descriptor of a cached descriptor set. For buffers 'handle' is a
+// VkBuffer and 'offset', 'range' describe buffer range. For images
+// 'handle' is a VkImageView and 'offset' is image layout.
+typedef struct {
+  uint64_t  handle;
+  VkSampler sampler;
+  uint32_t  offset;
+  uint32_t  range;
+} Cached_Descriptor;
+
+typedef struct {
+  // layout is VK_NULL_HANDLE when this entry references a destroyed
+  // object, such entries are never found
+  VkDescriptorSetLayout layout;
+  uint32_t              num_bindings;
+  Cached_Descriptor     descriptors[LIDA_GFX_SHADER_MAX_BINDINGS_PER_SET];
+  VkDescriptorSet       set;
+} Cached_DS;
+
+static VkResult
+create_timeline(Timeline* timeline, VkQueue queue)
+{
+  timeline->queue = queue;
+  timeline->submitted = 0;
+  timeline->completed = 0;
+  VkResult err;
+  if (g.has_timeline_semaphores) {
+    VkSemaphoreTypeCreateInfoKHR type_info = {
+      .sType         = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR,
+      .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR,
+      .initialValue  = 0,
+    };
+    VkSemaphoreCreateInfo semaphore_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+      .pNext = &type_info,
+    };
+    err = vkCreateSemaphore(g.logical_device, &semaphore_info, NULL, &timeline->semaphore);
   } else {
-    window->swapchain_extent = capabilities.currentExtent;
+    VkFenceCreateInfo fence_info = { .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO };
+    for (uint32_t i = 0; i < MAX_TIMELINE_FENCES; i++) {
+      err = vkCreateFence(g.logical_device, &fence_info, NULL, &timeline->fences[i]);
+      if (err != VK_SUCCESS)
+	break;
+    }
+  }
+  if (err != VK_SUCCESS) {
+    LOG_ERROR("failed to create timeline with error %s", to_string_VkResult(err));
   }
+  return err;
+}
 
-  // choose image count
-  uint32_t image_count = capabilities.minImageCount + 1;
-  if (capabilities.maxImageCount > 0 && image_count > capabilities.maxImageCount)
-    image_count = capabilities.maxImageCount;
+static void
+destroy_timeline(Timeline* timeline)
+{
+  if (timeline->queue == VK_NULL_HANDLE)
+    return;
+  if (g.has_timeline_semaphores) {
+    vkDestroySemaphore(g.logical_device, timeline->semaphore, NULL);
+  } else {
+    for (uint32_t i = 0; i < MAX_TIMELINE_FENCES; i++)
+      vkDestroyFence(g.logical_device, timeline->fences[i], NULL);
+  }
+  timeline->queue = VK_NULL_HANDLE;
+}
 
-  // choose composite alpha flag
-  if (capabilities.supportedCompositeAlpha & VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR) {
-    window->composite_alpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+static Timeline*
+get_timeline(GFX_Queue queue)
+{
+  if ((uint32_t)queue < NUM_QUEUES && g.timelines[queue].queue != VK_NULL_HANDLE)
+    return &g.timelines[queue];
+  return &g.timelines[GFX_QUEUE_GRAPHICS];
+}
+
+// Update and return last value completed by GPU, this never blocks.
+static uint64_t
+poll_timeline(Timeline* timeline)
+{
+  if (timeline->completed == timeline->submitted)
+    return timeline->completed;
+  if (g.has_timeline_semaphores) {
+    uint64_t value;
+    if (vkGetSemaphoreCounterValueKHR(g.logical_device, timeline->semaphore, &value) == VK_SUCCESS)
+      timeline->completed = value;
   } else {
-    uint32_t i = 0;
-    VkCompositeAlphaFlagsKHR flags = capabilities.supportedCompositeAlpha;
-    // composite_alpha always will be initialized as spec says:
-    // supportedCompositeAlpha is a bitmask of VkCompositeAlphaFlagBitsKHR, representing the alpha compositing modes supported by the presentation engine for the surface on the specified device, and at least one bit will be set
-    while (flags > 0) {
-      if (flags & 1) {
-	window->composite_alpha = 1 << i;
-	break;
-      }
-      flags >>= 1;
+    // fences of a queue are signaled in submission order
+    while (timeline->completed < timeline->submitted &&
+	   vkGetFenceStatus(g.logical_device, timeline->fences[(timeline->completed+1) % MAX_TIMELINE_FENCES]) == VK_SUCCESS)
+      timeline->completed++;
+  }
+  return timeline->completed;
+}
+
+static VkResult
+wait_timeline(Timeline* timeline, uint64_t value, uint64_t timeout)
+{
+  if (value > timeline->submitted) {
+    LOG_ERROR("waiting for value %lu which was never submitted", (unsigned long)value);
+    return VK_ERROR_UNKNOWN;
+  }
+  if (poll_timeline(timeline) >= value)
+    return VK_SUCCESS;
+  VkResult err;
+  uint64_t wait_begin = get_host_time();
+  TRACE_BEGIN("wait for GPU");
+  if (g.has_timeline_semaphores) {
+    VkSemaphoreWaitInfoKHR wait_info = {
+      .sType          = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR,
+      .semaphoreCount = 1,
+      .pSemaphores    = &timeline->semaphore,
+      .pValues        = &value,
+    };
+    err = vkWaitSemaphoresKHR(g.logical_device, &wait_info, timeout);
+  } else {
+    err = vkWaitForFences(g.logical_device, 1, &timeline->fences[value % MAX_TIMELINE_FENCES], VK_TRUE, timeout);
+  }
+  TRACE_END();
+  g.frame_stats.wait_time += get_host_time() - wait_begin;
+  if (err == VK_SUCCESS) {
+    // values up to 'value' are complete too
+    poll_timeline(timeline);
+    if (timeline->completed < value)
+      timeline->completed = value;
+  } else if (err != VK_TIMEOUT) {
+    LOG_ERROR("failed to wait for GPU with error %s", to_string_VkResult(err));
+  }
+  return err;
+}
+
+/**
+   Submit a batch that signals next value of timeline. The value is
+   written to 'value' if it's not NULL.
+ */
+static VkResult
+submit_to_timeline(Timeline* timeline, const VkSubmitInfo* info, uint64_t* value)
+{
+  uint64_t next = timeline->submitted + 1;
+  VkSubmitInfo submit_info = *info;
+  VkFence fence = VK_NULL_HANDLE;
+  VkTimelineSemaphoreSubmitInfoKHR timeline_info;
+  if (g.has_timeline_semaphores) {
+    // timeline semaphore goes after binary ones, values of binary
+    // semaphores are ignored
+    uint32_t count = info->signalSemaphoreCount;
+    VkSemaphore* signal_semaphores = alloca((count + 1) * sizeof(VkSemaphore));
+    uint64_t* signal_values = alloca((count + 1) * sizeof(uint64_t));
+    for (uint32_t i = 0; i < count; i++) {
+      signal_semaphores[i] = info->pSignalSemaphores[i];
+      signal_values[i] = 0;
+    }
+    signal_semaphores[count] = timeline->semaphore;
+    signal_values[count] = next;
+    timeline_info = (VkTimelineSemaphoreSubmitInfoKHR) {
+      .sType                     = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR,
+      .pNext                     = info->pNext,
+      .signalSemaphoreValueCount = count + 1,
+      .pSignalSemaphoreValues    = signal_values,
+    };
+    submit_info.pNext = &timeline_info;
+    submit_info.signalSemaphoreCount = count + 1;
+    submit_info.pSignalSemaphores = signal_semaphores;
+  } else {
+    // fence of this value was last used MAX_TIMELINE_FENCES values ago
+    if (next > MAX_TIMELINE_FENCES) {
+      VkResult err = wait_timeline(timeline, next - MAX_TIMELINE_FENCES, UINT64_MAX);
+      if (err != VK_SUCCESS)
+	return err;
+    }
+    fence = timeline->fences[next % MAX_TIMELINE_FENCES];
+    vkResetFences(g.logical_device, 1, &fence);
+  }
+  TRACE_BEGIN("vkQueueSubmit");
+  VkResult err = vkQueueSubmit(timeline->queue, 1, &submit_info, fence);
+  TRACE_END();
+  if (err != VK_SUCCESS) {
+    LOG_ERROR("failed to submit commands with error %s", to_string_VkResult(err));
+    return err;
+  }
+  timeline->submitted = next;
+  if (value)
+    *value = next;
+  return VK_SUCCESS;
+}
+
+// Wait till every submitted graphics command is complete.
+static void
+wait_graphics_timeline()
+{
+  Timeline* timeline = &g.timelines[GFX_QUEUE_GRAPHICS];
+  wait_timeline(timeline, timeline->submitted, UINT64_MAX);
+}
+
+/**
+   Check whether GPU is done with commands of frame number 'frame'
+   (see 'g.frame_counter'). Frame that is being recorded is never
+   complete.
+ */
+static int
+is_frame_complete(uint64_t frame)
+{
+  if (frame >= g.frame_counter)
+    return 0;
+  // values of older frames are not kept, but they're not greater than
+  // value of the oldest kept frame, so it's safe to check that instead
+  if (frame + MAX_FRAME_VALUES < g.frame_counter)
+    frame = g.frame_counter - MAX_FRAME_VALUES;
+  return g.timelines[GFX_QUEUE_GRAPHICS].completed >= g.frame_values[frame % MAX_FRAME_VALUES];
+}
+
+static void
+free_retired_descriptor_sets(int wait_all)
+{
+  uint32_t i = 0;
+  while (i < g.num_retired_sets) {
+    if (wait_all || is_frame_complete(g.retired_sets[i].frame)) {
+      vkFreeDescriptorSets(g.logical_device, g.ds_cache_pool, 1, &g.retired_sets[i].set);
+      g.retired_sets[i] = g.retired_sets[--g.num_retired_sets];
+    } else {
       i++;
     }
   }
+}
 
-  // TODO: present queue?
-  uint32_t queue_family_indices[] = { g.graphics_queue_family };
+/**
+   Free a cached descriptor set when frames that might use it are
+   done on GPU.
+   NOTE: frame counter is global, it assumes that only one window is
+   presented.
+ */
+static void
+retire_cached_descriptor_set(VkDescriptorSet set)
+{
+  invalidate_command_lists((uint64_t)set);
+  if (g.num_retired_sets == MAX_RETIRED_SETS) {
+    LOG_WARN("too many retired descriptor sets, waiting for GPU");
+    wait_graphics_timeline();
+    free_retired_descriptor_sets(1);
+  }
+  g.retired_sets[g.num_retired_sets].set = set;
+  g.retired_sets[g.num_retired_sets].frame = g.frame_counter;
+  g.num_retired_sets++;
+}
 
-  // create swapchain
-  VkSwapchainCreateInfoKHR swapchain_info = {
-    .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
-    .surface = window->surface,
-    .minImageCount = image_count,
-    .imageFormat = window->format.format,
-    .imageColorSpace = window->format.colorSpace,
-    .imageExtent = window->swapchain_extent,
-    .imageArrayLayers = 1,
-    .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT,
-    .imageSharingMode = VK_SHARING_MODE_EXCLUSIVE,
-    .queueFamilyIndexCount = 1,
-    .pQueueFamilyIndices = queue_family_indices,
-    .preTransform = capabilities.currentTransform,
-    .compositeAlpha = window->composite_alpha,
-    .presentMode = window->present_mode,
-    .clipped = 1,
-    .oldSwapchain = window->swapchain,
+static uint32_t
+hash_cached_ds(const void* obj)
+{
+  const Cached_DS* s = obj;
+  return hash_memory(s->descriptors, s->num_bindings * sizeof(Cached_Descriptor)) ^
+    hash_memory(&s->layout, sizeof(VkDescriptorSetLayout));
+}
+
+static int
+eq_cached_ds(const void* l, const void* r)
+{
+  const Cached_DS* left = l, *right = r;
+  return left->layout == right->layout &&
+    left->num_bindings == right->num_bindings &&
+    memcmp(left->descriptors, right->descriptors, left->num_bindings * sizeof(Cached_Descriptor)) == 0;
+}
+
+static void
+destroy_cached_ds(void* obj)
+{
+  Cached_DS* s = obj;
+  if (s->set) {
+    retire_cached_descriptor_set(s->set);
+    s->set = VK_NULL_HANDLE;
+  }
+}
+
+/**
+   Drop cached descriptor sets which reference 'handle'. Call this when
+   a buffer, image view, sampler or descriptor set layout is destroyed.
+ */
+static void
+forget_cached_descriptor_sets(uint64_t handle)
+{
+  if (g.ds_cache.node_data == NULL)
+    return;
+  LRU_CACHE_FOREACH(&g.ds_cache, Cached_DS, it) {
+    if (it->layout == VK_NULL_HANDLE)
+      continue;
+    int found = (uint64_t)it->layout == handle;
+    for (uint32_t i = 0; i < it->num_bindings && !found; i++) {
+      found = it->descriptors[i].handle == handle || (uint64_t)it->descriptors[i].sampler == handle;
+    }
+    if (found) {
+      destroy_cached_ds(it);
+      it->layout = VK_NULL_HANDLE;
+    }
+  }
+}
+
+static void
+init_memory_allocator()
+{
+  memset(&g.allocator, 0, sizeof(g.allocator));
+  for (uint32_t i = 0; i < LIDA_GFX_MAX_MEMORY_CHUNKS; i++) {
+    g.allocator.chunks[i].next_free = (i+1 < LIDA_GFX_MAX_MEMORY_CHUNKS) ? i+1 : MEMORY_NONE;
+  }
+  g.allocator.unused_chunks = 0;
+  for (uint32_t i = 0; i < g.memory_properties.memoryHeapCount; i++) {
+    g.allocator.heap_budget[i] = g.memory_properties.memoryHeaps[i].size / 100 * LIDA_GFX_MEMORY_BUDGET_PERCENT;
+  }
+}
+
+static void
+update_memory_budget()
+{
+  if (g.has_memory_budget == 0)
+    return;
+  VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT,
   };
-  // note: we specified swapchainInfo.oldSwapchain so
-  // we don't need to destroy oldSwapchain when resizing
-  // From vulkan spec:
-  // Upon calling vkCreateSwapchainKHR with an oldSwapchain that is not
-  // VK_NULL_HANDLE, oldSwapchain is retired — even if creation of the new
-  // swapchain fails. The new swapchain is created in the non-retired state
-  // whether or not oldSwapchain is VK_NULL_HANDLE.
-  err = vkCreateSwapchainKHR(g.logical_device, &swapchain_info, NULL, &window->swapchain);
-  if (err != VK_SUCCESS) {
-    LOG_ERROR("failed to create swapchain with error %s", to_string_VkResult(err));
-    return err;
+  VkPhysicalDeviceMemoryProperties2KHR properties = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2_KHR,
+    .pNext = &budget,
+  };
+  vkGetPhysicalDeviceMemoryProperties2KHR(g.physical_device, &properties);
+  for (uint32_t i = 0; i < g.memory_properties.memoryHeapCount; i++) {
+    g.allocator.heap_usage[i] = budget.heapUsage[i];
+    g.allocator.heap_budget[i] = budget.heapBudget[i];
+  }
+}
+
+static void
+memory_mapping(VkDeviceSize size, uint32_t* fl, uint32_t* sl)
+{
+  uint32_t bit = find_last_set(size);
+  *fl = bit - MEMORY_FL_SHIFT;
+  *sl = (uint32_t)(size >> (bit - MEMORY_SL_BITS)) & ((1 << MEMORY_SL_BITS) - 1);
+}
+
+static uint32_t
+new_memory_chunk()
+{
+  uint32_t index = g.allocator.unused_chunks;
+  if (index == MEMORY_NONE) {
+    LOG_ERROR("out of memory chunks, try increasing LIDA_GFX_MAX_MEMORY_CHUNKS");
+    return MEMORY_NONE;
   }
-  if (swapchain_info.oldSwapchain) {
-    vkDestroySwapchainKHR(g.logical_device, swapchain_info.oldSwapchain, NULL);
+  g.allocator.unused_chunks = g.allocator.chunks[index].next_free;
+  return index;
+}
+
+static void
+delete_memory_chunk(uint32_t index)
+{
+  g.allocator.chunks[index].next_free = g.allocator.unused_chunks;
+  g.allocator.unused_chunks = index;
+}
+
+static void
+insert_free_chunk(Memory_Pool* pool, uint32_t index)
+{
+  Memory_Chunk* chunk = &g.allocator.chunks[index];
+  uint32_t fl, sl;
+  memory_mapping(chunk->size, &fl, &sl);
+  uint32_t* head = &pool->free_lists[fl][sl];
+  chunk->is_free = 1;
+  chunk->prev_free = MEMORY_NONE;
+  chunk->next_free = *head;
+  if (*head != MEMORY_NONE)
+    g.allocator.chunks[*head].prev_free = index;
+  *head = index;
+  pool->fl_bitmap |= 1u << fl;
+  pool->sl_bitmaps[fl] |= 1u << sl;
+}
+
+static void
+remove_free_chunk(Memory_Pool* pool, uint32_t index)
+{
+  Memory_Chunk* chunk = &g.allocator.chunks[index];
+  uint32_t fl, sl;
+  memory_mapping(chunk->size, &fl, &sl);
+  if (chunk->prev_free != MEMORY_NONE)
+    g.allocator.chunks[chunk->prev_free].next_free = chunk->next_free;
+  else
+    pool->free_lists[fl][sl] = chunk->next_free;
+  if (chunk->next_free != MEMORY_NONE)
+    g.allocator.chunks[chunk->next_free].prev_free = chunk->prev_free;
+  if (pool->free_lists[fl][sl] == MEMORY_NONE) {
+    pool->sl_bitmaps[fl] &= ~(1u << sl);
+    if (pool->sl_bitmaps[fl] == 0)
+      pool->fl_bitmap &= ~(1u << fl);
   }
+  chunk->is_free = 0;
+}
 
-  // recreate render pass if needed
-  if (old_format.format != window->format.format) {
-    GFX_Attachment_Info attachment = {
-      .format = (GFX_Format)window->format.format,
-      .load_op = GFX_ATTACHMENT_OP_NONE,
-      .store_op = GFX_ATTACHMENT_OP_STORE,
-      .initial_layout = GFX_IMAGE_LAYOUT_UNDEFINED,
-      .final_layout = GFX_IMAGE_LAYOUT_PRESENT_SRC_KHR,
-      .work_layout = GFX_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
-    };
-    window->render_pass = create_render_pass(&attachment, 1);
+// Find a free chunk of at least 'size' bytes in O(1). Size is rounded
+// up to the next list, so any chunk of that list is big enough.
+static uint32_t
+find_free_chunk(const Memory_Pool* pool, VkDeviceSize size)
+{
+  size += ((VkDeviceSize)1 << (find_last_set(size) - MEMORY_SL_BITS)) - 1;
+  uint32_t fl, sl;
+  memory_mapping(size, &fl, &sl);
+  if (fl >= MEMORY_FL_COUNT)
+    return MEMORY_NONE;
+  uint32_t sl_map = pool->sl_bitmaps[fl] & (~0u << sl);
+  if (sl_map == 0) {
+    uint32_t fl_map = (fl+1 < MEMORY_FL_COUNT) ? pool->fl_bitmap & (~0u << (fl+1)) : 0;
+    if (fl_map == 0)
+      return MEMORY_NONE;
+    fl = find_first_set(fl_map);
+    sl_map = pool->sl_bitmaps[fl];
   }
+  sl = find_first_set(sl_map);
+  return pool->free_lists[fl][sl];
+}
 
-  // get images of swapchain (Vulkan kindly manages their memory and lifetime for us)
-  vkGetSwapchainImagesKHR(g.logical_device, window->swapchain, &window->num_images, NULL);
-  // NOTE: we hope that no device creates more than 8 swapchain images
-  VkImage swapchain_images[8];
-  vkGetSwapchainImagesKHR(g.logical_device, window->swapchain, &window->num_images, swapchain_images);
+// Cut first 'size' bytes of chunk, return index of chunk with the
+// rest, it's not inserted to free lists.
+static uint32_t
+split_memory_chunk(uint32_t index, VkDeviceSize size)
+{
+  Memory_Chunk* chunk = &g.allocator.chunks[index];
+  if (chunk->size == size)
+    return MEMORY_NONE;
+  uint32_t rest_index = new_memory_chunk();
+  if (rest_index == MEMORY_NONE)
+    return MEMORY_NONE;
+  Memory_Chunk* rest = &g.allocator.chunks[rest_index];
+  rest->offset = chunk->offset + size;
+  rest->size = chunk->size - size;
+  rest->page = chunk->page;
+  rest->is_free = 0;
+  rest->prev_phys = index;
+  rest->next_phys = chunk->next_phys;
+  if (chunk->next_phys != MEMORY_NONE)
+    g.allocator.chunks[chunk->next_phys].prev_phys = rest_index;
+  chunk->next_phys = rest_index;
+  chunk->size = size;
+  return rest_index;
+}
 
-  // create attachments
-  VkImageViewCreateInfo image_view_info = {
-    .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-    .viewType = VK_IMAGE_VIEW_TYPE_2D,
-    .format = window->format.format,
-    .components = { .r = VK_COMPONENT_SWIZZLE_R,
-		    .g = VK_COMPONENT_SWIZZLE_G,
-		    .b = VK_COMPONENT_SWIZZLE_B,
-		    .a = VK_COMPONENT_SWIZZLE_A,},
-    .subresourceRange = { .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
-			  .baseMipLevel = 0,
-			  .levelCount = 1,
-			  .baseArrayLayer = 0,
-			  .layerCount = 1 },
-  };
-  VkFramebufferCreateInfo framebuffer_info = {
-    .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
-    .renderPass = window->render_pass->render_pass,
-    .attachmentCount = 1,
-    .width = window->swapchain_extent.width,
-    .height = window->swapchain_extent.height,
-    .layers = 1,
+static uint32_t
+get_memory_pool(uint32_t type, uint32_t is_image)
+{
+  for (uint32_t i = 0; i < g.allocator.num_pools; i++) {
+    if (g.allocator.pools[i].type == type && g.allocator.pools[i].is_image == is_image)
+      return i;
+  }
+  if (g.allocator.num_pools == MEMORY_MAX_POOLS) {
+    LOG_ERROR("too many memory pools");
+    return MEMORY_NONE;
+  }
+  uint32_t index = g.allocator.num_pools++;
+  Memory_Pool* pool = &g.allocator.pools[index];
+  memset(pool, 0, sizeof(Memory_Pool));
+  pool->type = type;
+  pool->is_image = is_image;
+  pool->empty_page = MEMORY_NONE;
+  for (uint32_t i = 0; i < MEMORY_FL_COUNT; i++)
+    for (uint32_t j = 0; j < (1<<MEMORY_SL_BITS); j++)
+      pool->free_lists[i][j] = MEMORY_NONE;
+  return index;
+}
+
+static uint32_t
+allocate_memory_page(uint32_t pool_index, VkDeviceSize size,
+		     const VkMemoryDedicatedAllocateInfoKHR* dedicated)
+{
+  Memory_Pool* pool = &g.allocator.pools[pool_index];
+  uint32_t index = 0;
+  while (index < LIDA_GFX_MAX_MEMORY_PAGES && g.allocator.pages[index].handle)
+    index++;
+  if (index == LIDA_GFX_MAX_MEMORY_PAGES) {
+    LOG_ERROR("too many memory pages, try increasing LIDA_GFX_MAX_MEMORY_PAGES");
+    return MEMORY_NONE;
+  }
+  uint32_t chunk_index = new_memory_chunk();
+  if (chunk_index == MEMORY_NONE)
+    return MEMORY_NONE;
+  Memory_Page* page = &g.allocator.pages[index];
+  VkMemoryAllocateInfo allocate_info = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    .pNext = dedicated,
+    .allocationSize = size,
+    .memoryTypeIndex = pool->type,
   };
-  for (uint32_t i = 0; i < window->num_images; i++) {
-    window->images[i].image = swapchain_images[i];
-    image_view_info.image = swapchain_images[i];
-    err = vkCreateImageView(g.logical_device, &image_view_info, NULL, &window->images[i].image_view);
-    if (err != VK_SUCCESS) {
-      LOG_ERROR("failed to create image view no. %u with error %s", i, to_string_VkResult(err));
-    }
-    framebuffer_info.pAttachments = &window->images[i].image_view;
-    err = vkCreateFramebuffer(g.logical_device, &framebuffer_info, NULL, &window->images[i].framebuffer);
+  VkResult err = vkAllocateMemory(g.logical_device, &allocate_info, NULL, &page->handle);
+  if (err != VK_SUCCESS) {
+    LOG_ERROR("failed to allocate memory with error %s", to_string_VkResult(err));
+    page->handle = VK_NULL_HANDLE;
+    delete_memory_chunk(chunk_index);
+    return MEMORY_NONE;
+  }
+  page->mapped = NULL;
+  if (g.memory_properties.memoryTypes[pool->type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    err = vkMapMemory(g.logical_device, page->handle, 0, VK_WHOLE_SIZE, 0, &page->mapped);
     if (err != VK_SUCCESS) {
-      LOG_ERROR("failed to create framebuffer no. %u with error %s", i, to_string_VkResult(err));
+      LOG_ERROR("failed to map memory with error %s", to_string_VkResult(err));
+      vkFreeMemory(g.logical_device, page->handle, NULL);
+      page->handle = VK_NULL_HANDLE;
+      delete_memory_chunk(chunk_index);
+      return MEMORY_NONE;
     }
   }
+  page->size = size;
+  page->pool = pool_index;
+  page->first_chunk = chunk_index;
+  page->used = 0;
+  page->dedicated = (dedicated != NULL);
+  g.allocator.heap_usage[g.memory_properties.memoryTypes[pool->type].heapIndex] += size;
+  Memory_Chunk* chunk = &g.allocator.chunks[chunk_index];
+  chunk->offset = 0;
+  chunk->size = size;
+  chunk->page = index;
+  chunk->prev_phys = MEMORY_NONE;
+  chunk->next_phys = MEMORY_NONE;
+  // chunk of dedicated page is taken by its owner right away
+  if (dedicated)
+    chunk->is_free = 0;
+  else
+    insert_free_chunk(pool, chunk_index);
+  pool->num_pages++;
+  return index;
+}
 
-  // TODO: manage preTransform
-  // This is crucial for devices you can flip
+static void
+free_memory_page(uint32_t index)
+{
+  Memory_Page* page = &g.allocator.pages[index];
+  if (page->mapped)
+    vkUnmapMemory(g.logical_device, page->handle);
+  vkFreeMemory(g.logical_device, page->handle, NULL);
+  page->handle = VK_NULL_HANDLE;
+  g.allocator.pools[page->pool].num_pages--;
+  uint32_t heap = g.memory_properties.memoryTypes[g.allocator.pools[page->pool].type].heapIndex;
+  g.allocator.heap_usage[heap] -= MIN(g.allocator.heap_usage[heap], page->size);
+}
 
-  return err;
+static void
+destroy_memory_allocator()
+{
+  for (uint32_t i = 0; i < LIDA_GFX_MAX_MEMORY_PAGES; i++) {
+    if (g.allocator.pages[i].handle)
+      free_memory_page(i);
+  }
+  g.allocator.num_pools = 0;
 }
 
-static VkResult
-create_window_frames(Window* window)
+static void free_memory_chunk(uint32_t index);
+
+// Free empty pages kept by pools of 'heap'.
+static void
+release_empty_memory_pages(uint32_t heap)
 {
-  VkResult err;
-  VkCommandBuffer command_buffers[2];
-  err = allocate_command_buffers(command_buffers, 2, VK_COMMAND_BUFFER_LEVEL_PRIMARY);
-  if (err != VK_SUCCESS) {
-    LOG_ERROR("failed to allocate command buffers with error %s", to_string_VkResult(err));
-    return err;
+  for (uint32_t i = 0; i < g.allocator.num_pools; i++) {
+    Memory_Pool* pool = &g.allocator.pools[i];
+    if (pool->empty_page == MEMORY_NONE || g.memory_properties.memoryTypes[pool->type].heapIndex != heap)
+      continue;
+    uint32_t chunk = g.allocator.pages[pool->empty_page].first_chunk;
+    remove_free_chunk(pool, chunk);
+    delete_memory_chunk(chunk);
+    free_memory_page(pool->empty_page);
+    pool->empty_page = MEMORY_NONE;
   }
-  VkSemaphoreCreateInfo semaphore_info = { .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
-  VkFenceCreateInfo fence_info = { .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-				   .flags = VK_FENCE_CREATE_SIGNALED_BIT };
-  for (int i = 0; i < 2; i++) {
-    window->frames[i].cmd = command_buffers[i];
-    err = vkCreateSemaphore(g.logical_device, &semaphore_info, NULL, &window->frames[i].image_available);
-    if (err != VK_SUCCESS) {
-      LOG_ERROR("failed to create semaphore with error %s", to_string_VkResult(err));
-      return err;
+}
+
+/**
+   Evict the least recently used streamable block of 'heap' that
+   can't be used by frames in flight. Return 0 if there's none.
+ */
+static int
+evict_streamable(uint32_t heap)
+{
+  uint32_t victim = MEMORY_NONE;
+  for (uint32_t i = 0; i < LIDA_GFX_MAX_STREAMABLES; i++) {
+    const Streamable* it = &g.allocator.streamables[i];
+    if (it->memory == NULL || it->last_used + g.frames_in_flight > g.frame_counter)
+      continue;
+    const Memory_Block* memory = (Memory_Block*)it->memory;
+    if (memory->handle == VK_NULL_HANDLE || g.memory_properties.memoryTypes[memory->type].heapIndex != heap)
+      continue;
+    if (victim == MEMORY_NONE || it->last_used < g.allocator.streamables[victim].last_used)
+      victim = i;
+  }
+  if (victim == MEMORY_NONE)
+    return 0;
+  Streamable* streamable = &g.allocator.streamables[victim];
+  Memory_Block* memory = (Memory_Block*)streamable->memory;
+  streamable->evict(streamable->memory, streamable->udata);
+  free_memory_chunk(memory->chunk);
+  memory->handle = VK_NULL_HANDLE;
+  streamable->memory = NULL;
+  g.allocator.num_evictions++;
+  return 1;
+}
+
+/**
+   Find room for 'size' bytes when pool has no free chunk big
+   enough. Streamable blocks are evicted instead of going over heap
+   budget or when Vulkan runs out of memory. Return index of free
+   chunk or MEMORY_NONE.
+ */
+static uint32_t
+grow_memory_pool(uint32_t pool_index, VkDeviceSize size)
+{
+  Memory_Pool* pool = &g.allocator.pools[pool_index];
+  uint32_t heap = g.memory_properties.memoryTypes[pool->type].heapIndex;
+  VkDeviceSize page_size = MAX(LIDA_GFX_MEMORY_PAGE_SIZE, size);
+  uint32_t page;
+  update_memory_budget();
+  for (;;) {
+    if (g.allocator.heap_usage[heap] + page_size > g.allocator.heap_budget[heap])
+      release_empty_memory_pages(heap);
+    if (g.allocator.heap_usage[heap] + page_size <= g.allocator.heap_budget[heap]) {
+      page = allocate_memory_page(pool_index, page_size, NULL);
+      if (page != MEMORY_NONE)
+	return g.allocator.pages[page].first_chunk;
     }
+    if (g.allocator.locked || evict_streamable(heap) == 0)
+      break;
+    uint32_t index = find_free_chunk(pool, size);
+    if (index != MEMORY_NONE)
+      return index;
   }
-  err = vkCreateSemaphore(g.logical_device, &semaphore_info, NULL, &window->render_finished_semaphore);
-  if (err != VK_SUCCESS) {
-    LOG_ERROR("failed to create semaphore with error %s", to_string_VkResult(err));
-    return err;
+  if (g.allocator.heap_usage[heap] + page_size > g.allocator.heap_budget[heap]) {
+    LOG_WARN("memory heap %u goes over budget: %lu of %lu bytes used", heap,
+	     (unsigned long)(g.allocator.heap_usage[heap] + page_size),
+	     (unsigned long)g.allocator.heap_budget[heap]);
   }
-  err = vkCreateFence(g.logical_device, &fence_info, NULL, &window->resources_available_fence);
-  if (err != VK_SUCCESS) {
-    LOG_ERROR("failed to create fence with error %s", to_string_VkResult(err));
-    return err;
+  page = allocate_memory_page(pool_index, page_size, NULL);
+  return (page != MEMORY_NONE) ? g.allocator.pages[page].first_chunk : MEMORY_NONE;
+}
+
+// Allocate 'size' bytes aligned to 'alignment' from pages of memory
+// 'type'. Return index of chunk or MEMORY_NONE.
+static uint32_t
+allocate_memory_chunk(uint32_t type, uint32_t is_image, VkDeviceSize size, VkDeviceSize alignment)
+{
+  uint32_t pool_index = get_memory_pool(type, is_image);
+  if (pool_index == MEMORY_NONE)
+    return MEMORY_NONE;
+  Memory_Pool* pool = &g.allocator.pools[pool_index];
+  size = ALIGN_TO(size, MEMORY_MIN_CHUNK);
+  // chunks are aligned to MEMORY_MIN_CHUNK, so with bigger alignment
+  // this much space may be skipped
+  VkDeviceSize padded_size = size + ((alignment > MEMORY_MIN_CHUNK) ? alignment - MEMORY_MIN_CHUNK : 0);
+  uint32_t index = find_free_chunk(pool, padded_size);
+  if (index == MEMORY_NONE) {
+    index = grow_memory_pool(pool_index, padded_size);
+    if (index == MEMORY_NONE)
+      return MEMORY_NONE;
   }
-  window->frame_counter = 0;
-  window->current_image = UINT32_MAX;
-  return err;
+  remove_free_chunk(pool, index);
+  if (g.allocator.chunks[index].page == pool->empty_page)
+    pool->empty_page = MEMORY_NONE;
+  VkDeviceSize offset = g.allocator.chunks[index].offset;
+  VkDeviceSize padding = ALIGN_TO(offset, alignment) - offset;
+  if (padding > 0) {
+    uint32_t aligned = split_memory_chunk(index, padding);
+    insert_free_chunk(pool, index);
+    if (aligned == MEMORY_NONE)
+      return MEMORY_NONE;
+    index = aligned;
+  }
+  uint32_t rest = split_memory_chunk(index, size);
+  if (rest != MEMORY_NONE)
+    insert_free_chunk(pool, rest);
+  pool->used += g.allocator.chunks[index].size;
+  pool->num_allocations++;
+  g.allocator.pages[g.allocator.chunks[index].page].used += g.allocator.chunks[index].size;
+  return index;
 }
 
-typedef struct {
-  VkDeviceMemory handle;
-  VkDeviceSize size;
-  VkDeviceSize offset;
-  uint32_t type;
-  // maybe NULL
-  void* mapped;
-} Memory_Block;
-_Static_assert(sizeof(Memory_Block) <= sizeof(GFX_Memory_Block), "internal error: need to adjust sizeof GFX_Memory_Block");
+static void
+free_memory_chunk(uint32_t index)
+{
+  Memory_Chunk* chunk = &g.allocator.chunks[index];
+  Memory_Page* page = &g.allocator.pages[chunk->page];
+  Memory_Pool* pool = &g.allocator.pools[page->pool];
+  pool->used -= chunk->size;
+  pool->num_allocations--;
+  page->used -= chunk->size;
+  // merge with free neighbours
+  uint32_t next = chunk->next_phys;
+  if (next != MEMORY_NONE && g.allocator.chunks[next].is_free) {
+    remove_free_chunk(pool, next);
+    chunk->size += g.allocator.chunks[next].size;
+    chunk->next_phys = g.allocator.chunks[next].next_phys;
+    if (chunk->next_phys != MEMORY_NONE)
+      g.allocator.chunks[chunk->next_phys].prev_phys = index;
+    delete_memory_chunk(next);
+  }
+  uint32_t prev = chunk->prev_phys;
+  if (prev != MEMORY_NONE && g.allocator.chunks[prev].is_free) {
+    remove_free_chunk(pool, prev);
+    g.allocator.chunks[prev].size += chunk->size;
+    g.allocator.chunks[prev].next_phys = chunk->next_phys;
+    if (chunk->next_phys != MEMORY_NONE)
+      g.allocator.chunks[chunk->next_phys].prev_phys = prev;
+    delete_memory_chunk(index);
+    index = prev;
+    chunk = &g.allocator.chunks[index];
+  }
+  if (chunk->size == page->size) {
+    // page is empty, keep one page of normal size around
+    if (pool->empty_page == MEMORY_NONE && page->size == LIDA_GFX_MEMORY_PAGE_SIZE && page->dedicated == 0) {
+      pool->empty_page = chunk->page;
+    } else {
+      free_memory_page(chunk->page);
+      delete_memory_chunk(index);
+      return;
+    }
+  }
+  insert_free_chunk(pool, index);
+}
 
 static VkMemoryPropertyFlags
 get_memory_flags(const Memory_Block* memory)
@@ -2762,88 +5383,473 @@ merge_memory_requirements(const VkMemoryRequirements* requirements, uint32_t cou
   memcpy(out, &requirements[0], sizeof(VkMemoryRequirements));
   for (uint32_t i = 1; i < count; i++) {
     out->size = ALIGN_TO(out->size, requirements[i].alignment) + requirements[i].size;
+    out->alignment = MAX(out->alignment, requirements[i].alignment);
     out->memoryTypeBits &= requirements[i].memoryTypeBits;
   }
 }
 
 static VkResult
-allocate_memory_block(Memory_Block* memory, VkDeviceSize size,
-		      VkMemoryPropertyFlags flags, uint32_t memory_type_bits)
+allocate_memory_block_of_type(Memory_Block* memory, const VkMemoryRequirements* requirements,
+			      uint32_t type, uint32_t is_image)
+{
+  memory->handle = VK_NULL_HANDLE;
+  uint32_t chunk_index = allocate_memory_chunk(type, is_image, requirements->size, requirements->alignment);
+  if (chunk_index == MEMORY_NONE) {
+    uint32_t heap = g.memory_properties.memoryTypes[type].heapIndex;
+    LOG_ERROR("failed to allocate %lu bytes of memory, heap %u has %lu of %lu bytes used",
+	      (unsigned long)requirements->size, heap,
+	      (unsigned long)g.allocator.heap_usage[heap], (unsigned long)g.allocator.heap_budget[heap]);
+    return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+  }
+  const Memory_Chunk* chunk = &g.allocator.chunks[chunk_index];
+  const Memory_Page* page = &g.allocator.pages[chunk->page];
+  memory->handle = page->handle;
+  memory->base = chunk->offset;
+  memory->offset = chunk->offset;
+  memory->size = chunk->offset + chunk->size;
+  memory->type = type;
+  memory->chunk = chunk_index;
+  memory->mapped = page->mapped;
+  return VK_SUCCESS;
+}
+
+// Memory type must have all 'required' properties, types with more
+// 'preferred' and less 'avoided' properties are tried first.
+typedef struct {
+  VkMemoryPropertyFlags required;
+  VkMemoryPropertyFlags preferred;
+  VkMemoryPropertyFlags avoided;
+} Memory_Request;
+
+static const Memory_Request memory_usage_requests[] = {
+  [GFX_MEMORY_USAGE_GPU_ONLY] = {
+    0,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+  },
+  [GFX_MEMORY_USAGE_CPU_TO_GPU] = {
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+    VK_MEMORY_PROPERTY_HOST_CACHED_BIT
+  },
+  [GFX_MEMORY_USAGE_UPLOAD] = {
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    0,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT|VK_MEMORY_PROPERTY_HOST_CACHED_BIT
+  },
+  [GFX_MEMORY_USAGE_READBACK] = {
+    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT
+  },
+};
+
+/**
+   Pick best memory type of 'type_bits' for 'request'. Types whose
+   heap has no room for 'size' bytes within budget are picked only if
+   there's nothing else. On ties the type that comes first wins, as
+   drivers list faster types first. Return MEMORY_NONE if no type
+   fits.
+ */
+static uint32_t
+find_memory_type(uint32_t type_bits, const Memory_Request* request, VkDeviceSize size)
 {
-  uint32_t best_type = 0;
+  uint32_t best_type = MEMORY_NONE;
+  int best_score = 0;
   for (uint32_t i = 0; i < g.memory_properties.memoryTypeCount; i++) {
-    if ((g.memory_properties.memoryTypes[i].propertyFlags & flags) == flags &&
-	(1 << i) & memory_type_bits) {
-      uint32_t a = g.memory_properties.memoryTypes[i].propertyFlags;
-      uint32_t b = g.memory_properties.memoryTypes[best_type].propertyFlags;
-      if (count_set_bits(a&flags) > count_set_bits(b&flags))
-	best_type = i;
+    VkMemoryPropertyFlags flags = g.memory_properties.memoryTypes[i].propertyFlags;
+    if (((1u << i) & type_bits) == 0 || (flags & request->required) != request->required)
+      continue;
+    uint32_t heap = g.memory_properties.memoryTypes[i].heapIndex;
+    int fits_budget = g.allocator.heap_usage[heap] + size <= g.allocator.heap_budget[heap];
+    int score = 256 * fits_budget + 16 * count_set_bits(flags & request->preferred)
+      - count_set_bits(flags & request->avoided);
+    if (best_type == MEMORY_NONE || score > best_score) {
+      best_type = i;
+      best_score = score;
     }
   }
-  VkMemoryAllocateInfo allocate_info = {
-    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-    .allocationSize = size,
-    .memoryTypeIndex = best_type,
+  return best_type;
+}
+
+/**
+   Sub-allocate a block for resources with 'requirements'. Blocks of
+   optimal images and buffers come from different pages. If memory of
+   best type can't be allocated then next best type is tried.
+ */
+static VkResult
+allocate_memory_block(Memory_Block* memory, const VkMemoryRequirements* requirements,
+		      const Memory_Request* request, uint32_t is_image)
+{
+  update_memory_budget();
+  uint32_t type_bits = requirements->memoryTypeBits;
+  for (;;) {
+    uint32_t type = find_memory_type(type_bits, request, requirements->size);
+    if (type == MEMORY_NONE)
+      break;
+    if (allocate_memory_block_of_type(memory, requirements, type, is_image) == VK_SUCCESS)
+      return VK_SUCCESS;
+    type_bits &= ~(1u << type);
+  }
+  memory->handle = VK_NULL_HANDLE;
+  LOG_ERROR("no memory type with properties %u can hold %lu bytes",
+	    request->required, (unsigned long)requirements->size);
+  return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+}
+
+/**
+   Get memory requirements of 'image' or 'buffer'. Return 1 if driver
+   prefers them to have their own allocation.
+ */
+static int
+get_dedicated_requirements(VkImage image, VkBuffer buffer, VkMemoryRequirements* requirements)
+{
+  if (g.has_dedicated_allocation == 0) {
+    if (image)
+      vkGetImageMemoryRequirements(g.logical_device, image, requirements);
+    else
+      vkGetBufferMemoryRequirements(g.logical_device, buffer, requirements);
+    return 0;
+  }
+  VkMemoryDedicatedRequirementsKHR dedicated = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_REQUIREMENTS_KHR,
+  };
+  VkMemoryRequirements2KHR requirements2 = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2_KHR,
+    .pNext = &dedicated,
+  };
+  if (image) {
+    VkImageMemoryRequirementsInfo2KHR info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2_KHR,
+      .image = image,
+    };
+    vkGetImageMemoryRequirements2KHR(g.logical_device, &info, &requirements2);
+  } else {
+    VkBufferMemoryRequirementsInfo2KHR info = {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_REQUIREMENTS_INFO_2_KHR,
+      .buffer = buffer,
+    };
+    vkGetBufferMemoryRequirements2KHR(g.logical_device, &info, &requirements2);
+  }
+  memcpy(requirements, &requirements2.memoryRequirements, sizeof(VkMemoryRequirements));
+  return dedicated.prefersDedicatedAllocation || dedicated.requiresDedicatedAllocation;
+}
+
+/**
+   Allocate a page that holds only 'image' or 'buffer'. Drivers
+   prefer this for big render targets as they can compress them
+   better.
+ */
+static VkResult
+allocate_dedicated_memory_block(Memory_Block* memory, const VkMemoryRequirements* requirements,
+				const Memory_Request* request, VkImage image, VkBuffer buffer)
+{
+  VkMemoryDedicatedAllocateInfoKHR dedicated = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_DEDICATED_ALLOCATE_INFO_KHR,
+    .image = image,
+    .buffer = buffer,
+  };
+  update_memory_budget();
+  uint32_t type_bits = requirements->memoryTypeBits;
+  memory->handle = VK_NULL_HANDLE;
+  for (;;) {
+    uint32_t type = find_memory_type(type_bits, request, requirements->size);
+    if (type == MEMORY_NONE)
+      break;
+    type_bits &= ~(1u << type);
+    uint32_t pool_index = get_memory_pool(type, image != VK_NULL_HANDLE);
+    if (pool_index == MEMORY_NONE)
+      continue;
+    uint32_t heap = g.memory_properties.memoryTypes[type].heapIndex;
+    while (g.allocator.heap_usage[heap] + requirements->size > g.allocator.heap_budget[heap] &&
+	   g.allocator.locked == 0) {
+      release_empty_memory_pages(heap);
+      if (g.allocator.heap_usage[heap] + requirements->size <= g.allocator.heap_budget[heap] ||
+	  evict_streamable(heap) == 0)
+	break;
+    }
+    uint32_t page_index = allocate_memory_page(pool_index, requirements->size, &dedicated);
+    if (page_index == MEMORY_NONE)
+      continue;
+    Memory_Page* page = &g.allocator.pages[page_index];
+    Memory_Pool* pool = &g.allocator.pools[pool_index];
+    pool->used += page->size;
+    pool->num_allocations++;
+    page->used = page->size;
+    memory->handle = page->handle;
+    memory->base = 0;
+    memory->offset = 0;
+    memory->size = page->size;
+    memory->type = type;
+    memory->chunk = page->first_chunk;
+    memory->mapped = page->mapped;
+    return VK_SUCCESS;
+  }
+  LOG_ERROR("failed to allocate dedicated memory of %lu bytes", (unsigned long)requirements->size);
+  return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+}
+
+static void
+free_memory_block(Memory_Block* memory)
+{
+  if (memory->handle)
+    free_memory_chunk(memory->chunk);
+  memory->handle = VK_NULL_HANDLE;
+}
+
+static void
+reset_memory_block(Memory_Block* memory)
+{
+  memory->offset = memory->base;
+}
+
+static VkResult
+eat_memory_block(Memory_Block* memory, const VkMemoryRequirements* requirements)
+{
+  if (((1 << memory->type) & requirements->memoryTypeBits) == 0) {
+    LOG_ERROR("buffer cannot be bound to memory. bits %u are needed, but bit %u is available",
+	      requirements->memoryTypeBits, memory->type);
+    return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+  }
+  memory->offset = ALIGN_TO(memory->offset, requirements->alignment);
+  if (memory->offset + requirements->size > memory->size) {
+    LOG_ERROR("out of video memory");
+    return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+  }
+  return VK_SUCCESS;
+}
+
+// Bindings of bindless descriptor set.
+enum {
+  BINDLESS_SAMPLED_IMAGES = 0,
+  BINDLESS_STORAGE_IMAGES = 1,
+  BINDLESS_STORAGE_BUFFERS = 2,
+};
+#define BINDLESS_NONE UINT32_MAX
+
+static VkResult
+create_bindless_set()
+{
+  VkDescriptorType types[] = {
+    VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+    VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+    VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+  };
+  VkDescriptorSetLayoutBinding bindings[ARR_SIZE(types)];
+  VkDescriptorBindingFlagsEXT binding_flags[ARR_SIZE(types)];
+  VkDescriptorPoolSize sizes[ARR_SIZE(types)];
+  for (uint32_t i = 0; i < ARR_SIZE(types); i++) {
+    bindings[i] = (VkDescriptorSetLayoutBinding) {
+      .binding = i,
+      .descriptorType = types[i],
+      .descriptorCount = LIDA_GFX_BINDLESS_MAX_RESOURCES,
+      .stageFlags = VK_SHADER_STAGE_ALL,
+    };
+    binding_flags[i] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT|
+      VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT|
+      VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT_EXT;
+    sizes[i] = (VkDescriptorPoolSize) { types[i], LIDA_GFX_BINDLESS_MAX_RESOURCES };
+  }
+  VkDescriptorSetLayoutBindingFlagsCreateInfoEXT flags_info = {
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT,
+    .bindingCount = ARR_SIZE(types),
+    .pBindingFlags = binding_flags,
+  };
+  VkDescriptorSetLayoutCreateInfo layout_info = {
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+    .pNext = &flags_info,
+    .flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT,
+    .bindingCount = ARR_SIZE(types),
+    .pBindings = bindings,
+  };
+  VkResult err = vkCreateDescriptorSetLayout(g.logical_device, &layout_info, NULL, &g.bindless.layout);
+  if (err != VK_SUCCESS) {
+    LOG_ERROR("failed to create bindless descriptor set layout with error %s", to_string_VkResult(err));
+    return err;
+  }
+  VkDescriptorPoolCreateInfo pool_info = {
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+    .flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT,
+    .maxSets = 1,
+    .poolSizeCount = ARR_SIZE(sizes),
+    .pPoolSizes = sizes,
+  };
+  err = vkCreateDescriptorPool(g.logical_device, &pool_info, NULL, &g.bindless.pool);
+  if (err != VK_SUCCESS) {
+    LOG_ERROR("failed to create bindless descriptor pool with error %s", to_string_VkResult(err));
+    return err;
+  }
+  VkDescriptorSetAllocateInfo allocate_info = {
+    .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+    .descriptorPool     = g.bindless.pool,
+    .descriptorSetCount = 1,
+    .pSetLayouts        = &g.bindless.layout,
+  };
+  err = vkAllocateDescriptorSets(g.logical_device, &allocate_info, &g.bindless.set);
+  if (err != VK_SUCCESS) {
+    LOG_ERROR("failed to allocate bindless descriptor set with error %s", to_string_VkResult(err));
+    return err;
+  }
+  VkSamplerCreateInfo sampler_info = {
+    .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+    .magFilter = VK_FILTER_LINEAR,
+    .minFilter = VK_FILTER_LINEAR,
+    .mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR,
+    .addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+    .addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+    .addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+    .minLod = 0.0f,
+    .maxLod = VK_LOD_CLAMP_NONE,
+    .borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_BLACK,
   };
-  VkResult err = vkAllocateMemory(g.logical_device, &allocate_info, NULL, &memory->handle);
+  err = vkCreateSampler(g.logical_device, &sampler_info, NULL, &g.bindless.sampler);
   if (err != VK_SUCCESS) {
-    LOG_ERROR("failed to allocate memory with error %s", to_string_VkResult(err));
+    LOG_ERROR("failed to create bindless sampler with error %s", to_string_VkResult(err));
     return err;
   }
-  memory->offset = 0;
-  memory->size = size;
-  memory->type = best_type;
-  if (get_memory_flags(memory) & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
-    err = vkMapMemory(g.logical_device, memory->handle, 0, VK_WHOLE_SIZE, 0, &memory->mapped);
-    if (err != VK_SUCCESS) {
-      LOG_ERROR("failed to map memory with error %s", to_string_VkResult(err));
-      return err;
-    }
-  } else {
-    memory->mapped = NULL;
-  }
+  memset(g.bindless.used, 0, sizeof(g.bindless.used));
+  g.bindless.num_retired = 0;
   return VK_SUCCESS;
 }
 
 static void
-free_memory_block(Memory_Block* memory)
+destroy_bindless_set()
+{
+  vkDestroySampler(g.logical_device, g.bindless.sampler, NULL);
+  vkDestroyDescriptorPool(g.logical_device, g.bindless.pool, NULL);
+  vkDestroyDescriptorSetLayout(g.logical_device, g.bindless.layout, NULL);
+  g.bindless.enabled = 0;
+}
+
+static uint32_t
+acquire_bindless_index(uint32_t binding)
 {
-  if (memory->handle && memory->mapped) {
-    vkUnmapMemory(g.logical_device, memory->handle);
+  uint32_t* used = g.bindless.used[binding];
+  for (uint32_t i = 0; i < LIDA_GFX_BINDLESS_MAX_RESOURCES/32; i++) {
+    if (used[i] != UINT32_MAX) {
+      uint32_t bit = 0;
+      while (used[i] & (1u << bit))
+	bit++;
+      used[i] |= 1u << bit;
+      return i*32 + bit;
+    }
   }
-  vkFreeMemory(g.logical_device, memory->handle, NULL);
-  memory->handle = VK_NULL_HANDLE;
+  LOG_ERROR("bindless array %u is full, increase LIDA_GFX_BINDLESS_MAX_RESOURCES", binding);
+  return BINDLESS_NONE;
 }
 
 static void
-reset_memory_block(Memory_Block* memory)
+free_retired_bindless_indices(int wait_all)
 {
-  memory->offset = 0;
+  uint32_t i = 0;
+  while (i < g.bindless.num_retired) {
+    if (wait_all || is_frame_complete(g.bindless.retired[i].frame)) {
+      uint32_t index = g.bindless.retired[i].index;
+      g.bindless.used[g.bindless.retired[i].binding][index/32] &= ~(1u << (index%32));
+      g.bindless.retired[i] = g.bindless.retired[--g.bindless.num_retired];
+    } else {
+      i++;
+    }
+  }
 }
 
-static VkResult
-eat_memory_block(Memory_Block* memory, const VkMemoryRequirements* requirements)
+/**
+   Release element of bindless array. It's reused when frames that
+   might access it are done on GPU.
+ */
+static void
+release_bindless_index(uint32_t binding, uint32_t index)
 {
-  if (((1 << memory->type) & requirements->memoryTypeBits) == 0) {
-    LOG_ERROR("buffer cannot be bound to memory. bits %u are needed, but bit %u is available",
-	      requirements->memoryTypeBits, memory->type);
-    return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+  if (index == BINDLESS_NONE)
+    return;
+  if (g.bindless.num_retired == MAX_RETIRED_INDICES) {
+    LOG_WARN("too many released bindless resources, waiting for GPU");
+    wait_graphics_timeline();
+    free_retired_bindless_indices(1);
   }
-  memory->offset = ALIGN_TO(memory->offset, requirements->alignment);
-  if (memory->offset > memory->size) {
-    LOG_ERROR("out of video memory");
-    return VK_ERROR_OUT_OF_DEVICE_MEMORY;
+  g.bindless.retired[g.bindless.num_retired].binding = binding;
+  g.bindless.retired[g.bindless.num_retired].index = index;
+  g.bindless.retired[g.bindless.num_retired].frame = g.frame_counter;
+  g.bindless.num_retired++;
+}
+
+static void
+write_bindless_descriptor(uint32_t binding, uint32_t index, const Descriptor_Info* info)
+{
+  VkWriteDescriptorSet write = {
+    .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+    .dstSet = g.bindless.set,
+    .dstBinding = binding,
+    .dstArrayElement = index,
+    .descriptorCount = 1,
+  };
+  switch (binding) {
+  case BINDLESS_SAMPLED_IMAGES:
+    write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write.pImageInfo = &info->image;
+    break;
+  case BINDLESS_STORAGE_IMAGES:
+    write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    write.pImageInfo = &info->image;
+    break;
+  case BINDLESS_STORAGE_BUFFERS:
+    write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    write.pBufferInfo = &info->buffer;
+    break;
   }
-  return VK_SUCCESS;
+  vkUpdateDescriptorSets(g.logical_device, 1, &write, 0, NULL);
+  g.frame_stats.num_descriptor_writes++;
 }
 
 typedef struct {
   VkBuffer handle;
   uint32_t size;
+  // element of bindless storage buffer array
+  uint32_t bindless_index;
   void* mapped;
+  VkBufferUsageFlags usage;
 } Buffer;
 _Static_assert(sizeof(Buffer) <= sizeof(GFX_Buffer), "internal error: adjust sizeof for GFX_Buffer");
 
+// Get queue families that resources are shared between, so they're
+// used on compute and transfer queues without ownership transfers.
+static uint32_t
+get_sharing_queue_families(uint32_t families[NUM_QUEUES], int with_transfer)
+{
+  uint32_t count = 0;
+  families[count++] = g.graphics_queue_family;
+  if (g.compute_queue_family != UINT32_MAX)
+    families[count++] = g.compute_queue_family;
+  if (with_transfer && g.transfer_queue_family != UINT32_MAX)
+    families[count++] = g.transfer_queue_family;
+  return count;
+}
+
+// Get queue and its family used for 'queue'. Compute and transfer work
+// goes to graphics queue when device has no dedicated family for it.
+static VkQueue
+get_queue(GFX_Queue queue, uint32_t* family)
+{
+  if (queue == GFX_QUEUE_COMPUTE && g.compute_queue_family != UINT32_MAX) {
+    *family = g.compute_queue_family;
+    return g.compute_queue;
+  }
+  if (queue == GFX_QUEUE_TRANSFER && g.transfer_queue_family != UINT32_MAX) {
+    *family = g.transfer_queue_family;
+    return g.transfer_queue;
+  }
+  *family = g.graphics_queue_family;
+  return g.graphics_queue;
+}
+
+// Storage images are shared with compute queue, the rest are owned by
+// graphics queue.
+static int
+is_image_shared(VkImageUsageFlags usage)
+{
+  return (usage & VK_IMAGE_USAGE_STORAGE_BIT) && g.compute_queue_family != UINT32_MAX;
+}
+
 static VkResult
 create_buffer(Buffer* buffer, GFX_Buffer_Usage usage, uint32_t size)
 {
@@ -2853,18 +5859,38 @@ create_buffer(Buffer* buffer, GFX_Buffer_Usage usage, uint32_t size)
     .usage       = (VkBufferUsageFlags)usage,
     .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
   };
+  // buffers are shared with compute queue and, if they're copied, with
+  // transfer queue, so no ownership transfers are needed
+  uint32_t queue_families[NUM_QUEUES];
+  uint32_t num_families = get_sharing_queue_families(queue_families,
+						     usage & (GFX_BUFFER_USAGE_TRANSFER_SRC|GFX_BUFFER_USAGE_TRANSFER_DST));
+  if (num_families > 1) {
+    buffer_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+    buffer_info.queueFamilyIndexCount = num_families;
+    buffer_info.pQueueFamilyIndices = queue_families;
+  }
   VkResult err = vkCreateBuffer(g.logical_device, &buffer_info, NULL, &buffer->handle);
   if (err != VK_SUCCESS) {
     LOG_ERROR("failed to create buffer with error %s", to_string_VkResult(err));
   }
   buffer->size = size;
   buffer->mapped = NULL;
+  buffer->usage = (VkBufferUsageFlags)usage;
+  // descriptor is written when buffer is bound to memory
+  buffer->bindless_index = BINDLESS_NONE;
+  if (g.bindless.enabled && (usage & GFX_BUFFER_USAGE_STORAGE) && err == VK_SUCCESS) {
+    buffer->bindless_index = acquire_bindless_index(BINDLESS_STORAGE_BUFFERS);
+  }
   return err;
 }
 
 static void
 destroy_buffer(Buffer* buffer)
 {
+  invalidate_command_lists((uint64_t)buffer->handle);
+  forget_cached_descriptor_sets((uint64_t)buffer->handle);
+  release_bindless_index(BINDLESS_STORAGE_BUFFERS, buffer->bindless_index);
+  buffer->bindless_index = BINDLESS_NONE;
   vkDestroyBuffer(g.logical_device, buffer->handle, NULL);
   buffer->handle = VK_NULL_HANDLE;
 }
@@ -2885,6 +5911,10 @@ bind_buffer_to_memory(Memory_Block* memory, Buffer* buffer,
     if (memory->mapped) {
       buffer->mapped = (char*)memory->mapped + memory->offset;
     }
+    if (buffer->bindless_index != BINDLESS_NONE) {
+      Descriptor_Info info = { .buffer = { buffer->handle, 0, VK_WHOLE_SIZE } };
+      write_bindless_descriptor(BINDLESS_STORAGE_BUFFERS, buffer->bindless_index, &info);
+    }
     if (mapped_range) {
       mapped_range->sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
       mapped_range->memory = memory->handle;
@@ -2899,10 +5929,55 @@ bind_buffer_to_memory(Memory_Block* memory, Buffer* buffer,
   return err;
 }
 
+static VkResult
+create_frame_data()
+{
+  Buffer* buffer = (Buffer*)&g.frame_data.buffer;
+  Memory_Block* memory = (Memory_Block*)&g.frame_data.memory;
+  const VkPhysicalDeviceLimits* limits = &g.device_properties.limits;
+  g.frame_data.alignment = (uint32_t)MAX(limits->minUniformBufferOffsetAlignment,
+					 limits->minStorageBufferOffsetAlignment);
+  g.frame_data.begin = 0;
+  g.frame_data.offset = 0;
+  g.frame_data.mapped = NULL;
+  VkResult err = create_buffer(buffer, GFX_BUFFER_USAGE_UNIFORM|GFX_BUFFER_USAGE_STORAGE,
+			       g.frames_in_flight * LIDA_GFX_FRAME_DATA_SIZE);
+  if (err != VK_SUCCESS)
+    return err;
+  VkMemoryRequirements requirements;
+  vkGetBufferMemoryRequirements(g.logical_device, buffer->handle, &requirements);
+  err = allocate_memory_block(memory, &requirements,
+			      &memory_usage_requests[GFX_MEMORY_USAGE_CPU_TO_GPU], 0);
+  if (err == VK_SUCCESS)
+    err = bind_buffer_to_memory(memory, buffer, &requirements, NULL);
+  if (err != VK_SUCCESS || buffer->mapped == NULL) {
+    LOG_ERROR("failed to allocate host visible memory for frame data");
+    destroy_buffer(buffer);
+    if (memory->handle)
+      free_memory_block(memory);
+    return (err != VK_SUCCESS) ? err : VK_ERROR_MEMORY_MAP_FAILED;
+  }
+  g.frame_data.mapped = buffer->mapped;
+  return VK_SUCCESS;
+}
+
+static void
+destroy_frame_data()
+{
+  if (g.frame_data.mapped == NULL)
+    return;
+  destroy_buffer((Buffer*)&g.frame_data.buffer);
+  free_memory_block((Memory_Block*)&g.frame_data.memory);
+  g.frame_data.mapped = NULL;
+}
+
 typedef struct {
   VkImage handle;
   VkExtent3D extent;
   VkFormat format;
+  VkImageUsageFlags usage;
+  uint16_t mips;
+  uint16_t layers;
 } Image;
 _Static_assert(sizeof(Image) <= sizeof(GFX_Image), "internal error: adjust sizeof for GFX_Image");
 
@@ -2922,18 +5997,28 @@ create_image(Image* image, GFX_Image_Usage usage, VkExtent3D extent, GFX_Format
     .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
     .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
   };
+  uint32_t queue_families[NUM_QUEUES];
+  if (is_image_shared((VkImageUsageFlags)usage)) {
+    image_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+    image_info.queueFamilyIndexCount = get_sharing_queue_families(queue_families, 0);
+    image_info.pQueueFamilyIndices = queue_families;
+  }
   VkResult err = vkCreateImage(g.logical_device, &image_info, NULL, &image->handle);
   if (err != VK_SUCCESS) {
     LOG_ERROR("failed to create image with error %s", to_string_VkResult(err));
   }
   image->extent = extent;
   image->format = (VkFormat)format;
+  image->usage = (VkImageUsageFlags)usage;
+  image->mips = (uint16_t)mips;
+  image->layers = (uint16_t)layers;
   return err;
 }
 
 static void
 destroy_image(Image* image)
 {
+  invalidate_command_lists((uint64_t)image->handle);
   vkDestroyImage(g.logical_device, image->handle, NULL);
   image->handle = VK_NULL_HANDLE;
 }
@@ -2958,6 +6043,14 @@ bind_image_to_memory(Memory_Block* memory, Image* image,
 typedef struct {
   VkImageView image_view;
   VkExtent3D extent;
+  // elements of bindless image arrays
+  uint32_t sampled_index;
+  uint32_t storage_index;
+  // subresource range of view, needed to recreate it
+  uint16_t first_mip;
+  uint16_t num_mips;
+  uint16_t first_layer;
+  uint16_t num_layers;
 } Texture;
 _Static_assert(sizeof(Texture) <= sizeof(GFX_Texture), "internal error: adjust sizeof for GFX_Texture");
 
@@ -2992,16 +6085,604 @@ create_texture(Texture* texture, Image* image, uint32_t first_mip, uint32_t firs
   if (texture->extent.height == 0)  texture->extent.height = 1;
   texture->extent.depth = image->extent.depth >> first_mip;
   if (texture->extent.depth == 0)  texture->extent.depth = 1;
+  texture->first_mip = (uint16_t)first_mip;
+  texture->num_mips = (uint16_t)num_mips;
+  texture->first_layer = (uint16_t)first_layer;
+  texture->num_layers = (uint16_t)num_layers;
+  texture->sampled_index = BINDLESS_NONE;
+  texture->storage_index = BINDLESS_NONE;
+  if (g.bindless.enabled && err == VK_SUCCESS) {
+    if (image->usage & VK_IMAGE_USAGE_SAMPLED_BIT) {
+      texture->sampled_index = acquire_bindless_index(BINDLESS_SAMPLED_IMAGES);
+      Descriptor_Info info = { .image = { g.bindless.sampler, texture->image_view, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL } };
+      if (texture->sampled_index != BINDLESS_NONE)
+	write_bindless_descriptor(BINDLESS_SAMPLED_IMAGES, texture->sampled_index, &info);
+    }
+    if (image->usage & VK_IMAGE_USAGE_STORAGE_BIT) {
+      texture->storage_index = acquire_bindless_index(BINDLESS_STORAGE_IMAGES);
+      Descriptor_Info info = { .image = { VK_NULL_HANDLE, texture->image_view, VK_IMAGE_LAYOUT_GENERAL } };
+      if (texture->storage_index != BINDLESS_NONE)
+	write_bindless_descriptor(BINDLESS_STORAGE_IMAGES, texture->storage_index, &info);
+    }
+  }
   return err;
 }
 
 static void
 destroy_texture(Texture* texture)
 {
+  invalidate_command_lists((uint64_t)texture->image_view);
+  forget_cached_descriptor_sets((uint64_t)texture->image_view);
+  release_bindless_index(BINDLESS_SAMPLED_IMAGES, texture->sampled_index);
+  release_bindless_index(BINDLESS_STORAGE_IMAGES, texture->storage_index);
+  texture->sampled_index = BINDLESS_NONE;
+  texture->storage_index = BINDLESS_NONE;
   vkDestroyImageView(g.logical_device, texture->image_view, NULL);
   texture->image_view = VK_NULL_HANDLE;
 }
 
+enum {
+  RETIRED_BUFFER,
+  RETIRED_IMAGE,
+  RETIRED_TEXTURE,
+};
+
+static void
+free_retired_resources(int wait_all)
+{
+  uint32_t i = 0;
+  while (i < g.num_retired_resources) {
+    if (wait_all || is_frame_complete(g.retired_resources[i].frame)) {
+      switch (g.retired_resources[i].type) {
+      case RETIRED_BUFFER:
+	destroy_buffer((Buffer*)&g.retired_resources[i].object.buffer);
+	break;
+      case RETIRED_IMAGE:
+	destroy_image((Image*)&g.retired_resources[i].object.image);
+	break;
+      case RETIRED_TEXTURE:
+	destroy_texture((Texture*)&g.retired_resources[i].object.texture);
+	break;
+      }
+      if (g.retired_resources[i].chunk != MEMORY_NONE)
+	free_memory_chunk(g.retired_resources[i].chunk);
+      g.retired_resources[i] = g.retired_resources[--g.num_retired_resources];
+    } else {
+      i++;
+    }
+  }
+}
+
+/**
+   Destroy resource when frames that might use it are done on
+   GPU. Command lists and cached descriptor sets that reference it are
+   forgotten right away, so they're not used with the old handle.
+ */
+static void
+retire_resource(uint32_t type, const void* object, size_t size, uint64_t handle, uint32_t chunk)
+{
+  invalidate_command_lists(handle);
+  forget_cached_descriptor_sets(handle);
+  uint32_t index = g.num_retired_resources++;
+  g.retired_resources[index].type = type;
+  memcpy(&g.retired_resources[index].object, object, size);
+  g.retired_resources[index].chunk = chunk;
+  g.retired_resources[index].frame = g.frame_counter;
+}
+
+// Page is moved out of if less than half of it is used. The most
+// used page of pool is never moved out of, other pages are compacted
+// into it.
+static uint32_t
+pick_sparse_memory_pages(uint32_t* pages)
+{
+  uint32_t densest[MEMORY_MAX_POOLS];
+  for (uint32_t i = 0; i < g.allocator.num_pools; i++)
+    densest[i] = MEMORY_NONE;
+  for (uint32_t i = 0; i < LIDA_GFX_MAX_MEMORY_PAGES; i++) {
+    const Memory_Page* page = &g.allocator.pages[i];
+    if (page->handle == VK_NULL_HANDLE || page->size != LIDA_GFX_MEMORY_PAGE_SIZE || page->dedicated)
+      continue;
+    if (densest[page->pool] == MEMORY_NONE || g.allocator.pages[densest[page->pool]].used < page->used)
+      densest[page->pool] = i;
+  }
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < LIDA_GFX_MAX_MEMORY_PAGES; i++) {
+    const Memory_Page* page = &g.allocator.pages[i];
+    if (page->handle == VK_NULL_HANDLE || page->size != LIDA_GFX_MEMORY_PAGE_SIZE || page->dedicated ||
+	densest[page->pool] == i)
+      continue;
+    if (page->used > 0 && page->used * 2 < page->size)
+      pages[count++] = i;
+  }
+  return count;
+}
+
+// Hide free chunks of pages from allocator, so resources aren't moved
+// within sparse pages. No chunk may be freed while pages are locked,
+// so streamables aren't evicted meanwhile.
+static void
+lock_memory_pages(const uint32_t* pages, uint32_t count, int lock)
+{
+  g.allocator.locked = lock;
+  for (uint32_t i = 0; i < count; i++) {
+    Memory_Page* page = &g.allocator.pages[pages[i]];
+    Memory_Pool* pool = &g.allocator.pools[page->pool];
+    for (uint32_t it = page->first_chunk; it != MEMORY_NONE; it = g.allocator.chunks[it].next_phys) {
+      if (g.allocator.chunks[it].is_free == 0)
+	continue;
+      if (lock) {
+	remove_free_chunk(pool, it);
+	g.allocator.chunks[it].is_free = 1;
+      } else {
+	insert_free_chunk(pool, it);
+      }
+    }
+  }
+}
+
+static int
+move_buffer(VkCommandBuffer cmd, Memory_Block* memory, Buffer* buffer)
+{
+  const VkBufferUsageFlags transfer = VK_BUFFER_USAGE_TRANSFER_SRC_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+  if ((buffer->usage & transfer) != transfer)
+    return 0;
+  Buffer new_buffer;
+  if (create_buffer(&new_buffer, (GFX_Buffer_Usage)buffer->usage, buffer->size) != VK_SUCCESS)
+    return 0;
+  VkMemoryRequirements requirements;
+  vkGetBufferMemoryRequirements(g.logical_device, new_buffer.handle, &requirements);
+  Memory_Block new_memory;
+  if (allocate_memory_block_of_type(&new_memory, &requirements, memory->type, 0) != VK_SUCCESS) {
+    destroy_buffer(&new_buffer);
+    return 0;
+  }
+  bind_buffer_to_memory(&new_memory, &new_buffer, &requirements, NULL);
+  VkBufferCopy region = { 0, 0, buffer->size };
+  vkCmdCopyBuffer(cmd, buffer->handle, new_buffer.handle, 1, &region);
+  retire_resource(RETIRED_BUFFER, buffer, sizeof(Buffer), (uint64_t)buffer->handle, memory->chunk);
+  *buffer = new_buffer;
+  *memory = new_memory;
+  return 1;
+}
+
+static int
+move_image(VkCommandBuffer cmd, Memory_Block* memory, Image* image,
+	   Texture* textures, uint32_t num_textures, VkImageLayout layout)
+{
+  const VkImageUsageFlags transfer = VK_IMAGE_USAGE_TRANSFER_SRC_BIT|VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+  if ((image->usage & transfer) != transfer)
+    return 0;
+  Image new_image;
+  if (create_image(&new_image, (GFX_Image_Usage)image->usage, image->extent,
+		   (GFX_Format)image->format, image->mips, image->layers) != VK_SUCCESS)
+    return 0;
+  VkMemoryRequirements requirements;
+  vkGetImageMemoryRequirements(g.logical_device, new_image.handle, &requirements);
+  Memory_Block new_memory;
+  if (allocate_memory_block_of_type(&new_memory, &requirements, memory->type, 1) != VK_SUCCESS) {
+    destroy_image(&new_image);
+    return 0;
+  }
+  bind_image_to_memory(&new_memory, &new_image, &requirements);
+  // contents of image in undefined layout needn't be preserved
+  if (layout != VK_IMAGE_LAYOUT_UNDEFINED) {
+    VkImageAspectFlags aspect = (image->format >= VK_FORMAT_D16_UNORM && image->format <= VK_FORMAT_D32_SFLOAT_S8_UINT) ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT;
+    VkImageSubresourceRange range = { aspect, 0, image->mips, 0, image->layers };
+    VkImageMemoryBarrier barriers[2] = {
+      {
+	.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+	.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT,
+	.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+	.oldLayout = layout,
+	.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+	.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+	.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+	.image = image->handle,
+	.subresourceRange = range,
+      },
+      {
+	.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+	.srcAccessMask = 0,
+	.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+	.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+	.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+	.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+	.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+	.image = new_image.handle,
+	.subresourceRange = range,
+      },
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+			 0, NULL, 0, NULL, 2, barriers);
+    VkImageCopy* regions = alloca(image->mips * sizeof(VkImageCopy));
+    for (uint32_t i = 0; i < image->mips; i++) {
+      regions[i] = (VkImageCopy) {
+	.srcSubresource = { aspect, i, 0, image->layers },
+	.dstSubresource = { aspect, i, 0, image->layers },
+	.extent = { MAX(image->extent.width >> i, 1), MAX(image->extent.height >> i, 1), MAX(image->extent.depth >> i, 1) },
+      };
+    }
+    vkCmdCopyImage(cmd, image->handle, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		   new_image.handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, image->mips, regions);
+    barriers[1].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barriers[1].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT|VK_ACCESS_MEMORY_WRITE_BIT;
+    barriers[1].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barriers[1].newLayout = layout;
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+			 0, NULL, 0, NULL, 1, &barriers[1]);
+  }
+  for (uint32_t i = 0; i < num_textures; i++) {
+    Texture* texture = &textures[i];
+    retire_resource(RETIRED_TEXTURE, texture, sizeof(Texture), (uint64_t)texture->image_view, MEMORY_NONE);
+    create_texture(texture, &new_image, texture->first_mip, texture->first_layer,
+		   texture->num_mips, texture->num_layers);
+  }
+  retire_resource(RETIRED_IMAGE, image, sizeof(Image), (uint64_t)image->handle, memory->chunk);
+  *image = new_image;
+  *memory = new_memory;
+  return 1;
+}
+
+static int
+compare_image_uploads(const Image_Upload* a, const Image_Upload* b)
+{
+  if (a->image != b->image)
+    return ((uint64_t)a->image < (uint64_t)b->image) ? -1 : 1;
+  if (a->region.imageSubresource.mipLevel != b->region.imageSubresource.mipLevel)
+    return (a->region.imageSubresource.mipLevel < b->region.imageSubresource.mipLevel) ? -1 : 1;
+  if (a->region.imageSubresource.baseArrayLayer != b->region.imageSubresource.baseArrayLayer)
+    return (a->region.imageSubresource.baseArrayLayer < b->region.imageSubresource.baseArrayLayer) ? -1 : 1;
+  return 0;
+}
+
+static VkResult
+create_upload_manager()
+{
+  Buffer* buffer = (Buffer*)&g.upload.buffer;
+  Memory_Block* memory = (Memory_Block*)&g.upload.memory;
+  g.upload.mapped = NULL;
+  g.upload.head = 0;
+  g.upload.tail = 0;
+  g.upload.next_batch = 0;
+  g.upload.num_buffer_copies = 0;
+  g.upload.num_image_copies = 0;
+  VkResult err = create_buffer(buffer, GFX_BUFFER_USAGE_TRANSFER_SRC, LIDA_GFX_STAGING_SIZE);
+  if (err != VK_SUCCESS)
+    return err;
+  VkMemoryRequirements requirements;
+  vkGetBufferMemoryRequirements(g.logical_device, buffer->handle, &requirements);
+  err = allocate_memory_block(memory, &requirements, &memory_usage_requests[GFX_MEMORY_USAGE_UPLOAD], 0);
+  if (err == VK_SUCCESS)
+    err = bind_buffer_to_memory(memory, buffer, &requirements, NULL);
+  if (err != VK_SUCCESS) {
+    destroy_buffer(buffer);
+    if (memory->handle)
+      free_memory_block(memory);
+    return err;
+  }
+  g.upload.mapped = buffer->mapped;
+
+  VkCommandPoolCreateInfo pool_info = {
+    .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+    .flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+    .queueFamilyIndex = g.graphics_queue_family,
+  };
+  VkCommandBuffer cmds[LIDA_GFX_MAX_UPLOAD_BATCHES];
+  VkCommandBufferAllocateInfo allocate_info = {
+    .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+    .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+    .commandBufferCount = LIDA_GFX_MAX_UPLOAD_BATCHES,
+  };
+  vkCreateCommandPool(g.logical_device, &pool_info, NULL, &g.upload.graphics_pool);
+  allocate_info.commandPool = g.upload.graphics_pool;
+  vkAllocateCommandBuffers(g.logical_device, &allocate_info, cmds);
+  for (uint32_t i = 0; i < LIDA_GFX_MAX_UPLOAD_BATCHES; i++)
+    g.upload.batches[i].graphics_cmd = cmds[i];
+  if (g.transfer_queue_family != UINT32_MAX) {
+    pool_info.queueFamilyIndex = g.transfer_queue_family;
+    vkCreateCommandPool(g.logical_device, &pool_info, NULL, &g.upload.transfer_pool);
+    allocate_info.commandPool = g.upload.transfer_pool;
+    vkAllocateCommandBuffers(g.logical_device, &allocate_info, cmds);
+  }
+  VkSemaphoreCreateInfo semaphore_info = { .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+  for (uint32_t i = 0; i < LIDA_GFX_MAX_UPLOAD_BATCHES; i++) {
+    g.upload.batches[i].pending = 0;
+    if (g.transfer_queue_family != UINT32_MAX) {
+      g.upload.batches[i].transfer_cmd = cmds[i];
+      vkCreateSemaphore(g.logical_device, &semaphore_info, NULL, &g.upload.batches[i].semaphore);
+    }
+  }
+  return VK_SUCCESS;
+}
+
+static void
+destroy_upload_manager()
+{
+  if (g.upload.mapped == NULL)
+    return;
+  if (g.transfer_queue_family != UINT32_MAX) {
+    for (uint32_t i = 0; i < LIDA_GFX_MAX_UPLOAD_BATCHES; i++)
+      vkDestroySemaphore(g.logical_device, g.upload.batches[i].semaphore, NULL);
+  }
+  vkDestroyCommandPool(g.logical_device, g.upload.graphics_pool, NULL);
+  if (g.transfer_queue_family != UINT32_MAX)
+    vkDestroyCommandPool(g.logical_device, g.upload.transfer_pool, NULL);
+  destroy_buffer((Buffer*)&g.upload.buffer);
+  free_memory_block((Memory_Block*)&g.upload.memory);
+  g.upload.mapped = NULL;
+}
+
+// Give staging memory of finished batches back to ring. Batches
+// finish in the order they were submitted.
+static void
+poll_upload_batches(int wait)
+{
+  Timeline* timeline = &g.timelines[GFX_QUEUE_GRAPHICS];
+  poll_timeline(timeline);
+  for (uint32_t i = 0; i < LIDA_GFX_MAX_UPLOAD_BATCHES; i++) {
+    uint32_t index = (g.upload.next_batch + i) % LIDA_GFX_MAX_UPLOAD_BATCHES;
+    Upload_Batch* batch = &g.upload.batches[index];
+    if (batch->pending == 0)
+      continue;
+    if (wait) {
+      wait_timeline(timeline, batch->value, UINT64_MAX);
+    } else if (timeline->completed < batch->value) {
+      break;
+    }
+    g.upload.tail = batch->head;
+    batch->pending = 0;
+  }
+}
+
+static void
+sort_upload_copies()
+{
+  // insertion sort keeps order of copies to the same place
+  for (uint32_t i = 1; i < g.upload.num_buffer_copies; i++) {
+    Buffer_Upload tmp = g.upload.buffer_copies[i];
+    uint32_t j = i;
+    while (j > 0 && (uint64_t)g.upload.buffer_copies[j-1].buffer > (uint64_t)tmp.buffer) {
+      g.upload.buffer_copies[j] = g.upload.buffer_copies[j-1];
+      j--;
+    }
+    g.upload.buffer_copies[j] = tmp;
+  }
+  for (uint32_t i = 1; i < g.upload.num_image_copies; i++) {
+    Image_Upload tmp = g.upload.image_copies[i];
+    uint32_t j = i;
+    while (j > 0 && compare_image_uploads(&g.upload.image_copies[j-1], &tmp) > 0) {
+      g.upload.image_copies[j] = g.upload.image_copies[j-1];
+      j--;
+    }
+    g.upload.image_copies[j] = tmp;
+  }
+}
+
+/**
+   Record copies of one image. Each mip and layer touched is
+   transitioned once: from old layout of its first copy to new layout
+   of its last copy. Copies on transfer queue release image to
+   graphics queue.
+ */
+static void
+record_image_uploads(VkCommandBuffer cmd, VkCommandBuffer acquire_cmd,
+		     const Image_Upload* uploads, uint32_t count)
+{
+  VkImageMemoryBarrier* barriers = alloca(count * sizeof(VkImageMemoryBarrier));
+  VkBufferImageCopy* regions = alloca(count * sizeof(VkBufferImageCopy));
+  uint32_t num_barriers = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    regions[i] = uploads[i].region;
+    const VkImageSubresourceLayers* layers = &uploads[i].region.imageSubresource;
+    if (num_barriers > 0 &&
+	barriers[num_barriers-1].subresourceRange.baseMipLevel == layers->mipLevel &&
+	barriers[num_barriers-1].subresourceRange.baseArrayLayer == layers->baseArrayLayer) {
+      barriers[num_barriers-1].newLayout = uploads[i].new_layout;
+      continue;
+    }
+    barriers[num_barriers++] = (VkImageMemoryBarrier) {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_MEMORY_READ_BIT|VK_ACCESS_MEMORY_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .oldLayout = uploads[i].old_layout,
+      .newLayout = uploads[i].new_layout,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .image = uploads[i].image,
+      .subresourceRange = { layers->aspectMask, layers->mipLevel, 1, layers->baseArrayLayer, 1 },
+    };
+  }
+  // barriers keep new layouts while image is written
+  VkImageLayout* new_layouts = alloca(num_barriers * sizeof(VkImageLayout));
+  for (uint32_t i = 0; i < num_barriers; i++) {
+    new_layouts[i] = barriers[i].newLayout;
+    barriers[i].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+  }
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+		       0, NULL, 0, NULL, num_barriers, barriers);
+  vkCmdCopyBufferToImage(cmd, ((Buffer*)&g.upload.buffer)->handle, uploads[0].image,
+			 VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, count, regions);
+  for (uint32_t i = 0; i < num_barriers; i++) {
+    barriers[i].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barriers[i].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT|VK_ACCESS_MEMORY_WRITE_BIT;
+    barriers[i].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barriers[i].newLayout = new_layouts[i];
+  }
+  if (acquire_cmd == VK_NULL_HANDLE) {
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+			 0, NULL, 0, NULL, num_barriers, barriers);
+    return;
+  }
+  // queue family ownership transfer: release on transfer queue...
+  for (uint32_t i = 0; i < num_barriers; i++) {
+    barriers[i].dstAccessMask = 0;
+    barriers[i].srcQueueFamilyIndex = g.transfer_queue_family;
+    barriers[i].dstQueueFamilyIndex = g.graphics_queue_family;
+  }
+  vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+		       0, NULL, 0, NULL, num_barriers, barriers);
+  // ...and acquire on graphics queue
+  for (uint32_t i = 0; i < num_barriers; i++) {
+    barriers[i].srcAccessMask = 0;
+    barriers[i].dstAccessMask = VK_ACCESS_MEMORY_READ_BIT|VK_ACCESS_MEMORY_WRITE_BIT;
+  }
+  vkCmdPipelineBarrier(acquire_cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+		       0, NULL, 0, NULL, num_barriers, barriers);
+}
+
+/**
+   Submit copies recorded by 'gfx_upload_*()'. Buffer copies and
+   copies to images whose contents are discarded go to transfer queue
+   if device has one, others are executed on graphics queue. Work
+   submitted to graphics queue after this sees uploaded data.
+ */
+static VkResult
+flush_uploads()
+{
+  if (g.upload.num_buffer_copies == 0 && g.upload.num_image_copies == 0)
+    return VK_SUCCESS;
+  Upload_Batch* batch = &g.upload.batches[g.upload.next_batch];
+  if (batch->pending) {
+    // this is the oldest batch
+    wait_timeline(&g.timelines[GFX_QUEUE_GRAPHICS], batch->value, UINT64_MAX);
+    poll_upload_batches(0);
+  }
+  sort_upload_copies();
+  VkCommandBufferBeginInfo begin_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+  };
+  VkBuffer staging = ((Buffer*)&g.upload.buffer)->handle;
+  int has_transfer_queue = (g.transfer_queue_family != UINT32_MAX);
+  int used_transfer_queue = 0;
+  vkBeginCommandBuffer(batch->graphics_cmd, &begin_info);
+  if (has_transfer_queue)
+    vkBeginCommandBuffer(batch->transfer_cmd, &begin_info);
+  VkCommandBuffer buffer_cmd = (has_transfer_queue) ? batch->transfer_cmd : batch->graphics_cmd;
+  // one copy command per destination buffer
+  uint32_t i = 0;
+  while (i < g.upload.num_buffer_copies) {
+    uint32_t j = i;
+    while (j < g.upload.num_buffer_copies && g.upload.buffer_copies[j].buffer == g.upload.buffer_copies[i].buffer)
+      j++;
+    VkBufferCopy* regions = alloca((j - i) * sizeof(VkBufferCopy));
+    for (uint32_t k = i; k < j; k++)
+      regions[k - i] = g.upload.buffer_copies[k].region;
+    vkCmdCopyBuffer(buffer_cmd, staging, g.upload.buffer_copies[i].buffer, j - i, regions);
+    used_transfer_queue |= has_transfer_queue;
+    i = j;
+  }
+  // one copy command per destination image
+  i = 0;
+  while (i < g.upload.num_image_copies) {
+    uint32_t j = i;
+    int discard = !g.upload.image_copies[i].shared;
+    while (j < g.upload.num_image_copies && g.upload.image_copies[j].image == g.upload.image_copies[i].image) {
+      discard &= (g.upload.image_copies[j].old_layout == VK_IMAGE_LAYOUT_UNDEFINED);
+      j++;
+    }
+    // transfer queue can't keep old contents of image without
+    // acquiring it from graphics queue first
+    if (has_transfer_queue && discard && g.upload.transfer_images) {
+      record_image_uploads(batch->transfer_cmd, batch->graphics_cmd, &g.upload.image_copies[i], j - i);
+      used_transfer_queue = 1;
+    } else {
+      record_image_uploads(batch->graphics_cmd, VK_NULL_HANDLE, &g.upload.image_copies[i], j - i);
+    }
+    i = j;
+  }
+  // make copied data visible to everything submitted after
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_MEMORY_READ_BIT|VK_ACCESS_MEMORY_WRITE_BIT,
+  };
+  vkCmdPipelineBarrier(batch->graphics_cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+		       1, &barrier, 0, NULL, 0, NULL);
+  vkEndCommandBuffer(batch->graphics_cmd);
+  if (has_transfer_queue)
+    vkEndCommandBuffer(batch->transfer_cmd);
+  VkResult err;
+  if (used_transfer_queue) {
+    VkSubmitInfo submit_info = {
+      .sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .commandBufferCount   = 1,
+      .pCommandBuffers      = &batch->transfer_cmd,
+      .signalSemaphoreCount = 1,
+      .pSignalSemaphores    = &batch->semaphore,
+    };
+    err = vkQueueSubmit(g.transfer_queue, 1, &submit_info, VK_NULL_HANDLE);
+    if (err != VK_SUCCESS) {
+      LOG_ERROR("failed to submit uploads to transfer queue with error %s", to_string_VkResult(err));
+      return err;
+    }
+  }
+  VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+  VkSubmitInfo submit_info = {
+    .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .waitSemaphoreCount = used_transfer_queue,
+    .pWaitSemaphores    = &batch->semaphore,
+    .pWaitDstStageMask  = &wait_stage,
+    .commandBufferCount = 1,
+    .pCommandBuffers    = &batch->graphics_cmd,
+  };
+  err = submit_to_timeline(&g.timelines[GFX_QUEUE_GRAPHICS], &submit_info, &batch->value);
+  if (err != VK_SUCCESS) {
+    return err;
+  }
+  batch->head = g.upload.head;
+  batch->pending = 1;
+  g.upload.next_batch = (g.upload.next_batch + 1) % LIDA_GFX_MAX_UPLOAD_BATCHES;
+  g.upload.num_buffer_copies = 0;
+  g.upload.num_image_copies = 0;
+  return VK_SUCCESS;
+}
+
+/**
+   Allocate 'size' bytes from staging ring. When ring is full, pending
+   copies are flushed and oldest batches are waited. Return offset in
+   staging buffer or UINT64_MAX.
+ */
+static uint64_t
+allocate_staging_memory(uint64_t size)
+{
+  // offsets of image copies must be multiple of texel size
+  size = ALIGN_TO(size, 16);
+  if (size > LIDA_GFX_STAGING_SIZE) {
+    LOG_ERROR("upload of %lu bytes doesn't fit to staging memory, increase LIDA_GFX_STAGING_SIZE",
+	      (unsigned long)size);
+    return UINT64_MAX;
+  }
+  for (;;) {
+    uint64_t offset = g.upload.head % LIDA_GFX_STAGING_SIZE;
+    // allocations don't wrap around end of ring
+    uint64_t skip = (offset + size > LIDA_GFX_STAGING_SIZE) ? LIDA_GFX_STAGING_SIZE - offset : 0;
+    if (g.upload.head + skip + size - g.upload.tail <= LIDA_GFX_STAGING_SIZE) {
+      g.upload.head += skip;
+      offset = g.upload.head % LIDA_GFX_STAGING_SIZE;
+      g.upload.head += size;
+      return offset;
+    }
+    if (flush_uploads() != VK_SUCCESS)
+      return UINT64_MAX;
+    // wait for the oldest batch
+    uint64_t tail = g.upload.tail;
+    for (uint32_t i = 0; i < LIDA_GFX_MAX_UPLOAD_BATCHES && tail == g.upload.tail; i++) {
+      Upload_Batch* batch = &g.upload.batches[(g.upload.next_batch + i) % LIDA_GFX_MAX_UPLOAD_BATCHES];
+      if (batch->pending) {
+	wait_timeline(&g.timelines[GFX_QUEUE_GRAPHICS], batch->value, UINT64_MAX);
+	poll_upload_batches(0);
+      }
+    }
+    if (tail == g.upload.tail) {
+      // nothing is in flight, skip to beginning of ring
+      g.upload.head = ALIGN_TO(g.upload.head, LIDA_GFX_STAGING_SIZE);
+      g.upload.tail = g.upload.head;
+    }
+  }
+}
+
 typedef struct {
   VkRenderPass render_pass;
   VkImageView attachments[LIDA_GFX_RENDER_PASS_MAX_ATTACHMENTS];
@@ -3029,6 +6710,7 @@ static void
 destroy_framebuffer(void* obj)
 {
   Framebuffer* f = obj;
+  invalidate_command_lists((uint64_t)f->handle);
   vkDestroyFramebuffer(g.logical_device, f->handle, NULL);
 }
 
@@ -3073,62 +6755,55 @@ create_framebuffer(const Render_Pass* render_pass, const GFX_Texture* attachment
   return ret;
 }
 
-typedef struct {
-  VkFilter filter;
-  VkSamplerAddressMode mode;
-  VkSampler handle;
-} Sampler;
-
-static uint32_t
-hash_sampler(const void* obj)
-{
-  const Sampler* s = obj;
-  return hash_memory(s, offsetof(Sampler, handle));
-}
-
-static int
-eq_sampler(const void* l, const void* r)
+static VkResult
+create_samplers()
 {
-  const Sampler* left = l, *right = r;
-  return memcmp(left, right, offsetof(Sampler, handle)) == 0;
+  for (int is_linear = 0; is_linear < 2; is_linear++)
+    for (uint32_t mode = 0; mode < ARR_SIZE(g.samplers[0]); mode++) {
+      if (mode == VK_SAMPLER_ADDRESS_MODE_MIRROR_CLAMP_TO_EDGE &&
+	  !is_device_extension_enabled(VK_KHR_SAMPLER_MIRROR_CLAMP_TO_EDGE_EXTENSION_NAME))
+	continue;
+      VkFilter filter = (is_linear) ? VK_FILTER_LINEAR : VK_FILTER_NEAREST;
+      VkSamplerCreateInfo sampler_info = {
+	.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+	.magFilter = filter,
+	.minFilter = filter,
+	.mipmapMode = (is_linear) ? VK_SAMPLER_MIPMAP_MODE_LINEAR : VK_SAMPLER_MIPMAP_MODE_NEAREST,
+	.addressModeU = (VkSamplerAddressMode)mode,
+	.addressModeV = (VkSamplerAddressMode)mode,
+	.addressModeW = (VkSamplerAddressMode)mode,
+	.minLod = 0.0f,
+	.maxLod = 1.0f,             // TODO: option to set max lod
+	.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_BLACK,
+      };
+      VkResult err = vkCreateSampler(g.logical_device, &sampler_info, NULL, &g.samplers[is_linear][mode]);
+      if (err != VK_SUCCESS) {
+	LOG_ERROR("failed to create sampler with error %s", to_string_VkResult(err));
+	return err;
+      }
+    }
+  return VK_SUCCESS;
 }
 
 static void
-destroy_sampler(void* obj)
+destroy_samplers()
 {
-  Sampler* s = obj;
-  vkDestroySampler(g.logical_device, s->handle, NULL);
+  for (int is_linear = 0; is_linear < 2; is_linear++)
+    for (uint32_t mode = 0; mode < ARR_SIZE(g.samplers[0]); mode++) {
+      vkDestroySampler(g.logical_device, g.samplers[is_linear][mode], NULL);
+      g.samplers[is_linear][mode] = VK_NULL_HANDLE;
+    }
 }
 
-static Sampler*
-create_sampler(int is_linear, VkSamplerAddressMode mode)
+// Doesn't modify any state, so may be called from any thread.
+static VkSampler
+get_sampler(int is_linear, VkSamplerAddressMode mode)
 {
-  Sampler tmp = {
-    .filter = (is_linear) ? VK_FILTER_LINEAR : VK_FILTER_NEAREST,
-    .mode = mode,
-  };
-  int flag;
-  Sampler* ret = lru_cache_get(&g.sampler_cache, &tmp, &flag);
-  if (flag == 0)
-    return ret;
-  // create a new sampler
-  VkSamplerCreateInfo sampler_info = {
-    .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
-    .magFilter = ret->filter,
-    .minFilter = ret->filter,
-    .mipmapMode = (ret->filter == VK_FILTER_NEAREST) ? VK_SAMPLER_MIPMAP_MODE_NEAREST : VK_SAMPLER_MIPMAP_MODE_LINEAR,
-    .addressModeU = ret->mode,
-    .addressModeV = ret->mode,
-    .addressModeW = ret->mode,
-    .minLod = 0.0f,
-    .maxLod = 1.0f,             // TODO: option to set max lod
-    .borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_BLACK,
-  };
-  VkResult err = vkCreateSampler(g.logical_device, &sampler_info, NULL, &ret->handle);
-  if (err != VK_SUCCESS) {
-    LOG_ERROR("failed to create sampler with error %s", to_string_VkResult(err));
+  VkSampler sampler = g.samplers[is_linear != 0][mode];
+  if (sampler == VK_NULL_HANDLE) {
+    LOG_ERROR("sampler address mode %d is not supported", (int)mode);
   }
-  return ret;
+  return sampler;
 }
 
 
@@ -3141,6 +6816,18 @@ gfx_init(const GFX_Init_Info* info)
   g.load_shader_fn = info->load_shader_fn;
   g.free_shader_fn = info->free_shader_fn;
   g.ds_writes_offset = 0;
+#ifdef LIDA_GFX_HEADLESS
+  g.headless = 1;
+#else
+  g.headless = info->headless;
+#endif
+  g.has_compute_window = 0;
+  g.frames_in_flight = (info->frames_in_flight == 0) ? 2 : info->frames_in_flight;
+  if (g.frames_in_flight < 2 || g.frames_in_flight > LIDA_GFX_MAX_FRAMES_IN_FLIGHT) {
+    LOG_WARN("info->frames_in_flight=%u is out of range [2, %d], clamping",
+	     info->frames_in_flight, LIDA_GFX_MAX_FRAMES_IN_FLIGHT);
+    g.frames_in_flight = (g.frames_in_flight < 2) ? 2 : LIDA_GFX_MAX_FRAMES_IN_FLIGHT;
+  }
 
   g.memright = ARR_SIZE(g.membuf);
 
@@ -3260,28 +6947,80 @@ gfx_init(const GFX_Init_Info* info)
   vkGetPhysicalDeviceQueueFamilyProperties(g.physical_device,
 					   &g.num_queue_families,
 					   g.queue_families);
-  for (uint32_t i = 0; i < count; i++) {
-    if (g.queue_families[0].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+  g.graphics_queue_family = UINT32_MAX;
+  for (uint32_t i = 0; i < g.num_queue_families; i++) {
+    if (g.queue_families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
       g.graphics_queue_family = i;
       break;
     }
   }
+  if (g.graphics_queue_family == UINT32_MAX) {
+    LOG_ERROR("device has no graphics queue");
+    err = VK_ERROR_INITIALIZATION_FAILED;
+    goto end;
+  }
+  // async compute work runs alongside graphics work
+  g.compute_queue_family = UINT32_MAX;
+  for (uint32_t i = 0; i < g.num_queue_families; i++) {
+    VkQueueFlags flags = g.queue_families[i].queueFlags;
+    if ((flags & VK_QUEUE_COMPUTE_BIT) && (flags & VK_QUEUE_GRAPHICS_BIT) == 0) {
+      g.compute_queue_family = i;
+      break;
+    }
+  }
+  // copies on transfer only queue run alongside graphics work
+  g.transfer_queue_family = UINT32_MAX;
+  for (uint32_t i = 0; i < g.num_queue_families && info->disable_transfer_queue == 0; i++) {
+    VkQueueFlags flags = g.queue_families[i].queueFlags;
+    if ((flags & VK_QUEUE_TRANSFER_BIT) && (flags & (VK_QUEUE_GRAPHICS_BIT|VK_QUEUE_COMPUTE_BIT)) == 0) {
+      VkExtent3D granularity = g.queue_families[i].minImageTransferGranularity;
+      g.transfer_queue_family = i;
+      g.upload.transfer_images = (granularity.width == 1 && granularity.height == 1 && granularity.depth == 1);
+      break;
+    }
+  }
 
   // stage 5: create logical device
   float queue_priorities[] = { 1.0f };
-  VkDeviceQueueCreateInfo queueInfo = {
-    .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-    .queueFamilyIndex = g.graphics_queue_family,
-    .queueCount       = 1,
-    .pQueuePriorities = queue_priorities,
-  };
+  // one queue from each family we use, families are distinct
+  uint32_t queue_families[NUM_QUEUES];
+  uint32_t num_queue_infos = get_sharing_queue_families(queue_families, 1);
+  VkDeviceQueueCreateInfo queue_infos[NUM_QUEUES];
+  for (uint32_t i = 0; i < num_queue_infos; i++) {
+    queue_infos[i] = (VkDeviceQueueCreateInfo) {
+      .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+      .queueFamilyIndex = queue_families[i],
+      .queueCount       = 1,
+      .pQueuePriorities = queue_priorities,
+    };
+  }
 
   get_device_extensions(info);
+  g.has_update_templates = is_device_extension_enabled(VK_KHR_DESCRIPTOR_UPDATE_TEMPLATE_EXTENSION_NAME);
+  g.has_push_descriptors = is_device_extension_enabled(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+  g.has_memory_budget = is_device_extension_enabled(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+  g.has_dedicated_allocation = is_device_extension_enabled(VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME) &&
+    is_device_extension_enabled(VK_KHR_DEDICATED_ALLOCATION_EXTENSION_NAME);
+  VkPhysicalDeviceDescriptorIndexingFeaturesEXT indexing_features = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT,
+  };
+  g.bindless.enabled = (info->enable_bindless) ? get_bindless_features(&indexing_features) : 0;
+  VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timeline_features = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR,
+    .pNext = (g.bindless.enabled) ? &indexing_features : NULL,
+  };
+  g.has_timeline_semaphores = get_timeline_features(&timeline_features);
+  g.has_calibrated_timestamps = 0;
+#ifdef LIDA_GFX_TRACE
+  if (is_device_extension_enabled(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME))
+    g.has_calibrated_timestamps = has_host_time_domain();
+#endif
 
   VkDeviceCreateInfo device_info = {
     .sType                   = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-    .queueCreateInfoCount    = 1,
-    .pQueueCreateInfos       = &queueInfo,
+    .pNext                   = (g.has_timeline_semaphores) ? (void*)&timeline_features : timeline_features.pNext,
+    .queueCreateInfoCount    = num_queue_infos,
+    .pQueueCreateInfos       = queue_infos,
     .ppEnabledExtensionNames = g.enabled_device_extensions,
     .enabledExtensionCount   = g.num_enabled_device_extensions,
     .pEnabledFeatures        = &g.device_features,
@@ -3291,8 +7030,21 @@ gfx_init(const GFX_Init_Info* info)
     LOG_ERROR("failed to create Vulkan device with error %s", to_string_VkResult(err));
     goto end;
   }
-  // get graphics queue
+  // get queues
   vkGetDeviceQueue(g.logical_device, g.graphics_queue_family, 0, &g.graphics_queue);
+  if (g.compute_queue_family != UINT32_MAX)
+    vkGetDeviceQueue(g.logical_device, g.compute_queue_family, 0, &g.compute_queue);
+  if (g.transfer_queue_family != UINT32_MAX)
+    vkGetDeviceQueue(g.logical_device, g.transfer_queue_family, 0, &g.transfer_queue);
+  // every submission is tracked by timeline of its queue
+  err = create_timeline(&g.timelines[GFX_QUEUE_GRAPHICS], g.graphics_queue);
+  if (err == VK_SUCCESS && g.compute_queue_family != UINT32_MAX)
+    err = create_timeline(&g.timelines[GFX_QUEUE_COMPUTE], g.compute_queue);
+  if (err == VK_SUCCESS && g.transfer_queue_family != UINT32_MAX)
+    err = create_timeline(&g.timelines[GFX_QUEUE_TRANSFER], g.transfer_queue);
+  if (err != VK_SUCCESS) {
+    goto end;
+  }
 
   // stage 6: create command pool
   VkCommandPoolCreateInfo command_pool_info = {
@@ -3316,8 +7068,8 @@ gfx_init(const GFX_Init_Info* info)
     // { VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER, 0 },
     { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 32 },
     { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 32 },
-    // { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 0 },
-    // { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 0 },
+    { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 16 },
+    { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC, 16 },
     // { VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT, 16 },
   };
   VkDescriptorPoolCreateInfo pool_info = {
@@ -3335,6 +7087,32 @@ gfx_init(const GFX_Init_Info* info)
   if (err != VK_SUCCESS) {
     LOG_WARN("failed to create descriptor pool with error %s", to_string_VkResult(err));
   }
+  err = create_ds_pool(LIDA_GFX_DS_CACHE_POOL_SIZE, VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT, &g.ds_cache_pool);
+  if (err != VK_SUCCESS) {
+    LOG_WARN("failed to create descriptor pool with error %s", to_string_VkResult(err));
+  }
+  if (create_samplers() != VK_SUCCESS) {
+    LOG_WARN("failed to create samplers, sampled textures won't work");
+  }
+  if (g.bindless.enabled && create_bindless_set() != VK_SUCCESS) {
+    LOG_WARN("bindless mode is disabled");
+    g.bindless.enabled = 0;
+  }
+  g.num_retired_sets = 0;
+  g.ds_cache_hits = 0;
+  g.ds_cache_misses = 0;
+  g.frame_counter = 0;
+  init_memory_allocator();
+  if (create_frame_data() != 0) {
+    LOG_WARN("failed to create frame data buffer, 'gfx_allocate_frame_data()' will fail");
+  }
+  g.gpu_zones.enabled = 0;
+  if (info->enable_gpu_zones && create_gpu_zones() != 0) {
+    destroy_gpu_zones();
+  }
+  if (create_upload_manager() != 0) {
+    LOG_WARN("failed to create staging buffer, 'gfx_upload_*()' will fail");
+  }
 
   // initialize caches.
   // Magic numbers in here need tweaking.
@@ -3344,7 +7122,7 @@ gfx_init(const GFX_Init_Info* info)
   g.ds_layout_cache = CACHE_CREATE(2048, ds_layout, DS_Layout);
   g.pipeline_layout_cache = CACHE_CREATE(1536, pipeline_layout, Pipeline_Layout);
   g.framebuffer_cache = CACHE_CREATE(1024, framebuffer, Framebuffer);
-  g.sampler_cache = CACHE_CREATE(512, sampler, Sampler);
+  g.ds_cache = CACHE_CREATE(LIDA_GFX_DS_CACHE_SIZE, cached_ds, Cached_DS);
 #undef CACHE_CREATE
 
   return 0;
@@ -3358,16 +7136,42 @@ gfx_init(const GFX_Init_Info* info)
 void
 gfx_free()
 {
-  lru_cache_destroy(&g.sampler_cache);
+  free_retired_resources(1);
+  if (g.has_compute_window) {
+    destroy_window_frames((Window*)&g.compute_window);
+    g.has_compute_window = 0;
+  }
+  lru_cache_destroy(&g.ds_cache);
+  // pool is destroyed anyway
+  g.num_retired_sets = 0;
+  destroy_samplers();
   lru_cache_destroy(&g.framebuffer_cache);
   lru_cache_destroy(&g.pipeline_layout_cache);
   lru_cache_destroy(&g.ds_layout_cache);
   lru_cache_destroy(&g.shader_cache);
   lru_cache_destroy(&g.render_pass_cache);
 
+  destroy_upload_manager();
+  destroy_frame_data();
+  destroy_gpu_zones();
+  destroy_memory_allocator();
   vkDestroyDescriptorPool(g.logical_device, g.static_ds_pool, NULL);
   vkDestroyDescriptorPool(g.logical_device, g.dynamic_ds_pool, NULL);
+  vkDestroyDescriptorPool(g.logical_device, g.ds_cache_pool, NULL);
+  if (g.bindless.enabled)
+    destroy_bindless_set();
   vkDestroyCommandPool(g.logical_device, g.command_pool, NULL);
+  for (uint32_t q = 0; q < NUM_QUEUES; q++) {
+    for (uint32_t i = 0; i < LIDA_GFX_MAX_THREADS; i++) {
+      if (g.thread_command_pools[q][i]) {
+	vkDestroyCommandPool(g.logical_device, g.thread_command_pools[q][i], NULL);
+	g.thread_command_pools[q][i] = VK_NULL_HANDLE;
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < NUM_QUEUES; i++)
+    destroy_timeline(&g.timelines[i]);
 
   vkDestroyDevice(g.logical_device, NULL);
 
@@ -3375,8 +7179,8 @@ gfx_free()
     vkDestroyDebugReportCallbackEXT(g.instance, g.debug_report_callback, NULL);
   vkDestroyInstance(g.instance, NULL);
 
-  g.memptr = 0;
-  g.memright = ARR_SIZE(g.membuf);
+  // forget everything, so library may be initialised again
+  memset(&g, 0, sizeof(g));
 }
 
 int
@@ -3389,6 +7193,31 @@ void
 gfx_wait_idle_gpu()
 {
   vkDeviceWaitIdle(g.logical_device);
+  for (uint32_t i = 0; i < NUM_QUEUES; i++)
+    g.timelines[i].completed = g.timelines[i].submitted;
+  free_retired_descriptor_sets(1);
+  free_retired_bindless_indices(1);
+  free_retired_resources(1);
+  poll_upload_batches(1);
+}
+
+uint64_t
+gfx_get_submitted_value(GFX_Queue queue)
+{
+  return get_timeline(queue)->submitted;
+}
+
+uint64_t
+gfx_get_completed_value(GFX_Queue queue)
+{
+  return poll_timeline(get_timeline(queue));
+}
+
+int
+gfx_wait_for_value(GFX_Queue queue, uint64_t value, uint64_t timeout)
+{
+  VkResult err = wait_timeline(get_timeline(queue), value, timeout);
+  return (err == VK_TIMEOUT) ? 1 : err;
 }
 
 int
@@ -3434,8 +7263,11 @@ gfx_create_graphics_pipelines(GFX_Pipeline* pipelines, uint32_t count, const GFX
       };
     }
     // create pipeline layout
-    Pipeline_Layout* layout = create_pipeline_layout(reflects, (descs[i].fragment_shader) ? 2 : 1);
+    Pipeline_Layout* layout = create_pipeline_layout(reflects, (descs[i].fragment_shader) ? 2 : 1,
+						     descs[i].push_descriptors, descs[i].dynamic_buffer_sets);
+    if (!layout) return -1;
     ((Pipeline*)&pipelines[i])->layout = layout->handle;
+    init_push_set((Pipeline*)&pipelines[i], layout, descs[i].push_descriptors);
     // pipeline setup
     vertex_input_states[i] = (VkPipelineVertexInputStateCreateInfo) {
       .sType                           = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
@@ -3530,8 +7362,10 @@ gfx_create_graphics_pipelines(GFX_Pipeline* pipelines, uint32_t count, const GFX
       .subpass             = 0
     };
   }
+  TRACE_BEGIN("vkCreateGraphicsPipelines");
   VkResult err = vkCreateGraphicsPipelines(g.logical_device, VK_NULL_HANDLE, // TODO: pipeline caches
 					   count, create_infos, VK_NULL_HANDLE, handles);
+  TRACE_END();
   if (err != VK_SUCCESS) {
     LOG_ERROR("failed to create some of pipelines with error %s", to_string_VkResult(err));
     return -1;
@@ -3555,8 +7389,10 @@ gfx_create_compute_pipelines(GFX_Pipeline* pipelines, uint32_t count, const char
     if (!shader) return -1;
     const Shader_Reflect* reflect = &shader->reflect;
     modules[i] = shader->module;
-    Pipeline_Layout* layout = create_pipeline_layout(&reflect, 1);
+    Pipeline_Layout* layout = create_pipeline_layout(&reflect, 1, 0, 0);
+    if (!layout) return -1;
     ((Pipeline*)&pipelines[i])->layout = layout->handle;
+    init_push_set((Pipeline*)&pipelines[i], layout, 0);
     create_infos[i] = (VkComputePipelineCreateInfo) {
       .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
       .stage = (VkPipelineShaderStageCreateInfo) {
@@ -3568,8 +7404,10 @@ gfx_create_compute_pipelines(GFX_Pipeline* pipelines, uint32_t count, const char
       .layout = layout->handle
     };
   }
+  TRACE_BEGIN("vkCreateComputePipelines");
   VkResult err = vkCreateComputePipelines(g.logical_device, VK_NULL_HANDLE, // TODO: pipeline caches
 					  count, create_infos, VK_NULL_HANDLE, handles);
+  TRACE_END();
   if (err != VK_SUCCESS) {
     LOG_ERROR("failed to create some of pipelines with error %s", to_string_VkResult(err));
     return -1;
@@ -3586,6 +7424,7 @@ void
 gfx_destroy_pipeline(GFX_Pipeline* pip)
 {
   Pipeline* pipeline = (Pipeline*)pip;
+  invalidate_command_lists((uint64_t)pipeline->handle);
   vkDestroyPipeline(g.logical_device, pipeline->handle, NULL);
 }
 
@@ -3595,6 +7434,10 @@ gfx_create_window_sdl(GFX_Window* win, SDL_Window* handle, int vsync)
 {
   if (!gfx_is_initialised())
     return -1;
+  if (g.headless) {
+    LOG_ERROR("windows can't be created in headless mode");
+    return -1;
+  }
   Window* window = (Window*)win;
 
   // step 1: create Vulkan surface
@@ -3628,16 +7471,9 @@ gfx_destroy_window(GFX_Window* win)
 {
   Window* window = (Window*)win;
 
-  for (int i = 0; i < 2; i++) {
-    vkDestroySemaphore(g.logical_device, window->frames[i].image_available, NULL);
-  }
-  vkDestroyFence(g.logical_device, window->resources_available_fence, NULL);
-  vkDestroySemaphore(g.logical_device, window->render_finished_semaphore, NULL);
+  destroy_window_frames(window);
 
-  for (uint32_t i = 0; i < window->num_images; i++) {
-    vkDestroyFramebuffer(g.logical_device, window->images[i].framebuffer, NULL);
-    vkDestroyImageView(g.logical_device, window->images[i].image_view, NULL);
-  }
+  destroy_window_images(window);
   vkDestroySwapchainKHR(g.logical_device, window->swapchain, NULL);
   vkDestroySurfaceKHR(g.instance, window->surface, NULL);
 
@@ -3645,136 +7481,596 @@ gfx_destroy_window(GFX_Window* win)
 }
 
 int
-gfx_resize_window(GFX_Window* win, uint32_t* width, uint32_t* height)
+gfx_resize_window(GFX_Window* win, uint32_t* width, uint32_t* height)
+{
+  Window* window = (Window*)win;
+
+  VkSurfaceCapabilitiesKHR surface_capabilities;
+  VkResult err = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(g.physical_device, window->surface,
+							   &surface_capabilities);
+  if (err != VK_SUCCESS) {
+    LOG_WARN("failed to update surface capabilities");
+  }
+
+  *width = surface_capabilities.currentExtent.width;
+  *height = surface_capabilities.currentExtent.height;
+  if (window->swapchain_extent.width == *width && window->swapchain_extent.height == *height)
+    return 0;
+
+  // wait before commands end so we can destroy resources in use.
+  gfx_wait_idle_gpu();
+
+  destroy_window_images(window);
+  err = create_swapchain(window);
+  if (err != VK_SUCCESS) {
+    LOG_ERROR("failed to recreate swapchain with error %s", to_string_VkResult(err));
+    return err;
+  }
+  LOG_INFO("resized window %p", window);
+  return 1;
+}
+
+void
+gfx_get_window_size(const GFX_Window* win, uint32_t* width, uint32_t* height)
+{
+  Window* window = (Window*)win;
+  *width = window->swapchain_extent.width;
+  *height = window->swapchain_extent.height;
+}
+
+int
+gfx_begin_commands(GFX_Window* win)
+{
+  Window* window = (Window*)win;
+  Window_Frame* frame = get_current_frame(window);
+  // wait till GPU is done with commands submitted 'num_frames' frames
+  // ago, so we can safely reuse command buffer and GPU resources of
+  // this frame
+  VkResult err = wait_timeline(&g.timelines[GFX_QUEUE_GRAPHICS], frame->value, UINT64_MAX);
+  if (err != VK_SUCCESS) {
+    return err;
+  }
+  // transient descriptor sets of this frame are no longer used by GPU
+  reset_transient_ds_pools(frame);
+  g.current_frame = frame;
+  // partition could be used by other window since then
+  g.frame_data.partition = frame - window->frames;
+  err = wait_timeline(&g.timelines[GFX_QUEUE_GRAPHICS], g.frame_data.values[g.frame_data.partition], UINT64_MAX);
+  if (err != VK_SUCCESS) {
+    return err;
+  }
+  g.frame_data.begin = g.frame_data.partition * LIDA_GFX_FRAME_DATA_SIZE;
+  g.frame_data.offset = g.frame_data.begin;
+  free_retired_descriptor_sets(0);
+  free_retired_bindless_indices(0);
+  free_retired_resources(0);
+  poll_upload_batches(0);
+  err = begin_command_list(&window->main_list, frame - window->frames,
+			   VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, NULL);
+  if (err != VK_SUCCESS) {
+    return err;
+  }
+  begin_gpu_zone_frame(&window->main_list);
+  window->num_frame_lists = 0;
+  window->num_wait_semaphores = 0;
+  window->num_signal_semaphores = 0;
+  g.current_list = (GFX_Command_List*)&window->main_list;
+  return 0;
+}
+
+int
+gfx_swap_buffers(GFX_Window* win)
+{
+  Window* window = (Window*)win;
+  Window_Frame* frame = get_current_frame(window);
+  VkResult err = vkAcquireNextImageKHR(g.logical_device,
+				       window->swapchain,
+				       UINT64_MAX,
+				       frame->image_available,
+				       VK_NULL_HANDLE,
+				       &window->current_image);
+  switch (err)
+    {
+    case VK_SUCCESS:
+      break;
+    case VK_SUBOPTIMAL_KHR:
+      LOG_WARN("acquire next image: got VK_SUBOPTIMAL_KHR");
+      return 1;
+    default:
+      LOG_ERROR("failed to acquire next swapchain image with error %s", to_string_VkResult(err));
+      return err;
+    }
+  return 0;
+}
+
+// Number of cache lookups that created Vulkan objects so far.
+static uint32_t
+count_cache_misses()
+{
+  return g.render_pass_cache.num_misses + g.shader_cache.num_misses +
+    g.ds_layout_cache.num_misses + g.pipeline_layout_cache.num_misses +
+    g.framebuffer_cache.num_misses + g.ds_cache.num_misses;
+}
+
+/**
+   Submit commands of current frame of window. Frames of windows
+   without swapchain(see 'gfx_begin_compute()') don't wait for
+   swapchain image and are not presented.
+ */
+static VkResult
+submit_window_frame(Window* window, int present)
+{
+  Window_Frame* frame = get_current_frame(window);
+  if (g.gpu_zones.list == &window->main_list) {
+    // zones left open are closed, otherwise their results would never
+    // be available
+    end_gpu_zones_from(&window->main_list, 0);
+#ifdef LIDA_GFX_TRACE
+    g.gpu_zones.recording->submit_time = get_host_time();
+#endif
+    g.gpu_zones.list = NULL;
+  }
+  vkEndCommandBuffer(window->main_list.cmd);
+  // uploads recorded during this frame are visible to its commands
+  VkResult err = flush_uploads();
+  if (err != VK_SUCCESS) {
+    return err;
+  }
+  // main command list goes after all lists submitted with 'gfx_submit_command_lists()'
+  window->frame_lists[window->num_frame_lists] = window->main_list.cmd;
+  // submit commands; we don't wait for anything here, timeline value
+  // of this frame is waited in 'gfx_begin_commands()' when the frame
+  // is reused
+  window->wait_semaphores[0] = frame->image_available;
+  window->wait_stages[0] = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  window->signal_semaphores[0] = frame->render_finished;
+  // first slots are skipped if there's no swapchain
+  uint32_t first = (present) ? 0 : 1;
+  VkSubmitInfo submit_info = {
+    .sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .waitSemaphoreCount   = window->num_wait_semaphores + 1 - first,
+    .pWaitSemaphores      = window->wait_semaphores + first,
+    .pWaitDstStageMask    = window->wait_stages + first,
+    .commandBufferCount   = window->num_frame_lists + 1,
+    .pCommandBuffers      = window->frame_lists,
+    .signalSemaphoreCount = window->num_signal_semaphores + 1 - first,
+    .pSignalSemaphores    = window->signal_semaphores + first,
+  };
+  err = submit_to_timeline(&g.timelines[GFX_QUEUE_GRAPHICS], &submit_info, &frame->value);
+  if (err != VK_SUCCESS) {
+    return err;
+  }
+  g.frame_values[g.frame_counter % MAX_FRAME_VALUES] = frame->value;
+  g.frame_data.values[g.frame_data.partition] = frame->value;
+  if (present) {
+    // present image to screen
+    VkResult present_results[1];
+    VkPresentInfoKHR present_info = {
+      .sType              = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+      .waitSemaphoreCount = 1,
+      .pWaitSemaphores    = &frame->render_finished,
+      .swapchainCount     = 1,
+      .pSwapchains        = &window->swapchain,
+      .pImageIndices      = &window->current_image,
+      .pResults           = present_results,
+    };
+    TRACE_BEGIN("vkQueuePresentKHR");
+    err = vkQueuePresentKHR(g.graphics_queue, &present_info);
+    TRACE_END();
+    if (err != VK_SUCCESS && err != VK_SUBOPTIMAL_KHR) {
+      LOG_ERROR("queue failed to present with error %s", to_string_VkResult(err));
+    }
+  }
+  // frame stats are complete, start counting the next frame
+  add_frame_stats(&g.frame_stats, &window->main_list.stats);
+  uint32_t cache_misses = count_cache_misses();
+  g.frame_stats.num_cache_misses = cache_misses - g.frame_cache_misses;
+  g.frame_cache_misses = cache_misses;
+  g.last_frame_stats = g.frame_stats;
+  memset(&g.frame_stats, 0, sizeof(GFX_Frame_Stats));
+  window->frame_counter++;
+  g.frame_counter++;
+  window->current_image = UINT32_MAX;
+  window->num_frame_lists = 0;
+  window->num_wait_semaphores = 0;
+  window->num_signal_semaphores = 0;
+  g.current_list = NULL;
+  return VK_SUCCESS;
+}
+
+int
+gfx_submit_and_present(GFX_Window* win)
+{
+  return submit_window_frame((Window*)win, 1);
+}
+
+GFX_Command_List*
+gfx_begin_compute()
+{
+  Window* window = (Window*)&g.compute_window;
+  if (g.has_compute_window == 0) {
+    memset(window, 0, sizeof(Window));
+    if (create_window_frames(window) != VK_SUCCESS)
+      return NULL;
+    g.has_compute_window = 1;
+  }
+  if (gfx_begin_commands(&g.compute_window) != 0)
+    return NULL;
+  return g.current_list;
+}
+
+GFX_Fence
+gfx_submit()
+{
+  Window* window = (Window*)&g.compute_window;
+  if (g.current_list != (GFX_Command_List*)&window->main_list) {
+    LOG_ERROR("'gfx_submit()' must be called after 'gfx_begin_compute()'");
+    return 0;
+  }
+  if (submit_window_frame(window, 0) != VK_SUCCESS)
+    return 0;
+  return g.timelines[GFX_QUEUE_GRAPHICS].submitted;
+}
+
+int
+gfx_wait(GFX_Fence fence, uint64_t timeout)
+{
+  return gfx_wait_for_value(GFX_QUEUE_GRAPHICS, fence, timeout);
+}
+
+// Return size of texel in bytes or 0 for formats we don't know.
+static uint32_t
+get_format_size(VkFormat format)
+{
+  if (format >= VK_FORMAT_R8_UNORM && format <= VK_FORMAT_R8_SRGB)
+    return 1;
+  if (format >= VK_FORMAT_R8G8_UNORM && format <= VK_FORMAT_R8G8_SRGB)
+    return 2;
+  if (format >= VK_FORMAT_R8G8B8_UNORM && format <= VK_FORMAT_R8G8B8_SRGB)
+    return 3;
+  if (format >= VK_FORMAT_R8G8B8A8_UNORM && format <= VK_FORMAT_B8G8R8A8_SRGB)
+    return 4;
+  if (format >= VK_FORMAT_R16_UNORM && format <= VK_FORMAT_R16_SFLOAT)
+    return 2;
+  if (format >= VK_FORMAT_R16G16_UNORM && format <= VK_FORMAT_R16G16_SFLOAT)
+    return 4;
+  if (format >= VK_FORMAT_R16G16B16_UNORM && format <= VK_FORMAT_R16G16B16_SFLOAT)
+    return 6;
+  if (format >= VK_FORMAT_R16G16B16A16_UNORM && format <= VK_FORMAT_R16G16B16A16_SFLOAT)
+    return 8;
+  if (format >= VK_FORMAT_R32_UINT && format <= VK_FORMAT_R32_SFLOAT)
+    return 4;
+  if (format >= VK_FORMAT_R32G32_UINT && format <= VK_FORMAT_R32G32_SFLOAT)
+    return 8;
+  if (format >= VK_FORMAT_R32G32B32_UINT && format <= VK_FORMAT_R32G32B32_SFLOAT)
+    return 12;
+  if (format >= VK_FORMAT_R32G32B32A32_UINT && format <= VK_FORMAT_R32G32B32A32_SFLOAT)
+    return 16;
+  return 0;
+}
+
+typedef struct {
+  // frames are cycled like frames of a window without swapchain,
+  // i-th frame renders to i-th image of window
+  Window           window;
+  GFX_Image        images[LIDA_GFX_MAX_FRAMES_IN_FLIGHT];
+  GFX_Memory_Block image_memory;
+  // i-th frame copies its image to i-th buffer
+  GFX_Buffer       readback_buffers[LIDA_GFX_MAX_FRAMES_IN_FLIGHT];
+  GFX_Memory_Block readback_memory;
+  // graphics timeline value after which readback of i-th frame is
+  // ready, 0 if there's no readback pending
+  uint64_t         readback_values[LIDA_GFX_MAX_FRAMES_IN_FLIGHT];
+  uint64_t         readback_frames[LIDA_GFX_MAX_FRAMES_IN_FLIGHT];
+  uint32_t         row_pitch;
+} Offscreen_Target;
+_Static_assert(sizeof(Offscreen_Target) <= sizeof(GFX_Offscreen_Target), "Internal error: adjust sizeof for GFX_Offscreen_Target");
+
+// Works with partially created target too, parts that weren't created
+// are zero.
+static void
+destroy_offscreen_target(Offscreen_Target* target)
+{
+  Window* window = &target->window;
+  // GPU might still render to images or copy to buffers
+  for (uint32_t i = 0; i < window->num_frames; i++) {
+    wait_timeline(&g.timelines[GFX_QUEUE_GRAPHICS], window->frames[i].value, UINT64_MAX);
+  }
+  destroy_window_frames(window);
+  destroy_window_images(window);
+  for (uint32_t i = 0; i < window->num_images; i++) {
+    if (((Image*)&target->images[i])->handle)
+      destroy_image((Image*)&target->images[i]);
+    if (((Buffer*)&target->readback_buffers[i])->handle)
+      destroy_buffer((Buffer*)&target->readback_buffers[i]);
+  }
+  free_memory_block((Memory_Block*)&target->image_memory);
+  free_memory_block((Memory_Block*)&target->readback_memory);
+  window->num_images = 0;
+  window->num_frames = 0;
+}
+
+int
+gfx_create_offscreen_target(GFX_Offscreen_Target* offscreen_target, uint32_t width, uint32_t height, GFX_Format format)
+{
+  Offscreen_Target* target = (Offscreen_Target*)offscreen_target;
+  Window* window = &target->window;
+  memset(target, 0, sizeof(Offscreen_Target));
+  uint32_t texel_size = get_format_size((VkFormat)format);
+  if (texel_size == 0) {
+    LOG_ERROR("format %d can't be read back", format);
+    return -1;
+  }
+  target->row_pitch = width * texel_size;
+  window->swapchain_extent = (VkExtent2D) { width, height };
+  window->format.format = (VkFormat)format;
+  // image is transitioned for copy explicitly in 'gfx_submit_offscreen_frame()'
+  GFX_Attachment_Info attachment = {
+    .format = format,
+    .load_op = GFX_ATTACHMENT_OP_NONE,
+    .store_op = GFX_ATTACHMENT_OP_STORE,
+    .initial_layout = GFX_IMAGE_LAYOUT_UNDEFINED,
+    .final_layout = GFX_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+    .work_layout = GFX_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+  };
+  // render pass is owned by cache, it's not destroyed with target
+  window->render_pass = create_render_pass(&attachment, 1);
+  if (window->render_pass == NULL) {
+    return -1;
+  }
+  if (create_window_frames(window) != VK_SUCCESS) {
+    goto error;
+  }
+  // every frame gets its own image and readback buffer, so frames
+  // don't wait for each other
+  window->num_images = window->num_frames;
+  for (uint32_t i = 0; i < window->num_images; i++) {
+    if (create_image((Image*)&target->images[i],
+		     GFX_IMAGE_USAGE_COLOR_ATTACHMENT|GFX_IMAGE_USAGE_TRANSFER_SRC,
+		     (VkExtent3D) { width, height, 1 }, format, 1, 1) != VK_SUCCESS) {
+      goto error;
+    }
+    if (create_buffer((Buffer*)&target->readback_buffers[i], GFX_BUFFER_USAGE_TRANSFER_DST,
+		      target->row_pitch * height) != VK_SUCCESS) {
+      goto error;
+    }
+    window->images[i].image = ((Image*)&target->images[i])->handle;
+  }
+  if (gfx_allocate_image_memory(&target->image_memory, target->images, window->num_images,
+				GFX_MEMORY_USAGE_GPU_ONLY) != 0 ||
+      gfx_allocate_buffer_memory(&target->readback_memory, target->readback_buffers, window->num_images,
+				 GFX_MEMORY_USAGE_READBACK) != 0) {
+    LOG_ERROR("failed to allocate memory for offscreen target");
+    goto error;
+  }
+  if (create_window_images(window) != VK_SUCCESS) {
+    goto error;
+  }
+  LOG_INFO("created offscreen target %ux%u with %u frames", width, height, window->num_frames);
+  return 0;
+
+ error:
+  destroy_offscreen_target(target);
+  return -1;
+}
+
+void
+gfx_destroy_offscreen_target(GFX_Offscreen_Target* offscreen_target)
+{
+  destroy_offscreen_target((Offscreen_Target*)offscreen_target);
+}
+
+GFX_Command_List*
+gfx_begin_offscreen_frame(GFX_Offscreen_Target* offscreen_target)
+{
+  Offscreen_Target* target = (Offscreen_Target*)offscreen_target;
+  Window* window = &target->window;
+  if (gfx_begin_commands((GFX_Window*)window) != 0)
+    return NULL;
+  // readback that this frame made last time is complete now, it's
+  // overwritten only when this frame is submitted
+  window->current_image = window->frame_counter % window->num_frames;
+  return g.current_list;
+}
+
+GFX_Render_Pass*
+gfx_get_offscreen_pass(GFX_Offscreen_Target* offscreen_target)
+{
+  Offscreen_Target* target = (Offscreen_Target*)offscreen_target;
+  return (GFX_Render_Pass*)target->window.render_pass;
+}
+
+void
+gfx_cmd_begin_offscreen_pass(GFX_Command_List* command_list, GFX_Offscreen_Target* offscreen_target, int secondary_contents)
+{
+  Offscreen_Target* target = (Offscreen_Target*)offscreen_target;
+  gfx_cmd_begin_main_pass(command_list, (GFX_Window*)&target->window, secondary_contents);
+}
+
+void
+gfx_begin_offscreen_pass(GFX_Offscreen_Target* offscreen_target)
+{
+  Offscreen_Target* target = (Offscreen_Target*)offscreen_target;
+  gfx_cmd_begin_offscreen_pass((GFX_Command_List*)&target->window.main_list, offscreen_target, 0);
+}
+
+GFX_Fence
+gfx_submit_offscreen_frame(GFX_Offscreen_Target* offscreen_target, int readback)
+{
+  Offscreen_Target* target = (Offscreen_Target*)offscreen_target;
+  Window* window = &target->window;
+  if (g.current_list != (GFX_Command_List*)&window->main_list) {
+    LOG_ERROR("'gfx_submit_offscreen_frame()' must be called after 'gfx_begin_offscreen_frame()'");
+    return 0;
+  }
+  uint32_t index = window->current_image;
+  if (readback) {
+    Command_List* list = &window->main_list;
+    VkImageMemoryBarrier image_barrier = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+      .oldLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+      .newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+      .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+      .image = window->images[index].image,
+      .subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 },
+    };
+    vkCmdPipelineBarrier(list->cmd, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+			 0, NULL, 0, NULL, 1, &image_barrier);
+    gfx_cmd_copy_image_to_buffer((GFX_Command_List*)list, &target->images[index], &target->readback_buffers[index],
+				 0, 0, 0, window->swapchain_extent.width, window->swapchain_extent.height, 1);
+    // make copied pixels visible to CPU
+    VkMemoryBarrier memory_barrier = {
+      .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+    };
+    vkCmdPipelineBarrier(list->cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+			 1, &memory_barrier, 0, NULL, 0, NULL);
+    list->stats.num_barriers += 2;
+  }
+  uint64_t frame = window->frame_counter;
+  if (submit_window_frame(window, 0) != VK_SUCCESS)
+    return 0;
+  uint64_t value = g.timelines[GFX_QUEUE_GRAPHICS].submitted;
+  if (readback) {
+    // readback of this frame that wasn't polled is dropped
+    target->readback_values[index] = value;
+    target->readback_frames[index] = frame;
+  }
+  return value;
+}
+
+int
+gfx_poll_readback(GFX_Offscreen_Target* offscreen_target, GFX_Readback* readback, int wait)
 {
-  Window* window = (Window*)win;
-
-  VkSurfaceCapabilitiesKHR surface_capabilities;
-  VkResult err = vkGetPhysicalDeviceSurfaceCapabilitiesKHR(g.physical_device, window->surface,
-							   &surface_capabilities);
-  if (err != VK_SUCCESS) {
-    LOG_WARN("failed to update surface capabilities");
+  Offscreen_Target* target = (Offscreen_Target*)offscreen_target;
+  Window* window = &target->window;
+  // readbacks are returned in order they were submitted
+  uint32_t oldest = UINT32_MAX;
+  for (uint32_t i = 0; i < window->num_frames; i++) {
+    if (target->readback_values[i] == 0)
+      continue;
+    if (oldest == UINT32_MAX || target->readback_frames[i] < target->readback_frames[oldest])
+      oldest = i;
   }
-
-  *width = surface_capabilities.currentExtent.width;
-  *height = surface_capabilities.currentExtent.height;
-  if (window->swapchain_extent.width == *width && window->swapchain_extent.height == *height)
+  if (oldest == UINT32_MAX)
+    return 0;
+  Timeline* timeline = &g.timelines[GFX_QUEUE_GRAPHICS];
+  if (wait) {
+    if (wait_timeline(timeline, target->readback_values[oldest], UINT64_MAX) != VK_SUCCESS)
+      return 0;
+  } else if (poll_timeline(timeline) < target->readback_values[oldest]) {
     return 0;
-
-  // wait before commands end so we can destroy resources in use.
-  gfx_wait_idle_gpu();
-
-  for (uint32_t i = 0; i < window->num_images; i++) {
-    vkDestroyFramebuffer(g.logical_device, window->images[i].framebuffer, NULL);
-    vkDestroyImageView(g.logical_device, window->images[i].image_view, NULL);
-  }
-  err = create_swapchain(window);
-  if (err != VK_SUCCESS) {
-    LOG_ERROR("failed to recreate swapchain with error %s", to_string_VkResult(err));
-    return err;
   }
-  LOG_INFO("resized window %p", window);
+  readback->data = ((Buffer*)&target->readback_buffers[oldest])->mapped;
+  readback->width = window->swapchain_extent.width;
+  readback->height = window->swapchain_extent.height;
+  readback->row_pitch = target->row_pitch;
+  readback->frame = target->readback_frames[oldest];
+  target->readback_values[oldest] = 0;
   return 1;
 }
 
 void
-gfx_get_window_size(const GFX_Window* win, uint32_t* width, uint32_t* height)
+gfx_cmd_gpu_zone_begin(GFX_Command_List* command_list, const char* name)
 {
-  Window* window = (Window*)win;
-  *width = window->swapchain_extent.width;
-  *height = window->swapchain_extent.height;
+  Command_List* list = (Command_List*)command_list;
+  if (begin_gpu_zone(list, name) < 0 && g.gpu_zones.list == list) {
+    // frame is full, matching 'gfx_cmd_gpu_zone_end()' is ignored too
+    g.gpu_zones.skipped++;
+  }
 }
 
 void
-gfx_begin_commands(GFX_Window* win)
+gfx_cmd_gpu_zone_end(GFX_Command_List* command_list)
 {
-  Window* window = (Window*)win;
-  Window_Frame* frame = &window->frames[window->frame_counter & 1];
-  VkCommandBufferBeginInfo begin_info = { .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO };
-  vkBeginCommandBuffer(frame->cmd, &begin_info);
-  g.current_cmd = frame->cmd;
+  end_gpu_zone((Command_List*)command_list);
 }
 
-int
-gfx_swap_buffers(GFX_Window* win)
+void
+gfx_gpu_zone_begin(const char* name)
 {
-  Window* window = (Window*)win;
-  Window_Frame* frame = &window->frames[window->frame_counter & 1];
-  VkResult err = vkAcquireNextImageKHR(g.logical_device,
-				       window->swapchain,
-				       UINT64_MAX,
-				       frame->image_available,
-				       VK_NULL_HANDLE,
-				       &window->current_image);
-  switch (err)
-    {
-    case VK_SUCCESS:
-      break;
-    case VK_SUBOPTIMAL_KHR:
-      LOG_WARN("acquire next image: got VK_SUBOPTIMAL_KHR");
-      return 1;
-    default:
-      LOG_ERROR("failed to acquire next swapchain image with error %s", to_string_VkResult(err));
-      return err;
-    }
-  return 0;
+  gfx_cmd_gpu_zone_begin(g.current_list, name);
 }
 
-int
-gfx_submit_and_present(GFX_Window* win)
+void
+gfx_gpu_zone_end()
 {
-  Window* window = (Window*)win;
-  Window_Frame* frame = &window->frames[window->frame_counter % 2];
-  vkEndCommandBuffer(frame->cmd);
-  VkResult err;
-  // wait till commands from previous frame are done, so we can safely use GPU resources
-  err = vkWaitForFences(g.logical_device, 1, &window->resources_available_fence,
-			VK_TRUE, UINT64_MAX);
-  if (err != VK_SUCCESS) {
-    LOG_ERROR("failed to wait for fence with error %s", to_string_VkResult(err));
-    return err;
-  }
-  err = vkResetFences(g.logical_device, 1, &window->resources_available_fence);
-  if (err != VK_SUCCESS) {
-    LOG_ERROR("failed to reset fence before presenting image with error %s", to_string_VkResult(err));
-    return err;
-  }
-  // submit commands
-  VkPipelineStageFlags wait_stages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
-  VkSubmitInfo submit_info = {
-    .sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-    .waitSemaphoreCount   = 1,
-    .pWaitSemaphores      = &frame->image_available,
-    .pWaitDstStageMask    = wait_stages,
-    .commandBufferCount   = 1,
-    .pCommandBuffers      = &frame->cmd,
-    .signalSemaphoreCount = 1,
-    .pSignalSemaphores    = &window->render_finished_semaphore,
-  };
-  err = vkQueueSubmit(g.graphics_queue, 1, &submit_info, window->resources_available_fence);
-  if (err != VK_SUCCESS) {
-    LOG_ERROR("failed to submit commands to graphics queue with error %s", to_string_VkResult(err));
-    return err;
+  gfx_cmd_gpu_zone_end(g.current_list);
+}
+
+uint32_t
+gfx_get_gpu_zones(const GFX_GPU_Zone** zones, uint64_t* frame)
+{
+  *zones = g.gpu_zones.resolved;
+  if (frame)
+    *frame = g.gpu_zones.resolved_frame;
+  return g.gpu_zones.num_resolved;
+}
+
+#ifdef LIDA_GFX_TRACE
+// Write 'str' as contents of a JSON string: quotes, backslashes and
+// control characters are escaped. Return 0 if it doesn't fit into
+// 'size' bytes including null terminator.
+static int
+escape_json_string(char* dst, size_t size, const char* str)
+{
+  size_t length = 0;
+  for (; *str; str++) {
+    unsigned char c = (unsigned char)*str;
+    char escaped[7];
+    int n;
+    if (c == '"' || c == '\\') {
+      n = snprintf(escaped, sizeof(escaped), "\\%c", c);
+    } else if (c < 0x20) {
+      n = snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+    } else {
+      escaped[0] = (char)c;
+      n = 1;
+    }
+    if (length + n >= size)
+      return 0;
+    memcpy(dst + length, escaped, n);
+    length += n;
   }
-  // present image to screen
-  VkResult present_results[1];
-  VkPresentInfoKHR present_info = {
-    .sType              = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
-    .waitSemaphoreCount = 1,
-    .pWaitSemaphores    = &window->render_finished_semaphore,
-    .swapchainCount     = 1,
-    .pSwapchains        = &window->swapchain,
-    .pImageIndices      = &window->current_image,
-    .pResults           = present_results,
-  };
-  err = vkQueuePresentKHR(g.graphics_queue, &present_info);
-  if (err != VK_SUCCESS && err != VK_SUBOPTIMAL_KHR) {
-    LOG_ERROR("queue failed to present with error %s", to_string_VkResult(err));
+  dst[length] = '\0';
+  return 1;
+}
+
+void
+gfx_write_trace(GFX_Trace_Write_Callback write_fn, void* udata)
+{
+  char buffer[256];
+  char name[128];
+  int length = snprintf(buffer, sizeof(buffer),
+			"{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+			"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"CPU\"}},\n"
+			"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"GPU\"}}",
+			TRACE_TRACK_CPU, TRACE_TRACK_GPU);
+  write_fn(buffer, length, udata);
+  // timestamps are written in microseconds
+  for (; g.trace.tail < g.trace.head; g.trace.tail++) {
+    const Trace_Event* event = &g.trace.events[g.trace.tail % LIDA_GFX_TRACE_EVENTS];
+    // zone names come from user and may contain quotes
+    if (!escape_json_string(name, sizeof(name), event->name)) {
+      LOG_WARN("skipping trace event with too long name");
+      continue;
+    }
+    length = snprintf(buffer, sizeof(buffer),
+		      ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+		      name, event->track, event->begin * 1e-3, event->duration * 1e-3);
+    if (length >= (int)sizeof(buffer)) {
+      LOG_WARN("skipping trace event with too long name");
+      continue;
+    }
+    write_fn(buffer, length, udata);
   }
-  window->frame_counter++;
-  window->current_image = UINT32_MAX;
-  return 0;
+  write_fn("\n]}\n", 4, udata);
 }
+#endif
 
 GFX_Render_Pass*
 gfx_get_main_pass(GFX_Window* win)
@@ -3783,64 +8079,51 @@ gfx_get_main_pass(GFX_Window* win)
   return (GFX_Render_Pass*)window->render_pass;
 }
 
+void
+gfx_cmd_begin_main_pass(GFX_Command_List* command_list, GFX_Window* win, int secondary_contents)
+{
+  Window* window = (Window*)win;
+  int32_t zone = begin_gpu_zone((Command_List*)command_list, "main pass");
+  if (zone >= 0)
+    g.gpu_zones.pass_zone = zone;
+  begin_render_pass((Command_List*)command_list,
+		    window->render_pass->render_pass,
+		    window->images[window->current_image].framebuffer,
+		    window->swapchain_extent,
+		    NULL, 0, secondary_contents);
+}
+
 void
 gfx_begin_main_pass(GFX_Window* win)
 {
   Window* window = (Window*)win;
-  Window_Frame* frame = &window->frames[window->frame_counter % 2];
-  VkRect2D render_area = { .offset = {0, 0},
-			   .extent = window->swapchain_extent };
-  VkRenderPassBeginInfo begin_info = {
-    .sType           = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-    .renderPass      = window->render_pass->render_pass,
-    .framebuffer     = window->images[window->current_image].framebuffer,
-    .renderArea      = render_area,
-    .clearValueCount = 0,
-  };
-  vkCmdBeginRenderPass(frame->cmd, &begin_info, VK_SUBPASS_CONTENTS_INLINE);
-  VkViewport viewport = {
-    .x        = 0.0f,
-    .y        = 0.0f,
-    .width    = (float)render_area.extent.width,
-    .height   = (float)render_area.extent.height,
-    .minDepth = 0.0f,
-    .maxDepth = 1.0f,
-  };
-  vkCmdSetViewport(frame->cmd, 0, 1, &viewport);
-  vkCmdSetScissor(frame->cmd, 0, 1, &render_area);
+  gfx_cmd_begin_main_pass((GFX_Command_List*)&window->main_list, win, 0);
 }
 
 void
-gfx_begin_render_pass(GFX_Render_Pass* render_pass, const GFX_Texture* attachments, uint32_t num_attachments, const GFX_Clear_Color* clear_colors)
+gfx_cmd_begin_render_pass(GFX_Command_List* command_list, GFX_Render_Pass* render_pass, const GFX_Texture* attachments, uint32_t num_attachments, const GFX_Clear_Color* clear_colors, int secondary_contents)
 {
+  Command_List* list = (Command_List*)command_list;
+  int32_t zone = begin_gpu_zone(list, "render pass");
+  if (zone >= 0)
+    g.gpu_zones.pass_zone = zone;
   Framebuffer* framebuffer = create_framebuffer((Render_Pass*)render_pass, attachments, num_attachments);
   VkClearValue* clear_values = alloca(num_attachments * sizeof(VkClearValue));
   for (uint32_t i = 0; i < num_attachments; i++) {
     memcpy(&clear_values[i], clear_colors[i], sizeof(float)*4);
+    add_list_reference(list, (uint64_t)framebuffer->attachments[i]);
   }
-  // TODO: option to specify render area
-  VkRect2D render_area = { .offset = {0, 0},
-			   .extent = {framebuffer->width, framebuffer->height} };
-  VkRenderPassBeginInfo begin_info = {
-    .sType           = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
-    .renderPass      = ((Render_Pass*)render_pass)->render_pass,
-    .framebuffer     = framebuffer->handle,
-    .renderArea      = render_area,
-    .clearValueCount = num_attachments,
-    .pClearValues = clear_values,
-  };
-  vkCmdBeginRenderPass(g.current_cmd, &begin_info, VK_SUBPASS_CONTENTS_INLINE);
-  // TODO: option to specify whether to dynamically set viewport/scissor
-  VkViewport viewport = {
-    .x        = 0.0f,
-    .y        = 0.0f,
-    .width    = (float)render_area.extent.width,
-    .height   = (float)render_area.extent.height,
-    .minDepth = 0.0f,
-    .maxDepth = 1.0f,
-  };
-  vkCmdSetViewport(g.current_cmd, 0, 1, &viewport);
-  vkCmdSetScissor(g.current_cmd, 0, 1, &render_area);
+  begin_render_pass(list,
+		    ((Render_Pass*)render_pass)->render_pass,
+		    framebuffer->handle,
+		    (VkExtent2D) { framebuffer->width, framebuffer->height },
+		    clear_values, num_attachments, secondary_contents);
+}
+
+void
+gfx_begin_render_pass(GFX_Render_Pass* render_pass, const GFX_Texture* attachments, uint32_t num_attachments, const GFX_Clear_Color* clear_colors)
+{
+  gfx_cmd_begin_render_pass(g.current_list, render_pass, attachments, num_attachments, clear_colors, 0);
 }
 
 GFX_Render_Pass*
@@ -3849,68 +8132,223 @@ gfx_render_pass(const GFX_Attachment_Info* attachments, uint32_t count)
   return (GFX_Render_Pass*)create_render_pass(attachments, count);
 }
 
+void
+gfx_cmd_end_render_pass(GFX_Command_List* command_list)
+{
+  Command_List* list = (Command_List*)command_list;
+  flush_draw_queue(list);
+  vkCmdEndRenderPass(list->cmd);
+  list->render_pass = VK_NULL_HANDLE;
+  list->framebuffer = VK_NULL_HANDLE;
+  if (g.gpu_zones.list == list && g.gpu_zones.pass_zone >= 0) {
+    end_gpu_zones_from(list, g.gpu_zones.pass_zone);
+    g.gpu_zones.pass_zone = -1;
+  }
+}
+
 void
 gfx_end_render_pass()
 {
-  vkCmdEndRenderPass(g.current_cmd);
+  gfx_cmd_end_render_pass(g.current_list);
 }
 
 void
-gfx_bind_pipeline(GFX_Pipeline* pip)
+gfx_cmd_bind_pipeline(GFX_Command_List* command_list, GFX_Pipeline* pip)
 {
+  Command_List* list = (Command_List*)command_list;
   Pipeline* pipeline = (Pipeline*)pip;
-  vkCmdBindPipeline(g.current_cmd, pipeline->bind_point, pipeline->handle);
-  g.current_pipeline = pip;
+  if (list->queue) {
+    Draw_State* pending = &list->queue->pending;
+    if (pending->pipeline.layout != pipeline->layout) {
+      pending->num_sets = 0;
+      pending->num_dynamic_offsets = 0;
+    }
+    pending->pipeline = *pipeline;
+    list->pipeline = *pipeline;
+    list->queue->current_state = DRAW_STATE_NONE;
+    return;
+  }
+  bind_pipeline(list, pipeline);
+}
+
+void
+gfx_bind_pipeline(GFX_Pipeline* pipeline)
+{
+  gfx_cmd_bind_pipeline(g.current_list, pipeline);
+}
+
+void
+gfx_cmd_bind_descriptor_sets(GFX_Command_List* command_list, const GFX_Descriptor_Set* descriptor_sets, uint32_t ds_count)
+{
+  gfx_cmd_bind_descriptor_sets_with_offsets(command_list, descriptor_sets, ds_count, NULL, 0);
 }
 
 void
 gfx_bind_descriptor_sets(const GFX_Descriptor_Set* descriptor_sets, uint32_t ds_count)
 {
-  Pipeline* pipeline = (Pipeline*)g.current_pipeline;
-  vkCmdBindDescriptorSets(g.current_cmd, pipeline->bind_point,
-			  pipeline->layout, 0,
-			  ds_count, (const VkDescriptorSet*)descriptor_sets,
-			  0, NULL);
+  gfx_cmd_bind_descriptor_sets(g.current_list, descriptor_sets, ds_count);
+}
+
+void
+gfx_cmd_bind_descriptor_sets_with_offsets(GFX_Command_List* command_list, const GFX_Descriptor_Set* descriptor_sets, uint32_t ds_count,
+					  const uint32_t* offsets, uint32_t num_offsets)
+{
+  Command_List* list = (Command_List*)command_list;
+  if (list->queue) {
+    Draw_State* pending = &list->queue->pending;
+    if (ds_count > LIDA_GFX_SHADER_MAX_SETS) {
+      LOG_ERROR("can't bind %u descriptor sets, maximum is %d", ds_count, LIDA_GFX_SHADER_MAX_SETS);
+      return;
+    }
+    if (num_offsets > LIDA_GFX_MAX_DYNAMIC_OFFSETS) {
+      LOG_ERROR("can't bind %u dynamic offsets in draw queue, maximum is %d", num_offsets, LIDA_GFX_MAX_DYNAMIC_OFFSETS);
+      return;
+    }
+    memcpy(pending->sets, descriptor_sets, ds_count * sizeof(VkDescriptorSet));
+    if (num_offsets > 0 || pending->num_dynamic_offsets > 0) {
+      // sets left from previous bind may use offsets we replace
+      pending->num_sets = ds_count;
+      pending->num_dynamic_offsets = num_offsets;
+      memcpy(pending->dynamic_offsets, offsets, num_offsets * sizeof(uint32_t));
+    } else {
+      pending->num_sets = MAX(pending->num_sets, ds_count);
+    }
+    list->queue->current_state = DRAW_STATE_NONE;
+    return;
+  }
+  bind_descriptor_sets(list, (const VkDescriptorSet*)descriptor_sets, ds_count, offsets, num_offsets);
+}
+
+void
+gfx_bind_descriptor_sets_with_offsets(const GFX_Descriptor_Set* descriptor_sets, uint32_t ds_count,
+				      const uint32_t* offsets, uint32_t num_offsets)
+{
+  gfx_cmd_bind_descriptor_sets_with_offsets(g.current_list, descriptor_sets, ds_count, offsets, num_offsets);
+}
+
+void
+gfx_cmd_push_constants(GFX_Command_List* command_list, const void* push_constant, uint32_t push_constant_size)
+{
+  gfx_cmd_push_constants_with_offset(command_list, push_constant, 0, push_constant_size);
 }
 
 void
 gfx_push_constants(const void* push_constant, uint32_t push_constant_size)
 {
-  Pipeline* pipeline = (Pipeline*)g.current_pipeline;
-  VkShaderStageFlags stage = (pipeline->bind_point == VK_PIPELINE_BIND_POINT_GRAPHICS) ? GFX_STAGE_VERTEX : GFX_STAGE_COMPUTE;
-  vkCmdPushConstants(g.current_cmd, pipeline->layout, stage,
-		     0, push_constant_size, push_constant);
+  gfx_cmd_push_constants(g.current_list, push_constant, push_constant_size);
+}
+
+void
+gfx_cmd_push_constants_with_offset(GFX_Command_List* command_list, const void* push_constant, uint32_t offset, uint32_t size)
+{
+  Command_List* list = (Command_List*)command_list;
+  if (list->queue) {
+    Draw_Queue* queue = list->queue;
+    if (offset + size > LIDA_GFX_MAX_PUSH_CONSTANT_SIZE) {
+      LOG_ERROR("push constants of size %u at offset %u can't be queued, maximum is %d",
+		size, offset, LIDA_GFX_MAX_PUSH_CONSTANT_SIZE);
+      return;
+    }
+    memcpy(queue->pending_push_constants + offset, push_constant, size);
+    // bytes that were never pushed below or above the range are not
+    // replayed
+    Draw_State* pending = &queue->pending;
+    uint32_t begin = offset, end = offset + size;
+    if (pending->push_constant_size > 0) {
+      begin = MIN(begin, pending->push_constant_offset);
+      end = MAX(end, pending->push_constant_offset + pending->push_constant_size);
+    }
+    pending->push_constant_offset = begin;
+    pending->push_constant_size = end - begin;
+    queue->current_state = DRAW_STATE_NONE;
+    return;
+  }
+  push_constants(list, push_constant, offset, size);
+}
+
+void
+gfx_push_constants_with_offset(const void* push_constant, uint32_t offset, uint32_t size)
+{
+  gfx_cmd_push_constants_with_offset(g.current_list, push_constant, offset, size);
+}
+
+void
+gfx_cmd_draw(GFX_Command_List* command_list, uint32_t vertex_count, uint32_t instance_count, uint32_t first_vertex, uint32_t first_instance)
+{
+  Command_List* list = (Command_List*)command_list;
+  if (list->queue) {
+    queue_draw(list, &(Draw_Packet) {
+	.indexed        = 0,
+	.count          = vertex_count,
+	.instance_count = instance_count,
+	.first          = first_vertex,
+	.first_instance = first_instance,
+      });
+    return;
+  }
+  vkCmdDraw(list->cmd, vertex_count, instance_count, first_vertex, first_instance);
+  count_draw(list, vertex_count, instance_count);
 }
 
 void
 gfx_draw(uint32_t vertex_count, uint32_t instance_count, uint32_t first_vertex, uint32_t first_instance)
 {
-  vkCmdDraw(g.current_cmd, vertex_count, instance_count, first_vertex, first_instance);
+  gfx_cmd_draw(g.current_list, vertex_count, instance_count, first_vertex, first_instance);
+}
+
+void
+gfx_cmd_draw_indexed(GFX_Command_List* command_list, uint32_t index_count, uint32_t instance_count, uint32_t first_index, int32_t vertex_offset, uint32_t first_instance)
+{
+  Command_List* list = (Command_List*)command_list;
+  if (list->queue) {
+    queue_draw(list, &(Draw_Packet) {
+	.indexed        = 1,
+	.count          = index_count,
+	.instance_count = instance_count,
+	.first          = first_index,
+	.vertex_offset  = vertex_offset,
+	.first_instance = first_instance,
+      });
+    return;
+  }
+  vkCmdDrawIndexed(list->cmd, index_count, instance_count, first_index, vertex_offset, first_instance);
+  count_draw(list, index_count, instance_count);
 }
 
 void
 gfx_draw_indexed(uint32_t index_count, uint32_t instance_count, uint32_t first_index, int32_t vertex_offset, uint32_t first_instance)
 {
-  vkCmdDrawIndexed(g.current_cmd, index_count, instance_count, first_index, vertex_offset, first_instance);
+  gfx_cmd_draw_indexed(g.current_list, index_count, instance_count, first_index, vertex_offset, first_instance);
+}
+
+void
+gfx_cmd_dispatch(GFX_Command_List* command_list, uint32_t x, uint32_t y, uint32_t z)
+{
+  Command_List* list = (Command_List*)command_list;
+  vkCmdDispatch(list->cmd, x, y, z);
+  list->stats.num_dispatches++;
 }
 
 void
 gfx_dispatch(uint32_t x, uint32_t y, uint32_t z)
 {
-  vkCmdDispatch(g.current_cmd, x, y, z);
+  gfx_cmd_dispatch(g.current_list, x, y, z);
 }
 
 void
-gfx_barrier(GFX_Pipeline_Stage src_stage, GFX_Pipeline_Stage dst_stage,
-	    const GFX_Image_Barrier* barriers, uint32_t count)
+gfx_cmd_barrier(GFX_Command_List* command_list, GFX_Pipeline_Stage src_stage, GFX_Pipeline_Stage dst_stage,
+		const GFX_Image_Barrier* barriers, uint32_t count)
 {
+  Command_List* list = (Command_List*)command_list;
+  flush_draw_queue(list);
+  list->stats.num_barriers++;
   if (count == 0) {
     VkMemoryBarrier barrier = {
       .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
       .srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT,
       .dstAccessMask = VK_ACCESS_MEMORY_READ_BIT|VK_ACCESS_MEMORY_WRITE_BIT,
     };
-    vkCmdPipelineBarrier(g.current_cmd, src_stage, dst_stage,
+    vkCmdPipelineBarrier(list->cmd, src_stage, dst_stage,
 			 0,
 			 1, &barrier,
 			 0, NULL,
@@ -3921,6 +8359,7 @@ gfx_barrier(GFX_Pipeline_Stage src_stage, GFX_Pipeline_Stage dst_stage,
   VkImageMemoryBarrier* image_barriers = alloca(sizeof(VkImageMemoryBarrier) * count);
   for (uint32_t i = 0; i < count; i++) {
     Image* image = (Image*)barriers[i].image;
+    add_list_reference(list, (uint64_t)image->handle);
     image_barriers[i] = (VkImageMemoryBarrier) {
       .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
       .srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT,
@@ -3938,7 +8377,7 @@ gfx_barrier(GFX_Pipeline_Stage src_stage, GFX_Pipeline_Stage dst_stage,
       },
     };
   }
-  vkCmdPipelineBarrier(g.current_cmd, src_stage, dst_stage,
+  vkCmdPipelineBarrier(list->cmd, src_stage, dst_stage,
 		       0,       // in my experience dependency flags don't matter at all
 		       0, NULL,
 		       0, NULL,
@@ -3946,13 +8385,22 @@ gfx_barrier(GFX_Pipeline_Stage src_stage, GFX_Pipeline_Stage dst_stage,
 }
 
 void
-gfx_clear_attachment(const GFX_Clear_Color* clear_color, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+gfx_barrier(GFX_Pipeline_Stage src_stage, GFX_Pipeline_Stage dst_stage,
+	    const GFX_Image_Barrier* barriers, uint32_t count)
+{
+  gfx_cmd_barrier(g.current_list, src_stage, dst_stage, barriers, count);
+}
+
+void
+gfx_cmd_clear_attachment(GFX_Command_List* command_list, const GFX_Clear_Color* clear_color, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
 {
+  Command_List* list = (Command_List*)command_list;
   VkClearAttachment clear_attachment = {
     .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT, // TODO: support aspect other than color
     .colorAttachment = 0
   };
   memcpy(&clear_attachment.clearValue, clear_color, sizeof(GFX_Clear_Color));
+  flush_draw_queue(list);
   VkClearRect clear_rect = {
     .rect = (VkRect2D) {
       .offset = {x, y},
@@ -3961,53 +8409,298 @@ gfx_clear_attachment(const GFX_Clear_Color* clear_color, uint32_t x, uint32_t y,
     .baseArrayLayer = 0,
     .layerCount = 1
   };
-  vkCmdClearAttachments(g.current_cmd, 1, &clear_attachment, 1, &clear_rect);
+  vkCmdClearAttachments(list->cmd, 1, &clear_attachment, 1, &clear_rect);
+}
+
+void
+gfx_clear_attachment(const GFX_Clear_Color* clear_color, uint32_t x, uint32_t y, uint32_t w, uint32_t h)
+{
+  gfx_cmd_clear_attachment(g.current_list, clear_color, x, y, w, h);
+}
+
+static int
+allocate_memory_for_buffers(Memory_Block* memory, GFX_Buffer* buffers, uint32_t count, const Memory_Request* request)
+{
+  VkMemoryRequirements* buffer_requirements = alloca(count * sizeof(VkMemoryRequirements));
+  int dedicated = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    Buffer* buffer = (Buffer*)&buffers[i];
+    dedicated |= get_dedicated_requirements(VK_NULL_HANDLE, buffer->handle, &buffer_requirements[i]);
+  }
+  VkResult err;
+  if (count == 1 && dedicated) {
+    err = allocate_dedicated_memory_block(memory, &buffer_requirements[0], request,
+					  VK_NULL_HANDLE, ((Buffer*)buffers)->handle);
+  } else {
+    VkMemoryRequirements requirements;
+    merge_memory_requirements(buffer_requirements, count, &requirements);
+    err = allocate_memory_block(memory, &requirements, request, 0);
+  }
+  if (err != VK_SUCCESS) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    Buffer* buffer = (Buffer*)&buffers[i];
+    bind_buffer_to_memory(memory, buffer, &buffer_requirements[i], NULL);
+  }
+  return 0;
+}
+
+static int
+allocate_memory_for_images(Memory_Block* memory, GFX_Image* images, uint32_t count, const Memory_Request* request)
+{
+  VkMemoryRequirements* image_requirements = alloca(count * sizeof(VkMemoryRequirements));
+  int dedicated = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    Image* image = (Image*)&images[i];
+    dedicated |= get_dedicated_requirements(image->handle, VK_NULL_HANDLE, &image_requirements[i]);
+  }
+  VkResult err;
+  if (count == 1 && dedicated) {
+    err = allocate_dedicated_memory_block(memory, &image_requirements[0], request,
+					  ((Image*)images)->handle, VK_NULL_HANDLE);
+  } else {
+    VkMemoryRequirements requirements;
+    merge_memory_requirements(image_requirements, count, &requirements);
+    err = allocate_memory_block(memory, &requirements, request, 1);
+  }
+  if (err != VK_SUCCESS) {
+    return -1;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    Image* image = (Image*)&images[i];
+    bind_image_to_memory(memory, image, &image_requirements[i]);
+  }
+  return 0;
+}
+
+int
+gfx_allocate_memory_for_buffers(GFX_Memory_Block* memory, GFX_Buffer* buffers, uint32_t count, GFX_Memory_Properties properties)
+{
+  Memory_Request request = { (VkMemoryPropertyFlags)properties, 0, 0 };
+  return allocate_memory_for_buffers((Memory_Block*)memory, buffers, count, &request);
+}
+
+int
+gfx_allocate_memory_for_images(GFX_Memory_Block* memory, GFX_Image* images, uint32_t count, GFX_Memory_Properties properties)
+{
+  Memory_Request request = { (VkMemoryPropertyFlags)properties, 0, 0 };
+  return allocate_memory_for_images((Memory_Block*)memory, images, count, &request);
+}
+
+int
+gfx_allocate_buffer_memory(GFX_Memory_Block* memory, GFX_Buffer* buffers, uint32_t count, GFX_Memory_Usage usage)
+{
+  return allocate_memory_for_buffers((Memory_Block*)memory, buffers, count, &memory_usage_requests[usage]);
 }
 
 int
-gfx_allocate_memory_for_buffers(GFX_Memory_Block* memory, GFX_Buffer* buffers, uint32_t count, GFX_Memory_Properties properties)
+gfx_allocate_image_memory(GFX_Memory_Block* memory, GFX_Image* images, uint32_t count, GFX_Memory_Usage usage)
 {
-  VkMemoryRequirements* buffer_requirements = alloca(count * sizeof(VkMemoryRequirements));
-  for (uint32_t i = 0; i < count; i++) {
-    Buffer* buffer = (Buffer*)&buffers[i];
-    vkGetBufferMemoryRequirements(g.logical_device, buffer->handle, &buffer_requirements[i]);
+  return allocate_memory_for_images((Memory_Block*)memory, images, count, &memory_usage_requests[usage]);
+}
+
+void
+gfx_free_memory(GFX_Memory_Block* memory)
+{
+  free_memory_block((Memory_Block*)memory);
+}
+
+void
+gfx_get_memory_stats(GFX_Memory_Stats* stats)
+{
+  memset(stats, 0, sizeof(GFX_Memory_Stats));
+  VkDeviceSize free_bytes = 0;
+  for (uint32_t i = 0; i < LIDA_GFX_MAX_MEMORY_PAGES; i++) {
+    const Memory_Page* page = &g.allocator.pages[i];
+    if (page->handle == VK_NULL_HANDLE)
+      continue;
+    stats->num_pages++;
+    stats->allocated_bytes += page->size;
+    for (uint32_t it = page->first_chunk; it != MEMORY_NONE; it = g.allocator.chunks[it].next_phys) {
+      const Memory_Chunk* chunk = &g.allocator.chunks[it];
+      if (chunk->is_free) {
+	stats->num_free_blocks++;
+	free_bytes += chunk->size;
+	stats->largest_free_block = MAX(stats->largest_free_block, chunk->size);
+      } else {
+	stats->num_allocations++;
+	stats->used_bytes += chunk->size;
+      }
+    }
   }
-  VkMemoryRequirements requirements;
-  merge_memory_requirements(buffer_requirements, count, &requirements);
-  if (allocate_memory_block((Memory_Block*)memory, requirements.size, properties, UINT32_MAX) != 0) {
-    return -1;
+  stats->fragmentation = (free_bytes > 0) ? 1.0f - (float)stats->largest_free_block / (float)free_bytes : 0.0f;
+  update_memory_budget();
+  stats->num_heaps = g.memory_properties.memoryHeapCount;
+  for (uint32_t i = 0; i < stats->num_heaps; i++) {
+    stats->heaps[i].size = g.memory_properties.memoryHeaps[i].size;
+    stats->heaps[i].usage = g.allocator.heap_usage[i];
+    stats->heaps[i].budget = g.allocator.heap_budget[i];
+    stats->heaps[i].device_local = (g.memory_properties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) != 0;
   }
-  for (uint32_t i = 0; i < count; i++) {
-    Buffer* buffer = (Buffer*)&buffers[i];
-    bind_buffer_to_memory((Memory_Block*)memory, buffer, &buffer_requirements[i], NULL);
+  stats->num_evictions = g.allocator.num_evictions;
+}
+
+int
+gfx_upload_buffer(GFX_Buffer* buf, uint64_t offset, const void* data, uint64_t size)
+{
+  Buffer* buffer = (Buffer*)buf;
+  const char* bytes = data;
+  g.frame_stats.uploaded_bytes += size;
+  // big uploads are split, so they don't take the whole ring
+  while (size > 0) {
+    uint64_t part = MIN(size, LIDA_GFX_STAGING_SIZE / 2);
+    if (g.upload.num_buffer_copies == LIDA_GFX_MAX_UPLOAD_REGIONS && flush_uploads() != VK_SUCCESS)
+      return -1;
+    uint64_t staging = allocate_staging_memory(part);
+    if (staging == UINT64_MAX)
+      return -1;
+    memcpy(g.upload.mapped + staging, bytes, part);
+    Buffer_Upload* upload = &g.upload.buffer_copies[g.upload.num_buffer_copies++];
+    upload->buffer = buffer->handle;
+    upload->region = (VkBufferCopy) { staging, offset, part };
+    bytes += part;
+    offset += part;
+    size -= part;
   }
   return 0;
 }
 
 int
-gfx_allocate_memory_for_images(GFX_Memory_Block* memory, GFX_Image* images, uint32_t count, GFX_Memory_Properties properties)
+gfx_upload_image(GFX_Image* img, const void* data, uint64_t size,
+		 uint32_t x, uint32_t y, uint32_t z,
+		 uint32_t width, uint32_t height, uint32_t depth,
+		 uint32_t mip, uint32_t layer,
+		 GFX_Image_Layout old_layout, GFX_Image_Layout new_layout)
 {
-  VkMemoryRequirements* image_requirements = alloca(count * sizeof(VkMemoryRequirements));
-  for (uint32_t i = 0; i < count; i++) {
-    Image* image = (Image*)&images[i];
-    vkGetImageMemoryRequirements(g.logical_device, image->handle, &image_requirements[i]);
-  }
-  VkMemoryRequirements requirements;
-  merge_memory_requirements(image_requirements, count, &requirements);
-  if (allocate_memory_block((Memory_Block*)memory, requirements.size, properties, UINT32_MAX) != 0) {
+  Image* image = (Image*)img;
+  if (g.upload.num_image_copies == LIDA_GFX_MAX_UPLOAD_REGIONS && flush_uploads() != VK_SUCCESS)
     return -1;
-  }
-  for (uint32_t i = 0; i < count; i++) {
-    Image* image = (Image*)&images[i];
-    bind_image_to_memory((Memory_Block*)memory, image, &image_requirements[i]);
-  }
+  uint64_t staging = allocate_staging_memory(size);
+  if (staging == UINT64_MAX)
+    return -1;
+  memcpy(g.upload.mapped + staging, data, size);
+  g.frame_stats.uploaded_bytes += size;
+  Image_Upload* upload = &g.upload.image_copies[g.upload.num_image_copies++];
+  upload->image = image->handle;
+  upload->region = (VkBufferImageCopy) {
+    .bufferOffset = staging,
+    .imageSubresource = {
+      .aspectMask = (image->format >= VK_FORMAT_D16_UNORM && image->format <= VK_FORMAT_D32_SFLOAT_S8_UINT) ? VK_IMAGE_ASPECT_DEPTH_BIT : VK_IMAGE_ASPECT_COLOR_BIT,
+      .mipLevel = mip,
+      .baseArrayLayer = layer,
+      .layerCount = 1,
+    },
+    .imageOffset = { (int32_t)x, (int32_t)y, (int32_t)z },
+    .imageExtent = { width, height, depth },
+  };
+  upload->old_layout = (VkImageLayout)old_layout;
+  upload->new_layout = (VkImageLayout)new_layout;
+  upload->shared = is_image_shared(image->usage);
   return 0;
 }
 
+int
+gfx_flush_uploads(int wait)
+{
+  VkResult err = flush_uploads();
+  if (wait)
+    poll_upload_batches(1);
+  return err;
+}
+
+uint32_t
+gfx_register_streamable(GFX_Memory_Block* memory, GFX_Evict_Function evict, void* udata)
+{
+  for (uint32_t i = 0; i < LIDA_GFX_MAX_STREAMABLES; i++) {
+    Streamable* streamable = &g.allocator.streamables[i];
+    if (streamable->memory == NULL) {
+      streamable->memory = memory;
+      streamable->evict = evict;
+      streamable->udata = udata;
+      streamable->last_used = g.frame_counter;
+      return i;
+    }
+  }
+  LOG_ERROR("too many streamable memory blocks, try increasing LIDA_GFX_MAX_STREAMABLES");
+  return GFX_STREAMABLE_NONE;
+}
+
 void
-gfx_free_memory(GFX_Memory_Block* memory)
+gfx_unregister_streamable(uint32_t id)
 {
-  free_memory_block((Memory_Block*)memory);
+  if (id < LIDA_GFX_MAX_STREAMABLES)
+    g.allocator.streamables[id].memory = NULL;
+}
+
+void
+gfx_touch_streamable(uint32_t id)
+{
+  if (id < LIDA_GFX_MAX_STREAMABLES)
+    g.allocator.streamables[id].last_used = g.frame_counter;
+}
+
+uint32_t
+gfx_defragment_memory(GFX_Command_List* command_list, GFX_Defrag_Resource* resources, uint32_t count, uint64_t max_bytes)
+{
+  Command_List* list = (Command_List*)command_list;
+  if (list->render_pass) {
+    LOG_ERROR("memory can't be defragmented inside of render pass");
+    return 0;
+  }
+  uint32_t pages[LIDA_GFX_MAX_MEMORY_PAGES];
+  uint32_t num_pages = pick_sparse_memory_pages(pages);
+  if (num_pages == 0)
+    return 0;
+  lock_memory_pages(pages, num_pages, 1);
+  // make previous writes to moved buffers visible to copies
+  VkMemoryBarrier barrier = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+  };
+  vkCmdPipelineBarrier(list->cmd, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+		       1, &barrier, 0, NULL, 0, NULL);
+  uint32_t num_moved = 0;
+  uint64_t num_bytes = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    GFX_Defrag_Resource* resource = &resources[i];
+    Memory_Block* memory = (Memory_Block*)resource->memory;
+    if (memory->handle == VK_NULL_HANDLE)
+      continue;
+    const Memory_Chunk* chunk = &g.allocator.chunks[memory->chunk];
+    uint32_t j = 0;
+    while (j < num_pages && pages[j] != chunk->page)
+      j++;
+    if (j == num_pages)
+      continue;
+    if (num_bytes + chunk->size > max_bytes)
+      continue;
+    uint32_t num_retired = 1 + (resource->image ? resource->num_textures : 0);
+    if (g.num_retired_resources + num_retired > MAX_RETIRED_RESOURCES)
+      break;
+    VkDeviceSize size = chunk->size;
+    int moved;
+    if (resource->buffer) {
+      moved = move_buffer(list->cmd, memory, (Buffer*)resource->buffer);
+    } else {
+      moved = move_image(list->cmd, memory, (Image*)resource->image,
+			 (Texture*)resource->textures, resource->num_textures,
+			 (VkImageLayout)resource->layout);
+    }
+    if (moved) {
+      num_moved++;
+      num_bytes += size;
+    }
+  }
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_MEMORY_READ_BIT|VK_ACCESS_MEMORY_WRITE_BIT;
+  vkCmdPipelineBarrier(list->cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0,
+		       1, &barrier, 0, NULL, 0, NULL);
+  list->stats.num_barriers += 2;
+  list->stats.copied_bytes += num_bytes;
+  lock_memory_pages(pages, num_pages, 0);
+  return num_moved;
 }
 
 int
@@ -4039,33 +8732,88 @@ gfx_copy_to_buffer(GFX_Buffer* buff, const void* src, uint32_t offset, uint32_t
     return -2;
   void* dst = (char*)buffer->mapped + offset;
   memcpy(dst, src, size);
+  g.frame_stats.uploaded_bytes += size;
   return 0;
 }
 
+void*
+gfx_allocate_frame_data(uint32_t size, uint32_t* offset)
+{
+  if (g.frame_data.mapped == NULL)
+    return NULL;
+  uint32_t begin = ALIGN_TO(g.frame_data.offset, g.frame_data.alignment);
+  if (begin + size > g.frame_data.begin + LIDA_GFX_FRAME_DATA_SIZE) {
+    LOG_ERROR("out of frame data memory: can't allocate %u bytes, %u bytes are left",
+	      size, g.frame_data.begin + LIDA_GFX_FRAME_DATA_SIZE - g.frame_data.offset);
+    return NULL;
+  }
+  g.frame_data.offset = begin + size;
+  *offset = begin;
+  return g.frame_data.mapped + begin;
+}
+
+const GFX_Buffer*
+gfx_get_frame_data_buffer()
+{
+  return &g.frame_data.buffer;
+}
+
 void
-gfx_bind_vertex_buffers(GFX_Buffer* buffers, uint32_t count, const uint64_t* offsets)
+gfx_cmd_bind_vertex_buffers(GFX_Command_List* command_list, GFX_Buffer* buffers, uint32_t count, const uint64_t* offsets)
 {
-  VkBuffer* handles = alloca(count * sizeof(VkBuffer));
+  Command_List* list = (Command_List*)command_list;
+  if (count > LIDA_GFX_MAX_VERTEX_BUFFERS) {
+    LOG_ERROR("can't bind %u vertex buffers, maximum is %d", count, LIDA_GFX_MAX_VERTEX_BUFFERS);
+    return;
+  }
+  VkBuffer handles[LIDA_GFX_MAX_VERTEX_BUFFERS];
   for (uint32_t i = 0; i < count; i++) {
-    Buffer* buffer = (Buffer*)&buffers[i];
-    handles[i] = buffer->handle;
+    handles[i] = ((Buffer*)&buffers[i])->handle;
   }
-  vkCmdBindVertexBuffers(g.current_cmd, 0, count, handles, offsets);
+  if (list->queue) {
+    Draw_State* pending = &list->queue->pending;
+    memcpy(pending->vertex_buffers, handles, count * sizeof(VkBuffer));
+    memcpy(pending->vertex_offsets, offsets, count * sizeof(VkDeviceSize));
+    pending->num_vertex_buffers = MAX(pending->num_vertex_buffers, count);
+    list->queue->current_state = DRAW_STATE_NONE;
+    return;
+  }
+  bind_vertex_buffers(list, handles, offsets, count);
+}
+
+void
+gfx_bind_vertex_buffers(GFX_Buffer* buffers, uint32_t count, const uint64_t* offsets)
+{
+  gfx_cmd_bind_vertex_buffers(g.current_list, buffers, count, offsets);
 }
 
 void
-gfx_bind_index_buffer(GFX_Buffer* buff, const uint64_t offset)
+gfx_cmd_bind_index_buffer(GFX_Command_List* command_list, GFX_Buffer* buff, const uint64_t offset)
 {
+  Command_List* list = (Command_List*)command_list;
   Buffer* buffer = (Buffer*)buff;
-  vkCmdBindIndexBuffer(g.current_cmd, buffer->handle, offset, VK_INDEX_TYPE_UINT32);
+  if (list->queue) {
+    list->queue->pending.index_buffer = buffer->handle;
+    list->queue->pending.index_offset = offset;
+    list->queue->current_state = DRAW_STATE_NONE;
+    return;
+  }
+  bind_index_buffer(list, buffer->handle, offset);
 }
 
 void
-gfx_copy_buffer_to_image_with_offset(GFX_Buffer* buf, GFX_Image* img, uint64_t offset,
-			 uint32_t x, uint32_t y, uint32_t z,
-			 uint32_t w, uint32_t h, uint32_t d)
+gfx_bind_index_buffer(GFX_Buffer* buffer, const uint64_t offset)
+{
+  gfx_cmd_bind_index_buffer(g.current_list, buffer, offset);
+}
+
+void
+gfx_cmd_copy_buffer_to_image_with_offset(GFX_Command_List* command_list, GFX_Buffer* buf, GFX_Image* img, uint64_t offset,
+					 uint32_t x, uint32_t y, uint32_t z,
+					 uint32_t w, uint32_t h, uint32_t d)
 {
   // TODO: specify subregion of image
+  Command_List* list = (Command_List*)command_list;
   Buffer* buffer = (Buffer*)buf;
   Image* image = (Image*)img;
   VkImageSubresourceLayers subresource = {
@@ -4082,26 +8830,38 @@ gfx_copy_buffer_to_image_with_offset(GFX_Buffer* buf, GFX_Image* img, uint64_t o
     .imageOffset = (VkOffset3D) {x, y, z},
     .imageExtent = (VkExtent3D) { w, h, d }
   };
-  vkCmdCopyBufferToImage(g.current_cmd, buffer->handle, image->handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+  vkCmdCopyBufferToImage(list->cmd, buffer->handle, image->handle, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
 			 1, &copy_info);
+  list->stats.copied_bytes += (uint64_t)w * h * d * get_format_size(image->format);
+  add_list_reference(list, (uint64_t)buffer->handle);
+  add_list_reference(list, (uint64_t)image->handle);
 
   // LOG_DEBUG("copied %u pixels", w*h*d);
 }
 
 void
-gfx_copy_buffer_to_image(GFX_Buffer* buf, GFX_Image* img,
+gfx_copy_buffer_to_image_with_offset(GFX_Buffer* buf, GFX_Image* img, uint64_t offset,
 			 uint32_t x, uint32_t y, uint32_t z,
 			 uint32_t w, uint32_t h, uint32_t d)
 {
-  gfx_copy_buffer_to_image_with_offset(buf, img, 0, x, y, z, w, h, d);
+  gfx_cmd_copy_buffer_to_image_with_offset(g.current_list, buf, img, offset, x, y, z, w, h, d);
 }
 
 void
-gfx_copy_image_to_buffer(GFX_Image* img, GFX_Buffer* buf,
+gfx_copy_buffer_to_image(GFX_Buffer* buf, GFX_Image* img,
 			 uint32_t x, uint32_t y, uint32_t z,
 			 uint32_t w, uint32_t h, uint32_t d)
+{
+  gfx_copy_buffer_to_image_with_offset(buf, img, 0, x, y, z, w, h, d);
+}
+
+void
+gfx_cmd_copy_image_to_buffer(GFX_Command_List* command_list, GFX_Image* img, GFX_Buffer* buf,
+			     uint32_t x, uint32_t y, uint32_t z,
+			     uint32_t w, uint32_t h, uint32_t d)
 {
   // TODO: specify subregion of image
+  Command_List* list = (Command_List*)command_list;
   Buffer* buffer = (Buffer*)buf;
   Image* image = (Image*)img;
   VkImageSubresourceLayers subresource = {
@@ -4118,83 +8878,388 @@ gfx_copy_image_to_buffer(GFX_Image* img, GFX_Buffer* buf,
     .imageOffset = (VkOffset3D) {x, y, z},
     .imageExtent = (VkExtent3D) { w, h, d }
   };
-  vkCmdCopyImageToBuffer(g.current_cmd, image->handle, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+  vkCmdCopyImageToBuffer(list->cmd, image->handle, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
 			 buffer->handle, 1, &region);
+  list->stats.copied_bytes += (uint64_t)w * h * d * get_format_size(image->format);
+  add_list_reference(list, (uint64_t)buffer->handle);
+  add_list_reference(list, (uint64_t)image->handle);
+}
+
+void
+gfx_copy_image_to_buffer(GFX_Image* img, GFX_Buffer* buf,
+			 uint32_t x, uint32_t y, uint32_t z,
+			 uint32_t w, uint32_t h, uint32_t d)
+{
+  gfx_cmd_copy_image_to_buffer(g.current_list, img, buf, x, y, z, w, h, d);
+}
+
+int
+gfx_create_image(GFX_Image* image, GFX_Image_Usage usage,
+		 uint32_t width, uint32_t height, uint32_t depth,
+		 GFX_Format format, uint32_t mips, uint32_t levels)
+{
+  return create_image((Image*)image, usage, (VkExtent3D){ width, height, depth },
+		      format, mips, levels);
+}
+
+void
+gfx_destroy_image(GFX_Image* image)
+{
+  destroy_image((Image*)image);
+}
+
+void
+gfx_get_image_extent(GFX_Image* img, uint32_t* width, uint32_t* height, uint32_t* depth)
+{
+  Image* image = (Image*)img;
+  if (width)  *width  = image->extent.width;
+  if (height) *height = image->extent.height;
+  if (depth)  *depth  = image->extent.depth;
+}
+
+int
+gfx_create_texture(GFX_Texture* texture, const GFX_Image* image,
+		   uint32_t first_mip, uint32_t first_layer,
+		   uint32_t num_mips, uint32_t num_layers)
+{
+  return create_texture((Texture*)texture, (Image*)image,
+			first_mip, first_layer, num_mips, num_layers);
+}
+
+void
+gfx_destroy_texture(GFX_Texture* texture)
+{
+  destroy_texture((Texture*)texture);
+}
+
+static DS_Layout*
+get_ds_layout(const GFX_Descriptor_Set_Binding* bindings, uint32_t num_bindings)
+{
+  VkDescriptorSetLayoutBinding* bindings_vk = alloca(num_bindings * sizeof(VkDescriptorSetLayoutBinding));
+  for (uint32_t i = 0; i < num_bindings; i++) {
+    bindings_vk[i] = (VkDescriptorSetLayoutBinding) {
+      .binding = bindings[i].binding,
+      .descriptorType = (VkDescriptorType)bindings[i].type,
+      .descriptorCount = 1,
+      .stageFlags = (VkShaderStageFlags)bindings[i].stages,
+    };
+  }
+  return create_ds_layout(bindings_vk, num_bindings, 0);
+}
+
+int
+gfx_allocate_descriptor_sets(GFX_Descriptor_Set* sets, uint32_t num_sets,
+			     const GFX_Descriptor_Set_Binding* bindings, uint32_t num_bindings,
+			     int resetable)
+{
+  DS_Layout* layout = get_ds_layout(bindings, num_bindings);
+  if (layout == NULL)
+    return -1;
+  VkDescriptorSetLayout* layouts = alloca(num_sets * sizeof(VkDescriptorSetLayout));
+  for (uint32_t i = 0; i < num_sets; i++)
+    layouts[i] = layout->layout;
+  VkDescriptorSetAllocateInfo allocate_info = {
+    .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+    .descriptorPool     = (resetable) ? g.dynamic_ds_pool : g.static_ds_pool,
+    .descriptorSetCount = num_sets,
+    .pSetLayouts        = layouts,
+  };
+  VkResult err = vkAllocateDescriptorSets(g.logical_device, &allocate_info, (VkDescriptorSet*)sets);
+  if (err != VK_SUCCESS) {
+    LOG_WARN("failed to allocate descriptor sets with error %s", to_string_VkResult(err));
+  }
+  return err;
+}
+
+int
+gfx_allocate_transient_descriptor_sets(GFX_Window* win, GFX_Descriptor_Set* sets, uint32_t num_sets,
+				       const GFX_Descriptor_Set_Binding* bindings, uint32_t num_bindings)
+{
+  Window* window = (Window*)win;
+  DS_Layout* layout = get_ds_layout(bindings, num_bindings);
+  if (layout == NULL)
+    return -1;
+  VkDescriptorSetLayout* layouts = alloca(num_sets * sizeof(VkDescriptorSetLayout));
+  for (uint32_t i = 0; i < num_sets; i++)
+    layouts[i] = layout->layout;
+  return allocate_transient_descriptor_sets(get_current_frame(window), (VkDescriptorSet*)sets, layouts, num_sets);
+}
+
+int
+gfx_get_cached_descriptor_set(GFX_Descriptor_Set* set,
+			      const GFX_Descriptor_Set_Binding* bindings, uint32_t num_bindings,
+			      const GFX_Descriptor_Resource* resources)
+{
+  DS_Layout* layout = get_ds_layout(bindings, num_bindings);
+  if (layout == NULL)
+    return -1;
+  Cached_DS key;
+  memset(&key, 0, sizeof(Cached_DS));
+  key.layout = layout->layout;
+  key.num_bindings = num_bindings;
+  for (uint32_t i = 0; i < num_bindings; i++) {
+    Cached_Descriptor* descriptor = &key.descriptors[i];
+    switch (bindings[i].type) {
+    case GFX_TYPE_UNIFORM_BUFFER:
+    case GFX_TYPE_STORAGE_BUFFER:
+    case GFX_TYPE_UNIFORM_BUFFER_DYNAMIC:
+    case GFX_TYPE_STORAGE_BUFFER_DYNAMIC: {
+      const Buffer* buffer = (const Buffer*)resources[i].buffer;
+      descriptor->handle = (uint64_t)buffer->handle;
+      descriptor->offset = resources[i].offset;
+      descriptor->range = (resources[i].range == 0) ? buffer->size : resources[i].range;
+    } break;
+    case GFX_TYPE_IMAGE_SAMPLER:
+      descriptor->sampler = get_sampler(resources[i].is_linear_filter,
+					(VkSamplerAddressMode)resources[i].address_mode);
+      ATTRIBUTE_FALLTHROUGH();
+    case GFX_TYPE_STORAGE_IMAGE: {
+      const Texture* texture = (const Texture*)resources[i].texture;
+      descriptor->handle = (uint64_t)texture->image_view;
+      descriptor->offset = (bindings[i].type == GFX_TYPE_STORAGE_IMAGE) ? VK_IMAGE_LAYOUT_GENERAL : (uint32_t)resources[i].layout;
+    } break;
+    default:
+      LOG_ERROR("descriptor type %d is not supported by descriptor set cache", bindings[i].type);
+      return -1;
+    }
+  }
+  int flag;
+  Cached_DS* cached = lru_cache_get(&g.ds_cache, &key, &flag);
+  if (flag == 0) {
+    g.ds_cache_hits++;
+    *set = (GFX_Descriptor_Set)cached->set;
+    return 0;
+  }
+  g.ds_cache_misses++;
+  VkDescriptorSetAllocateInfo allocate_info = {
+    .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+    .descriptorPool     = g.ds_cache_pool,
+    .descriptorSetCount = 1,
+    .pSetLayouts        = &layout->layout,
+  };
+  VkResult err = vkAllocateDescriptorSets(g.logical_device, &allocate_info, &cached->set);
+  if (err != VK_SUCCESS) {
+    LOG_ERROR("failed to allocate cached descriptor set with error %s", to_string_VkResult(err));
+    cached->set = VK_NULL_HANDLE;
+    cached->layout = VK_NULL_HANDLE;
+    return err;
+  }
+  Descriptor_Info infos[LIDA_GFX_SHADER_MAX_BINDINGS_PER_SET];
+  for (uint32_t i = 0; i < num_bindings; i++) {
+    const Cached_Descriptor* descriptor = &cached->descriptors[i];
+    if (bindings[i].type == GFX_TYPE_UNIFORM_BUFFER || bindings[i].type == GFX_TYPE_STORAGE_BUFFER ||
+	bindings[i].type == GFX_TYPE_UNIFORM_BUFFER_DYNAMIC || bindings[i].type == GFX_TYPE_STORAGE_BUFFER_DYNAMIC) {
+      infos[i].buffer = (VkDescriptorBufferInfo) {
+	.buffer = (VkBuffer)descriptor->handle,
+	.offset = descriptor->offset,
+	.range = descriptor->range,
+      };
+    } else {
+      infos[i].image = (VkDescriptorImageInfo) {
+	.sampler = descriptor->sampler,
+	.imageView = (VkImageView)descriptor->handle,
+	.imageLayout = (VkImageLayout)descriptor->offset,
+      };
+    }
+  }
+  write_descriptor_set(layout, cached->set, infos);
+  *set = (GFX_Descriptor_Set)cached->set;
+  return 0;
+}
+
+// Fill descriptor data of one set from user-provided resources.
+static int
+fill_descriptor_infos(const GFX_Descriptor_Set_Binding* bindings, uint32_t num_bindings,
+		      const GFX_Descriptor_Resource* resources, Descriptor_Info* infos)
+{
+  for (uint32_t i = 0; i < num_bindings; i++) {
+    switch (bindings[i].type) {
+    case GFX_TYPE_UNIFORM_BUFFER:
+    case GFX_TYPE_STORAGE_BUFFER:
+    case GFX_TYPE_UNIFORM_BUFFER_DYNAMIC:
+    case GFX_TYPE_STORAGE_BUFFER_DYNAMIC: {
+      const Buffer* buffer = (const Buffer*)resources[i].buffer;
+      infos[i].buffer = (VkDescriptorBufferInfo) {
+	.buffer = buffer->handle,
+	.offset = resources[i].offset,
+	.range = (resources[i].range == 0) ? buffer->size : resources[i].range,
+      };
+    } break;
+    case GFX_TYPE_IMAGE_SAMPLER: {
+      const Texture* texture = (const Texture*)resources[i].texture;
+      infos[i].image = (VkDescriptorImageInfo) {
+	.sampler = get_sampler(resources[i].is_linear_filter,
+			       (VkSamplerAddressMode)resources[i].address_mode),
+	.imageView = texture->image_view,
+	.imageLayout = (VkImageLayout)resources[i].layout,
+      };
+    } break;
+    case GFX_TYPE_STORAGE_IMAGE: {
+      const Texture* texture = (const Texture*)resources[i].texture;
+      infos[i].image = (VkDescriptorImageInfo) {
+	.sampler = VK_NULL_HANDLE,
+	.imageView = texture->image_view,
+	.imageLayout = VK_IMAGE_LAYOUT_GENERAL,
+      };
+    } break;
+    default:
+      LOG_ERROR("descriptor type %d is not supported", bindings[i].type);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int
+gfx_update_descriptor_sets(const GFX_Descriptor_Set* sets, uint32_t num_sets,
+			   const GFX_Descriptor_Set_Binding* bindings, uint32_t num_bindings,
+			   const GFX_Descriptor_Resource* resources)
+{
+  DS_Layout* layout = get_ds_layout(bindings, num_bindings);
+  if (layout == NULL)
+    return -1;
+  // keep order with writes recorded by 'gfx_descriptor_*()'
+  if (g.ds_writes_offset > 0)
+    gfx_batch_update_descriptor_sets();
+  Descriptor_Info infos[LIDA_GFX_SHADER_MAX_BINDINGS_PER_SET];
+  for (uint32_t s = 0; s < num_sets; s++) {
+    if (fill_descriptor_infos(bindings, num_bindings, &resources[s * num_bindings], infos) != 0)
+      return -1;
+    // Vulkan spec: updating a descriptor set invalidates command
+    // buffers it is bound to
+    invalidate_command_lists(sets[s]);
+    write_descriptor_set(layout, (VkDescriptorSet)sets[s], infos);
+  }
+  return 0;
+}
+
+void
+gfx_cmd_push_descriptors(GFX_Command_List* command_list,
+			 const GFX_Descriptor_Set_Binding* bindings, uint32_t num_bindings,
+			 const GFX_Descriptor_Resource* resources)
+{
+  Command_List* list = (Command_List*)command_list;
+  const Pipeline* pipeline = &list->pipeline;
+  if (pipeline->push_set == UINT32_MAX) {
+    LOG_ERROR("bound pipeline was not created with push descriptors");
+    return;
+  }
+  if (num_bindings > LIDA_GFX_SHADER_MAX_BINDINGS_PER_SET) {
+    LOG_ERROR("can't push %u descriptors, maximum is %d", num_bindings, LIDA_GFX_SHADER_MAX_BINDINGS_PER_SET);
+    return;
+  }
+  Descriptor_Info infos[LIDA_GFX_SHADER_MAX_BINDINGS_PER_SET];
+  VkWriteDescriptorSet writes[LIDA_GFX_SHADER_MAX_BINDINGS_PER_SET];
+  if (fill_descriptor_infos(bindings, num_bindings, resources, infos) != 0)
+    return;
+  Bind_Point_State* state = &list->state.bind_points[pipeline->bind_point];
+
+  if (g.has_push_descriptors) {
+    if (list->queue) {
+      LOG_ERROR("push descriptors can't be recorded to a draw queue");
+      return;
+    }
+    for (uint32_t i = 0; i < num_bindings; i++) {
+      writes[i] = make_descriptor_write(VK_NULL_HANDLE, bindings[i].binding,
+					(VkDescriptorType)bindings[i].type, &infos[i]);
+      add_list_reference(list, (writes[i].pBufferInfo) ?
+			 (uint64_t)infos[i].buffer.buffer : (uint64_t)infos[i].image.imageView);
+    }
+    count_state_command(list, 1);
+    vkCmdPushDescriptorSetKHR(list->cmd, pipeline->bind_point, pipeline->layout,
+			      pipeline->push_set, num_bindings, writes);
+    list->stats.num_descriptor_set_binds++;
+    list->stats.num_descriptor_writes += num_bindings;
+    // pushed set replaces the set which was bound at its index
+    if (state->layout == pipeline->layout)
+      state->num_sets = MIN(state->num_sets, pipeline->push_set);
+    return;
+  }
+
+  // fallback: write a transient set and bind it in place of pushed one
+  Window_Frame* frame = g.current_frame;
+  if (frame == NULL) {
+    LOG_ERROR("push descriptors are not supported, 'gfx_begin_commands()' must be called to use transient sets instead");
+    return;
+  }
+  VkDescriptorSet set;
+  if (allocate_transient_descriptor_sets(frame, &set, &pipeline->push_layout, 1) != VK_SUCCESS)
+    return;
+  for (uint32_t i = 0; i < num_bindings; i++) {
+    writes[i] = make_descriptor_write(set, bindings[i].binding,
+				      (VkDescriptorType)bindings[i].type, &infos[i]);
+  }
+  TRACE_BEGIN("vkUpdateDescriptorSets");
+  vkUpdateDescriptorSets(g.logical_device, num_bindings, writes, 0, NULL);
+  TRACE_END();
+  list->stats.num_descriptor_writes += num_bindings;
+  if (list->queue) {
+    Draw_State* pending = &list->queue->pending;
+    pending->sets[pipeline->push_set] = set;
+    pending->num_sets = MAX(pending->num_sets, pipeline->push_set+1);
+    list->queue->current_state = DRAW_STATE_NONE;
+    return;
+  }
+  count_state_command(list, 1);
+  vkCmdBindDescriptorSets(list->cmd, pipeline->bind_point, pipeline->layout,
+			  pipeline->push_set, 1, &set, 0, NULL);
+  list->stats.num_descriptor_set_binds++;
+  add_list_reference(list, (uint64_t)set);
+  if (state->layout != pipeline->layout) {
+    state->layout = pipeline->layout;
+    state->num_sets = 0;
+  } else if (state->num_sets >= pipeline->push_set) {
+    state->sets[pipeline->push_set] = set;
+    state->num_sets = MAX(state->num_sets, pipeline->push_set+1);
+  }
+  if (state->num_dynamic_offsets != 0)
+    state->num_dynamic_offsets = DYNAMIC_OFFSETS_UNKNOWN;
 }
 
-int
-gfx_create_image(GFX_Image* image, GFX_Image_Usage usage,
-		 uint32_t width, uint32_t height, uint32_t depth,
-		 GFX_Format format, uint32_t mips, uint32_t levels)
+void
+gfx_push_descriptors(const GFX_Descriptor_Set_Binding* bindings, uint32_t num_bindings,
+		     const GFX_Descriptor_Resource* resources)
 {
-  return create_image((Image*)image, usage, (VkExtent3D){ width, height, depth },
-		      format, mips, levels);
+  gfx_cmd_push_descriptors(g.current_list, bindings, num_bindings, resources);
 }
 
-void
-gfx_destroy_image(GFX_Image* image)
+GFX_Descriptor_Set
+gfx_get_bindless_descriptor_set()
 {
-  destroy_image((Image*)image);
+  return (g.bindless.enabled) ? (GFX_Descriptor_Set)g.bindless.set : 0;
 }
 
-void
-gfx_get_image_extent(GFX_Image* img, uint32_t* width, uint32_t* height, uint32_t* depth)
+uint32_t
+gfx_get_buffer_index(const GFX_Buffer* buffer)
 {
-  Image* image = (Image*)img;
-  if (width)  *width  = image->extent.width;
-  if (height) *height = image->extent.height;
-  if (depth)  *depth  = image->extent.depth;
+  return ((const Buffer*)buffer)->bindless_index;
 }
 
-int
-gfx_create_texture(GFX_Texture* texture, const GFX_Image* image,
-		   uint32_t first_mip, uint32_t first_layer,
-		   uint32_t num_mips, uint32_t num_layers)
+uint32_t
+gfx_get_texture_index(const GFX_Texture* texture)
 {
-  return create_texture((Texture*)texture, (Image*)image,
-			first_mip, first_layer, num_mips, num_layers);
+  return ((const Texture*)texture)->sampled_index;
 }
 
-void
-gfx_destroy_texture(GFX_Texture* texture)
+uint32_t
+gfx_get_storage_texture_index(const GFX_Texture* texture)
 {
-  destroy_texture((Texture*)texture);
+  return ((const Texture*)texture)->storage_index;
 }
 
-int
-gfx_allocate_descriptor_sets(GFX_Descriptor_Set* sets, uint32_t num_sets,
-			     const GFX_Descriptor_Set_Binding* bindings, uint32_t num_bindings,
-			     int resetable)
+void
+gfx_get_descriptor_cache_stats(uint32_t* hits, uint32_t* misses)
 {
-  VkDescriptorSetLayoutBinding* bindings_vk = alloca(num_bindings * sizeof(VkDescriptorSetLayoutBinding));
-  for (uint32_t i = 0; i < num_bindings; i++) {
-    bindings_vk[i] = (VkDescriptorSetLayoutBinding) {
-      .binding = bindings[i].binding,
-      .descriptorType = (VkDescriptorType)bindings[i].type,
-      .descriptorCount = 1,
-      .stageFlags = (VkShaderStageFlags)bindings[i].stages,
-    };
-  }
-  DS_Layout* layout = create_ds_layout(bindings_vk, num_bindings);
-  VkDescriptorSetLayout* layouts = alloca(num_sets * sizeof(VkDescriptorSetLayout));
-  for (uint32_t i = 0; i < num_sets; i++)
-    layouts[i] = layout->layout;
-  VkDescriptorSetAllocateInfo allocate_info = {
-    .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-    .descriptorPool     = (resetable) ? g.dynamic_ds_pool : g.static_ds_pool,
-    .descriptorSetCount = num_sets,
-    .pSetLayouts        = layouts,
-  };
-  VkResult err = vkAllocateDescriptorSets(g.logical_device, &allocate_info, (VkDescriptorSet*)sets);
-  if (err != VK_SUCCESS) {
-    LOG_WARN("failed to allocate descriptor sets with error %s", to_string_VkResult(err));
-  }
-  return err;
+  if (hits) *hits = g.ds_cache_hits;
+  if (misses) *misses = g.ds_cache_misses;
 }
 
 int
 gfx_free_descriptor_sets(GFX_Descriptor_Set* sets, uint32_t num_sets)
 {
+  for (uint32_t i = 0; i < num_sets; i++) {
+    invalidate_command_lists(sets[i]);
+  }
   VkResult err = vkFreeDescriptorSets(g.logical_device, g.dynamic_ds_pool, num_sets, (VkDescriptorSet*)sets);
   if (err != VK_SUCCESS) {
     LOG_WARN("failed to free descriptor sets with error %s", to_string_VkResult(err));
@@ -4205,7 +9270,8 @@ gfx_free_descriptor_sets(GFX_Descriptor_Set* sets, uint32_t num_sets)
 void
 gfx_descriptor_buffer(GFX_Descriptor_Set set, uint32_t binding, GFX_Descriptor_Type type, const GFX_Buffer* buff, uint32_t offset, uint32_t range)
 {
-  assert(g.ds_writes_offset < MAX_DS_WRITES);
+  if (g.ds_writes_offset == MAX_DS_WRITES)
+    gfx_batch_update_descriptor_sets();
   const Buffer* buffer = (const Buffer*)buff;
   g.ds_objects[g.ds_writes_offset].buffer = (VkDescriptorBufferInfo) {
     .buffer = buffer->handle,
@@ -4226,11 +9292,11 @@ gfx_descriptor_buffer(GFX_Descriptor_Set set, uint32_t binding, GFX_Descriptor_T
 void gfx_descriptor_sampled_texture(GFX_Descriptor_Set set, uint32_t binding,
 				    const GFX_Texture* tex, GFX_Image_Layout layout, int is_linear_filter, GFX_Sampler_Address_Mode mode)
 {
-  assert(g.ds_writes_offset < MAX_DS_WRITES);
+  if (g.ds_writes_offset == MAX_DS_WRITES)
+    gfx_batch_update_descriptor_sets();
   const Texture* texture = (const Texture*)tex;
-  Sampler* sampler = create_sampler(is_linear_filter, (VkSamplerAddressMode)mode);
   g.ds_objects[g.ds_writes_offset].image = (VkDescriptorImageInfo) {
-    .sampler = sampler->handle,
+    .sampler = get_sampler(is_linear_filter, (VkSamplerAddressMode)mode),
     .imageView = texture->image_view,
     .imageLayout = (VkImageLayout)layout,
   };
@@ -4248,7 +9314,8 @@ void gfx_descriptor_sampled_texture(GFX_Descriptor_Set set, uint32_t binding,
 void
 gfx_descriptor_storage_texture(GFX_Descriptor_Set set, uint32_t binding, const GFX_Texture* tex)
 {
-  assert(g.ds_writes_offset < MAX_DS_WRITES);
+  if (g.ds_writes_offset == MAX_DS_WRITES)
+    gfx_batch_update_descriptor_sets();
   const Texture* texture = (const Texture*)tex;
   g.ds_objects[g.ds_writes_offset].image = (VkDescriptorImageInfo) {
     .sampler = VK_NULL_HANDLE,
@@ -4269,13 +9336,22 @@ gfx_descriptor_storage_texture(GFX_Descriptor_Set set, uint32_t binding, const G
 void
 gfx_batch_update_descriptor_sets()
 {
+  // Vulkan spec: updating a descriptor set invalidates command
+  // buffers it is bound to
+  for (uint32_t i = 0; i < g.ds_writes_offset; i++) {
+    invalidate_command_lists((uint64_t)g.ds_writes[i].dstSet);
+  }
+  TRACE_BEGIN("vkUpdateDescriptorSets");
   vkUpdateDescriptorSets(g.logical_device, g.ds_writes_offset, g.ds_writes, 0, NULL);
+  TRACE_END();
+  g.frame_stats.num_descriptor_writes += g.ds_writes_offset;
   g.ds_writes_offset = 0;
 }
 
 void
-gfx_clear_color_image(GFX_Image* img, GFX_Image_Layout layout)
+gfx_cmd_clear_color_image(GFX_Command_List* command_list, GFX_Image* img, GFX_Image_Layout layout)
 {
+  Command_List* list = (Command_List*)command_list;
   VkClearColorValue clear_color = {};
   clear_color.float32[0] = 0.0f;
   VkImageSubresourceRange range = {
@@ -4286,5 +9362,427 @@ gfx_clear_color_image(GFX_Image* img, GFX_Image_Layout layout)
     .layerCount = 1
   };
   Image* image = (Image*)img;
-  vkCmdClearColorImage(g.current_cmd, image->handle, (VkImageLayout)layout, &clear_color, 1, &range);
+  vkCmdClearColorImage(list->cmd, image->handle, (VkImageLayout)layout, &clear_color, 1, &range);
+  add_list_reference(list, (uint64_t)image->handle);
+}
+
+void
+gfx_clear_color_image(GFX_Image* image, GFX_Image_Layout layout)
+{
+  gfx_cmd_clear_color_image(g.current_list, image, layout);
+}
+
+static int
+create_thread_command_lists(GFX_Command_List* lists, uint32_t count, uint32_t thread_id,
+			    GFX_Queue queue, VkCommandBufferLevel level)
+{
+  if (thread_id >= LIDA_GFX_MAX_THREADS) {
+    LOG_ERROR("thread_id=%u is out of bounds, maximum number of threads is %d",
+	      thread_id, LIDA_GFX_MAX_THREADS);
+    return -1;
+  }
+  if ((uint32_t)queue >= NUM_QUEUES) {
+    LOG_ERROR("invalid queue %d", queue);
+    return -1;
+  }
+  uint32_t queue_family;
+  get_queue(queue, &queue_family);
+  // command pools must be externally synchronized, so every thread
+  // gets its own one. Only this thread touches the slot so no locking
+  // is needed.
+  VkCommandPool* pool = &g.thread_command_pools[queue][thread_id];
+  if (*pool == VK_NULL_HANDLE) {
+    VkCommandPoolCreateInfo command_pool_info = {
+      .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+      .flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+      .queueFamilyIndex = queue_family,
+    };
+    VkResult err = vkCreateCommandPool(g.logical_device, &command_pool_info, NULL, pool);
+    if (err != VK_SUCCESS) {
+      LOG_ERROR("failed to create command pool for thread %u with error %s",
+		thread_id, to_string_VkResult(err));
+      return err;
+    }
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    VkResult err = allocate_command_list((Command_List*)&lists[i], *pool, g.frames_in_flight, level, queue_family);
+    if (err != VK_SUCCESS) {
+      return err;
+    }
+  }
+  return 0;
+}
+
+int
+gfx_create_command_lists(GFX_Command_List* lists, uint32_t count, uint32_t thread_id, int secondary)
+{
+  VkCommandBufferLevel level = (secondary) ? VK_COMMAND_BUFFER_LEVEL_SECONDARY : VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  return create_thread_command_lists(lists, count, thread_id, GFX_QUEUE_GRAPHICS, level);
+}
+
+int
+gfx_create_queue_command_lists(GFX_Command_List* lists, uint32_t count, uint32_t thread_id, GFX_Queue queue)
+{
+  return create_thread_command_lists(lists, count, thread_id, queue, VK_COMMAND_BUFFER_LEVEL_PRIMARY);
+}
+
+void
+gfx_destroy_command_lists(GFX_Command_List* lists, uint32_t count)
+{
+  for (uint32_t i = 0; i < count; i++) {
+    free_command_list((Command_List*)&lists[i]);
+  }
+}
+
+int
+gfx_begin_command_list(GFX_Command_List* command_list)
+{
+  Command_List* list = (Command_List*)command_list;
+  uint32_t index = list->counter % list->num_cmds;
+  list->counter++;
+  return begin_command_list(list, index, VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT, NULL);
+}
+
+int
+gfx_begin_secondary_command_list(GFX_Command_List* command_list, const GFX_Command_List* parent_list)
+{
+  Command_List* list = (Command_List*)command_list;
+  const Command_List* parent = (const Command_List*)parent_list;
+  if (list->level != VK_COMMAND_BUFFER_LEVEL_SECONDARY) {
+    LOG_ERROR("list must be created as secondary to continue a render pass");
+    return -1;
+  }
+  if (parent->render_pass == VK_NULL_HANDLE) {
+    LOG_ERROR("parent list is not inside a render pass");
+    return -1;
+  }
+  // NOTE: we don't support subpasses, so subpass is always 0
+  VkCommandBufferInheritanceInfo inheritance = {
+    .sType       = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+    .renderPass  = parent->render_pass,
+    .subpass     = 0,
+    .framebuffer = parent->framebuffer,
+  };
+  uint32_t index = list->counter % list->num_cmds;
+  list->counter++;
+  VkResult err = begin_command_list(list, index,
+				    VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT|VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+				    &inheritance);
+  if (err != VK_SUCCESS) {
+    return err;
+  }
+  list->render_pass = parent->render_pass;
+  list->framebuffer = parent->framebuffer;
+  list->render_area = parent->render_area;
+  // dynamic state is not inherited from primary command buffer
+  set_full_viewport(list, list->render_area);
+  return 0;
+}
+
+int
+gfx_end_command_list(GFX_Command_List* command_list)
+{
+  Command_List* list = (Command_List*)command_list;
+  VkResult err = vkEndCommandBuffer(list->cmd);
+  if (err != VK_SUCCESS) {
+    LOG_ERROR("failed to end command buffer with error %s", to_string_VkResult(err));
+  } else if (list->reusable) {
+    list->valid = 1;
+  }
+  return err;
+}
+
+// Wait until GPU is done with submits that used reusable 'list', so
+// its command buffer can be recorded again.
+static VkResult
+wait_reusable_command_list(Command_List* list)
+{
+  for (uint32_t q = 0; q < NUM_QUEUES; q++) {
+    if (list->used_values[q] == 0)
+      continue;
+    Timeline* timeline = &g.timelines[q];
+    // the frame was submitted before list is recorded again, so it's
+    // covered by the last submitted value
+    uint64_t value = (list->used_values[q] == LIST_USED_BY_FRAME) ? timeline->submitted : list->used_values[q];
+    VkResult err = wait_timeline(timeline, value, UINT64_MAX);
+    if (err != VK_SUCCESS)
+      return err;
+    list->used_values[q] = 0;
+  }
+  return VK_SUCCESS;
+}
+
+int
+gfx_begin_reusable_command_list(GFX_Command_List* command_list)
+{
+  Command_List* list = (Command_List*)command_list;
+  if (list->reusable == 0) {
+    if (g.num_reusable_lists == LIDA_GFX_MAX_REUSABLE_LISTS) {
+      LOG_ERROR("too many reusable command lists, maximum is %d", LIDA_GFX_MAX_REUSABLE_LISTS);
+      return -1;
+    }
+    g.reusable_lists[g.num_reusable_lists++] = list;
+    list->reusable = 1;
+  }
+  // command buffer may still be pending
+  VkResult err = wait_reusable_command_list(list);
+  if (err != VK_SUCCESS)
+    return err;
+  // lists that execute this one must be recorded again
+  invalidate_command_lists((uint64_t)(uintptr_t)list->cmds[0]);
+  list->valid = 0;
+  list->num_refs = 0;
+  // NOTE: a reusable list may be pending in several frames at once
+  return begin_command_list(list, 0, VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT, NULL);
+}
+
+int
+gfx_is_command_list_valid(const GFX_Command_List* command_list)
+{
+  const Command_List* list = (const Command_List*)command_list;
+  return list->valid;
+}
+
+void
+gfx_get_frame_stats(GFX_Frame_Stats* stats)
+{
+  *stats = g.last_frame_stats;
+}
+
+void
+gfx_get_command_list_stats(const GFX_Command_List* command_list, uint32_t* issued, uint32_t* elided)
+{
+  const Command_List* list = (const Command_List*)command_list;
+  if (issued) *issued = list->num_issued;
+  if (elided) *elided = list->num_elided;
+}
+
+int
+gfx_begin_draw_queue(GFX_Command_List* command_list, GFX_Draw_Queue* queue, void* memory, size_t size)
+{
+  Command_List* list = (Command_List*)command_list;
+  if (list->queue) {
+    LOG_ERROR("command list already has a draw queue");
+    return -1;
+  }
+  if (size > UINT32_MAX)
+    size = UINT32_MAX;
+  begin_draw_queue(list, (Draw_Queue*)queue, memory, (uint32_t)size);
+  return 0;
+}
+
+void
+gfx_end_draw_queue(GFX_Command_List* command_list)
+{
+  Command_List* list = (Command_List*)command_list;
+  Draw_Queue* queue = list->queue;
+  flush_draw_queue(list);
+  list->queue = NULL;
+  // after replay state of the last sorted draw is bound, restore
+  // state user bound last so following draws use it
+  if (queue)
+    apply_draw_state(list, &queue->pending, queue->pending_push_constants + queue->pending.push_constant_offset);
+}
+
+void
+gfx_cmd_set_draw_order(GFX_Command_List* command_list, uint32_t layer, float depth)
+{
+  Command_List* list = (Command_List*)command_list;
+  if (list->queue == NULL)
+    return;
+  if (depth < 0.0f) depth = 0.0f;
+  if (depth > 1.0f) depth = 1.0f;
+  uint64_t depth_bits = (uint64_t)(depth * (float)0xFFFFFF);
+  list->queue->order_key = ((uint64_t)(layer & 0xFF) << 56) | depth_bits;
+}
+
+void
+gfx_set_draw_order(uint32_t layer, float depth)
+{
+  gfx_cmd_set_draw_order(g.current_list, layer, depth);
+}
+
+GFX_Command_List*
+gfx_get_command_list(GFX_Window* win)
+{
+  Window* window = (Window*)win;
+  return (GFX_Command_List*)&window->main_list;
+}
+
+void
+gfx_cmd_execute_command_lists(GFX_Command_List* command_list, const GFX_Command_List* secondaries, uint32_t count)
+{
+  Command_List* list = (Command_List*)command_list;
+  flush_draw_queue(list);
+  VkCommandBuffer* cmds = alloca(count * sizeof(VkCommandBuffer));
+  uint32_t num_cmds = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    const Command_List* secondary = (const Command_List*)&secondaries[i];
+    if (secondary->reusable && secondary->valid == 0) {
+      LOG_WARN("skipping invalidated command list %p, record it again", secondary);
+      continue;
+    }
+    cmds[num_cmds++] = secondary->cmd;
+    add_list_reference(list, (uint64_t)(uintptr_t)secondary->cmd);
+    if (secondary->reusable)
+      ((Command_List*)secondary)->used_values[GFX_QUEUE_GRAPHICS] = LIST_USED_BY_FRAME;
+    add_frame_stats(&list->stats, &secondary->stats);
+  }
+  if (num_cmds == 0)
+    return;
+  // timestamps can't be written inside render pass with secondary
+  // contents
+  int32_t zone = (list->render_pass == VK_NULL_HANDLE) ? begin_gpu_zone(list, "command lists") : -1;
+  vkCmdExecuteCommands(list->cmd, num_cmds, cmds);
+  if (zone >= 0)
+    end_gpu_zones_from(list, zone);
+  // Vulkan spec: after vkCmdExecuteCommands the state of primary
+  // command buffer is undefined
+  list->pipeline.handle = VK_NULL_HANDLE;
+  reset_command_state(list);
+}
+
+int
+gfx_submit_command_lists(GFX_Window* win, const GFX_Command_List* lists, uint32_t count)
+{
+  Window* window = (Window*)win;
+  if (window->num_frame_lists + count > LIDA_GFX_MAX_FRAME_COMMAND_LISTS) {
+    LOG_ERROR("too many command lists submitted with one frame, maximum is %d",
+	      LIDA_GFX_MAX_FRAME_COMMAND_LISTS);
+    return -1;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    const Command_List* list = (const Command_List*)&lists[i];
+    if (list->level != VK_COMMAND_BUFFER_LEVEL_PRIMARY) {
+      LOG_ERROR("only primary command lists can be submitted, use 'gfx_cmd_execute_command_lists()' for secondary ones");
+      return -1;
+    }
+    if (list->reusable && list->valid == 0) {
+      LOG_ERROR("command list %p was invalidated, record it again", list);
+      return -1;
+    }
+    window->frame_lists[window->num_frame_lists++] = list->cmd;
+    add_frame_stats(&g.frame_stats, &list->stats);
+    if (list->reusable)
+      ((Command_List*)list)->used_values[GFX_QUEUE_GRAPHICS] = LIST_USED_BY_FRAME;
+  }
+  return 0;
+}
+
+typedef struct {
+  VkSemaphore handle;
+} Semaphore;
+_Static_assert(sizeof(Semaphore) <= sizeof(GFX_Semaphore), "internal error: adjust sizeof for GFX_Semaphore");
+
+int
+gfx_create_semaphore(GFX_Semaphore* sem)
+{
+  Semaphore* semaphore = (Semaphore*)sem;
+  VkSemaphoreCreateInfo semaphore_info = { .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO };
+  VkResult err = vkCreateSemaphore(g.logical_device, &semaphore_info, NULL, &semaphore->handle);
+  if (err != VK_SUCCESS) {
+    LOG_ERROR("failed to create semaphore with error %s", to_string_VkResult(err));
+  }
+  return err;
+}
+
+void
+gfx_destroy_semaphore(GFX_Semaphore* sem)
+{
+  Semaphore* semaphore = (Semaphore*)sem;
+  vkDestroySemaphore(g.logical_device, semaphore->handle, NULL);
+  semaphore->handle = VK_NULL_HANDLE;
+}
+
+int
+gfx_is_queue_dedicated(GFX_Queue queue)
+{
+  uint32_t family;
+  get_queue(queue, &family);
+  return queue != GFX_QUEUE_GRAPHICS && family != g.graphics_queue_family;
+}
+
+int
+gfx_submit_to_queue(GFX_Queue queue, const GFX_Submit_Info* info)
+{
+  uint32_t family;
+  get_queue(queue, &family);
+  VkCommandBuffer* cmds = alloca(info->num_lists * sizeof(VkCommandBuffer));
+  for (uint32_t i = 0; i < info->num_lists; i++) {
+    const Command_List* list = (const Command_List*)&info->lists[i];
+    if (list->level != VK_COMMAND_BUFFER_LEVEL_PRIMARY) {
+      LOG_ERROR("only primary command lists can be submitted, use 'gfx_cmd_execute_command_lists()' for secondary ones");
+      return -1;
+    }
+    if (list->queue_family != family) {
+      LOG_ERROR("command list %p was created for other queue", list);
+      return -1;
+    }
+    if (list->reusable && list->valid == 0) {
+      LOG_ERROR("command list %p was invalidated, record it again", list);
+      return -1;
+    }
+    cmds[i] = list->cmd;
+  }
+  VkSemaphore* wait_semaphores = alloca(info->num_wait_semaphores * sizeof(VkSemaphore));
+  VkPipelineStageFlags* wait_stages = alloca(info->num_wait_semaphores * sizeof(VkPipelineStageFlags));
+  for (uint32_t i = 0; i < info->num_wait_semaphores; i++) {
+    wait_semaphores[i] = ((const Semaphore*)&info->wait_semaphores[i])->handle;
+    wait_stages[i] = (VkPipelineStageFlags)info->wait_stages[i];
+  }
+  VkSemaphore* signal_semaphores = alloca(info->num_signal_semaphores * sizeof(VkSemaphore));
+  for (uint32_t i = 0; i < info->num_signal_semaphores; i++) {
+    signal_semaphores[i] = ((const Semaphore*)&info->signal_semaphores[i])->handle;
+  }
+  VkSubmitInfo submit_info = {
+    .sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .waitSemaphoreCount   = info->num_wait_semaphores,
+    .pWaitSemaphores      = wait_semaphores,
+    .pWaitDstStageMask    = wait_stages,
+    .commandBufferCount   = info->num_lists,
+    .pCommandBuffers      = cmds,
+    .signalSemaphoreCount = info->num_signal_semaphores,
+    .pSignalSemaphores    = signal_semaphores,
+  };
+  Timeline* timeline = get_timeline(queue);
+  uint64_t value;
+  VkResult err = submit_to_timeline(timeline, &submit_info, &value);
+  if (err == VK_SUCCESS) {
+    for (uint32_t i = 0; i < info->num_lists; i++) {
+      Command_List* list = (Command_List*)&info->lists[i];
+      add_frame_stats(&g.frame_stats, &list->stats);
+      if (list->reusable)
+	list->used_values[timeline - g.timelines] = value;
+    }
+  }
+  return err;
+}
+
+int
+gfx_wait_semaphore(GFX_Window* win, const GFX_Semaphore* semaphore, GFX_Pipeline_Stage stage)
+{
+  Window* window = (Window*)win;
+  // first slot is taken by 'image_available'
+  if (window->num_wait_semaphores == LIDA_GFX_MAX_FRAME_SEMAPHORES) {
+    LOG_ERROR("too many semaphores waited by one frame, maximum is %d", LIDA_GFX_MAX_FRAME_SEMAPHORES);
+    return -1;
+  }
+  window->num_wait_semaphores++;
+  window->wait_semaphores[window->num_wait_semaphores] = ((const Semaphore*)semaphore)->handle;
+  window->wait_stages[window->num_wait_semaphores] = (VkPipelineStageFlags)stage;
+  return 0;
+}
+
+int
+gfx_signal_semaphore(GFX_Window* win, const GFX_Semaphore* semaphore)
+{
+  Window* window = (Window*)win;
+  // first slot is taken by 'render_finished'
+  if (window->num_signal_semaphores == LIDA_GFX_MAX_FRAME_SEMAPHORES) {
+    LOG_ERROR("too many semaphores signaled by one frame, maximum is %d", LIDA_GFX_MAX_FRAME_SEMAPHORES);
+    return -1;
+  }
+  window->num_signal_semaphores++;
+  window->signal_semaphores[window->num_signal_semaphores] = ((const Semaphore*)semaphore)->handle;
+  return 0;
 }
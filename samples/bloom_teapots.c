@@ -4,7 +4,20 @@
    synchronization.  Starting from this sample the app window is
    resizable.
 
-   Usage: press SPC to toggle camera movement. press 'b' to toggle glowing.
+   The bloom chain doesn't change between frames, so it's recorded
+   once into a reusable command list and replayed each frame. The list
+   is recorded again when window is resized.
+
+   Camera uniforms are written each frame to memory allocated with
+   'gfx_allocate_frame_data()', so CPU never overwrites data GPU still
+   reads. The descriptor set points to the frame data buffer once, and
+   the allocation is selected with a dynamic offset.
+
+   Passes are measured with GPU zones. Render passes and the bloom
+   list are zoned by the library, we only give the bloom a name.
+
+   Usage: press SPC to toggle camera movement. press 'b' to toggle
+   glowing. press 't' to print GPU times of passes.
 */
 #include <stdio.h>
 #include <string.h>
@@ -28,6 +41,12 @@ typedef struct {
   Vec3 color;
 } Teapot;
 
+typedef struct {
+  Mat4 camera_matrix;
+  Mat4 camera_view;
+  Vec3 camera_dir;
+} Camera_Uniform;
+
 static GFX_Render_Pass* create_offscreen_pass();
 static uint32_t create_offscreen_pass_attachments(GFX_Window* window, GFX_Memory_Block* memory,
                                               GFX_Image* color_image, GFX_Image* depth_image,
@@ -35,8 +54,25 @@ static uint32_t create_offscreen_pass_attachments(GFX_Window* window, GFX_Memory
 static void destroy_offscreen_pass_attachments(GFX_Memory_Block* memory,
                                               GFX_Image* color_image, GFX_Image* depth_image,
                                               GFX_Texture* color_mips, GFX_Texture* depth_texture);
+static void write_descriptor_sets(GFX_Descriptor_Set offscreen_ds, GFX_Descriptor_Set bloom_ds[2][16],
+                                  const GFX_Texture* color_mips, uint32_t num_mips);
+static void record_bloom_pass(GFX_Command_List* list, GFX_Image* color_image, uint32_t num_mips,
+                              GFX_Pipeline* bloom_read_pipeline, GFX_Pipeline* bloom_downsample_pipeline,
+                              GFX_Pipeline* bloom_upsample_pipeline, GFX_Descriptor_Set bloom_ds[2][16]);
 static void gen_teapot(Teapot* object);
 
+static void print_gpu_zones()
+{
+  const GFX_GPU_Zone* zones;
+  uint64_t frame;
+  uint32_t count = gfx_get_gpu_zones(&zones, &frame);
+  printf("GPU times of frame %lu:\n", (unsigned long)frame);
+  for (uint32_t i = 0; i < count; i++) {
+    printf("%*s%s: %.3f ms\n", 2 * (int)zones[i].depth + 2, "", zones[i].name,
+           zones[i].duration * 1e-6);
+  }
+}
+
 int main(int argc, char** argv)
 {
   int r = gfx_init(&(GFX_Init_Info) {
@@ -44,6 +80,7 @@ int main(int argc, char** argv)
       .app_version = 0,
       .enable_debug_layers = 1,
       .gpu_id = 0,
+      .enable_gpu_zones = 1,
       .log_fn = log_func,
       .load_shader_fn = SDL_LoadFile,
       .free_shader_fn = SDL_free
@@ -56,18 +93,16 @@ int main(int argc, char** argv)
   const uint32_t num_vertices = sizeof(teapot_model_vertices) / sizeof(uint32_t);
 
   // Allocate buffers.
-  GFX_Buffer vertex_buffer, index_buffer, uniform_buffer;
+  GFX_Buffer vertex_buffer, index_buffer;
   gfx_create_buffer(&vertex_buffer, GFX_BUFFER_USAGE_VERTEX, num_vertices * sizeof(Vertex));
   gfx_create_buffer(&index_buffer, GFX_BUFFER_USAGE_INDEX, num_indices * sizeof(uint32_t));
-  gfx_create_buffer(&uniform_buffer, GFX_BUFFER_USAGE_UNIFORM, 2048);
   GFX_Memory_Block buffer_memory;
   {
-    GFX_Buffer buffers[3] = { vertex_buffer, index_buffer, uniform_buffer };
-    gfx_allocate_memory_for_buffers(&buffer_memory, buffers, 3,
+    GFX_Buffer buffers[2] = { vertex_buffer, index_buffer };
+    gfx_allocate_memory_for_buffers(&buffer_memory, buffers, 2,
                                     GFX_MEMORY_PROPERTY_HOST_VISIBLE|GFX_MEMORY_PROPERTY_HOST_COHERENT);
     vertex_buffer = buffers[0];
     index_buffer = buffers[1];
-    uniform_buffer = buffers[2];
   }
 
   // Load mesh to buffers. (mesh is defined in 'data/teapot.h')
@@ -112,6 +147,8 @@ int main(int argc, char** argv)
         .depth_test = 1,
         .depth_write = 1,
         .render_pass            = offscreen_pass,
+        // camera uniforms come from frame data
+        .dynamic_buffer_sets    = 1,
       },
       {
         .vertex_shader          = "shaders/offscreen.vert.spv",
@@ -141,7 +178,7 @@ int main(int argc, char** argv)
   GFX_Descriptor_Set uniform_ds;
   gfx_allocate_descriptor_sets(&uniform_ds, 1, &(GFX_Descriptor_Set_Binding) {
       .binding = 0,
-      .type = GFX_TYPE_UNIFORM_BUFFER,
+      .type = GFX_TYPE_UNIFORM_BUFFER_DYNAMIC,
       .stages = GFX_STAGE_VERTEX|GFX_STAGE_FRAGMENT
     }, 1,
     0);
@@ -166,23 +203,19 @@ int main(int argc, char** argv)
         .stages = GFX_STAGE_COMPUTE
       },
     };
-    gfx_allocate_descriptor_sets(bloom_ds[0], num_mips-1, bindings, 2, 1);
+    // allocate sets for maximum number of mips so we don't need to
+    // reallocate them on resize
+    gfx_allocate_descriptor_sets(bloom_ds[0], 15, bindings, 2, 1);
     bindings[0].binding = 1;
     bindings[1].binding = 0;
-    gfx_allocate_descriptor_sets(bloom_ds[1], num_mips-1, bindings, 2, 1);
+    gfx_allocate_descriptor_sets(bloom_ds[1], 15, bindings, 2, 1);
   }
-  gfx_descriptor_buffer(uniform_ds, 0, GFX_TYPE_UNIFORM_BUFFER, &uniform_buffer, 0, sizeof(Mat4));
-  gfx_descriptor_sampled_texture(offscreen_ds, 0, &color_mips[0], GFX_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 0, GFX_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
-  // gfx_descriptor_sampled_texture(offscreen_ds, 0, &color_mips[4], GFX_IMAGE_LAYOUT_GENERAL, 0, GFX_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
-  for (uint32_t i = 1; i < num_mips; i++) {
-    // for downsampling
-    gfx_descriptor_sampled_texture(bloom_ds[0][i-1], 0, &color_mips[i-1], GFX_IMAGE_LAYOUT_GENERAL, 1, GFX_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
-    gfx_descriptor_storage_texture(bloom_ds[0][i-1], 1, &color_mips[i]);
-    // for upsampling
-    gfx_descriptor_storage_texture(bloom_ds[1][i-1], 0, &color_mips[i-1]);
-    gfx_descriptor_sampled_texture(bloom_ds[1][i-1], 1, &color_mips[i], GFX_IMAGE_LAYOUT_GENERAL, 1, GFX_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
-  }
-  gfx_batch_update_descriptor_sets();
+  gfx_descriptor_buffer(uniform_ds, 0, GFX_TYPE_UNIFORM_BUFFER_DYNAMIC, gfx_get_frame_data_buffer(), 0, sizeof(Camera_Uniform));
+  write_descriptor_sets(offscreen_ds, bloom_ds, color_mips, num_mips);
+
+  // Bloom pass is recorded once and reused until it's invalidated.
+  GFX_Command_List bloom_list;
+  gfx_create_command_lists(&bloom_list, 1, 0, 1);
 
 #define NUM_TEAPOTS 16
   Teapot teapots[NUM_TEAPOTS];
@@ -215,6 +248,9 @@ int main(int argc, char** argv)
           case SDLK_SPACE:
             fix_camera = !fix_camera;
             break;
+          case SDLK_t:
+            print_gpu_zones();
+            break;
           }
         break;
       }
@@ -224,6 +260,8 @@ int main(int argc, char** argv)
     if (gfx_resize_window(&window, &window_width, &window_height)) {
       destroy_offscreen_pass_attachments(&image_memory, &color_image, &depth_image, color_mips, &depth_texture);
       num_mips = create_offscreen_pass_attachments(&window, &image_memory, &color_image, &depth_image, color_mips, &depth_texture);
+      // this invalidates bloom_list as it uses updated descriptor sets
+      write_descriptor_sets(offscreen_ds, bloom_ds, color_mips, num_mips);
     }
 
     static float phi = 0.0f;
@@ -235,18 +273,17 @@ int main(int argc, char** argv)
     Vec3 camera_up = { 0.0f, 1.0f, 0.0f };
     Mat4 view = look_at_matrix(camera_pos, camera_target, camera_up);
     Mat4 proj = perspective_matrix(radians(80.0f), (float)window_width/(float)window_height, 0.5f);
-    struct {
-      Mat4 camera_matrix;
-      Mat4 camera_view;
-      Vec3 camera_dir;
-    } uniform;
-    uniform.camera_matrix = mat4_mul(proj, view);
-    uniform.camera_view = view;
-    uniform.camera_dir = vec3_normalize(vec3_sub(camera_pos, camera_target));
-    gfx_copy_to_buffer(&uniform_buffer, &uniform, 0, sizeof(uniform));
 
     gfx_begin_commands(&window);
 
+    // GPU may still read uniforms of previous frames, so they're
+    // written to memory of this frame
+    uint32_t uniform_offset = 0;
+    Camera_Uniform* uniform = gfx_allocate_frame_data(sizeof(Camera_Uniform), &uniform_offset);
+    uniform->camera_matrix = mat4_mul(proj, view);
+    uniform->camera_view = view;
+    uniform->camera_dir = vec3_normalize(vec3_sub(camera_pos, camera_target));
+
     // Offscreen pass.
     {
       float clear_colors[][4] = {
@@ -257,12 +294,13 @@ int main(int argc, char** argv)
       gfx_begin_render_pass(offscreen_pass, textures, 2, clear_colors);
 
       gfx_bind_pipeline(&model_pipeline);
-      gfx_bind_descriptor_sets(&uniform_ds, 1);
+      gfx_bind_descriptor_sets_with_offsets(&uniform_ds, 1, &uniform_offset, 1);
       uint64_t offset = 0;
       gfx_bind_vertex_buffers(&vertex_buffer, 1, &offset);
       gfx_bind_index_buffer(&index_buffer, 0);
 
       for (int i = 0; i < NUM_TEAPOTS; i++) {
+        // model matrix goes to vertex shader and color to fragment shader
         gfx_push_constants(&teapots[i], sizeof(Teapot));
         gfx_draw_indexed(num_indices, 1, 0, 0, 0);
       }
@@ -272,53 +310,14 @@ int main(int argc, char** argv)
 
     // bloom pass
     if (bloom_enabled) {
-      // step 0: transition entire image to general layout
-      gfx_barrier(GFX_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT, GFX_PIPELINE_STAGE_COMPUTE_SHADER,
-                  &(GFX_Image_Barrier) {
-                    .image = &color_image,
-                    .mip_level = 0,
-                    .mip_count = num_mips,
-                    .array_layer = 0,
-                    .layer_count = 1,
-                    .new_layout = GFX_IMAGE_LAYOUT_GENERAL,
-                  }, 1);
-
-      // stage 1: save bright pixels into image
-      gfx_bind_pipeline(&bloom_read_pipeline);
-      uint32_t width, height;
-      gfx_get_image_extent(&color_image, &width, &height, NULL);
-      gfx_bind_descriptor_sets(&bloom_ds[0][0], 1);
-      gfx_dispatch((width+15)/16, (height+15)/16, 1);
-      // stage 2: downsample pass
-      gfx_bind_pipeline(&bloom_downsample_pipeline);
-      for (int i = 1; i < num_mips-1; i++) {
-        width = MAX(width>>1, 1);
-        height = MAX(height>>1, 1);
-        gfx_compute_to_compute_barrier(NULL, 0);
-        gfx_bind_descriptor_sets(&bloom_ds[0][i], 1);
-        gfx_dispatch((width+15)/16, (height+15)/16, 1);
+      if (!gfx_is_command_list_valid(&bloom_list)) {
+        record_bloom_pass(&bloom_list, &color_image, num_mips,
+                          &bloom_read_pipeline, &bloom_downsample_pipeline, &bloom_upsample_pipeline,
+                          bloom_ds);
       }
-      // stage 3: upsample pass
-      gfx_bind_pipeline(&bloom_upsample_pipeline);
-      for (int i = num_mips-2; i >= 0; i--) {
-        gfx_get_image_extent(&color_image, &width, &height, NULL);
-        width = MAX(width>>i, 1);
-        height = MAX(height>>i, 1);
-        gfx_compute_to_compute_barrier(NULL, 0);
-        gfx_bind_descriptor_sets(&bloom_ds[1][i], 1);
-        gfx_dispatch((width+15)/16, (height+15)/16, 1);
-      }
-
-      // stage 4: restore main image to read only layout
-      gfx_barrier(GFX_PIPELINE_STAGE_COMPUTE_SHADER, GFX_PIPELINE_STAGE_FRAGMENT_SHADER,
-                  &(GFX_Image_Barrier) {
-                    .image = &color_image,
-                    .mip_level = 0,
-                    .mip_count = 1,
-                    .array_layer = 0,
-                    .layer_count = 1,
-                    .new_layout = GFX_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-                  }, 1);
+      gfx_gpu_zone_begin("bloom");
+      gfx_cmd_execute_command_lists(gfx_get_command_list(&window), &bloom_list, 1);
+      gfx_gpu_zone_end();
     }
 
     gfx_swap_buffers(&window);
@@ -339,6 +338,7 @@ int main(int argc, char** argv)
 
   gfx_wait_idle_gpu();
 
+  gfx_destroy_command_lists(&bloom_list, 1);
   destroy_offscreen_pass_attachments(&image_memory, &color_image, &depth_image, color_mips, &depth_texture);
 
   gfx_destroy_pipeline(&bloom_upsample_pipeline);
@@ -346,7 +346,6 @@ int main(int argc, char** argv)
   gfx_destroy_pipeline(&bloom_read_pipeline);
   gfx_destroy_pipeline(&display_pipeline);
   gfx_destroy_pipeline(&model_pipeline);
-  gfx_destroy_buffer(&uniform_buffer);
   gfx_destroy_buffer(&index_buffer);
   gfx_destroy_buffer(&vertex_buffer);
   gfx_free_memory(&buffer_memory);
@@ -424,6 +423,81 @@ destroy_offscreen_pass_attachments(GFX_Memory_Block* memory,
   gfx_free_memory(memory);
 }
 
+void
+write_descriptor_sets(GFX_Descriptor_Set offscreen_ds, GFX_Descriptor_Set bloom_ds[2][16],
+                      const GFX_Texture* color_mips, uint32_t num_mips)
+{
+  gfx_descriptor_sampled_texture(offscreen_ds, 0, &color_mips[0], GFX_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, 0, GFX_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+  // gfx_descriptor_sampled_texture(offscreen_ds, 0, &color_mips[4], GFX_IMAGE_LAYOUT_GENERAL, 0, GFX_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+  for (uint32_t i = 1; i < num_mips; i++) {
+    // for downsampling
+    gfx_descriptor_sampled_texture(bloom_ds[0][i-1], 0, &color_mips[i-1], GFX_IMAGE_LAYOUT_GENERAL, 1, GFX_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+    gfx_descriptor_storage_texture(bloom_ds[0][i-1], 1, &color_mips[i]);
+    // for upsampling
+    gfx_descriptor_storage_texture(bloom_ds[1][i-1], 0, &color_mips[i-1]);
+    gfx_descriptor_sampled_texture(bloom_ds[1][i-1], 1, &color_mips[i], GFX_IMAGE_LAYOUT_GENERAL, 1, GFX_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+  }
+  gfx_batch_update_descriptor_sets();
+}
+
+void
+record_bloom_pass(GFX_Command_List* list, GFX_Image* color_image, uint32_t num_mips,
+                  GFX_Pipeline* bloom_read_pipeline, GFX_Pipeline* bloom_downsample_pipeline,
+                  GFX_Pipeline* bloom_upsample_pipeline, GFX_Descriptor_Set bloom_ds[2][16])
+{
+  gfx_begin_reusable_command_list(list);
+
+  // step 0: transition entire image to general layout
+  gfx_cmd_barrier(list, GFX_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT, GFX_PIPELINE_STAGE_COMPUTE_SHADER,
+                  &(GFX_Image_Barrier) {
+                    .image = color_image,
+                    .mip_level = 0,
+                    .mip_count = num_mips,
+                    .array_layer = 0,
+                    .layer_count = 1,
+                    .new_layout = GFX_IMAGE_LAYOUT_GENERAL,
+                  }, 1);
+
+  // stage 1: save bright pixels into image
+  gfx_cmd_bind_pipeline(list, bloom_read_pipeline);
+  uint32_t width, height;
+  gfx_get_image_extent(color_image, &width, &height, NULL);
+  gfx_cmd_bind_descriptor_sets(list, &bloom_ds[0][0], 1);
+  gfx_cmd_dispatch(list, (width+15)/16, (height+15)/16, 1);
+  // stage 2: downsample pass
+  gfx_cmd_bind_pipeline(list, bloom_downsample_pipeline);
+  for (int i = 1; i < (int)num_mips-1; i++) {
+    width = MAX(width>>1, 1);
+    height = MAX(height>>1, 1);
+    gfx_cmd_barrier(list, GFX_PIPELINE_STAGE_COMPUTE_SHADER, GFX_PIPELINE_STAGE_COMPUTE_SHADER, NULL, 0);
+    gfx_cmd_bind_descriptor_sets(list, &bloom_ds[0][i], 1);
+    gfx_cmd_dispatch(list, (width+15)/16, (height+15)/16, 1);
+  }
+  // stage 3: upsample pass
+  gfx_cmd_bind_pipeline(list, bloom_upsample_pipeline);
+  for (int i = num_mips-2; i >= 0; i--) {
+    gfx_get_image_extent(color_image, &width, &height, NULL);
+    width = MAX(width>>i, 1);
+    height = MAX(height>>i, 1);
+    gfx_cmd_barrier(list, GFX_PIPELINE_STAGE_COMPUTE_SHADER, GFX_PIPELINE_STAGE_COMPUTE_SHADER, NULL, 0);
+    gfx_cmd_bind_descriptor_sets(list, &bloom_ds[1][i], 1);
+    gfx_cmd_dispatch(list, (width+15)/16, (height+15)/16, 1);
+  }
+
+  // stage 4: restore main image to read only layout
+  gfx_cmd_barrier(list, GFX_PIPELINE_STAGE_COMPUTE_SHADER, GFX_PIPELINE_STAGE_FRAGMENT_SHADER,
+                  &(GFX_Image_Barrier) {
+                    .image = color_image,
+                    .mip_level = 0,
+                    .mip_count = 1,
+                    .array_layer = 0,
+                    .layer_count = 1,
+                    .new_layout = GFX_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                  }, 1);
+
+  gfx_end_command_list(list);
+}
+
 void
 gen_teapot(Teapot* object)
 {
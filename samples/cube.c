@@ -145,10 +145,11 @@ int main(int argc, char** argv) {
   GFX_Memory_Block buffer_memory;
   {
     GFX_Buffer buffers[] = { vertex_buffer, uniform_buffer };
-    gfx_allocate_memory_for_buffers(&buffer_memory, buffers, 2,
-                                    // We'd like to write to buffers from CPU side, so we're allocating
-                                    // a specific type of memory that can be accessed from CPU.
-                                    GFX_MEMORY_PROPERTY_HOST_VISIBLE|GFX_MEMORY_PROPERTY_HOST_COHERENT);
+    gfx_allocate_buffer_memory(&buffer_memory, buffers, 2,
+                               // We'd like to write to buffers from CPU side, so we're asking
+                               // for memory that can be accessed from CPU. It's also device
+                               // local if GPU has such memory.
+                               GFX_MEMORY_USAGE_CPU_TO_GPU);
     vertex_buffer = buffers[0];
     uniform_buffer = buffers[1];
   }
@@ -0,0 +1,237 @@
+/* lida_gfx sample: draw_sorting.c
+
+   This sample shows how a draw queue reduces number of state changes
+   and draw calls. A grid of quads is drawn with several pipelines and
+   materials in random order which changes every frame. With the draw
+   queue enabled draws are sorted by state and quads with the same
+   material are merged into instanced draws.
+
+   Time spent recording commands and number of state commands recorded
+   and skipped are printed to stdout periodically, so this sample can
+   be used as a benchmark.
+
+   Usage: press 'd' to toggle the draw queue.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <SDL.h>
+#include "lida_gfx.h"
+#include "util.h"
+
+#define GRID_SIZE 64
+#define NUM_QUADS (GRID_SIZE*GRID_SIZE)
+#define NUM_PIPELINES 4
+#define NUM_MATERIALS 16
+// NOTE: minUniformBufferOffsetAlignment is at most 256 bytes
+#define MATERIAL_STRIDE 256
+
+// memory for draw queue: 80 bytes per draw plus a state on every
+// material change
+static char queue_memory[NUM_QUADS * (80 + 256)];
+
+static void shuffle(uint32_t* array, uint32_t count);
+
+int main(int argc, char** argv)
+{
+  int r = gfx_init(&(GFX_Init_Info) {
+      .app_name = "lida_gfx_sample_draw_sorting",
+      .app_version = 0,
+      .enable_debug_layers = 1,
+      .gpu_id = 0,
+      .log_fn = log_func,
+      .load_shader_fn = SDL_LoadFile,
+      .free_shader_fn = SDL_free
+    });
+  if (r != 0) {
+    printf("FATAL: error ocurred while initialising graphics module!\n");
+    return -1;
+  }
+
+  SDL_Window* handle = SDL_CreateWindow("lida_gfx sample: draw sorting", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, 1080, 720, SDL_WINDOW_VULKAN);
+  GFX_Window window;
+  gfx_create_window_sdl(&window, handle, 1);
+
+  // Vertex buffer holds 6 vertices of a quad and offsets of all quads
+  // in grid. Offsets are read per instance, so quad with index 'i' is
+  // drawn with first_instance=i.
+  GFX_Buffer vertex_buffer, uniform_buffer;
+  gfx_create_buffer(&vertex_buffer, GFX_BUFFER_USAGE_VERTEX, sizeof(Vec2) * (6 + NUM_QUADS));
+  gfx_create_buffer(&uniform_buffer, GFX_BUFFER_USAGE_UNIFORM, MATERIAL_STRIDE * NUM_MATERIALS);
+  GFX_Memory_Block buffer_memory;
+  {
+    GFX_Buffer buffers[] = { vertex_buffer, uniform_buffer };
+    gfx_allocate_memory_for_buffers(&buffer_memory, buffers, 2,
+                                    GFX_MEMORY_PROPERTY_HOST_VISIBLE|GFX_MEMORY_PROPERTY_HOST_COHERENT);
+    vertex_buffer = buffers[0];
+    uniform_buffer = buffers[1];
+  }
+  {
+    const float size = 0.9f / GRID_SIZE;
+    Vec2 quad[6] = {
+      { 0.0f, 0.0f }, { size, 0.0f }, { size, size },
+      { size, size }, { 0.0f, size }, { 0.0f, 0.0f },
+    };
+    gfx_copy_to_buffer(&vertex_buffer, quad, 0, sizeof(quad));
+    for (uint32_t i = 0; i < NUM_QUADS; i++) {
+      Vec2 offset = { (float)(i % GRID_SIZE) / GRID_SIZE, (float)(i / GRID_SIZE) / GRID_SIZE };
+      gfx_copy_to_buffer(&vertex_buffer, &offset, sizeof(quad) + i * sizeof(Vec2), sizeof(Vec2));
+    }
+    for (uint32_t i = 0; i < NUM_MATERIALS; i++) {
+      Vec4 color = { (i & 1) ? 0.9f : 0.2f, (i & 2) ? 0.9f : 0.3f, (i & 4) ? 0.9f : 0.4f, 1.0f };
+      if (i & 8) {
+        color.x *= 0.5f;
+        color.y *= 0.5f;
+      }
+      gfx_copy_to_buffer(&uniform_buffer, &color, i * MATERIAL_STRIDE, sizeof(Vec4));
+    }
+  }
+
+  GFX_Vertex_Binding vertex_bindings[2] = {
+    { .binding = 0, .stride = sizeof(Vec2), .per_instance = 0 },
+    { .binding = 1, .stride = sizeof(Vec2), .per_instance = 1 },
+  };
+  GFX_Vertex_Attribute vertex_attributes[2] = {
+    { .location = 0, .binding = 0, .format = GFX_FORMAT_R32G32_SFLOAT, .offset = 0 },
+    { .location = 1, .binding = 1, .format = GFX_FORMAT_R32G32_SFLOAT, .offset = 0 },
+  };
+  // Pipelines are the same, but each of them has own handle. In a
+  // real application they'd differ by shaders or blending.
+  GFX_Pipeline pipelines[NUM_PIPELINES];
+  GFX_Pipeline_Desc descs[NUM_PIPELINES];
+  for (uint32_t i = 0; i < NUM_PIPELINES; i++) {
+    descs[i] = (GFX_Pipeline_Desc) {
+      .vertex_shader          = "shaders/quad.vert.spv",
+      .fragment_shader        = "shaders/colored2d.frag.spv",
+      .vertex_binding_count   = 2,
+      .vertex_bindings        = vertex_bindings,
+      .vertex_attribute_count = 2,
+      .vertex_attributes      = vertex_attributes,
+      .render_pass            = gfx_get_main_pass(&window),
+    };
+  }
+  gfx_create_graphics_pipelines(pipelines, NUM_PIPELINES, descs);
+
+  GFX_Descriptor_Set material_ds[NUM_MATERIALS];
+  gfx_allocate_descriptor_sets(material_ds, NUM_MATERIALS, &(GFX_Descriptor_Set_Binding) {
+      .binding = 0,
+      .type    = GFX_TYPE_UNIFORM_BUFFER,
+      .stages  = GFX_STAGE_VERTEX
+    }, 1,
+    0);
+  for (uint32_t i = 0; i < NUM_MATERIALS; i++) {
+    gfx_descriptor_buffer(material_ds[i], 0, GFX_TYPE_UNIFORM_BUFFER, &uniform_buffer, i * MATERIAL_STRIDE, sizeof(Vec4));
+  }
+  gfx_batch_update_descriptor_sets();
+
+  // Quads are split into NUM_MATERIALS stripes, order in which they're
+  // drawn is shuffled every frame.
+  static uint32_t draw_order[NUM_QUADS];
+  for (uint32_t i = 0; i < NUM_QUADS; i++) {
+    draw_order[i] = i;
+  }
+  srand(69);
+
+  int use_queue = 1;
+  GFX_Draw_Queue queue;
+  double record_time = 0.0;
+  uint32_t num_frames = 0;
+
+  int running = 1;
+  SDL_Event event;
+  while (running) {
+
+    while (SDL_PollEvent(&event)) {
+      switch (event.type) {
+      case SDL_QUIT:
+        running = 0;
+        break;
+      case SDL_KEYDOWN:
+        switch (event.key.keysym.sym) {
+        case SDLK_q:
+        case SDLK_ESCAPE:
+          running = 0;
+          break;
+        case SDLK_d:
+          use_queue = !use_queue;
+          record_time = 0.0;
+          num_frames = 0;
+          break;
+        }
+        break;
+      }
+    }
+
+    shuffle(draw_order, NUM_QUADS);
+
+    gfx_begin_commands(&window);
+    gfx_swap_buffers(&window);
+    {
+      GFX_Command_List* list = gfx_get_command_list(&window);
+      gfx_begin_main_pass(&window);
+
+      uint64_t start = SDL_GetPerformanceCounter();
+      if (use_queue) {
+        gfx_begin_draw_queue(list, &queue, queue_memory, sizeof(queue_memory));
+      }
+      GFX_Buffer buffers[2] = { vertex_buffer, vertex_buffer };
+      uint64_t offsets[2] = { 0, 6 * sizeof(Vec2) };
+      gfx_bind_vertex_buffers(buffers, 2, offsets);
+      for (uint32_t i = 0; i < NUM_QUADS; i++) {
+        uint32_t quad = draw_order[i];
+        uint32_t material = quad / (NUM_QUADS / NUM_MATERIALS);
+        gfx_bind_pipeline(&pipelines[material % NUM_PIPELINES]);
+        gfx_bind_descriptor_sets(&material_ds[material], 1);
+        // sort by quad index inside one material, this way adjacent
+        // quads are merged to one draw
+        gfx_set_draw_order(0, (float)quad / NUM_QUADS);
+        gfx_draw(6, 1, 0, quad);
+      }
+      if (use_queue) {
+        gfx_end_draw_queue(list);
+      }
+      record_time += (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+      gfx_end_render_pass();
+
+      num_frames++;
+      if (num_frames == 256) {
+        uint32_t issued, elided;
+        gfx_get_command_list_stats(list, &issued, &elided);
+        printf("draw queue %s: recording took %.3f ms, state commands issued=%u elided=%u\n",
+               use_queue ? "on" : "off", record_time * 1000.0 / num_frames, issued, elided);
+        record_time = 0.0;
+        num_frames = 0;
+      }
+    }
+
+    gfx_submit_and_present(&window);
+  }
+
+  gfx_wait_idle_gpu();
+
+  for (uint32_t i = 0; i < NUM_PIPELINES; i++) {
+    gfx_destroy_pipeline(&pipelines[i]);
+  }
+  gfx_destroy_buffer(&uniform_buffer);
+  gfx_destroy_buffer(&vertex_buffer);
+  gfx_free_memory(&buffer_memory);
+
+  gfx_destroy_window(&window);
+
+  gfx_free();
+  printf("\nFreed vulkan successfully!\n");
+
+  return 0;
+}
+
+void
+shuffle(uint32_t* array, uint32_t count)
+{
+  for (uint32_t i = count-1; i > 0; i--) {
+    uint32_t j = rand() % (i+1);
+    uint32_t tmp = array[i];
+    array[i] = array[j];
+    array[j] = tmp;
+  }
+}
@@ -0,0 +1,162 @@
+/* lida_gfx sample: frames_in_flight.c
+
+   This sample measures how much CPU and GPU work overlap depending on
+   'GFX_Init_Info::frames_in_flight'. Each frame spends some time on
+   CPU, like a game updating its world, and renders many overlapping
+   triangles to an offscreen target. The library is initialised with
+   2 and then with 4 frames in flight, and frames per second and time
+   CPU was blocked waiting for GPU are printed for both.
+
+   When CPU and GPU take similar time per frame, more frames in flight
+   hide jitter of either side, and CPU waits less. It works without a
+   window or SDL, so it can be run on lavapipe.
+
+   Usage: frames_in_flight [num_frames] [cpu_work_us] [num_triangles]
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lida_gfx.h"
+#include "util.h"
+
+#define WIDTH 512
+#define HEIGHT 512
+
+static void*
+load_file(const char* path, size_t* size)
+{
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+  fseek(file, 0, SEEK_END);
+  *size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  void* data = malloc(*size);
+  if (fread(data, 1, *size, file) != *size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(file);
+  return data;
+}
+
+static void
+free_file(void* data)
+{
+  free(data);
+}
+
+static double
+get_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Simulate CPU work of a frame. We spin instead of sleeping, so the
+// thread is busy like it would be in a real application.
+static void
+do_cpu_work(double seconds)
+{
+  double end = get_time() + seconds;
+  while (get_time() < end)
+    ;
+}
+
+// Render 'num_frames' frames and return frames per second. Total time
+// CPU waited for GPU is written to 'wait_time'.
+static double
+run_benchmark(uint32_t frames_in_flight, uint32_t num_frames, double cpu_work,
+	      uint32_t num_triangles, double* wait_time)
+{
+  int r = gfx_init(&(GFX_Init_Info) {
+      .app_name = "lida_gfx_sample_frames_in_flight",
+      .app_version = 0,
+      .enable_debug_layers = 0,
+      .gpu_id = 0,
+      .frames_in_flight = frames_in_flight,
+      .headless = 1,
+      .log_fn = log_func,
+      .load_shader_fn = load_file,
+      .free_shader_fn = free_file
+    });
+  if (r != 0) {
+    printf("FATAL: error ocurred while initialising graphics module!\n");
+    return -1.0;
+  }
+
+  GFX_Offscreen_Target target;
+  if (gfx_create_offscreen_target(&target, WIDTH, HEIGHT, GFX_FORMAT_R8G8B8A8_UNORM) != 0) {
+    printf("FATAL: failed to create offscreen target\n");
+    return -1.0;
+  }
+  GFX_Pipeline pipeline;
+  GFX_Pipeline_Desc desc = {
+    .vertex_shader   = "shaders/triangle.vert.spv",
+    .fragment_shader = "shaders/triangle.frag.spv",
+    .render_pass     = gfx_get_offscreen_pass(&target),
+  };
+  if (gfx_create_graphics_pipelines(&pipeline, 1, &desc) != 0) {
+    printf("FATAL: failed to create triangle pipeline\n");
+    return -1.0;
+  }
+
+  *wait_time = 0.0;
+  double start = get_time();
+  for (uint32_t i = 0; i < num_frames; i++) {
+    if (gfx_begin_offscreen_frame(&target) == NULL) {
+      printf("FATAL: failed to begin frame\n");
+      return -1.0;
+    }
+    do_cpu_work(cpu_work);
+    gfx_begin_offscreen_pass(&target);
+    {
+      GFX_Clear_Color clear_color = { 0.0f, 0.0f, 0.0f, 1.0f };
+      gfx_clear_attachment(&clear_color, 0, 0, WIDTH, HEIGHT);
+      gfx_bind_pipeline(&pipeline);
+      // all instances cover the same pixels, so GPU time grows
+      // linearly with number of triangles
+      gfx_draw(3, num_triangles, 0, 0);
+    }
+    gfx_end_render_pass();
+    if (gfx_submit_offscreen_frame(&target, 0) == 0) {
+      printf("FATAL: failed to submit frame\n");
+      return -1.0;
+    }
+    GFX_Frame_Stats stats;
+    gfx_get_frame_stats(&stats);
+    *wait_time += stats.wait_time * 1e-9;
+  }
+  gfx_wait_idle_gpu();
+  double elapsed = get_time() - start;
+
+  gfx_destroy_pipeline(&pipeline);
+  gfx_destroy_offscreen_target(&target);
+  gfx_free();
+  return num_frames / elapsed;
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t num_frames = (argc > 1) ? atoi(argv[1]) : 500;
+  double cpu_work = ((argc > 2) ? atoi(argv[2]) : 2000) * 1e-6;
+  uint32_t num_triangles = (argc > 3) ? atoi(argv[3]) : 64;
+
+  log_enable_colors = 0;
+  const uint32_t configs[] = { 2, 4 };
+  double fps[2];
+  for (uint32_t i = 0; i < 2; i++) {
+    double wait_time;
+    fps[i] = run_benchmark(configs[i], num_frames, cpu_work, num_triangles, &wait_time);
+    if (fps[i] < 0.0)
+      return -1;
+    printf("%u frames in flight: %.1f FPS, CPU waited for GPU %.3f ms per frame\n",
+	   configs[i], fps[i], wait_time * 1e3 / num_frames);
+  }
+  printf("4 frames in flight are %.2fx as fast as 2\n", fps[1] / fps[0]);
+
+  return 0;
+}
@@ -0,0 +1,167 @@
+/* lida_gfx sample: headless_dft.c
+
+   This sample runs the equalizer's Discrete Fourier Transform shader
+   as a batch job, without a window or SDL. It can run on a server
+   without display, or on a software implementation like lavapipe.
+
+   For each job we fill the input buffer with a sum of two sine waves,
+   record a dispatch with 'gfx_begin_compute()', submit it with
+   'gfx_submit()' and wait for the returned fence. Then we print the
+   strongest frequencies, which must match the frequencies of waves.
+
+   Build the library with LIDA_GFX_HEADLESS=ON to drop the dependency
+   on SDL2; the sample works with the regular build too.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lida_gfx.h"
+#include "util.h"
+
+static void*
+load_file(const char* path, size_t* size)
+{
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+  fseek(file, 0, SEEK_END);
+  *size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  void* data = malloc(*size);
+  if (fread(data, 1, *size, file) != *size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(file);
+  return data;
+}
+
+static void
+free_file(void* data)
+{
+  free(data);
+}
+
+#define NUM_SAMPLES 512
+#define NUM_FREQS (NUM_SAMPLES/2)
+
+// Layout of vertices generated by fourier_transform.comp(std140).
+typedef struct {
+  float position[2];
+  float pad0[2];
+  float color[3];
+  float pad1;
+} DFT_Vertex;
+
+int main(int argc, char** argv)
+{
+  log_enable_colors = 0;
+  int r = gfx_init(&(GFX_Init_Info) {
+      .app_name = "lida_gfx_sample_headless_dft",
+      .app_version = 0,
+      .enable_debug_layers = 1,
+      .gpu_id = 0,
+      .headless = 1,
+      .log_fn = log_func,
+      .load_shader_fn = load_file,
+      .free_shader_fn = free_file
+    });
+  if (r != 0) {
+    printf("FATAL: error ocurred while initialising graphics module!\n");
+    return -1;
+  }
+
+  // Samples are written by CPU every job, frequencies are read back.
+  GFX_Buffer sample_buffer, freq_buffer;
+  gfx_create_buffer(&sample_buffer, GFX_BUFFER_USAGE_STORAGE, NUM_SAMPLES * sizeof(float));
+  gfx_create_buffer(&freq_buffer, GFX_BUFFER_USAGE_STORAGE, NUM_FREQS * 6 * sizeof(DFT_Vertex));
+  GFX_Memory_Block sample_memory, freq_memory;
+  gfx_allocate_buffer_memory(&sample_memory, &sample_buffer, 1, GFX_MEMORY_USAGE_CPU_TO_GPU);
+  gfx_allocate_buffer_memory(&freq_memory, &freq_buffer, 1, GFX_MEMORY_USAGE_READBACK);
+  float* samples = gfx_get_buffer_data(&sample_buffer);
+  const DFT_Vertex* verts = gfx_get_buffer_data(&freq_buffer);
+
+  GFX_Pipeline fourier_pipeline;
+  {
+    const char* shaders[] = { "shaders/fourier_transform.comp.spv" };
+    if (gfx_create_compute_pipelines(&fourier_pipeline, 1, shaders) != 0) {
+      printf("FATAL: failed to create compute pipeline\n");
+      return -1;
+    }
+  }
+
+  GFX_Descriptor_Set fourier_ds;
+  {
+    GFX_Descriptor_Set_Binding bindings[2] = {
+      { .binding = 0,
+        .type = GFX_TYPE_STORAGE_BUFFER,
+        .stages = GFX_STAGE_COMPUTE, },
+      { .binding = 1,
+        .type = GFX_TYPE_STORAGE_BUFFER,
+        .stages = GFX_STAGE_COMPUTE, },
+    };
+    gfx_allocate_descriptor_sets(&fourier_ds, 1, bindings, 2, 0);
+    gfx_descriptor_buffer(fourier_ds, 0, GFX_TYPE_STORAGE_BUFFER, &sample_buffer, 0, 0);
+    gfx_descriptor_buffer(fourier_ds, 1, GFX_TYPE_STORAGE_BUFFER, &freq_buffer, 0, 0);
+  }
+  gfx_batch_update_descriptor_sets();
+
+  const uint32_t jobs[][2] = { {5, 40}, {17, 100}, {64, 200} };
+  int failed = 0;
+  for (uint32_t job = 0; job < sizeof(jobs)/sizeof(jobs[0]); job++) {
+    const float pi = 3.14159265358979f;
+    for (uint32_t i = 0; i < NUM_SAMPLES; i++) {
+      samples[i] = 0.5f * sinf(2.0f * pi * jobs[job][0] * i / NUM_SAMPLES) +
+        0.25f * sinf(2.0f * pi * jobs[job][1] * i / NUM_SAMPLES);
+    }
+
+    if (gfx_begin_compute() == NULL) {
+      printf("FATAL: failed to begin compute batch\n");
+      return -1;
+    }
+    struct {
+      uint32_t samples;
+      uint32_t freqs;
+    } transform_info = { NUM_SAMPLES, NUM_FREQS };
+    gfx_bind_pipeline(&fourier_pipeline);
+    gfx_bind_descriptor_sets(&fourier_ds, 1);
+    gfx_push_constants(&transform_info, sizeof(transform_info));
+    gfx_dispatch((NUM_FREQS+63)/64, 1, 1);
+    // make results visible to CPU
+    gfx_barrier(GFX_PIPELINE_STAGE_COMPUTE_SHADER, GFX_PIPELINE_STAGE_HOST, NULL, 0);
+    GFX_Fence fence = gfx_submit();
+    if (fence == 0 || gfx_wait(fence, UINT64_MAX) != 0) {
+      printf("FATAL: failed to run compute batch\n");
+      return -1;
+    }
+
+    // the second vertex of each rect lies on top of it, its height is
+    // amplitude of frequency
+    uint32_t peaks[2] = { 0, 0 };
+    for (uint32_t k = 1; k < NUM_FREQS; k++) {
+      float amplitude = verts[k*6+1].position[1];
+      if (amplitude > verts[peaks[0]*6+1].position[1]) {
+        peaks[1] = peaks[0];
+        peaks[0] = k;
+      } else if (amplitude > verts[peaks[1]*6+1].position[1]) {
+        peaks[1] = k;
+      }
+    }
+    int ok = (peaks[0] == jobs[job][0] && peaks[1] == jobs[job][1]);
+    printf("job %u: expected peaks at %u and %u, got %u and %u: %s\n",
+           job, jobs[job][0], jobs[job][1], peaks[0], peaks[1], ok ? "OK" : "FAIL");
+    failed |= !ok;
+  }
+
+  gfx_wait_idle_gpu();
+
+  gfx_destroy_pipeline(&fourier_pipeline);
+  gfx_destroy_buffer(&sample_buffer);
+  gfx_destroy_buffer(&freq_buffer);
+  gfx_free_memory(&sample_memory);
+  gfx_free_memory(&freq_memory);
+
+  gfx_free();
+
+  return failed;
+}
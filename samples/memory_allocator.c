@@ -0,0 +1,212 @@
+/* lida_gfx sample: memory_allocator.c
+
+   This sample checks the GPU memory allocator. Buffers of random
+   sizes get their own memory blocks from host visible memory and are
+   freed in random order, so blocks are split and merged all the time.
+   After each step we check that:
+   - mapped ranges of live blocks don't overlap and the pattern
+     written to each block is intact;
+   - 'gfx_get_memory_stats()' reports as many allocations as we hold
+     and at least as many used bytes as we asked for.
+   When everything is freed, stats must be the same as before we
+   started, with every page we added merged back to one free block.
+
+   It works without a window or SDL, so it can be run on lavapipe.
+   Returns 0 if all checks pass.
+
+   Usage: memory_allocator [num_steps] [seed]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lida_gfx.h"
+#include "util.h"
+
+#define MAX_BLOCKS 512
+#define MAX_BLOCK_SIZE (256 * 1024)
+
+typedef struct {
+  GFX_Buffer buffer;
+  GFX_Memory_Block memory;
+  unsigned char* data;
+  uint32_t size;
+  int live;
+} Block;
+
+static Block blocks[MAX_BLOCKS];
+static uint32_t rng_state;
+
+static uint32_t
+random_u32()
+{
+  // xorshift32, so runs are reproducible with the same seed
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+static int
+compare_blocks(const void* l, const void* r)
+{
+  const Block* left = *(const Block* const*)l, *right = *(const Block* const*)r;
+  if (left->data == right->data)
+    return 0;
+  return (left->data < right->data) ? -1 : 1;
+}
+
+// Return number of failed checks.
+static int
+check_blocks(const GFX_Memory_Stats* base, uint32_t step)
+{
+  Block* sorted[MAX_BLOCKS];
+  uint32_t num_live = 0;
+  uint64_t live_bytes = 0;
+  int failed = 0;
+  for (uint32_t i = 0; i < MAX_BLOCKS; i++) {
+    if (!blocks[i].live)
+      continue;
+    sorted[num_live++] = &blocks[i];
+    live_bytes += blocks[i].size;
+    for (uint32_t j = 0; j < blocks[i].size; j++) {
+      if (blocks[i].data[j] != (unsigned char)i) {
+	printf("step %u: block %u was overwritten at byte %u\n", step, i, j);
+	failed++;
+	break;
+      }
+    }
+  }
+  // mappings of different pages never overlap, so it's enough to
+  // compare host addresses
+  qsort(sorted, num_live, sizeof(Block*), compare_blocks);
+  for (uint32_t i = 1; i < num_live; i++) {
+    if (sorted[i-1]->data + sorted[i-1]->size > sorted[i]->data) {
+      printf("step %u: blocks %u and %u overlap\n", step,
+	     (uint32_t)(sorted[i-1] - blocks), (uint32_t)(sorted[i] - blocks));
+      failed++;
+    }
+  }
+  GFX_Memory_Stats stats;
+  gfx_get_memory_stats(&stats);
+  if (stats.num_allocations != base->num_allocations + num_live) {
+    printf("step %u: %u allocations reported, expected %u\n", step,
+	   stats.num_allocations, base->num_allocations + num_live);
+    failed++;
+  }
+  if (stats.used_bytes < base->used_bytes + live_bytes ||
+      stats.used_bytes + stats.largest_free_block > stats.allocated_bytes) {
+    printf("step %u: %lu used bytes reported, expected at least %lu\n", step,
+	   (unsigned long)stats.used_bytes, (unsigned long)(base->used_bytes + live_bytes));
+    failed++;
+  }
+  return failed;
+}
+
+static int
+allocate_block(uint32_t index)
+{
+  Block* block = &blocks[index];
+  // multiples of 256 bytes, the allocator's granularity
+  block->size = (random_u32() % (MAX_BLOCK_SIZE / 256) + 1) * 256;
+  if (gfx_create_buffer(&block->buffer, GFX_BUFFER_USAGE_TRANSFER_SRC, block->size) != 0)
+    return -1;
+  if (gfx_allocate_buffer_memory(&block->memory, &block->buffer, 1, GFX_MEMORY_USAGE_CPU_TO_GPU) != 0) {
+    gfx_destroy_buffer(&block->buffer);
+    return -1;
+  }
+  block->data = gfx_get_buffer_data(&block->buffer);
+  if (block->data == NULL) {
+    gfx_destroy_buffer(&block->buffer);
+    gfx_free_memory(&block->memory);
+    return -1;
+  }
+  memset(block->data, (unsigned char)index, block->size);
+  block->live = 1;
+  return 0;
+}
+
+static void
+free_block(uint32_t index)
+{
+  gfx_destroy_buffer(&blocks[index].buffer);
+  gfx_free_memory(&blocks[index].memory);
+  blocks[index].live = 0;
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t num_steps = (argc > 1) ? atoi(argv[1]) : 20000;
+  rng_state = (argc > 2) ? atoi(argv[2]) : 1234567;
+  if (rng_state == 0)
+    rng_state = 1;
+
+  log_enable_colors = 0;
+  int r = gfx_init(&(GFX_Init_Info) {
+      .app_name = "lida_gfx_sample_memory_allocator",
+      .app_version = 0,
+      .enable_debug_layers = 0,
+      .gpu_id = 0,
+      .headless = 1,
+      .log_fn = log_func,
+    });
+  if (r != 0) {
+    printf("FATAL: error ocurred while initialising graphics module!\n");
+    return -1;
+  }
+
+  // library allocates some memory for itself
+  GFX_Memory_Stats base;
+  gfx_get_memory_stats(&base);
+
+  int failed = 0;
+  uint32_t num_allocs = 0, num_frees = 0;
+  for (uint32_t step = 0; step < num_steps && failed == 0; step++) {
+    uint32_t index = random_u32() % MAX_BLOCKS;
+    if (blocks[index].live) {
+      free_block(index);
+      num_frees++;
+    } else {
+      if (allocate_block(index) != 0) {
+	printf("FATAL: failed to allocate block of %u bytes\n", blocks[index].size);
+	return -1;
+      }
+      num_allocs++;
+    }
+    // checking every block is slow, do it once in a while
+    if (step % 64 == 0)
+      failed += check_blocks(&base, step);
+  }
+  failed += check_blocks(&base, num_steps);
+
+  GFX_Memory_Stats end;
+  gfx_get_memory_stats(&end);
+  for (uint32_t i = 0; i < MAX_BLOCKS; i++) {
+    if (blocks[i].live)
+      free_block(i);
+  }
+  GFX_Memory_Stats stats;
+  gfx_get_memory_stats(&stats);
+  if (stats.num_allocations != base.num_allocations || stats.used_bytes != base.used_bytes) {
+    printf("%u allocations and %lu used bytes left, expected %u and %lu\n",
+	   stats.num_allocations, (unsigned long)stats.used_bytes,
+	   base.num_allocations, (unsigned long)base.used_bytes);
+    failed++;
+  }
+  // pages added for our blocks must be a single free block each, and
+  // free tails of pages we shared with the library must be whole again
+  if (stats.num_free_blocks - stats.num_pages != base.num_free_blocks - base.num_pages) {
+    printf("free blocks were not merged: %u free blocks in %u pages, expected %u in %u\n",
+	   stats.num_free_blocks, stats.num_pages, base.num_free_blocks + stats.num_pages - base.num_pages,
+	   stats.num_pages);
+    failed++;
+  }
+
+  printf("%u allocations, %u frees, %u pages at the end of run, fragmentation %.3f\n",
+	 num_allocs, num_frees, end.num_pages, end.fragmentation);
+  printf("%s\n", failed ? "FAIL" : "OK");
+
+  gfx_free();
+
+  return failed != 0;
+}
@@ -0,0 +1,178 @@
+/* lida_gfx sample: offscreen_triangle.c
+
+   This sample renders the triangle from triangle.c to an offscreen
+   target, like a server rendering thumbnails or video frames, and
+   prints frames per second and counters of the last frame. It works
+   without a window or SDL, so it can be run on lavapipe.
+
+   Each frame is read back to host memory. Readbacks are taken with
+   'gfx_poll_readback()' which doesn't block, so CPU keeps recording
+   next frames while GPU renders and copies previous ones.
+
+   If the library is built with LIDA_GFX_TRACE, a Chrome trace of the
+   last frames is written to offscreen_triangle.json. Open it with
+   chrome://tracing or ui.perfetto.dev.
+
+   Usage: offscreen_triangle [num_frames] [width] [height]
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lida_gfx.h"
+#include "util.h"
+
+static void*
+load_file(const char* path, size_t* size)
+{
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+  fseek(file, 0, SEEK_END);
+  *size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  void* data = malloc(*size);
+  if (fread(data, 1, *size, file) != *size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(file);
+  return data;
+}
+
+static void
+free_file(void* data)
+{
+  free(data);
+}
+
+#ifdef LIDA_GFX_TRACE
+static void
+write_trace(const char* data, size_t size, void* udata)
+{
+  fwrite(data, 1, size, udata);
+}
+#endif
+
+static double
+get_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Check that triangle covers center of image and corners are cleared.
+static int
+check_readback(const GFX_Readback* readback)
+{
+  const uint8_t* center = (const uint8_t*)readback->data +
+    (readback->height/2) * readback->row_pitch + (readback->width/2) * 4;
+  const uint8_t* corner = readback->data;
+  return memcmp(center, corner, 4) != 0 && corner[0] == 0 && corner[3] == 255;
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t num_frames = (argc > 1) ? atoi(argv[1]) : 1000;
+  uint32_t width = (argc > 2) ? atoi(argv[2]) : 512;
+  uint32_t height = (argc > 3) ? atoi(argv[3]) : 512;
+
+  log_enable_colors = 0;
+  int r = gfx_init(&(GFX_Init_Info) {
+      .app_name = "lida_gfx_sample_offscreen_triangle",
+      .app_version = 0,
+      .enable_debug_layers = 0,
+      .gpu_id = 0,
+      .headless = 1,
+      .enable_gpu_zones = 1,
+      .log_fn = log_func,
+      .load_shader_fn = load_file,
+      .free_shader_fn = free_file
+    });
+  if (r != 0) {
+    printf("FATAL: error ocurred while initialising graphics module!\n");
+    return -1;
+  }
+
+  GFX_Offscreen_Target target;
+  if (gfx_create_offscreen_target(&target, width, height, GFX_FORMAT_R8G8B8A8_UNORM) != 0) {
+    printf("FATAL: failed to create offscreen target\n");
+    return -1;
+  }
+
+  GFX_Pipeline triangle_pipeline;
+  GFX_Pipeline_Desc desc = {
+    .vertex_shader   = "shaders/triangle.vert.spv",
+    .fragment_shader = "shaders/triangle.frag.spv",
+    .render_pass     = gfx_get_offscreen_pass(&target),
+  };
+  if (gfx_create_graphics_pipelines(&triangle_pipeline, 1, &desc) != 0) {
+    printf("FATAL: failed to create triangle pipeline\n");
+    return -1;
+  }
+
+  uint32_t num_readbacks = 0, num_failed = 0;
+  GFX_Readback readback;
+  double start = get_time();
+  for (uint32_t i = 0; i < num_frames; i++) {
+    if (gfx_begin_offscreen_frame(&target) == NULL) {
+      printf("FATAL: failed to begin frame\n");
+      return -1;
+    }
+    // take finished frames, a real server would encode or save them
+    // here. Readback of the frame we're about to render is complete
+    // at this point, so nothing is dropped.
+    while (gfx_poll_readback(&target, &readback, 0)) {
+      num_failed += !check_readback(&readback);
+      num_readbacks++;
+    }
+    gfx_begin_offscreen_pass(&target);
+    {
+      GFX_Clear_Color clear_color = { 0.0f, 0.0f, 0.0f, 1.0f };
+      gfx_clear_attachment(&clear_color, 0, 0, width, height);
+      gfx_bind_pipeline(&triangle_pipeline);
+      gfx_draw(3, 1, 0, 0);
+    }
+    gfx_end_render_pass();
+    if (gfx_submit_offscreen_frame(&target, 1) == 0) {
+      printf("FATAL: failed to submit frame\n");
+      return -1;
+    }
+  }
+  // frames still in flight
+  while (gfx_poll_readback(&target, &readback, 1)) {
+    num_failed += !check_readback(&readback);
+    num_readbacks++;
+  }
+  double elapsed = get_time() - start;
+
+  printf("rendered %u frames of %ux%u in %.3f s: %.1f FPS\n",
+	 num_frames, width, height, elapsed, num_frames / elapsed);
+  printf("read back %u frames, %u are wrong, %u are dropped\n",
+	 num_readbacks, num_failed, num_frames - num_readbacks);
+  GFX_Frame_Stats stats;
+  gfx_get_frame_stats(&stats);
+  printf("last frame: %u draws, %lu triangles, %u barriers, %lu bytes copied, waited %.3f ms\n",
+	 stats.num_draws, (unsigned long)stats.num_triangles, stats.num_barriers,
+	 (unsigned long)stats.copied_bytes, stats.wait_time * 1e-6);
+
+  gfx_wait_idle_gpu();
+
+#ifdef LIDA_GFX_TRACE
+  FILE* trace_file = fopen("offscreen_triangle.json", "w");
+  if (trace_file) {
+    gfx_write_trace(write_trace, trace_file);
+    fclose(trace_file);
+  }
+#endif
+
+  gfx_destroy_pipeline(&triangle_pipeline);
+  gfx_destroy_offscreen_target(&target);
+
+  gfx_free();
+
+  return num_failed != 0;
+}
@@ -0,0 +1,187 @@
+/* lida_gfx sample: parallel_recording.c
+
+   This sample measures how recording of draws scales with number of
+   threads. Render pass of an offscreen target is begun with secondary
+   contents, then each thread continues it in its own secondary list
+   with 'gfx_begin_secondary_command_list()' and records its share of
+   draws. Main list executes secondary lists and submits the frame.
+
+   Draws recorded per second are printed for 1 to 16 threads. Only
+   recording is timed, time GPU spends on draws is not included. It
+   works without a window or SDL, so it can be run on lavapipe.
+
+   Usage: parallel_recording [num_frames] [draws_per_frame]
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lida_gfx.h"
+#include "util.h"
+
+#define WIDTH 256
+#define HEIGHT 256
+#define MAX_THREADS 16
+
+typedef struct {
+  GFX_Command_List* list;
+  const GFX_Command_List* parent;
+  GFX_Pipeline* pipeline;
+  uint32_t num_draws;
+  int result;
+} Worker;
+
+static GFX_Command_List secondary_lists[MAX_THREADS];
+
+static void*
+load_file(const char* path, size_t* size)
+{
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+  fseek(file, 0, SEEK_END);
+  *size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  void* data = malloc(*size);
+  if (fread(data, 1, *size, file) != *size) {
+    free(data);
+    data = NULL;
+  }
+  fclose(file);
+  return data;
+}
+
+static void
+free_file(void* data)
+{
+  free(data);
+}
+
+static double
+get_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void*
+record_draws(void* arg)
+{
+  Worker* worker = arg;
+  worker->result = gfx_begin_secondary_command_list(worker->list, worker->parent);
+  if (worker->result != 0)
+    return NULL;
+  gfx_cmd_bind_pipeline(worker->list, worker->pipeline);
+  for (uint32_t i = 0; i < worker->num_draws; i++) {
+    gfx_cmd_draw(worker->list, 3, 1, 0, 0);
+  }
+  worker->result = gfx_end_command_list(worker->list);
+  return NULL;
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t num_frames = (argc > 1) ? atoi(argv[1]) : 100;
+  uint32_t num_draws = (argc > 2) ? atoi(argv[2]) : 100000;
+
+  log_enable_colors = 0;
+  int r = gfx_init(&(GFX_Init_Info) {
+      .app_name = "lida_gfx_sample_parallel_recording",
+      .app_version = 0,
+      .enable_debug_layers = 0,
+      .gpu_id = 0,
+      .headless = 1,
+      .log_fn = log_func,
+      .load_shader_fn = load_file,
+      .free_shader_fn = free_file
+    });
+  if (r != 0) {
+    printf("FATAL: error ocurred while initialising graphics module!\n");
+    return -1;
+  }
+
+  GFX_Offscreen_Target target;
+  if (gfx_create_offscreen_target(&target, WIDTH, HEIGHT, GFX_FORMAT_R8G8B8A8_UNORM) != 0) {
+    printf("FATAL: failed to create offscreen target\n");
+    return -1;
+  }
+  GFX_Pipeline pipeline;
+  GFX_Pipeline_Desc desc = {
+    .vertex_shader   = "shaders/triangle.vert.spv",
+    .fragment_shader = "shaders/triangle.frag.spv",
+    .render_pass     = gfx_get_offscreen_pass(&target),
+  };
+  if (gfx_create_graphics_pipelines(&pipeline, 1, &desc) != 0) {
+    printf("FATAL: failed to create triangle pipeline\n");
+    return -1;
+  }
+  // each thread records to lists created for its thread id
+  for (uint32_t t = 0; t < MAX_THREADS; t++) {
+    if (gfx_create_command_lists(&secondary_lists[t], 1, t, 1) != 0) {
+      printf("FATAL: failed to create command lists\n");
+      return -1;
+    }
+  }
+
+  int failed = 0;
+  for (uint32_t num_threads = 1; num_threads <= MAX_THREADS; num_threads *= 2) {
+    Worker workers[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    double recording_time = 0.0;
+    uint32_t recorded_draws = 0;
+    for (uint32_t i = 0; i < num_frames; i++) {
+      GFX_Command_List* list = gfx_begin_offscreen_frame(&target);
+      if (list == NULL) {
+	printf("FATAL: failed to begin frame\n");
+	return -1;
+      }
+      gfx_cmd_begin_offscreen_pass(list, &target, 1);
+      double start = get_time();
+      for (uint32_t t = 0; t < num_threads; t++) {
+	workers[t] = (Worker) {
+	  .list      = &secondary_lists[t],
+	  .parent    = list,
+	  .pipeline  = &pipeline,
+	  // first threads take the remainder
+	  .num_draws = num_draws / num_threads + (t < num_draws % num_threads),
+	};
+	pthread_create(&threads[t], NULL, record_draws, &workers[t]);
+      }
+      for (uint32_t t = 0; t < num_threads; t++) {
+	pthread_join(threads[t], NULL);
+	if (workers[t].result != 0) {
+	  printf("FATAL: failed to record secondary list\n");
+	  return -1;
+	}
+      }
+      recording_time += get_time() - start;
+      gfx_cmd_execute_command_lists(list, secondary_lists, num_threads);
+      gfx_cmd_end_render_pass(list);
+      if (gfx_submit_offscreen_frame(&target, 0) == 0) {
+	printf("FATAL: failed to submit frame\n");
+	return -1;
+      }
+      GFX_Frame_Stats stats;
+      gfx_get_frame_stats(&stats);
+      recorded_draws += stats.num_draws;
+    }
+    int ok = (recorded_draws == num_draws * num_frames);
+    printf("%2u threads: %.2f M draws/s, recording took %.3f ms per frame%s\n",
+	   num_threads, num_draws * num_frames / recording_time * 1e-6,
+	   recording_time * 1e3 / num_frames, ok ? "" : ", FAIL: draws are missing");
+    failed |= !ok;
+  }
+
+  gfx_wait_idle_gpu();
+
+  gfx_destroy_command_lists(secondary_lists, MAX_THREADS);
+  gfx_destroy_pipeline(&pipeline);
+  gfx_destroy_offscreen_target(&target);
+
+  gfx_free();
+
+  return failed;
+}
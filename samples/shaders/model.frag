@@ -2,7 +2,6 @@
 #extension GL_GOOGLE_include_directive : enable
 
 layout (location = 0) in vec3 in_normal;
-layout (location = 1) in vec3 in_color;
 
 layout (location = 0) out vec4 out_color;
 
@@ -12,6 +11,10 @@ layout (set = 0, binding = 0) uniform Camera {
   vec3 camera_dir;
 };
 
+layout (push_constant) uniform Material {
+  layout (offset = 64) vec3 color;
+};
+
 const vec3 sun_dir = normalize(vec3(0.1, 1.0, 0.03));
 
 void main() {
@@ -24,7 +27,7 @@ void main() {
   vec3 halfway = normalize(sun_dir + camera_dir);
   float spec = energ_conserv * pow(max(dot(in_normal, halfway), 0.0), shiny);
 
-  vec3 light = (0.01 + diffuse + spec) * in_color;
+  vec3 light = (0.01 + diffuse + spec) * color;
 
   // out_color = vec4(in_normal, 1.0);
   out_color = vec4(light, 1.0);
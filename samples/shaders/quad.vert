@@ -0,0 +1,17 @@
+#version 450
+#extension GL_GOOGLE_include_directive : enable
+
+layout (location = 0) in vec2 in_position;
+// per instance
+layout (location = 1) in vec2 in_offset;
+
+layout (location = 0) out vec3 out_color;
+
+layout (set = 0, binding = 0) uniform Material {
+  vec4 color;
+};
+
+void main() {
+  gl_Position = vec4((in_offset + in_position) * 2.0 - 1.0, 0.0, 1.0);
+  out_color = color.rgb;
+}
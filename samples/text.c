@@ -218,7 +218,7 @@ init_text()
 
   const int max_glyphs = 16*1024;
   GFX_Buffer buffers[2];
-  gfx_create_buffer(&buffers[0], GFX_BUFFER_USAGE_VERTEX|GFX_BUFFER_USAGE_TRANSFER_SRC, max_glyphs * 4 * sizeof(Vertex));
+  gfx_create_buffer(&buffers[0], GFX_BUFFER_USAGE_VERTEX, max_glyphs * 4 * sizeof(Vertex));
   gfx_create_buffer(&buffers[1], GFX_BUFFER_USAGE_INDEX,  max_glyphs * 6 * sizeof(uint32_t));
   gfx_allocate_memory_for_buffers(&text.cpu_memory, buffers, 2,
                                   GFX_MEMORY_PROPERTY_HOST_VISIBLE|GFX_MEMORY_PROPERTY_HOST_COHERENT);
@@ -296,8 +296,8 @@ upload_font(FT_Face face)
     return;
   }
 
-  // load glyphs to staging buffer. (we use vertex buffer as staging)
-  uint8_t* tmp = gfx_get_buffer_data(&text.vertex_buffer);
+  // upload glyphs to font atlas, all of them are copied with one command
+  static uint8_t pixels[64 * 64 * 4];
   uint32_t max_height = 0;
   for (uint32_t i = 0; i < 128-32; i++) {
     int c = rects[i].id;
@@ -313,40 +313,32 @@ upload_font(FT_Face face)
              atlas_width, max_height);
       return;
     }
+    text.glyphs[c].uv_offset.x = rects[i].x * inv_extent_width;
+    text.glyphs[c].uv_offset.y = rects[i].y * inv_extent_height;
+    uint32_t width = glyph_slot->bitmap.width;
+    uint32_t height = glyph_slot->bitmap.rows;
+    if (width == 0 || height == 0)
+      continue;
+    if (width * height * 4 > sizeof(pixels)) {
+      printf("glyph '%c' is too big\n", c);
+      continue;
+    }
     // NOTE: we multiply here by 4 because format is RGBA8 - 4 bytes
-    uint32_t offset = (rects[i].x + rects[i].y * atlas_width) << 2;
-    uint8_t* data = tmp + offset;
-    for (uint32_t y = 0; y < glyph_slot->bitmap.rows; y++) {
-      for (uint32_t x = 0; x < glyph_slot->bitmap.width; x++) {
-        uint32_t pos = (y * atlas_width + x) << 2;
+    for (uint32_t y = 0; y < height; y++) {
+      for (uint32_t x = 0; x < width; x++) {
+        uint32_t pos = (y * width + x) << 2;
         // for now we fill everything with 1: every glyph will be white
-        data[pos + 0] = 255;
-        data[pos + 1] = 255;
-        data[pos + 2] = 255;
-        data[pos + 3] = glyph_slot->bitmap.buffer[y * glyph_slot->bitmap.width + x];
+        pixels[pos + 0] = 255;
+        pixels[pos + 1] = 255;
+        pixels[pos + 2] = 255;
+        pixels[pos + 3] = glyph_slot->bitmap.buffer[y * width + x];
       }
     }
-    text.glyphs[c].uv_offset.x = rects[i].x * inv_extent_width;
-    text.glyphs[c].uv_offset.y = rects[i].y * inv_extent_height;
+    // atlas wasn't written before, so its old contents are discarded
+    gfx_upload_image(&text.font_atlas, pixels, width * height * 4,
+                     rects[i].x, rects[i].y, 0, width, height, 1, 0, 0,
+                     GFX_IMAGE_LAYOUT_UNDEFINED, GFX_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
   }
-
-  // copy vertex buffer contents to font atlas
-  GFX_Image_Barrier barrier = {
-    .image = &text.font_atlas,
-    .new_layout = GFX_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-    .mip_level = 0,
-    .mip_count = 1,
-    .array_layer = 0,
-    .layer_count = 1
-  };
-  gfx_barrier(GFX_PIPELINE_STAGE_TOP_OF_PIPE, GFX_PIPELINE_STAGE_TRANSFER, &barrier, 1);
-
-  gfx_copy_buffer_to_image(&text.vertex_buffer, &text.font_atlas,
-                           0, 0, 0,
-                           atlas_width, max_height, 1);
-
-  barrier.new_layout = GFX_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-  gfx_barrier(GFX_PIPELINE_STAGE_TRANSFER, GFX_PIPELINE_STAGE_FRAGMENT_SHADER, &barrier, 1);
 }
 
 void
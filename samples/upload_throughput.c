@@ -0,0 +1,148 @@
+/* lida_gfx sample: upload_throughput.c
+
+   This sample measures how fast 'gfx_upload_buffer()' and
+   'gfx_upload_image()' move data to device local memory. The library
+   is initialised twice: first copies go through a dedicated transfer
+   queue, then with 'GFX_Init_Info::disable_transfer_queue' they go
+   through graphics queue. Megabytes per second are printed for
+   buffers and images in both cases. Time is measured from the first
+   upload until 'gfx_flush_uploads()' waited for GPU, so it includes
+   copies to staging ring as well as GPU copies.
+
+   If device has no transfer only queue family both runs use graphics
+   queue and should show the same numbers. It works without a window
+   or SDL, so it can be run on lavapipe.
+
+   Usage: upload_throughput [num_rounds] [buffer_mb]
+ */
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "lida_gfx.h"
+#include "util.h"
+
+// 4 MB per image, it fits into the staging ring in one piece
+#define IMAGE_SIZE 1024
+#define NUM_IMAGES 8
+
+static double
+get_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Upload 'data' to a buffer and to images 'num_rounds' times, write
+// megabytes per second to 'buffer_speed' and 'image_speed'.
+static int
+run_benchmark(int disable_transfer_queue, uint32_t num_rounds,
+	      const void* data, uint32_t buffer_size,
+	      double* buffer_speed, double* image_speed)
+{
+  int r = gfx_init(&(GFX_Init_Info) {
+      .app_name = "lida_gfx_sample_upload_throughput",
+      .app_version = 0,
+      .enable_debug_layers = 0,
+      .gpu_id = 0,
+      .headless = 1,
+      .disable_transfer_queue = disable_transfer_queue,
+      .log_fn = log_func,
+    });
+  if (r != 0) {
+    printf("FATAL: error ocurred while initialising graphics module!\n");
+    return -1;
+  }
+
+  GFX_Buffer buffer;
+  GFX_Memory_Block buffer_memory;
+  if (gfx_create_buffer(&buffer, GFX_BUFFER_USAGE_TRANSFER_DST, buffer_size) != 0 ||
+      gfx_allocate_buffer_memory(&buffer_memory, &buffer, 1, GFX_MEMORY_USAGE_GPU_ONLY) != 0) {
+    printf("FATAL: failed to create buffer\n");
+    return -1;
+  }
+  GFX_Image images[NUM_IMAGES];
+  GFX_Memory_Block image_memory;
+  for (uint32_t i = 0; i < NUM_IMAGES; i++) {
+    if (gfx_create_image(&images[i], GFX_IMAGE_USAGE_TRANSFER_DST|GFX_IMAGE_USAGE_SAMPLED,
+			 IMAGE_SIZE, IMAGE_SIZE, 1, GFX_FORMAT_R8G8B8A8_UNORM, 1, 1) != 0) {
+      printf("FATAL: failed to create image\n");
+      return -1;
+    }
+  }
+  if (gfx_allocate_image_memory(&image_memory, images, NUM_IMAGES, GFX_MEMORY_USAGE_GPU_ONLY) != 0) {
+    printf("FATAL: failed to allocate image memory\n");
+    return -1;
+  }
+
+  double start = get_time();
+  for (uint32_t i = 0; i < num_rounds; i++) {
+    if (gfx_upload_buffer(&buffer, 0, data, buffer_size) != 0) {
+      printf("FATAL: failed to upload buffer\n");
+      return -1;
+    }
+  }
+  gfx_flush_uploads(1);
+  double buffer_time = get_time() - start;
+
+  start = get_time();
+  for (uint32_t i = 0; i < num_rounds; i++) {
+    for (uint32_t j = 0; j < NUM_IMAGES; j++) {
+      // old contents are discarded, so copies may go to transfer queue
+      if (gfx_upload_image(&images[j], data, IMAGE_SIZE * IMAGE_SIZE * 4,
+			   0, 0, 0, IMAGE_SIZE, IMAGE_SIZE, 1, 0, 0,
+			   GFX_IMAGE_LAYOUT_UNDEFINED, GFX_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL) != 0) {
+	printf("FATAL: failed to upload image\n");
+	return -1;
+      }
+    }
+  }
+  gfx_flush_uploads(1);
+  double image_time = get_time() - start;
+
+  *buffer_speed = (double)num_rounds * buffer_size / buffer_time / (1024.0 * 1024.0);
+  *image_speed = (double)num_rounds * NUM_IMAGES * IMAGE_SIZE * IMAGE_SIZE * 4 / image_time / (1024.0 * 1024.0);
+
+  gfx_wait_idle_gpu();
+  gfx_destroy_buffer(&buffer);
+  for (uint32_t i = 0; i < NUM_IMAGES; i++) {
+    gfx_destroy_image(&images[i]);
+  }
+  gfx_free_memory(&buffer_memory);
+  gfx_free_memory(&image_memory);
+  gfx_free();
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  uint32_t num_rounds = (argc > 1) ? atoi(argv[1]) : 20;
+  uint32_t buffer_mb = (argc > 2) ? atoi(argv[2]) : 64;
+
+  log_enable_colors = 0;
+  uint32_t buffer_size = buffer_mb * 1024 * 1024;
+  // data must cover an image too
+  size_t data_size = MAX(buffer_size, IMAGE_SIZE * IMAGE_SIZE * 4);
+  unsigned char* data = malloc(data_size);
+  for (size_t i = 0; i < data_size; i++) {
+    data[i] = (unsigned char)(i * 31);
+  }
+
+  const char* names[2] = { "transfer queue", "graphics queue" };
+  double buffer_speeds[2], image_speeds[2];
+  for (int i = 0; i < 2; i++) {
+    if (run_benchmark(i, num_rounds, data, buffer_size, &buffer_speeds[i], &image_speeds[i]) != 0) {
+      free(data);
+      return -1;
+    }
+    printf("%s: buffers %.1f MB/s, images %.1f MB/s\n",
+	   names[i], buffer_speeds[i], image_speeds[i]);
+  }
+  printf("transfer queue is %.2fx as fast for buffers, %.2fx for images\n",
+	 buffer_speeds[0] / buffer_speeds[1], image_speeds[0] / image_speeds[1]);
+
+  free(data);
+  return 0;
+}